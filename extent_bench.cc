@@ -0,0 +1,506 @@
+//
+// extent store throughput benchmark.
+//
+// sweeps extent size and threads over a store opened in this process,
+// or over an extent_server, and prints one JSON object per point on
+// stdout:
+//
+//   extent_bench [-d dir | -h host:port] [-o put,get,mix,reopen]
+//                [-m sizes] [-t threads] [-n extents] [-N ops]
+//                [-T secs] [-k random|text|repeat|zero] [-v]
+//
+// without -d or -h the store is in memory.  with -d each point has a
+// store of its own in a new directory inside dir, removed after it,
+// set up from EXTENT_DEDUP, EXTENT_CACHE_MB, EXTENT_PACK and
+// EXTENT_SCRUB_KBPS as extent_server's is, except that the scrubber is
+// off unless asked for.  the puts of a store in this process are not
+// synced; those to a server are replied to once its group commit has
+// synced them, and EXTENT_STATS on the server shows the batches.
+//
+// every point first puts its n extents, untimed, then runs its op on
+// random ones of them for secs, or for ops calls in all: put, get, or
+// mix, a get or a put at random.  reopen closes a store in this
+// process and times opening it again.  -v puts extents of random sizes
+// up to the size.  the bytes are of the kind -k, each with a count in
+// its first 8 so that a dedup store can't share whole extents.  points
+// of a store in this process also print the bytes it has on disk and
+// how much the resident memory of the process grew during the point.
+
+#include "extent_store.h"
+#include "rpc.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lang/verify.h"
+
+typedef extent_protocol::extentid_t extentid_t;
+
+// where the points are run
+static std::string dir;   // with a store in this process on disk
+static std::string host;  // or with an extent_server
+static extent_store::options opts;
+
+// one point of the sweep
+struct point {
+  std::string op;
+  int size;
+  int threads;
+  int extents;
+  long long ops; // in all, or 0 to run for secs
+  double secs;
+  std::string kind;
+  bool vary;
+};
+
+// the store or the server of a point
+struct target {
+  std::string dir;
+  extent_store *s;
+  sockaddr_in dst;
+};
+
+struct worker {
+  const point *p;
+  target *t;
+  rpcc *cl;
+  unsigned long long seed;
+  struct timespec end;
+  long long ops;
+  std::string buf;
+  std::vector<int> lat_us;
+  int failures;
+};
+
+static unsigned long long
+next(unsigned long long &seed)
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return seed * 2685821657736338717ULL;
+}
+
+static long long
+elapsed_us(const struct timespec &a, const struct timespec &b)
+{
+  return (b.tv_sec - a.tv_sec) * 1000000LL + (b.tv_nsec - a.tv_nsec) / 1000;
+}
+
+static void
+rm_tree(const std::string &path)
+{
+  DIR *d = opendir(path.c_str());
+  if (d == NULL) {
+    unlink(path.c_str());
+    return;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+      rm_tree(path + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+  rmdir(path.c_str());
+}
+
+// the bytes of the files in path and below it
+static unsigned long long
+du(const std::string &path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return 0;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return st.st_size;
+  }
+  unsigned long long n = 0;
+  DIR *d = opendir(path.c_str());
+  if (d == NULL) {
+    return 0;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+      n += du(path + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+static unsigned long long
+rss_bytes()
+{
+  unsigned long size, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return (unsigned long long) resident * sysconf(_SC_PAGESIZE);
+}
+
+// size bytes of the kind of the point
+static void
+fill_bytes(const point &p, unsigned long long &seed, size_t size,
+           std::string &buf)
+{
+  static const char *words[] = {
+    "extent ", "server ", "block ", "chunk ", "recipe ", "segment ",
+    "log ", "clone ", "\n"
+  };
+  buf.clear();
+  if (p.kind == "random") {
+    while (buf.size() < size) {
+      unsigned long long x = next(seed);
+      buf.append((const char *) &x, std::min(sizeof(x), size - buf.size()));
+    }
+  } else if (p.kind == "text") {
+    while (buf.size() < size) {
+      buf += words[next(seed) % (sizeof(words) / sizeof(words[0]))];
+    }
+    buf.resize(size);
+  } else if (p.kind == "repeat") {
+    buf.assign(size, (char) ('a' + next(seed) % 26));
+  } else {
+    buf.assign(size, '\0');
+  }
+}
+
+// the bytes of the next put of w: its buffer, or the start of it, with
+// a count in front
+static std::string
+put_bytes(worker *w)
+{
+  size_t size = w->p->size;
+  if (w->p->vary) {
+    size = next(w->seed) % (size + 1);
+  }
+  std::string d = w->buf.substr(0, size);
+  unsigned long long n = next(w->seed);
+  memcpy(&d[0], &n, std::min(sizeof(n), d.size()));
+  return d;
+}
+
+static int
+one_put(worker *w, extentid_t id)
+{
+  std::string d = put_bytes(w);
+  if (w->cl != NULL) {
+    unsigned long long version;
+    return w->cl->call(extent_protocol::put, id, d, version);
+  }
+  extent_protocol::attr a = { 1, 1, 1, (unsigned int) d.size(), 0 };
+  return w->t->s->put(id, a, rpc_slice(std::move(d)));
+}
+
+static int
+one_get(worker *w, extentid_t id)
+{
+  if (w->cl != NULL) {
+    std::string d;
+    return w->cl->call(extent_protocol::get, id, d);
+  }
+  rpc_slice d;
+  return w->t->s->read(id, 0, (size_t) -1, d);
+}
+
+static void
+start_worker(worker *w)
+{
+  w->cl = NULL;
+  if (w->t->s == NULL) {
+    w->cl = new rpcc(w->t->dst);
+    VERIFY(w->cl->bind() == 0);
+  }
+  fill_bytes(*w->p, w->seed, w->p->size, w->buf);
+}
+
+// puts the extents of the point, every threads-th from the first one
+// of the worker
+static void *
+run_filler(void *x)
+{
+  worker *w = (worker *) x;
+  start_worker(w);
+  for (long long id = w->ops; id < w->p->extents; id += w->p->threads) {
+    if (one_put(w, id) != extent_protocol::OK) {
+      w->failures++;
+    }
+  }
+  delete w->cl;
+  return 0;
+}
+
+static void *
+run_worker(void *x)
+{
+  worker *w = (worker *) x;
+  start_worker(w);
+  for (long long i = 0; w->p->ops == 0 || i < w->ops; i++) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (w->p->ops == 0 && elapsed_us(w->end, t0) >= 0) {
+      break;
+    }
+    extentid_t id = next(w->seed) % w->p->extents;
+    bool put = w->p->op == "put" || (w->p->op == "mix" && next(w->seed) & 1);
+    int ret = put ? one_put(w, id) : one_get(w, id);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ret == extent_protocol::OK) {
+      w->lat_us.push_back(elapsed_us(t0, t1));
+    } else {
+      w->failures++;
+    }
+  }
+  delete w->cl;
+  return 0;
+}
+
+static int
+percentile(const std::vector<int> &v, double q)
+{
+  if (v.empty()) {
+    return 0;
+  }
+  size_t i = (size_t) (q * v.size());
+  return v[std::min(i, v.size() - 1)];
+}
+
+// runs f on a worker per thread of the point, and returns the workers
+static std::vector<worker>
+run_workers(const point &p, target &t, void *(*f)(void *))
+{
+  static unsigned long long seeds = 1;
+  std::vector<worker> ws(p.threads);
+  std::vector<pthread_t> th(p.threads);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (int i = 0; i < p.threads; i++) {
+    ws[i].p = &p;
+    ws[i].t = &t;
+    ws[i].seed = seeds++ * 0x9e3779b97f4a7c15ULL;
+    ws[i].failures = 0;
+    ws[i].end = now;
+    ws[i].end.tv_sec += (time_t) p.secs;
+    ws[i].end.tv_nsec += (long) ((p.secs - (time_t) p.secs) * 1e9);
+    if (ws[i].end.tv_nsec >= 1000000000) {
+      ws[i].end.tv_sec++;
+      ws[i].end.tv_nsec -= 1000000000;
+    }
+    // the first extent of a filler, or the calls of a worker
+    ws[i].ops = f == run_filler ? i : p.ops / p.threads +
+      (i < p.ops % p.threads ? 1 : 0);
+  }
+  for (int i = 0; i < p.threads; i++) {
+    VERIFY(pthread_create(&th[i], NULL, f, &ws[i]) == 0);
+  }
+  for (int i = 0; i < p.threads; i++) {
+    VERIFY(pthread_join(th[i], NULL) == 0);
+  }
+  return ws;
+}
+
+static void
+run_point(const point &p)
+{
+  static int npoints = 0;
+  target t;
+  t.s = NULL;
+  if (!host.empty()) {
+    make_sockaddr(host.c_str(), &t.dst);
+  } else {
+    if (!dir.empty()) {
+      char name[16];
+      snprintf(name, sizeof(name), "/%d", npoints++);
+      t.dir = dir + name;
+      rm_tree(t.dir);
+    }
+    t.s = extent_store::open(t.dir, opts);
+  }
+  unsigned long long rss0 = rss_bytes();
+
+  std::vector<worker> ws = run_workers(p, t, run_filler);
+  int failures = 0;
+  for (size_t i = 0; i < ws.size(); i++) {
+    failures += ws[i].failures;
+  }
+  if (t.s != NULL && t.s->needs_sync()) {
+    VERIFY(t.s->sync() == extent_protocol::OK);
+  }
+
+  struct timespec t0, t1;
+  std::vector<int> lat;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (p.op == "reopen") {
+    if (t.s != NULL) {
+      delete t.s;
+      t.s = extent_store::open(t.dir, opts);
+      lat.push_back(0);
+    }
+  } else {
+    ws = run_workers(p, t, run_worker);
+    for (size_t i = 0; i < ws.size(); i++) {
+      lat.insert(lat.end(), ws[i].lat_us.begin(), ws[i].lat_us.end());
+      failures += ws[i].failures;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (t.s != NULL && t.s->needs_sync()) {
+    VERIFY(t.s->sync() == extent_protocol::OK);
+  }
+
+  // the store is closed before the point is printed, as it may print
+  // as it closes
+  char extra[128] = "";
+  if (t.s != NULL) {
+    unsigned long long rss = rss_bytes();
+    double grew = rss > rss0 ? (rss - rss0) / 1048576.0 : 0.0;
+    if (t.dir.empty()) {
+      snprintf(extra, sizeof(extra), ", \"rss_growth_mb\": %.3f", grew);
+    } else {
+      snprintf(extra, sizeof(extra),
+               ", \"disk_mb\": %.3f, \"rss_growth_mb\": %.3f",
+               du(t.dir) / 1048576.0, grew);
+    }
+    delete t.s;
+    if (!t.dir.empty()) {
+      rm_tree(t.dir);
+    }
+  }
+
+  std::sort(lat.begin(), lat.end());
+  double el = elapsed_us(t0, t1) / 1e6;
+  double ops = lat.size();
+  printf("{\"op\": \"%s\", \"size\": %d, \"vary\": %s, \"kind\": \"%s\", "
+         "\"threads\": %d, \"extents\": %d, \"target\": \"%s\", "
+         "\"secs\": %.3f, \"ops\": %.0f, \"failures\": %d, "
+         "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+         "\"p50_us\": %d, \"p99_us\": %d, \"p999_us\": %d%s}\n",
+         p.op.c_str(), p.size, p.vary ? "true" : "false", p.kind.c_str(),
+         p.threads, p.extents,
+         !host.empty() ? host.c_str() : dir.empty() ? "memory" : "disk",
+         el, ops, failures, ops / el,
+         ops * (p.vary ? p.size / 2.0 : p.size) / el / (1 << 20),
+         percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999),
+         extra);
+}
+
+// splits a comma separated list of numbers; k and m multiply by 2^10, 2^20
+static std::vector<double>
+parse_list(const char *s)
+{
+  std::vector<double> v;
+  while (*s) {
+    char *end;
+    double x = strtod(s, &end);
+    if (end == s) {
+      break;
+    }
+    if (*end == 'k' || *end == 'K') {
+      x *= 1 << 10;
+      end++;
+    } else if (*end == 'm' || *end == 'M') {
+      x *= 1 << 20;
+      end++;
+    }
+    v.push_back(x);
+    s = *end == ',' ? end + 1 : end;
+  }
+  return v;
+}
+
+static void
+usage(const char *me)
+{
+  fprintf(stderr, "Usage: %s [-d dir | -h host:port] [-o put,get,mix,reopen] "
+          "[-m sizes] [-t threads] [-n extents] [-N ops] [-T secs] "
+          "[-k random|text|repeat|zero] [-v]\n", me);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  std::string opss = "put,get,mix";
+  std::vector<double> sizes = parse_list("64,1k,8k,64k");
+  std::vector<double> threads = parse_list("1,4,16");
+  int extents = 10000;
+  long long ops = 0;
+  double secs = 2;
+  std::string kind = "text";
+  bool vary = false;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "d:h:o:m:t:n:N:T:k:v")) != -1) {
+    switch (ch) {
+      case 'd': dir = optarg; break;
+      case 'h': host = optarg; break;
+      case 'o': opss = optarg; break;
+      case 'm': sizes = parse_list(optarg); break;
+      case 't': threads = parse_list(optarg); break;
+      case 'n': extents = atoi(optarg); break;
+      case 'N': ops = atoll(optarg); break;
+      case 'T': secs = atof(optarg); break;
+      case 'k': kind = optarg; break;
+      case 'v': vary = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if ((!dir.empty() && !host.empty()) || extents < 1 ||
+      (kind != "random" && kind != "text" && kind != "repeat" &&
+       kind != "zero")) {
+    usage(argv[0]);
+  }
+
+  char *dedup_env = getenv("EXTENT_DEDUP");
+  opts.dedup = dedup_env != NULL && atoi(dedup_env) != 0;
+  char *cache_env = getenv("EXTENT_CACHE_MB");
+  opts.cache = (size_t) (cache_env != NULL ? atoi(cache_env) : 64) << 20;
+  char *scrub_env = getenv("EXTENT_SCRUB_KBPS");
+  opts.scrub = (size_t) (scrub_env != NULL ? atoi(scrub_env) : 0) << 10;
+  char *pack_env = getenv("EXTENT_PACK");
+  opts.pack = pack_env == NULL || atoi(pack_env) != 0;
+  if (!dir.empty()) {
+    mkdir(dir.c_str(), 0755);
+  }
+
+  const char *all[] = { "put", "get", "mix", "reopen" };
+  for (size_t o = 0; o < sizeof(all) / sizeof(all[0]); o++) {
+    if (opss.find(all[o]) == std::string::npos) {
+      continue;
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      for (size_t m = 0; m < sizes.size(); m++) {
+        point p;
+        p.op = all[o];
+        p.size = (int) sizes[m];
+        p.threads = (int) threads[t];
+        p.extents = extents;
+        p.ops = ops;
+        p.secs = secs;
+        p.kind = kind;
+        p.vary = vary;
+        if (p.threads < 1 || p.size < 0) {
+          usage(argv[0]);
+        }
+        run_point(p);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,462 @@
+// the cache of hot extents
+
+#include "extent_cache_store.h"
+#include "extent_lz.h"
+
+#include <stdio.h>
+
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+extent_cache_store::extent_cache_store(extent_store *store, size_t budget,
+                                       bool pack)
+  : store_(store), budget_(budget / nshards), pack_(pack), prefetch_q_(256),
+    stopping_(false)
+{
+  for (int i = 0; i < nshards; i++) {
+    shard &sh = shards_[i];
+    VERIFY(pthread_mutex_init(&sh.m, 0) == 0);
+    sh.hand = 0;
+    sh.bytes = 0;
+    sh.len = 0;
+    sh.gen = 0;
+    sh.updates = 0;
+    sh.hits = sh.misses = sh.prefetched = sh.prefetch_hits = 0;
+  }
+  VERIFY(pthread_mutex_init(&streams_m_, 0) == 0);
+  for (int i = 0; i < nstreams; i++) {
+    streams_[i].key = 0;
+    streams_[i].last = 0;
+    streams_[i].step = 0;
+  }
+  VERIFY(pthread_create(&prefetcher_, NULL, &prefetch_thread, this) == 0);
+}
+
+extent_cache_store::~extent_cache_store()
+{
+  stopping_ = true;
+  prefetch_q_.enq(0);
+  VERIFY(pthread_join(prefetcher_, NULL) == 0);
+  delete store_;
+  for (int i = 0; i < nshards; i++) {
+    VERIFY(pthread_mutex_destroy(&shards_[i].m) == 0);
+  }
+  VERIFY(pthread_mutex_destroy(&streams_m_) == 0);
+}
+
+// a hit sets the extent's bit, and counts for the stream it was
+// prefetched for
+bool extent_cache_store::lookup(extent_protocol::extentid_t id,
+                                rpc_slice &data, unsigned int *len)
+{
+  shard &sh = shard_of(id);
+  bool prefetched;
+  {
+    ScopedLock l(&sh.m);
+    auto it = sh.slot.find(id);
+    if (it == sh.slot.end()) {
+      sh.misses++;
+      return false;
+    }
+    entry &e = sh.clock[it->second];
+    e.ref = true;
+    prefetched = e.prefetched;
+    if (prefetched) {
+      e.prefetched = false;
+      sh.prefetch_hits++;
+    }
+    sh.hits++;
+    data = e.data;
+    *len = e.len;
+  }
+  if (prefetched) {
+    note(id);
+  }
+  return true;
+}
+
+void extent_cache_store::insert_l(shard &sh, extent_protocol::extentid_t id,
+                                  const rpc_slice &data, unsigned int len,
+                                  bool ref, bool prefetch)
+{
+  drop_l(sh, id);
+  size_t need = data.size() + overhead;
+  if (need > budget_) {
+    return;
+  }
+  // the hand gives each extent a second chance, and evicts the first
+  // one not used since it last passed
+  while (sh.bytes + need > budget_) {
+    entry &e = sh.clock[sh.hand];
+    if (e.used && e.ref) {
+      e.ref = false;
+    } else if (e.used) {
+      drop_l(sh, e.id);
+    }
+    sh.hand = (sh.hand + 1) % sh.clock.size();
+  }
+  size_t i;
+  if (sh.free.empty()) {
+    i = sh.clock.size();
+    sh.clock.push_back(entry());
+  } else {
+    i = sh.free.back();
+    sh.free.pop_back();
+  }
+  entry &e = sh.clock[i];
+  e.id = id;
+  e.data = data;
+  e.len = len;
+  e.used = true;
+  e.ref = ref;
+  e.prefetched = prefetch;
+  sh.slot[id] = i;
+  sh.bytes += need;
+  sh.len += len;
+  if (prefetch) {
+    sh.prefetched++;
+  }
+}
+
+void extent_cache_store::drop_l(shard &sh, extent_protocol::extentid_t id)
+{
+  auto it = sh.slot.find(id);
+  if (it == sh.slot.end()) {
+    return;
+  }
+  entry &e = sh.clock[it->second];
+  sh.bytes -= e.data.size() + overhead;
+  sh.len -= e.len;
+  e.data = rpc_slice();
+  e.used = false;
+  sh.free.push_back(it->second);
+  sh.slot.erase(it);
+}
+
+// before an update of the store behind.  the old bytes go now, as a
+// read that misses once the store has the new ones must not be
+// followed by one that hits on the old.
+void extent_cache_store::updating(extent_protocol::extentid_t id)
+{
+  shard &sh = shard_of(id);
+  ScopedLock l(&sh.m);
+  sh.updates++;
+  drop_l(sh, id);
+}
+
+// after an update of the store behind, so that a read that missed
+// before it can't put the old bytes back
+void extent_cache_store::updated(extent_protocol::extentid_t id)
+{
+  shard &sh = shard_of(id);
+  ScopedLock l(&sh.m);
+  sh.updates--;
+  sh.gen++;
+  drop_l(sh, id);
+}
+
+// the bytes to keep of an extent: packed if they shrink, or else data
+// itself, or a copy of it
+rpc_slice extent_cache_store::packed(const rpc_slice &data, bool copy)
+{
+  std::string z;
+  if (pack_ && lz_pack(data.data(), data.size(), z)) {
+    return rpc_slice(std::move(z));
+  }
+  return copy ? rpc_slice(data.str()) : data;
+}
+
+// the bytes of a put are kept as if read, but with the bit clear, so
+// that extents only ever written don't push out those being read
+void extent_cache_store::put_back(extent_protocol::extentid_t id,
+                                  const rpc_slice &data)
+{
+  shard &sh = shard_of(id);
+  // copied, as the put's slice may share the buffer of its request
+  rpc_slice keep;
+  if (data.size() <= max_extent) {
+    keep = packed(data, true);
+  }
+  ScopedLock l(&sh.m);
+  sh.updates--;
+  sh.gen++;
+  drop_l(sh, id);
+  if (data.size() <= max_extent) {
+    insert_l(sh, id, keep, data.size(), false, false);
+  }
+}
+
+// reads the whole extent from the store behind into the cache.  an
+// extent too big to cache is left out, and data is then empty.
+int extent_cache_store::fill(extent_protocol::extentid_t id, bool prefetch,
+                             rpc_slice &data)
+{
+  shard &sh = shard_of(id);
+  unsigned long long gen;
+  {
+    ScopedLock l(&sh.m);
+    gen = sh.gen;
+  }
+  extent_protocol::attr a;
+  int r = store_->getattr(id, a);
+  if (r != extent_protocol::OK) {
+    return r;
+  }
+  data = rpc_slice();
+  if (a.size > max_extent) {
+    return extent_protocol::OK;
+  }
+  // the extent may grow between the two calls, so it is read up to
+  // one byte past the limit
+  r = store_->read(id, 0, max_extent + 1, data);
+  if (r != extent_protocol::OK) {
+    return r;
+  }
+  if (data.size() > max_extent) {
+    data = rpc_slice();
+    return extent_protocol::OK;
+  }
+  rpc_slice keep = packed(data, false);
+  ScopedLock l(&sh.m);
+  if (sh.gen == gen && sh.updates == 0 &&
+      (!prefetch || sh.slot.find(id) == sh.slot.end())) {
+    insert_l(sh, id, keep, data.size(), !prefetch, prefetch);
+  }
+  return extent_protocol::OK;
+}
+
+// notes a read of id in its stream, and queues the extents ahead of it
+// once the stream has moved by the same step twice
+void extent_cache_store::note(extent_protocol::extentid_t id)
+{
+  unsigned int key = (unsigned int) id;
+  long long step;
+  {
+    ScopedLock l(&streams_m_);
+    stream &s = streams_[(key * 2654435761u) % nstreams];
+    if (s.key != key || s.last == 0) {
+      s.key = key;
+      s.last = id;
+      s.step = 0;
+      return;
+    }
+    long long d = (long long) (id - s.last);
+    s.last = id;
+    if (d == 0 || d != s.step) {
+      s.step = d;
+      return;
+    }
+    step = d;
+  }
+  for (int k = 1; k <= ahead; k++) {
+    // drops the rest if the prefetcher is behind
+    if (!prefetch_q_.enq(id + k * step, false)) {
+      break;
+    }
+  }
+}
+
+void *extent_cache_store::prefetch_thread(void *x)
+{
+  ((extent_cache_store *) x)->prefetcher();
+  return 0;
+}
+
+void extent_cache_store::prefetcher()
+{
+  while (1) {
+    extent_protocol::extentid_t id;
+    prefetch_q_.deq(&id);
+    if (stopping_) {
+      break;
+    }
+    shard &sh = shard_of(id);
+    {
+      ScopedLock l(&sh.m);
+      if (sh.slot.find(id) != sh.slot.end()) {
+        continue;
+      }
+    }
+    rpc_slice data;
+    fill(id, true, data);
+  }
+}
+
+int extent_cache_store::getattr(extent_protocol::extentid_t id,
+                                extent_protocol::attr &a)
+{
+  return store_->getattr(id, a);
+}
+
+int extent_cache_store::read(extent_protocol::extentid_t id, size_t off,
+                             size_t len, rpc_slice &data)
+{
+  rpc_slice whole;
+  unsigned int size;
+  if (!lookup(id, whole, &size)) {
+    note(id);
+    int r = fill(id, false, whole);
+    if (r != extent_protocol::OK) {
+      return r;
+    }
+    if (whole.size() == 0) {
+      // too big to cache, or empty
+      return store_->read(id, off, len, data);
+    }
+  } else if (whole.size() < size) {
+    // packed; unpacks no further than the read goes
+    if (off >= size) {
+      data = rpc_slice();
+      return extent_protocol::OK;
+    }
+    size_t end = off + std::min(len, size - off);
+    std::string buf(end, '\0');
+    if (!lz_unpack(whole.data(), whole.size(), &buf[0], end)) {
+      return extent_protocol::IOERR;
+    }
+    data = rpc_slice(std::move(buf)).sub(off, len);
+    return extent_protocol::OK;
+  }
+  data = whole.sub(off, len);
+  return extent_protocol::OK;
+}
+
+int extent_cache_store::put(extent_protocol::extentid_t id,
+                            const extent_protocol::attr &a,
+                            const rpc_slice &data)
+{
+  updating(id);
+  int r = store_->put(id, a, data);
+  if (r == extent_protocol::OK) {
+    put_back(id, data);
+  } else {
+    updated(id);
+  }
+  return r;
+}
+
+int extent_cache_store::write(extent_protocol::extentid_t id,
+                              const extent_protocol::attr &a, size_t off,
+                              const rpc_slice &data)
+{
+  updating(id);
+  int r = store_->write(id, a, off, data);
+  updated(id);
+  return r;
+}
+
+int extent_cache_store::touch(extent_protocol::extentid_t id, unsigned int t)
+{
+  return store_->touch(id, t);
+}
+
+int extent_cache_store::remove(extent_protocol::extentid_t id)
+{
+  updating(id);
+  int r = store_->remove(id);
+  updated(id);
+  return r;
+}
+
+void extent_cache_store::ids(std::vector<extent_protocol::extentid_t> &v)
+{
+  store_->ids(v);
+}
+
+void extent_cache_store::getattrs(
+    const std::vector<extent_protocol::extentid_t> &ids,
+    std::vector<extent_protocol::attr> &as, std::vector<int> &rets)
+{
+  store_->getattrs(ids, as, rets);
+}
+
+void extent_cache_store::puts(
+    const std::vector<extent_protocol::extentid_t> &ids,
+    const std::vector<extent_protocol::attr> &as,
+    const std::vector<rpc_slice> &data, std::vector<int> &rets)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    updating(ids[i]);
+  }
+  store_->puts(ids, as, data, rets);
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (rets[i] == extent_protocol::OK) {
+      put_back(ids[i], data[i]);
+    } else {
+      updated(ids[i]);
+    }
+  }
+}
+
+void extent_cache_store::have(const std::vector<chunk_hash> &hashes,
+                              std::string &flags)
+{
+  store_->have(hashes, flags);
+}
+
+int extent_cache_store::put_chunks(extent_protocol::extentid_t id,
+                                   const extent_protocol::attr &a,
+                                   const std::vector<extent_chunk> &chunks)
+{
+  updating(id);
+  int r = store_->put_chunks(id, a, chunks);
+  updated(id);
+  return r;
+}
+
+int extent_cache_store::clone(extent_protocol::extentid_t src,
+                              extent_protocol::extentid_t dst,
+                              const extent_protocol::attr &a)
+{
+  updating(dst);
+  int r = store_->clone(src, dst, a);
+  updated(dst);
+  return r;
+}
+
+bool extent_cache_store::dedups()
+{
+  return store_->dedups();
+}
+
+bool extent_cache_store::needs_sync()
+{
+  return store_->needs_sync();
+}
+
+int extent_cache_store::sync()
+{
+  return store_->sync();
+}
+
+void extent_cache_store::stats(std::string &s)
+{
+  size_t bytes = 0, len = 0, n = 0;
+  unsigned long long hits = 0, misses = 0, prefetched = 0, prefetch_hits = 0;
+  for (int i = 0; i < nshards; i++) {
+    shard &sh = shards_[i];
+    ScopedLock l(&sh.m);
+    bytes += sh.bytes;
+    len += sh.len;
+    n += sh.slot.size();
+    hits += sh.hits;
+    misses += sh.misses;
+    prefetched += sh.prefetched;
+    prefetch_hits += sh.prefetch_hits;
+  }
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "cache %.1f of %.1f MB holding %.1f MB in %lu extents, %.1f%% of "
+           "%llu reads hit, %llu prefetched, %llu of those read",
+           bytes / 1048576.0, budget_ * nshards / 1048576.0,
+           len / 1048576.0, (unsigned long) n,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+           hits + misses, prefetched, prefetch_hits);
+  s += buf;
+  std::string rest;
+  store_->stats(rest);
+  if (!rest.empty()) {
+    s += "; ";
+    s += rest;
+  }
+}
@@ -0,0 +1,136 @@
+// a cache of hot extents in front of a store on disk
+
+#ifndef extent_cache_store_h
+#define extent_cache_store_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include "extent_store.h"
+#include "rpc/fifo.h"
+
+// keeps the whole bytes of recently used extents of up to max_extent
+// bytes in memory, within a budget, and reads the others through the
+// store behind it.  updates go to that store first, then a put leaves
+// its bytes in the cache and other updates drop the extent from it.
+//
+// the cache is split in shards, each with its own share of the budget
+// and a CLOCK over its extents: a use sets an extent's bit, and the
+// hand going round to make room clears set bits and evicts extents
+// without one.  a read that misses notes the id in a stream, and once
+// the ids of a stream go up by the same step twice, a thread reads the
+// next few ahead into the cache.  yfs names block k of a file
+// (k+1)<<32 | inum, so the stream of an id is its low 32 bits, and a
+// file read in order is a stream with a step of 1<<32.
+//
+// with pack, the bytes of an extent that lz_pack shrinks are kept
+// packed, so that the budget holds more extents, and a hit unpacks
+// them into the buffer of the reply.
+class extent_cache_store : public extent_store {
+ private:
+  struct entry {
+    extent_protocol::extentid_t id;
+    rpc_slice data;
+    unsigned int len; // of the extent; data holds it packed if less
+    bool used;        // the slot holds an extent
+    bool ref;         // used since the hand last passed
+    bool prefetched;  // and not read since
+  };
+
+  struct shard {
+    pthread_mutex_t m;
+    std::unordered_map<extent_protocol::extentid_t, size_t> slot;
+    std::vector<entry> clock;
+    std::vector<size_t> free;
+    size_t hand;
+    size_t bytes;
+    size_t len; // of the extents held, unpacked
+    // moves on with every update, so that a read that missed doesn't
+    // put back bytes an update replaced while it read them
+    unsigned long long gen;
+    // updates of the store behind under way.  a read that misses
+    // meanwhile may read the bytes from before one of them after
+    // another read had those from after, so it doesn't fill.
+    int updates;
+    unsigned long long hits, misses, prefetched, prefetch_hits;
+  };
+
+  struct stream {
+    unsigned int key;
+    extent_protocol::extentid_t last;
+    long long step;
+  };
+
+  static const int nshards = 16;
+  static const int nstreams = 256;
+  static const int ahead = 4;     // extents read ahead of a stream
+  static const size_t overhead = sizeof(entry) + 48; // and its map node
+
+  extent_store *store_;
+  size_t budget_; // of a shard
+  bool pack_;
+  shard shards_[nshards];
+  pthread_mutex_t streams_m_;
+  stream streams_[nstreams];
+  fifo<extent_protocol::extentid_t> prefetch_q_;
+  bool stopping_;
+  pthread_t prefetcher_;
+
+  shard &shard_of(extent_protocol::extentid_t id) {
+    return shards_[(id * 0x9e3779b97f4a7c15ULL) >> 60];
+  }
+  bool lookup(extent_protocol::extentid_t id, rpc_slice &data,
+              unsigned int *len);
+  rpc_slice packed(const rpc_slice &data, bool copy);
+  int fill(extent_protocol::extentid_t id, bool prefetch, rpc_slice &data);
+  // these assume the shard's lock
+  void insert_l(shard &sh, extent_protocol::extentid_t id,
+                const rpc_slice &data, unsigned int len, bool ref,
+                bool prefetch);
+  void drop_l(shard &sh, extent_protocol::extentid_t id);
+  void updating(extent_protocol::extentid_t id);
+  void updated(extent_protocol::extentid_t id);
+  void put_back(extent_protocol::extentid_t id, const rpc_slice &data);
+  void note(extent_protocol::extentid_t id);
+
+  static void *prefetch_thread(void *);
+  void prefetcher();
+
+ public:
+  // extents bigger than this are never cached
+  static const size_t max_extent = 1024 * 1024;
+
+  // takes over store, and caches up to about budget bytes of it
+  extent_cache_store(extent_store *store, size_t budget, bool pack = false);
+  ~extent_cache_store();
+
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int read(extent_protocol::extentid_t id, size_t off, size_t len,
+           rpc_slice &data);
+  int put(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+          const rpc_slice &data);
+  int write(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+            size_t off, const rpc_slice &data);
+  int touch(extent_protocol::extentid_t id, unsigned int t);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &v);
+  void getattrs(const std::vector<extent_protocol::extentid_t> &ids,
+                std::vector<extent_protocol::attr> &as,
+                std::vector<int> &rets);
+  void puts(const std::vector<extent_protocol::extentid_t> &ids,
+            const std::vector<extent_protocol::attr> &as,
+            const std::vector<rpc_slice> &data, std::vector<int> &rets);
+  void have(const std::vector<chunk_hash> &hashes, std::string &flags);
+  int put_chunks(extent_protocol::extentid_t id,
+                 const extent_protocol::attr &a,
+                 const std::vector<extent_chunk> &chunks);
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            const extent_protocol::attr &a);
+  bool dedups();
+  bool needs_sync();
+  int sync();
+  void stats(std::string &s);
+};
+
+#endif
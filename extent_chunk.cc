@@ -0,0 +1,152 @@
+// content-defined chunking and SHA-256
+
+#include "extent_chunk.h"
+
+#include <stdint.h>
+#include <algorithm>
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+ror(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void
+sha256_block(uint32_t s[8], const unsigned char *p)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+      (uint32_t) p[4 * i + 2] << 8 | (uint32_t) p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = s[0], b = s[1], c = s[2], d = s[3];
+  uint32_t e = s[4], f = s[5], g = s[6], h = s[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+      ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+  s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+chunk_hash
+chunk_hash_of(const char *data, size_t len)
+{
+  uint32_t s[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  const unsigned char *p = (const unsigned char *) data;
+  size_t n = len;
+  for (; n >= 64; p += 64, n -= 64) {
+    sha256_block(s, p);
+  }
+  // the rest, a 1 bit, zeros, and the length in bits
+  unsigned char last[128];
+  memset(last, 0, sizeof(last));
+  memcpy(last, p, n);
+  last[n] = 0x80;
+  size_t blocks = n + 9 > 64 ? 2 : 1;
+  uint64_t bits = (uint64_t) len * 8;
+  for (int i = 0; i < 8; i++) {
+    last[blocks * 64 - 1 - i] = (unsigned char) (bits >> (8 * i));
+  }
+  for (size_t i = 0; i < blocks; i++) {
+    sha256_block(s, last + 64 * i);
+  }
+
+  chunk_hash c;
+  for (int i = 0; i < 8; i++) {
+    c.h[4 * i] = s[i] >> 24;
+    c.h[4 * i + 1] = s[i] >> 16;
+    c.h[4 * i + 2] = s[i] >> 8;
+    c.h[4 * i + 3] = s[i];
+  }
+  return c;
+}
+
+// a random number for every byte value, the same in every process
+struct gear_table {
+  uint64_t g[256];
+  gear_table() {
+    uint64_t x = 0x2545f4914f6cdd1dULL; // splitmix64
+    for (int i = 0; i < 256; i++) {
+      uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      g[i] = z ^ (z >> 31);
+    }
+  }
+};
+
+// a cut where the top mask_bits bits of the gear hash are zero, which
+// makes chunks about 16K past chunk_min on average.  the top bits of
+// the hash depend on the last 64 bytes.
+static const int mask_bits = 14;
+
+void
+chunk_split(const char *data, size_t len, std::vector<size_t> &lens)
+{
+  static const gear_table gear;
+  const unsigned char *p = (const unsigned char *) data;
+  size_t start = 0;
+  while (start < len) {
+    size_t end = std::min(len, start + chunk_max);
+    size_t i = std::min(end, start + chunk_min);
+    uint64_t h = 0;
+    for (; i < end; i++) {
+      h = (h << 1) + gear.g[p[i]];
+      if ((h >> (64 - mask_bits)) == 0) {
+        i++;
+        break;
+      }
+    }
+    lens.push_back(i - start);
+    start = i;
+  }
+}
+
+void
+chunk_extent(const rpc_slice &data, std::vector<extent_chunk> &chunks)
+{
+  std::vector<size_t> lens;
+  chunk_split(data.data(), data.size(), lens);
+  size_t off = 0;
+  for (size_t i = 0; i < lens.size(); i++) {
+    extent_chunk c;
+    c.hash = chunk_hash_of(data.data() + off, lens[i]);
+    c.len = lens[i];
+    c.data = data.sub(off, lens[i]);
+    chunks.push_back(c);
+    off += lens[i];
+  }
+}
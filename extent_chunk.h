@@ -0,0 +1,49 @@
+// content-defined chunks of extents, shared by extent_client and the
+// deduplicating store
+
+#ifndef extent_chunk_h
+#define extent_chunk_h
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include "rpc.h"
+
+// the SHA-256 of a chunk's bytes; chunks with the same hash are taken
+// to be the same
+struct chunk_hash {
+  unsigned char h[32];
+
+  bool operator==(const chunk_hash &o) const {
+    return memcmp(h, o.h, sizeof(h)) == 0;
+  }
+};
+
+struct chunk_hash_hasher {
+  size_t operator()(const chunk_hash &c) const {
+    size_t x;
+    memcpy(&x, c.h, sizeof(x));
+    return x;
+  }
+};
+
+// a chunk of an extent, as a client or the server cut it
+struct extent_chunk {
+  chunk_hash hash;
+  unsigned int len;
+  rpc_slice data; // empty if the store is to have the chunk already
+};
+
+// cut points fall where a rolling hash of the last bytes matches a
+// mask, so an insert only changes the chunks around it.  chunks are at
+// least chunk_min and at most chunk_max bytes, save the last.
+static const size_t chunk_min = 4 * 1024;
+static const size_t chunk_max = 64 * 1024;
+
+chunk_hash chunk_hash_of(const char *data, size_t len);
+// the lengths of the chunks data is cut into
+void chunk_split(const char *data, size_t len, std::vector<size_t> &lens);
+// cuts data into chunks and hashes them; the chunks share data's buffer
+void chunk_extent(const rpc_slice &data, std::vector<extent_chunk> &chunks);
+
+#endif
@@ -1,29 +1,158 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "extent_chunk.h"
 
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <algorithm>
 
 #include "lang/verify.h"
 #include "rpc/slock.h"
 #include "tprintf.h"
+#include "utils/utils.h"
 
 // The calls assume that the caller holds a lock on the extent
 
-extent_client::extent_client(std::string dst) : _cache()
+// extents bigger than this are moved with streaming calls, so that
+// neither side has to build a PDU holding the whole extent
+static const size_t stream_threshold = 1024 * 1024;
+
+// extents up to this size are fetched and cached whole by the byte
+// range calls too
+static const size_t whole_max = 64 * 1024;
+
+// extents from this size on are put as chunks, and the chunks the
+// server has already are not sent, if the server deduplicates
+static const size_t dedup_min = 4 * chunk_min;
+
+// at most this many clean extents, of at most this many bytes in all,
+// stay in the cache through a flush
+static const size_t keep_max = 4096;
+static const size_t keep_bytes_max = 16 * 1024 * 1024;
+
+class string_source : public rpc_source {
+ public:
+  string_source(const std::string &s) : s_(s), off_(0) {}
+  int read(std::string &chunk, int max) {
+    chunk = s_.substr(off_, max);
+    off_ += chunk.size();
+    return 0;
+  }
+ private:
+  const std::string &s_;
+  size_t off_;
+};
+
+class string_sink : public rpc_sink {
+ public:
+  string_sink(std::string &s) : s_(s) { s_.clear(); }
+  int write(const std::string &chunk) {
+    s_.append(chunk);
+    return 0;
+  }
+ private:
+  std::string &s_;
+};
+
+// how many times a call goes after an extent that MOVED
+static const int move_tries = 10;
+
+extent_client::extent_client(std::string dst)
+  : ring_(0, dst), _cache(), _kept(0), _kept_bytes(0)
 {
+  VERIFY(pthread_mutex_init(&_m, NULL) == 0);
+  VERIFY(pthread_mutex_init(&ring_m_, NULL) == 0);
+  VERIFY(!ring_.empty());
+  for (size_t i = 0; i < ring_.servers().size(); i++) {
+    _connect_wo(ring_.servers()[i]);
+  }
+  // servers may have joined since the list was made
+  _refresh();
+}
+
+extent_client::~extent_client()
+{
+  for (auto it = conns_.begin(); it != conns_.end(); it++) {
+    delete it->second;
+  }
+}
+
+// connects to dst unless the client is already; assumes ring_m_ or
+// that no one else uses the client yet
+void
+extent_client::_connect_wo(const std::string &dst)
+{
+  if (conns_.count(dst)) {
+    return;
+  }
   sockaddr_in dstsock;
   make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
+  rpcc *cl = new rpcc(dstsock);
   if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+    printf("extent_client: bind %s failed\n", dst.c_str());
   }
+  conns_[dst] = cl;
+}
 
-  VERIFY(pthread_mutex_init(&_m, NULL) == 0);
+// the server that has eid on the client's ring
+rpcc *
+extent_client::_server(extent_protocol::extentid_t eid)
+{
+  ScopedLock rl(&ring_m_);
+  return conns_[ring_.servers()[ring_.owner(eid)]];
+}
+
+// takes the newest ring any of the servers has, if it is newer than
+// the client's; true if it was
+bool
+extent_client::_refresh()
+{
+  std::vector<rpcc *> cls;
+  {
+    ScopedLock rl(&ring_m_);
+    for (auto it = conns_.begin(); it != conns_.end(); it++) {
+      cls.push_back(it->second);
+    }
+  }
+  extent_ring best;
+  for (size_t i = 0; i < cls.size(); i++) {
+    extent_ring ring;
+    if (cls[i]->call(extent_protocol::ring_get, 0, ring) ==
+        extent_protocol::OK && ring.epoch() > best.epoch()) {
+      best = ring;
+    }
+  }
+  ScopedLock rl(&ring_m_);
+  if (best.epoch() <= ring_.epoch()) {
+    return false;
+  }
+  ring_ = best;
+  for (size_t i = 0; i < ring_.servers().size(); i++) {
+    _connect_wo(ring_.servers()[i]);
+  }
+  tprintf("[EXT CLI] ring %u: %s\n", ring_.epoch(), ring_.str().c_str());
+  return true;
+}
+
+// whether a call that returned ret should be tried again, on the
+// server the ring has now.  a server that answers MOVED has the new
+// ring already, but the one that joined may not have given it to all
+// yet, so the client waits a little if no server has a newer one.
+bool
+extent_client::_moved(int ret, int &tries)
+{
+  if (ret != extent_protocol::MOVED || ++tries > move_tries) {
+    return false;
+  }
+  if (!_refresh()) {
+    usleep(100000 * tries);
+  }
+  return true;
 }
 
 extent_protocol::status
@@ -37,7 +166,7 @@ extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
       if (_cache[eid].removed) {
         return extent_protocol::NOENT;
       }
-      else if (_cache[eid].buf != NULL) {
+      else if (_cache[eid].buf != NULL && !_cache[eid].stale) {
         tprintf("[EXT CLI] read from cache %llu, sz: %lu\n", eid, _cache[eid].buf->size());
         buf = *(_cache[eid].buf);
         return ret;
@@ -45,7 +174,56 @@ extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
     }
   }
   tprintf("[EXT CLI] missed cache %llu\n", eid);
-  ret = cl->call(extent_protocol::get, eid, buf);
+  bool large = false;
+  unsigned long long version = 0;
+  {
+    ScopedLock l(&_m);
+    large = _cache.count(eid) && _cache[eid].attr &&
+      _cache[eid].attr->size > stream_threshold;
+    if (_cache.count(eid) && _cache[eid].stale) {
+      version = _cache[eid].attr->version;
+    }
+  }
+  int tries = 0;
+  if (!large || version != 0) {
+    // the bytes come with their version, or not at all if the stale
+    // ones in the cache are still those of the server
+    extent_protocol::batch_ent e;
+    do {
+      ret = _server(eid)->call(extent_protocol::get_if_changed, eid, version,
+                               e);
+    } while (_moved(ret, tries));
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    ScopedLock l(&_m);
+    if (e.ret != extent_protocol::OK && e.ret != extent_protocol::RPCERR) {
+      if (_cache.count(eid) && _cache[eid].stale) {
+        _clean_cache(eid);
+      }
+      return e.ret;
+    }
+    _fresh(eid, e.a);
+    cache_item &c = _cache[eid];
+    if (c.buf != NULL) {
+      tprintf("[EXT CLI] not modified %llu\n", eid);
+      buf = *c.buf;
+      return ret;
+    }
+    if (e.ret == extent_protocol::OK) {
+      c.buf = new std::string(e.data);
+      buf.swap(e.data);
+      return ret;
+    }
+    // too big to come in one reply
+  }
+  string_sink dst(buf);
+  do {
+    ret = _server(eid)->call_download(extent_protocol::get_stream, eid, &dst);
+  } while (_moved(ret, tries));
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
   {
     ScopedLock l(&_m);
     // load cache
@@ -66,17 +244,26 @@ extent_client::getattr(extent_protocol::extentid_t eid,
       if (_cache[eid].removed) {
         return extent_protocol::NOENT;
       }
-      else if (_cache[eid].attr) {
+      else if (_cache[eid].attr && !_cache[eid].stale) {
         attr = *(_cache[eid].attr);
         return ret;
       }
     }
   }
-  ret = cl->call(extent_protocol::getattr, eid, attr);
+  int tries = 0;
+  do {
+    ret = _server(eid)->call(extent_protocol::getattr, eid, attr);
+  } while (_moved(ret, tries));
   {
     ScopedLock l(&_m);
+    if (ret != extent_protocol::OK) {
+      if (_cache.count(eid) && _cache[eid].stale) {
+        _clean_cache(eid);
+      }
+      return ret;
+    }
     // load cache
-    _cache[eid].attr = new extent_protocol::attr(attr);
+    _fresh(eid, attr);
     return ret;
   }
 }
@@ -90,6 +277,7 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
   // ret = cl->call(extent_protocol::put, eid, buf, r);
   _cache[eid].removed = false;
   _cache[eid].dirty = true;
+  _unkeep(_cache[eid]);
   if (!_cache[eid].buf) {
     tprintf("[EXT CLI] new string\n");
     _cache[eid].buf = new std::string();
@@ -114,10 +302,350 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf)
   return ret;
 }
 
+// a stale eid is checked with the server first, so that the range
+// calls know whether it is still there and how big it is
+void
+extent_client::_revalidate(extent_protocol::extentid_t eid)
+{
+  bool stale;
+  {
+    ScopedLock l(&_m);
+    stale = _cache.count(eid) && _cache[eid].stale;
+  }
+  if (stale) {
+    extent_protocol::attr a;
+    getattr(eid, a);
+  }
+}
+
+// whether a range call should work on the whole extent in the cache;
+// false if it is unknown how big the extent is
+bool
+extent_client::_use_whole(extent_protocol::extentid_t eid, size_t end)
+{
+  if (_cache.count(eid) == 0) {
+    return false;
+  }
+  cache_item &c = _cache[eid];
+  if (c.buf != NULL) {
+    return true;
+  }
+  return c.attr != NULL && c.attr->size <= whole_max && end <= whole_max;
+}
+
+// the server changed the extent to size bytes
+void
+extent_client::_wrote(extent_protocol::extentid_t eid, size_t size)
+{
+  if (_cache.count(eid) && _cache[eid].attr) {
+    time_t now = time(NULL);
+    _cache[eid].attr->mtime = now;
+    _cache[eid].attr->ctime = now;
+    _cache[eid].attr->size = size;
+    _cache[eid].attr->version = 0; // unknown
+  }
+}
+
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, size_t off, size_t len,
+                    std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  bool whole;
+  _revalidate(eid);
+  {
+    ScopedLock l(&_m);
+    if (_cache.count(eid) && _cache[eid].removed) {
+      return extent_protocol::NOENT;
+    }
+    whole = _use_whole(eid, 0);
+  }
+  if (whole) {
+    std::string all;
+    if ((ret = get(eid, all)) != extent_protocol::OK) {
+      return ret;
+    }
+    buf = off > all.size() ? "" : all.substr(off, len);
+    return ret;
+  }
+
+  // a PDU at a time
+  int tries = 0;
+  buf.clear();
+  while (buf.size() < len) {
+    size_t n = std::min(len - buf.size(), stream_threshold);
+    std::string chunk;
+    do {
+      ret = _server(eid)->call(extent_protocol::read, eid,
+                               (unsigned int) (off + buf.size()),
+                               (unsigned int) n, chunk);
+    } while (_moved(ret, tries));
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    buf.append(chunk);
+    if (chunk.size() < n) {
+      break;
+    }
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, size_t off,
+                     const std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  bool whole, removed;
+  _revalidate(eid);
+  {
+    ScopedLock l(&_m);
+    removed = _cache.count(eid) && _cache[eid].removed;
+    whole = _use_whole(eid, off + buf.size());
+  }
+  if (removed) {
+    // like the server, a write recreates a removed extent
+    std::string all(off, '\0');
+    return put(eid, all.append(buf));
+  }
+  if (whole) {
+    std::string all;
+    if ((ret = get(eid, all)) != extent_protocol::OK) {
+      return ret;
+    }
+    if (all.size() < off + buf.size()) {
+      all.resize(off + buf.size());
+    }
+    all.replace(off, buf.size(), buf);
+    return put(eid, all);
+  }
+
+  int tries = 0;
+  size_t done = 0;
+  int size = 0;
+  do {
+    size_t n = std::min(buf.size() - done, stream_threshold);
+    do {
+      ret = _server(eid)->call(extent_protocol::write, eid,
+                               (unsigned int) (off + done),
+                               buf.substr(done, n), size);
+    } while (_moved(ret, tries));
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    done += n;
+  } while (done < buf.size());
+  ScopedLock l(&_m);
+  _wrote(eid, size);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, size_t size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  bool whole;
+  _revalidate(eid);
+  {
+    ScopedLock l(&_m);
+    if (_cache.count(eid) && _cache[eid].removed) {
+      return extent_protocol::NOENT;
+    }
+    whole = _use_whole(eid, size);
+  }
+  if (whole) {
+    std::string all;
+    if ((ret = get(eid, all)) != extent_protocol::OK) {
+      return ret;
+    }
+    all.resize(size);
+    return put(eid, all);
+  }
+
+  int r, tries = 0;
+  do {
+    ret = _server(eid)->call(extent_protocol::truncate, eid,
+                             (unsigned int) size, r);
+  } while (_moved(ret, tries));
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock l(&_m);
+  _wrote(eid, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::append(extent_protocol::extentid_t eid, const std::string &buf,
+                      size_t &size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  bool whole;
+  _revalidate(eid);
+  {
+    ScopedLock l(&_m);
+    whole = _cache.count(eid) &&
+      (_cache[eid].removed || _cache[eid].buf != NULL);
+  }
+  if (whole) {
+    // empty if removed; like a write, an append recreates it
+    std::string all;
+    get(eid, all);
+    all.append(buf);
+    size = all.size();
+    return put(eid, all);
+  }
+
+  int tries = 0;
+  size_t done = 0;
+  int r = 0;
+  do {
+    size_t n = std::min(buf.size() - done, stream_threshold);
+    do {
+      ret = _server(eid)->call(extent_protocol::append, eid,
+                               buf.substr(done, n), r);
+    } while (_moved(ret, tries));
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    done += n;
+  } while (done < buf.size());
+  ScopedLock l(&_m);
+  _wrote(eid, r);
+  size = r;
+  return ret;
+}
+
+// whether cl deduplicates chunks; asked once per server
+bool
+extent_client::_dedups(rpcc *cl)
+{
+  {
+    ScopedLock rl(&ring_m_);
+    auto it = features_.find(cl);
+    if (it != features_.end()) {
+      return it->second & extent_protocol::feature_dedup;
+    }
+  }
+  int r;
+  if (cl->call(extent_protocol::features, 0, r) != extent_protocol::OK) {
+    return false; // asked again next time
+  }
+  ScopedLock rl(&ring_m_);
+  features_[cl] = r;
+  return r & extent_protocol::feature_dedup;
+}
+
+// puts buf on eid's server.  on a server that deduplicates, a big
+// extent is cut into chunks, the server is asked which of them it has,
+// and only the others are sent.  a chunk the server drops in between
+// makes it fall back to sending it all.  version is the new version.
+int
+extent_client::_put(extent_protocol::extentid_t eid, const std::string &buf,
+                    unsigned long long &version)
+{
+  rpcc *cl = _server(eid);
+  int ret = extent_protocol::NOENT;
+  if (buf.size() >= dedup_min && _dedups(cl)) {
+    std::vector<size_t> lens;
+    chunk_split(buf.data(), buf.size(), lens);
+    std::string hashes, have;
+    for (size_t i = 0, off = 0; i < lens.size(); off += lens[i++]) {
+      chunk_hash h = chunk_hash_of(buf.data() + off, lens[i]);
+      hashes.append((const char *) &h, sizeof(h));
+    }
+    ret = cl->call(extent_protocol::have, hashes, have);
+    std::string sent(lens.size(), 0), data;
+    std::vector<unsigned int> ulens(lens.begin(), lens.end());
+    for (size_t i = 0, off = 0; ret == extent_protocol::OK && i < lens.size();
+         off += lens[i++]) {
+      if (i >= have.size() || !have[i]) {
+        sent[i] = 1;
+        data.append(buf, off, lens[i]);
+      }
+    }
+    if (ret == extent_protocol::OK && data.size() <= stream_threshold) {
+      ret = cl->call(extent_protocol::put_chunks, eid, hashes, ulens, sent,
+                     data, version);
+      tprintf("[EXT CLI] put %llu as %lu chunks, sent %lu of %lu bytes\n",
+              eid, (unsigned long) lens.size(), (unsigned long) data.size(),
+              (unsigned long) buf.size());
+    } else if (ret == extent_protocol::OK) {
+      ret = extent_protocol::NOENT; // too much to send in one call
+    }
+    if (ret != extent_protocol::NOENT) {
+      return ret;
+    }
+  }
+  if (buf.size() > stream_threshold) {
+    string_source src(buf);
+    return cl->call_upload(extent_protocol::put_stream, eid, &src, version);
+  }
+  return cl->call(extent_protocol::put, eid, buf, version);
+}
+
 void
 extent_client::_clean_cache(extent_protocol::extentid_t eid)
 {
-  _cache.erase(eid);
+  auto it = _cache.find(eid);
+  if (it != _cache.end()) {
+    _unkeep(it->second);
+    _cache.erase(it);
+  }
+}
+
+// assumes _m.  makes c stale, if it is clean, of a known version, and
+// there is room for it.
+bool
+extent_client::_keep(cache_item &c)
+{
+  if (c.stale) {
+    return true;
+  }
+  if (c.removed || c.dirty || c.buf == NULL || c.attr == NULL ||
+      c.attr->version == 0 || _kept >= keep_max ||
+      _kept_bytes + c.buf->size() > keep_bytes_max) {
+    return false;
+  }
+  c.stale = true;
+  _kept++;
+  _kept_bytes += c.buf->size();
+  return true;
+}
+
+// assumes _m
+void
+extent_client::_unkeep(cache_item &c)
+{
+  if (c.stale) {
+    c.stale = false;
+    _kept--;
+    _kept_bytes -= c.buf->size();
+  }
+}
+
+// assumes _m.  a is the attributes of eid on the server now.  a stale
+// eid is up to date if it has the same version, or else its bytes are
+// dropped.
+void
+extent_client::_fresh(extent_protocol::extentid_t eid,
+                      const extent_protocol::attr &a)
+{
+  cache_item &c = _cache[eid];
+  bool replace = c.attr == NULL || c.stale || c.attr->version == 0;
+  if (c.stale) {
+    bool same = c.attr->version == a.version;
+    _unkeep(c);
+    if (!same) {
+      delete c.buf;
+      c.buf = NULL;
+    }
+  }
+  if (c.attr == NULL) {
+    c.attr = new extent_protocol::attr(a);
+  } else if (replace) {
+    *c.attr = a;
+  }
 }
 
 extent_protocol::status
@@ -134,42 +662,318 @@ extent_client::remove(extent_protocol::extentid_t eid)
 extent_protocol::status
 extent_client::flush(extent_protocol::extentid_t eid)
 {
-  extent_protocol::status ret = extent_protocol::OK;
-  bool removed = false, dirty = false;
-  std::string buf;
   {
     ScopedLock l(&_m);
     if (_cache.count(eid) == 0) {
       return extent_protocol::NOENT;
     }
-    removed = _cache[eid].removed;
-    dirty = _cache[eid].dirty;
-    tprintf("[EXT CLI] flushing %llu removed:%d dirty:%d\n", eid, removed, dirty);
-    if (!removed && !dirty) {
-      _clean_cache(eid);
-      return ret;
+  }
+  return flush(std::vector<extent_protocol::extentid_t>(1, eid));
+}
+
+extent_protocol::status
+extent_client::clone(extent_protocol::extentid_t src,
+                     extent_protocol::extentid_t dst)
+{
+  flush(src);
+  {
+    ScopedLock l(&_m);
+    _clean_cache(dst); // and a remove not yet flushed, as dst is replaced
+  }
+  extent_protocol::status ret;
+  int r, tries = 0;
+  do {
+    rpcc *cl;
+    std::string to;
+    {
+      ScopedLock rl(&ring_m_);
+      int s = ring_.owner(src), d = ring_.owner(dst);
+      cl = conns_[ring_.servers()[s]];
+      if (d != s) {
+        to = ring_.servers()[d];
+      }
+    }
+    ret = cl->call(extent_protocol::clone, src, dst, to, r);
+  } while (_moved(ret, tries));
+  tprintf("[EXT CLI] clone %llu to %llu: %d\n", src, dst, ret);
+  return ret;
+}
+
+// groups the eids[which[i]] by the server that has them
+void
+extent_client::_by_server(const std::vector<extent_protocol::extentid_t> &eids,
+                          const std::vector<size_t> &which,
+                          std::map<rpcc *, std::vector<size_t> > &groups)
+{
+  for (size_t i = 0; i < which.size(); i++) {
+    groups[_server(eids[which[i]])].push_back(which[i]);
+  }
+}
+
+void
+extent_client::get(const std::vector<extent_protocol::extentid_t> &eids,
+                   std::vector<std::string> &bufs,
+                   std::vector<extent_protocol::status> &rets)
+{
+  bufs.assign(eids.size(), std::string());
+  rets.assign(eids.size(), extent_protocol::OK);
+  std::vector<size_t> missing;
+  {
+    ScopedLock l(&_m);
+    for (size_t i = 0; i < eids.size(); i++) {
+      auto it = _cache.find(eids[i]);
+      if (it != _cache.end() && it->second.removed) {
+        rets[i] = extent_protocol::NOENT;
+      } else if (it != _cache.end() && it->second.buf != NULL &&
+                 !it->second.stale) {
+        bufs[i] = *it->second.buf;
+      } else {
+        missing.push_back(i);
+      }
     }
-    if (dirty) {
-      buf = *(_cache[eid].buf);
-      tprintf("[EXT CLI] buf: \n===\n%s\n===\n", _cache[eid].buf->c_str());
+  }
+
+  std::map<rpcc *, std::vector<size_t> > groups;
+  _by_server(eids, missing, groups);
+  for (auto g = groups.begin(); g != groups.end(); g++) {
+    std::vector<extent_protocol::extentid_t> ids;
+    for (size_t k = 0; k < g->second.size(); k++) {
+      ids.push_back(eids[g->second[k]]);
     }
+    std::vector<extent_protocol::batch_ent> ents;
+    int ret = g->first->call(extent_protocol::multi_get, ids, ents);
+    for (size_t k = 0; k < g->second.size(); k++) {
+      size_t i = g->second[k];
+      if (ret != extent_protocol::OK || k >= ents.size() ||
+          ents[k].ret == extent_protocol::RPCERR) {
+        // left out of the batch, too big for it, or moved
+        rets[i] = get(eids[i], bufs[i]);
+        continue;
+      }
+      rets[i] = ents[k].ret;
+      if (rets[i] != extent_protocol::OK) {
+        continue;
+      }
+      bufs[i].swap(ents[k].data);
+      ScopedLock l(&_m);
+      _fresh(eids[i], ents[k].a);
+      cache_item &c = _cache[eids[i]];
+      if (c.buf == NULL) {
+        c.buf = new std::string(bufs[i]);
+      }
+    }
+    tprintf("[EXT CLI] got %lu extents in one call\n",
+            (unsigned long) ids.size());
   }
-  int r;
-  if (removed) {
-    ret = cl->call(extent_protocol::remove, eid, r);
+}
+
+void
+extent_client::getattr(const std::vector<extent_protocol::extentid_t> &eids,
+                       std::vector<extent_protocol::attr> &attrs,
+                       std::vector<extent_protocol::status> &rets)
+{
+  attrs.assign(eids.size(), extent_protocol::attr());
+  rets.assign(eids.size(), extent_protocol::OK);
+  std::vector<size_t> missing;
+  {
+    ScopedLock l(&_m);
+    for (size_t i = 0; i < eids.size(); i++) {
+      auto it = _cache.find(eids[i]);
+      if (it != _cache.end() && it->second.removed) {
+        rets[i] = extent_protocol::NOENT;
+      } else if (it != _cache.end() && it->second.attr != NULL &&
+                 !it->second.stale) {
+        attrs[i] = *it->second.attr;
+      } else {
+        missing.push_back(i);
+      }
+    }
   }
-  // if the resource is modified, write back to the server
-  else if (dirty) {
-    ret = cl->call(extent_protocol::put, eid, buf, r);
+
+  std::map<rpcc *, std::vector<size_t> > groups;
+  _by_server(eids, missing, groups);
+  for (auto g = groups.begin(); g != groups.end(); g++) {
+    std::vector<extent_protocol::extentid_t> ids;
+    for (size_t k = 0; k < g->second.size(); k++) {
+      ids.push_back(eids[g->second[k]]);
+    }
+    std::vector<extent_protocol::batch_ent> ents;
+    int ret = g->first->call(extent_protocol::multi_getattr, ids, ents);
+    for (size_t k = 0; k < g->second.size(); k++) {
+      size_t i = g->second[k];
+      if (ret == extent_protocol::MOVED) {
+        // one by one, on the servers the new ring has
+        rets[i] = getattr(eids[i], attrs[i]);
+        continue;
+      }
+      if (ret != extent_protocol::OK || k >= ents.size()) {
+        rets[i] = ret != extent_protocol::OK ? ret : extent_protocol::RPCERR;
+        continue;
+      }
+      rets[i] = ents[k].ret;
+      if (rets[i] != extent_protocol::OK) {
+        continue;
+      }
+      attrs[i] = ents[k].a;
+      ScopedLock l(&_m);
+      _fresh(eids[i], attrs[i]);
+    }
   }
+}
+
+// the removes and the puts for a server go in one multi_remove and as
+// few multi_puts as fit in stream_threshold.  extents too big for that,
+// and big ones for a server that deduplicates, are put one by one.  the
+// extents written back stay in the cache as stale, with the versions
+// the server gave them, like the clean ones.
+extent_protocol::status
+extent_client::flush(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<extent_protocol::extentid_t> ids;
+  std::vector<size_t> which;
+  std::vector<bool> removed;
+  std::vector<std::string> bufs;
   {
     ScopedLock l(&_m);
-    _clean_cache(eid);
-    if (r != extent_protocol::OK) {
-      return r;
+    for (size_t i = 0; i < eids.size(); i++) {
+      auto it = _cache.find(eids[i]);
+      if (it == _cache.end()) {
+        continue;
+      }
+      tprintf("[EXT CLI] flushing %llu removed:%d dirty:%d\n", eids[i],
+              it->second.removed, it->second.dirty);
+      if (!it->second.removed && !it->second.dirty) {
+        if (!_keep(it->second)) {
+          _clean_cache(eids[i]);
+        }
+        continue;
+      }
+      which.push_back(ids.size());
+      ids.push_back(eids[i]);
+      removed.push_back(it->second.removed);
+      bufs.push_back(it->second.removed ? "" : *it->second.buf);
     }
-    return ret;
   }
+
+  // the extents of a call that MOVED go again, on the new ring
+  std::vector<unsigned long long> versions(ids.size(), 0);
+  int tries = 0;
+  while (!which.empty()) {
+    std::vector<size_t> moved;
+    std::map<rpcc *, std::vector<size_t> > groups;
+    _by_server(ids, which, groups);
+    for (auto g = groups.begin(); g != groups.end(); g++) {
+      rpcc *cl = g->first;
+      std::vector<size_t> rm;
+      std::vector<std::vector<size_t> > batches(1);
+      size_t bytes = 0;
+      int r, cret;
+      for (size_t k = 0; k < g->second.size(); k++) {
+        size_t i = g->second[k];
+        if (removed[i]) {
+          rm.push_back(i);
+        } else if (bufs[i].size() > stream_threshold ||
+                   (bufs[i].size() >= dedup_min && _dedups(cl))) {
+          cret = _put(ids[i], bufs[i], versions[i]);
+          if (cret != extent_protocol::OK) {
+            versions[i] = 0;
+          }
+          if (cret == extent_protocol::MOVED) {
+            moved.push_back(i);
+          } else if (cret != extent_protocol::OK &&
+                     ret == extent_protocol::OK) {
+            ret = cret;
+          }
+        } else {
+          if (bytes + bufs[i].size() > stream_threshold &&
+              !batches.back().empty()) {
+            batches.push_back(std::vector<size_t>());
+            bytes = 0;
+          }
+          batches.back().push_back(i);
+          bytes += bufs[i].size();
+        }
+      }
+      for (size_t b = 0; b < batches.size() && !batches[b].empty(); b++) {
+        std::vector<extent_protocol::batch_ent> puts(batches[b].size());
+        for (size_t p = 0; p < puts.size(); p++) {
+          puts[p].id = ids[batches[b][p]];
+          puts[p].ret = extent_protocol::OK;
+          puts[p].data.swap(bufs[batches[b][p]]);
+        }
+        std::vector<unsigned long long> vs;
+        cret = cl->call(extent_protocol::multi_put, puts, vs);
+        if (cret == extent_protocol::MOVED) {
+          for (size_t p = 0; p < puts.size(); p++) {
+            bufs[batches[b][p]].swap(puts[p].data);
+          }
+          moved.insert(moved.end(), batches[b].begin(), batches[b].end());
+          continue;
+        } else if (cret != extent_protocol::OK && ret == extent_protocol::OK) {
+          ret = cret;
+        }
+        for (size_t p = 0; p < puts.size() && p < vs.size(); p++) {
+          versions[batches[b][p]] = vs[p];
+        }
+      }
+      if (!rm.empty()) {
+        std::vector<extent_protocol::extentid_t> rmids;
+        for (size_t k = 0; k < rm.size(); k++) {
+          rmids.push_back(ids[rm[k]]);
+        }
+        cret = cl->call(extent_protocol::multi_remove, rmids, r);
+        if (cret == extent_protocol::MOVED) {
+          moved.insert(moved.end(), rm.begin(), rm.end());
+        } else if (cret != extent_protocol::OK && ret == extent_protocol::OK) {
+          ret = cret;
+        }
+      }
+    }
+    which.swap(moved);
+    if (!which.empty() && !_moved(extent_protocol::MOVED, tries)) {
+      if (ret == extent_protocol::OK) {
+        ret = extent_protocol::MOVED;
+      }
+      break;
+    }
+  }
+
+  ScopedLock l(&_m);
+  for (size_t i = 0; i < ids.size(); i++) {
+    auto it = _cache.find(ids[i]);
+    if (it != _cache.end() && versions[i] != 0 && !it->second.removed &&
+        it->second.attr != NULL) {
+      it->second.dirty = false;
+      it->second.attr->version = versions[i];
+      if (_keep(it->second)) {
+        continue;
+      }
+    }
+    _clean_cache(ids[i]);
+  }
+  return ret;
 }
 
+void
+extent_client::cached(std::vector<extent_protocol::extentid_t> &ids)
+{
+  ScopedLock l(&_m);
+  for (auto it = _cache.begin(); it != _cache.end(); it++) {
+    ids.push_back(it->first);
+  }
+}
 
+bool
+extent_client::cached_attr(extent_protocol::extentid_t eid,
+                           extent_protocol::attr &a)
+{
+  ScopedLock l(&_m);
+  auto it = _cache.find(eid);
+  if (it == _cache.end() || it->second.removed || it->second.stale ||
+      it->second.attr == NULL) {
+    return false;
+  }
+  a = *it->second.attr;
+  return true;
+}
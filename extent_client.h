@@ -5,20 +5,33 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <pthread.h>
 
 #include "extent_protocol.h"
+#include "extent_ring.h"
 #include "rpc/rpc.h"
 
+// extents are spread over one or more extent servers by a consistent
+// hash ring.  all clients of a set of servers must be given the same
+// list; once a server joins, the servers have the ring, and a server
+// that no longer has an extent answers MOVED, on which the client
+// reads the ring from the servers and tries again.
 class extent_client {
  private:
-  rpcc *cl;
+  extent_ring ring_;
+  std::map<std::string, rpcc *> conns_; // by name on the ring
+  std::map<rpcc *, int> features_; // of the servers asked so far
+  pthread_mutex_t ring_m_; // protects the above
 
   struct cache_item {
     std::string * buf;
     bool dirty;
     bool removed;
     extent_protocol::attr * attr;
+    // kept clean through a flush.  buf is that of attr->version, or
+    // older, and is checked with the server before it is used again.
+    bool stale;
 
     ~cache_item() {
       delete buf;
@@ -27,21 +40,78 @@ class extent_client {
   };
 
   std::map<extent_protocol::extentid_t, cache_item> _cache;
+  // how many stale extents there are, and their bytes
+  size_t _kept;
+  size_t _kept_bytes;
 
   pthread_mutex_t _m;
 
   void _clean_cache(extent_protocol::extentid_t eid);
+  void _connect_wo(const std::string &dst);
+  bool _keep(cache_item &c);
+  void _unkeep(cache_item &c);
+  void _fresh(extent_protocol::extentid_t eid, const extent_protocol::attr &a);
+  void _revalidate(extent_protocol::extentid_t eid);
+  rpcc *_server(extent_protocol::extentid_t eid);
+  bool _refresh();
+  bool _moved(int ret, int &tries);
+  bool _dedups(rpcc *cl);
+  bool _use_whole(extent_protocol::extentid_t eid, size_t end);
+  void _wrote(extent_protocol::extentid_t eid, size_t size);
+  int _put(extent_protocol::extentid_t eid, const std::string &buf,
+           unsigned long long &version);
+  void _by_server(const std::vector<extent_protocol::extentid_t> &eids,
+                  const std::vector<size_t> &which,
+                  std::map<rpcc *, std::vector<size_t> > &groups);
 
  public:
+  // dst is a comma separated list of extent servers
   extent_client(std::string dst);
+  ~extent_client();
 
   extent_protocol::status get(extent_protocol::extentid_t eid,
 			      std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid,
 				  extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  // byte ranges.  small extents are still cached whole and written
+  // back on flush; the ranges of larger ones go straight to the server.
+  extent_protocol::status read(extent_protocol::extentid_t eid, size_t off,
+                               size_t len, std::string &buf);
+  extent_protocol::status write(extent_protocol::extentid_t eid, size_t off,
+                                const std::string &buf);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   size_t size);
+  // buf at the end of the extent, which is then size bytes.  only the
+  // new bytes are sent, unless the extent is in the cache.
+  extent_protocol::status append(extent_protocol::extentid_t eid,
+                                 const std::string &buf, size_t &size);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  // writes the extent back if it is dirty.  a clean one stays in the
+  // cache, and is fetched again on its next use only if its version
+  // on the server has changed.
   extent_protocol::status flush(extent_protocol::extentid_t eid);
+  // replaces dst with the contents of src on the servers, without
+  // moving the bytes through the client.  src is written back first.
+  extent_protocol::status clone(extent_protocol::extentid_t src,
+                                extent_protocol::extentid_t dst);
+
+  // batches of the calls above, with one call per server for all the
+  // extents that are not in the cache.  rets[i] is for eids[i].
+  void get(const std::vector<extent_protocol::extentid_t> &eids,
+           std::vector<std::string> &bufs,
+           std::vector<extent_protocol::status> &rets);
+  void getattr(const std::vector<extent_protocol::extentid_t> &eids,
+               std::vector<extent_protocol::attr> &attrs,
+               std::vector<extent_protocol::status> &rets);
+  // returns the first error, if any
+  extent_protocol::status
+    flush(const std::vector<extent_protocol::extentid_t> &eids);
+  // the ids of the extents in the cache
+  void cached(std::vector<extent_protocol::extentid_t> &ids);
+  // whether the cache holds eid's attributes, which it then puts in a,
+  // without asking the server
+  bool cached_attr(extent_protocol::extentid_t eid, extent_protocol::attr &a);
 };
 
 #endif
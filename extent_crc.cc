@@ -0,0 +1,93 @@
+// CRC32C, in hardware or by slicing-by-8
+
+#include "extent_crc.h"
+
+#include <string.h>
+
+// the reflected Castagnoli polynomial
+static const uint32_t poly = 0x82f63b78;
+
+// t[k][b] is the CRC of byte b followed by k zero bytes
+struct crc_tables {
+  uint32_t t[8][256];
+
+  crc_tables() {
+    for (int b = 0; b < 256; b++) {
+      uint32_t c = b;
+      for (int i = 0; i < 8; i++) {
+        c = (c >> 1) ^ (poly & (0 - (c & 1)));
+      }
+      t[0][b] = c;
+    }
+    for (int b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) {
+        t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+      }
+    }
+  }
+};
+
+static uint32_t
+crc32c_sw(const unsigned char *p, size_t n, uint32_t c)
+{
+  static const crc_tables tabs;
+  const uint32_t (*t)[256] = tabs.t;
+  for (; n > 0 && ((uintptr_t) p & 7) != 0; n--) {
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  }
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= c;
+    c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+        t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; n > 0; n--) {
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  }
+  return c;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(const unsigned char *p, size_t n, uint32_t c)
+{
+  for (; n > 0 && ((uintptr_t) p & 7) != 0; n--) {
+    c = __builtin_ia32_crc32qi(c, *p++);
+  }
+  uint64_t c64 = c;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    c64 = __builtin_ia32_crc32di(c64, w);
+  }
+  c = (uint32_t) c64;
+  for (; n > 0; n--) {
+    c = __builtin_ia32_crc32qi(c, *p++);
+  }
+  return c;
+}
+
+static bool
+have_hw()
+{
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  return hw;
+}
+#endif
+
+uint32_t
+crc32c(const void *p, size_t n, uint32_t crc)
+{
+  const unsigned char *b = (const unsigned char *) p;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (have_hw()) {
+    return ~crc32c_hw(b, n, ~crc);
+  }
+#endif
+  return ~crc32c_sw(b, n, ~crc);
+}
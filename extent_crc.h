@@ -0,0 +1,14 @@
+// CRC32C of extent bytes in the stores
+
+#ifndef extent_crc_h
+#define extent_crc_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the CRC32C (Castagnoli) of n bytes at p, continuing from crc, the
+// CRC32C of the bytes before them.  uses the crc32 instructions of
+// SSE4.2 where the CPU has them, and a table otherwise.
+uint32_t crc32c(const void *p, size_t n, uint32_t crc = 0);
+
+#endif
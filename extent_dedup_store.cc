@@ -0,0 +1,535 @@
+// the deduplicating extent store
+
+#include "extent_dedup_store.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_set>
+
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+extent_dedup_store::extent_dedup_store(extent_store *recipes,
+                                       extent_store *chunks)
+  : recipes_(recipes), chunks_(chunks), next_cid_(1)
+{
+  for (int i = 0; i < nshards; i++) {
+    VERIFY(pthread_mutex_init(&shards_[i].m, 0) == 0);
+  }
+  for (int i = 0; i < nstripes; i++) {
+    VERIFY(pthread_rwlock_init(&stripes_[i], 0) == 0);
+  }
+  recover();
+}
+
+extent_dedup_store::~extent_dedup_store()
+{
+  delete recipes_;
+  delete chunks_;
+  for (int i = 0; i < nshards; i++) {
+    VERIFY(pthread_mutex_destroy(&shards_[i].m) == 0);
+  }
+  for (int i = 0; i < nstripes; i++) {
+    VERIFY(pthread_rwlock_destroy(&stripes_[i]) == 0);
+  }
+}
+
+// counts the uses of every chunk, and drops what a crash left behind
+void extent_dedup_store::recover()
+{
+  std::vector<extent_protocol::extentid_t> ids;
+  recipes_->ids(ids);
+  std::vector<std::pair<extent_protocol::extentid_t, recipe> > all;
+  std::unordered_set<extent_protocol::extentid_t> bad;
+  for (size_t i = 0; i < ids.size(); i++) {
+    recipe r;
+    if (load_recipe(ids[i], r) != extent_protocol::OK) {
+      bad.insert(ids[i]);
+      continue;
+    }
+    for (size_t j = 0; j < r.ents.size(); j++) {
+      auto &map = shard_of(r.ents[j].hash).map;
+      auto it = map.find(r.ents[j].hash);
+      if (it == map.end()) {
+        map[r.ents[j].hash] = { r.ents[j].cid, 1 };
+      } else if (it->second.cid == r.ents[j].cid) {
+        it->second.refs++;
+      } else {
+        bad.insert(ids[i]);
+      }
+    }
+    all.push_back(std::make_pair(ids[i], r));
+  }
+
+  std::unordered_set<unsigned long long> lost;
+  for (int i = 0; i < nshards; i++) {
+    for (auto it = shards_[i].map.begin(); it != shards_[i].map.end(); it++) {
+      extent_protocol::attr a;
+      if (chunks_->getattr(it->second.cid, a) != extent_protocol::OK) {
+        lost.insert(it->second.cid);
+      }
+    }
+  }
+  for (size_t i = 0; i < all.size(); i++) {
+    const recipe &r = all[i].second;
+    bool ok = bad.count(all[i].first) == 0;
+    for (size_t j = 0; ok && j < r.ents.size(); j++) {
+      ok = lost.count(r.ents[j].cid) == 0;
+    }
+    if (ok) {
+      continue;
+    }
+    printf("extent_dedup_store: dropping %016llx, its chunks are gone\n",
+           all[i].first);
+    bad.insert(all[i].first);
+    for (size_t j = 0; j < r.ents.size(); j++) {
+      auto &map = shard_of(r.ents[j].hash).map;
+      auto it = map.find(r.ents[j].hash);
+      if (it != map.end() && it->second.cid == r.ents[j].cid &&
+          --it->second.refs == 0) {
+        map.erase(it);
+      }
+    }
+  }
+  for (auto it = bad.begin(); it != bad.end(); it++) {
+    recipes_->remove(*it);
+  }
+
+  std::unordered_set<unsigned long long> used;
+  size_t nchunks = 0;
+  for (int i = 0; i < nshards; i++) {
+    for (auto it = shards_[i].map.begin(); it != shards_[i].map.end(); it++) {
+      used.insert(it->second.cid);
+      nchunks++;
+    }
+  }
+  std::vector<extent_protocol::extentid_t> cids;
+  chunks_->ids(cids);
+  for (size_t i = 0; i < cids.size(); i++) {
+    next_cid_ = std::max(next_cid_, cids[i] + 1);
+    if (used.count(cids[i]) == 0) {
+      chunks_->remove(cids[i]);
+    }
+  }
+  printf("extent_dedup_store: %lu extents in %lu chunks\n",
+         (unsigned long) (ids.size() - bad.size()), (unsigned long) nchunks);
+}
+
+int extent_dedup_store::load_recipe(extent_protocol::extentid_t id,
+                                    recipe &r)
+{
+  rpc_slice s;
+  int ret = recipes_->read(id, 0, (size_t) -1, s);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  recipe_hdr h;
+  if (s.size() < sizeof(h)) {
+    return extent_protocol::IOERR;
+  }
+  memcpy(&h, s.data(), sizeof(h));
+  r.size = h.size;
+  r.ents.clear();
+  if (h.nchunks == 0) {
+    r.bytes = s.sub(sizeof(h), h.size);
+    return r.bytes.size() == h.size ? extent_protocol::OK
+                                    : extent_protocol::IOERR;
+  }
+  if (s.size() != sizeof(h) + h.nchunks * sizeof(recipe_ent)) {
+    return extent_protocol::IOERR;
+  }
+  r.ents.resize(h.nchunks);
+  memcpy(&r.ents[0], s.data() + sizeof(h), h.nchunks * sizeof(recipe_ent));
+  return extent_protocol::OK;
+}
+
+void extent_dedup_store::store_recipe(const recipe &r, std::string &buf)
+{
+  recipe_hdr h = { r.size, (unsigned int) r.ents.size() };
+  buf.assign((const char *) &h, sizeof(h));
+  if (r.ents.empty()) {
+    buf.append(r.bytes.data(), r.bytes.size());
+  } else {
+    buf.append((const char *) &r.ents[0], r.ents.size() * sizeof(recipe_ent));
+  }
+}
+
+// assumes the stripe of the extent
+int extent_dedup_store::read_recipe(const recipe &r, size_t off, size_t len,
+                                    rpc_slice &data)
+{
+  if (r.ents.empty()) {
+    data = r.bytes.sub(off, len);
+    return extent_protocol::OK;
+  }
+  off = std::min(off, (size_t) r.size);
+  len = std::min(len, r.size - off);
+  if (len == 0) {
+    data = rpc_slice();
+    return extent_protocol::OK;
+  }
+  std::string buf;
+  size_t at = 0;
+  for (size_t i = 0; i < r.ents.size() && at < off + len; i++) {
+    size_t end = at + r.ents[i].len;
+    if (end > off) {
+      size_t from = std::max(off, at);
+      size_t to = std::min(off + len, end);
+      rpc_slice piece;
+      if (chunks_->read(r.ents[i].cid, from - at, to - from, piece) !=
+          extent_protocol::OK || piece.size() != to - from) {
+        return extent_protocol::IOERR;
+      }
+      if (to - from == len) {
+        data = piece; // all in one chunk
+        return extent_protocol::OK;
+      }
+      buf.append(piece.data(), piece.size());
+    }
+    at = end;
+  }
+  data = rpc_slice(std::move(buf));
+  return extent_protocol::OK;
+}
+
+// counts a use of the chunk, and stores it if it is new
+int extent_dedup_store::ref(const extent_chunk &c, recipe_ent &e)
+{
+  shard &sh = shard_of(c.hash);
+  ScopedLock l(&sh.m);
+  e.hash = c.hash;
+  e.len = c.len;
+  e.pad = 0;
+  auto it = sh.map.find(c.hash);
+  if (it != sh.map.end()) {
+    it->second.refs++;
+    e.cid = it->second.cid;
+    return extent_protocol::OK;
+  }
+  if (c.data.size() != c.len) {
+    return extent_protocol::NOENT;
+  }
+  e.cid = __atomic_fetch_add(&next_cid_, 1, __ATOMIC_RELAXED);
+  extent_protocol::attr a = { 0, 0, 0, c.len };
+  if (chunks_->put(e.cid, a, c.data) != extent_protocol::OK) {
+    return extent_protocol::IOERR;
+  }
+  sh.map[c.hash] = { e.cid, 1 };
+  return extent_protocol::OK;
+}
+
+void extent_dedup_store::unref(const recipe_ent &e)
+{
+  shard &sh = shard_of(e.hash);
+  ScopedLock l(&sh.m);
+  auto it = sh.map.find(e.hash);
+  VERIFY(it != sh.map.end() && it->second.cid == e.cid);
+  if (--it->second.refs == 0) {
+    chunks_->remove(e.cid);
+    sh.map.erase(it);
+  }
+}
+
+// assumes the stripe of the extent alone.  r is old with chunks
+// from..to swapped for chunks counted for r; makes r the recipe of the
+// extent and drops the chunks it swapped out.  on failure the extent
+// is as it was.
+int extent_dedup_store::replace(extent_protocol::extentid_t id,
+                                const extent_protocol::attr &a,
+                                const recipe &old, recipe &r, size_t from,
+                                size_t to)
+{
+  std::string buf;
+  store_recipe(r, buf);
+  extent_protocol::attr ra = a;
+  ra.size = buf.size();
+  size_t nnew = r.ents.size() - (old.ents.size() - (to - from));
+  if (recipes_->put(id, ra, rpc_slice(std::move(buf))) !=
+      extent_protocol::OK) {
+    for (size_t i = from; i < from + nnew; i++) {
+      unref(r.ents[i]);
+    }
+    return extent_protocol::IOERR;
+  }
+  for (size_t i = from; i < to; i++) {
+    unref(old.ents[i]);
+  }
+  return extent_protocol::OK;
+}
+
+int extent_dedup_store::getattr(extent_protocol::extentid_t id,
+                                extent_protocol::attr &a)
+{
+  ScopedRead r(stripe(id));
+  int ret = recipes_->getattr(id, a);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  rpc_slice s;
+  recipe_hdr h;
+  ret = recipes_->read(id, 0, sizeof(h), s);
+  if (ret != extent_protocol::OK || s.size() != sizeof(h)) {
+    return extent_protocol::IOERR;
+  }
+  memcpy(&h, s.data(), sizeof(h));
+  a.size = h.size;
+  return extent_protocol::OK;
+}
+
+int extent_dedup_store::read(extent_protocol::extentid_t id, size_t off,
+                             size_t len, rpc_slice &data)
+{
+  ScopedRead r(stripe(id));
+  recipe rc;
+  int ret = load_recipe(id, rc);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  return read_recipe(rc, off, len, data);
+}
+
+int extent_dedup_store::put(extent_protocol::extentid_t id,
+                            const extent_protocol::attr &a,
+                            const rpc_slice &data)
+{
+  std::vector<extent_chunk> chunks;
+  if (data.size() < chunk_min) {
+    extent_chunk c;
+    c.len = data.size();
+    c.data = data;
+    chunks.push_back(c); // not hashed, as it is kept in the recipe
+  } else {
+    chunk_extent(data, chunks);
+  }
+  return put_chunks(id, a, chunks);
+}
+
+int extent_dedup_store::put_chunks(extent_protocol::extentid_t id,
+                                   const extent_protocol::attr &a,
+                                   const std::vector<extent_chunk> &chunks)
+{
+  ScopedWrite w(stripe(id));
+  recipe old, r;
+  if (load_recipe(id, old) != extent_protocol::OK) {
+    old = recipe();
+  }
+  r.size = a.size;
+
+  bool whole = true;
+  size_t size = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    whole = whole && chunks[i].data.size() == chunks[i].len;
+    size += chunks[i].len;
+  }
+  if (whole && size < chunk_min) {
+    std::string buf;
+    for (size_t i = 0; i < chunks.size(); i++) {
+      buf.append(chunks[i].data.data(), chunks[i].data.size());
+    }
+    r.bytes = rpc_slice(std::move(buf));
+  } else {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      recipe_ent e;
+      int ret = ref(chunks[i], e);
+      if (ret != extent_protocol::OK) {
+        for (size_t j = 0; j < r.ents.size(); j++) {
+          unref(r.ents[j]);
+        }
+        return ret;
+      }
+      r.ents.push_back(e);
+    }
+  }
+  return replace(id, a, old, r, 0, old.ents.size());
+}
+
+// rechunks only the chunks the write touches, and for a write at the
+// end the last chunk, so that appends don't leave a trail of small
+// chunks
+int extent_dedup_store::write(extent_protocol::extentid_t id,
+                              const extent_protocol::attr &a, size_t off,
+                              const rpc_slice &data)
+{
+  ScopedWrite w(stripe(id));
+  recipe old;
+  int ret = load_recipe(id, old);
+  if (ret == extent_protocol::NOENT) {
+    old = recipe();
+    old.size = 0;
+  } else if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  if (data.empty() && a.size == old.size) {
+    return replace(id, a, old, old, 0, 0);
+  }
+
+  std::vector<size_t> at(1, 0);
+  for (size_t i = 0; i < old.ents.size(); i++) {
+    at.push_back(at.back() + old.ents[i].len);
+  }
+  // chunks from..to of old become the bytes begin..end
+  size_t from = 0, to = old.ents.size(), begin = 0, end = a.size;
+  if (!old.ents.empty() && a.size >= chunk_min) {
+    size_t c = std::min(off, (size_t) std::min(a.size, old.size));
+    size_t q = std::min(c, (size_t) old.size - 1);
+    from = std::upper_bound(at.begin(), at.end(), q) - at.begin() - 1;
+    begin = at[from];
+    if (a.size == old.size && off + data.size() <= old.size) {
+      to = std::upper_bound(at.begin(), at.end(), off + data.size() - 1) -
+        at.begin();
+      end = at[to];
+    }
+  }
+
+  std::string buf;
+  if (begin < old.size) {
+    rpc_slice s;
+    ret = read_recipe(old, begin, std::min(end, (size_t) old.size) - begin, s);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+    buf.assign(s.data(), s.size());
+  }
+  buf.resize(end - begin);
+  if (off < end) {
+    buf.replace(off - begin, std::min(data.size(), end - off), data.data(),
+                std::min(data.size(), end - off));
+  }
+
+  recipe r;
+  r.size = a.size;
+  if (a.size < chunk_min) {
+    r.bytes = rpc_slice(std::move(buf));
+    return replace(id, a, old, r, 0, old.ents.size());
+  }
+  std::vector<extent_chunk> chunks;
+  chunk_extent(rpc_slice(std::move(buf)), chunks);
+  r.ents.assign(old.ents.begin(), old.ents.begin() + from);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    recipe_ent e;
+    if ((ret = ref(chunks[i], e)) != extent_protocol::OK) {
+      for (size_t j = from; j < r.ents.size(); j++) {
+        unref(r.ents[j]);
+      }
+      return ret;
+    }
+    r.ents.push_back(e);
+  }
+  r.ents.insert(r.ents.end(), old.ents.begin() + to, old.ents.end());
+  return replace(id, a, old, r, from, to);
+}
+
+int extent_dedup_store::touch(extent_protocol::extentid_t id, unsigned int t)
+{
+  return recipes_->touch(id, t);
+}
+
+int extent_dedup_store::remove(extent_protocol::extentid_t id)
+{
+  ScopedWrite w(stripe(id));
+  recipe old;
+  int ret = load_recipe(id, old);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  if ((ret = recipes_->remove(id)) != extent_protocol::OK) {
+    return ret;
+  }
+  for (size_t i = 0; i < old.ents.size(); i++) {
+    unref(old.ents[i]);
+  }
+  return extent_protocol::OK;
+}
+
+void extent_dedup_store::ids(std::vector<extent_protocol::extentid_t> &v)
+{
+  recipes_->ids(v);
+}
+
+bool extent_dedup_store::needs_sync()
+{
+  return recipes_->needs_sync() || chunks_->needs_sync();
+}
+
+// the chunks first, as a recipe on disk needs its chunks there too
+int extent_dedup_store::sync()
+{
+  int ret = chunks_->sync();
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  return recipes_->sync();
+}
+
+void extent_dedup_store::have(const std::vector<chunk_hash> &hashes,
+                              std::string &flags)
+{
+  flags.assign(hashes.size(), 0);
+  for (size_t i = 0; i < hashes.size(); i++) {
+    shard &sh = shard_of(hashes[i]);
+    ScopedLock l(&sh.m);
+    flags[i] = sh.map.count(hashes[i]) != 0;
+  }
+}
+
+// the clone gets a copy of the recipe, and counts another use of each
+// of its chunks
+int extent_dedup_store::clone(extent_protocol::extentid_t src,
+                              extent_protocol::extentid_t dst,
+                              const extent_protocol::attr &a)
+{
+  // the stripes in order, that of src only shared
+  pthread_rwlock_t *s = stripe(src), *d = stripe(dst);
+  if (s < d) {
+    VERIFY(pthread_rwlock_rdlock(s) == 0);
+  }
+  VERIFY(pthread_rwlock_wrlock(d) == 0);
+  if (s > d) {
+    VERIFY(pthread_rwlock_rdlock(s) == 0);
+  }
+
+  recipe from, old;
+  int ret = load_recipe(src, from);
+  if (ret == extent_protocol::OK) {
+    if (load_recipe(dst, old) != extent_protocol::OK) {
+      old = recipe();
+    }
+    recipe r = from;
+    for (size_t i = 0; ret == extent_protocol::OK && i < from.ents.size();
+         i++) {
+      extent_chunk c;
+      c.hash = from.ents[i].hash;
+      c.len = from.ents[i].len;
+      ret = ref(c, r.ents[i]);
+      if (ret != extent_protocol::OK) {
+        for (size_t j = 0; j < i; j++) {
+          unref(r.ents[j]);
+        }
+      }
+    }
+    if (ret == extent_protocol::OK) {
+      extent_protocol::attr da = a;
+      da.size = from.size;
+      ret = replace(dst, da, old, r, 0, old.ents.size());
+    }
+  }
+
+  if (s != d) {
+    VERIFY(pthread_rwlock_unlock(s) == 0);
+  }
+  VERIFY(pthread_rwlock_unlock(d) == 0);
+  return ret;
+}
+
+void extent_dedup_store::stats(std::string &s)
+{
+  std::string r, c;
+  recipes_->stats(r);
+  chunks_->stats(c);
+  if (!r.empty()) {
+    s += "recipes: " + r;
+  }
+  if (!c.empty()) {
+    s += (r.empty() ? "" : "; ") + std::string("chunks: ") + c;
+  }
+}
@@ -0,0 +1,105 @@
+// a store that keeps each distinct chunk once
+
+#ifndef extent_dedup_store_h
+#define extent_dedup_store_h
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include "extent_store.h"
+
+// an extent is kept as a recipe in one store: its size and the chunks
+// it is cut into, or, below chunk_min bytes, its bytes themselves.
+// the chunks are kept in another store, once for all the extents that
+// have them, under ids of their own, with a count of the recipes that
+// use them.  the counts and the hash of every chunk are only in
+// memory; opening the store rebuilds them from the recipes.
+//
+// a put writes the new chunks before the recipe, and removes the
+// chunks no recipe uses any more after it.  the two stores may lose
+// different amounts of log in a crash, so opening the store drops the
+// recipes whose chunks are gone, and the chunks no recipe uses.
+class extent_dedup_store : public extent_store {
+ private:
+  struct recipe_hdr {
+    unsigned int size;
+    unsigned int nchunks; // 0 if the bytes follow instead
+  };
+
+  struct recipe_ent {
+    chunk_hash hash;
+    unsigned long long cid; // in chunks_
+    unsigned int len;
+    unsigned int pad;
+  };
+
+  struct recipe {
+    unsigned int size;
+    std::vector<recipe_ent> ents;
+    rpc_slice bytes; // of an extent without chunks
+  };
+
+  struct chunk {
+    unsigned long long cid;
+    unsigned int refs;
+  };
+
+  struct shard {
+    pthread_mutex_t m;
+    std::unordered_map<chunk_hash, chunk, chunk_hash_hasher> map;
+  };
+
+  static const int nshards = 64;
+  shard shards_[nshards];
+  shard &shard_of(const chunk_hash &h) { return shards_[h.h[31] % nshards]; }
+
+  // reads of an extent share its stripe, and updates hold it alone, so
+  // the chunks of a recipe being read are not removed under the reader
+  static const int nstripes = 64;
+  pthread_rwlock_t stripes_[nstripes];
+  pthread_rwlock_t *stripe(extent_protocol::extentid_t id) {
+    return &stripes_[id % nstripes];
+  }
+
+  extent_store *recipes_;
+  extent_store *chunks_;
+  unsigned long long next_cid_;
+
+  void recover();
+  int load_recipe(extent_protocol::extentid_t id, recipe &r);
+  void store_recipe(const recipe &r, std::string &buf);
+  int read_recipe(const recipe &r, size_t off, size_t len, rpc_slice &data);
+  int ref(const extent_chunk &c, recipe_ent &e);
+  void unref(const recipe_ent &e);
+  int replace(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+              const recipe &old, recipe &r, size_t from, size_t to);
+
+ public:
+  // takes over both stores
+  extent_dedup_store(extent_store *recipes, extent_store *chunks);
+  ~extent_dedup_store();
+
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int read(extent_protocol::extentid_t id, size_t off, size_t len,
+           rpc_slice &data);
+  int put(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+          const rpc_slice &data);
+  int write(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+            size_t off, const rpc_slice &data);
+  int touch(extent_protocol::extentid_t id, unsigned int t);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &v);
+  void have(const std::vector<chunk_hash> &hashes, std::string &flags);
+  int put_chunks(extent_protocol::extentid_t id,
+                 const extent_protocol::attr &a,
+                 const std::vector<extent_chunk> &chunks);
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            const extent_protocol::attr &a);
+  bool dedups() { return true; }
+  bool needs_sync();
+  int sync();
+  void stats(std::string &s);
+};
+
+#endif
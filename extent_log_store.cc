@@ -0,0 +1,1486 @@
+// the log-structured extent store
+
+#include "extent_log_store.h"
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "extent_crc.h"
+#include "extent_lz.h"
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+const unsigned long long extent_log_store::seg_max;
+const unsigned int extent_log_store::max_writes;
+const unsigned int extent_log_store::block_size;
+
+// record types.  the data of a write starts with the 64-bit offset it
+// goes to, that of a clone is the 64-bit id of its source, and that of
+// a packed put is the bytes of the extent as lz_pack packed them.  a
+// bput and a bwrite are a put and a write whose bytes are in blocks,
+// behind a table of them, and the blocks of a bput may be packed.
+// puts, writes and packed puts are from logs written before.
+enum { REC_PUT = 1, REC_REMOVE = 2, REC_WRITE = 3, REC_CLONE = 4,
+       REC_PACKED = 5, REC_BPUT = 6, REC_BWRITE = 7 };
+
+static const uint32_t rec_magic = 0x43534659;  // "YFSC"
+static const uint32_t ckpt_magic = 0x4b534659; // "YFSK"
+// those of logs written before records were summed with CRC32C
+static const uint32_t old_rec_magic = 0x4c534659;  // "YFSL"
+static const uint32_t old_ckpt_magic = 0x4a534659; // "YFSJ"
+
+// the scrubber sleeps off its reads in steps of this many bytes
+static const size_t scrub_step = 64 * 1024;
+
+struct rec_hdr {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t id;
+  uint32_t atime, mtime, ctime, size;
+  uint32_t len;  // bytes of data after the header
+  // the CRC32C of the bytes of the extent in the data, or of the table
+  // of the blocks, continued over the header, with sum 0, and the
+  // offset of a write
+  uint32_t sum;
+};
+
+// the table of blocks is the number of bytes of the extent in them,
+// then one of these for each block_size of them, then the blocks
+struct blk_ent {
+  uint32_t crc;  // of the bytes of the block as stored
+  uint32_t zlen; // that they take; fewer than the block has if packed
+};
+
+struct ckpt_hdr {
+  uint32_t magic;
+  uint32_t head;     // the log continues in this segment
+  uint64_t head_off; // at this offset
+  uint64_t count;    // entries that follow
+  uint32_t sum;      // of the entries
+  uint32_t pad;
+};
+
+// one per piece; the first of an extent is its base
+struct ckpt_ent {
+  uint64_t id;
+  uint32_t atime, mtime, ctime, size;
+  uint32_t seg, at, len, rlen;
+  uint64_t off;
+  uint32_t clen; // with the top bit set if the bytes are packed
+  uint32_t crc;
+};
+
+// as in an old checkpoint, without the sums of the pieces
+struct old_ckpt_ent {
+  uint64_t id;
+  uint32_t atime, mtime, ctime, size;
+  uint32_t seg, at, len, rlen;
+  uint64_t off;
+};
+
+// FNV-1a, the sum of old records and checkpoints
+static uint32_t
+log_sum(const char *p, size_t n, uint32_t h = 2166136261u)
+{
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char) p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool
+is_write(uint32_t type)
+{
+  return type == REC_WRITE || type == REC_BWRITE;
+}
+
+static bool
+is_blocked(uint32_t type)
+{
+  return type == REC_BPUT || type == REC_BWRITE;
+}
+
+static void
+write_off(const rec_hdr &h, const char *data, uint64_t *at)
+{
+  *at = 0;
+  if (is_write(h.type) && h.len >= sizeof(*at)) {
+    memcpy(at, data, sizeof(*at));
+  }
+}
+
+static size_t
+nblocks(size_t len)
+{
+  return (len + extent_log_store::block_size - 1) /
+    extent_log_store::block_size;
+}
+
+// of the table of the blocks of len bytes
+static size_t
+table_size(size_t len)
+{
+  return sizeof(uint32_t) + nblocks(len) * sizeof(blk_ent);
+}
+
+static blk_ent
+table_ent(const char *table, size_t i)
+{
+  blk_ent e;
+  memcpy(&e, table + sizeof(uint32_t) + i * sizeof(e), sizeof(e));
+  return e;
+}
+
+// the table of the blocks of the n bytes at data
+static void
+block_table(const char *data, size_t n, std::string &table)
+{
+  table.resize(table_size(n));
+  uint32_t len = n;
+  memcpy(&table[0], &len, sizeof(len));
+  for (size_t i = 0; i < nblocks(n); i++) {
+    size_t at = i * extent_log_store::block_size;
+    blk_ent e;
+    e.zlen = std::min(n - at, (size_t) extent_log_store::block_size);
+    e.crc = crc32c(data + at, e.zlen);
+    memcpy(&table[sizeof(len) + i * sizeof(e)], &e, sizeof(e));
+  }
+}
+
+// whether the n bytes at data are a table of blocks and the blocks, and
+// they check out.  tlen is set to the size of the table.
+static bool
+blocks_ok(const char *data, size_t n, size_t *tlen)
+{
+  uint32_t len;
+  if (n < sizeof(len)) {
+    return false;
+  }
+  memcpy(&len, data, sizeof(len));
+  *tlen = table_size(len);
+  if (n < *tlen) {
+    return false;
+  }
+  size_t zoff = *tlen;
+  for (size_t i = 0; i < nblocks(len); i++) {
+    blk_ent e = table_ent(data, i);
+    if (n - zoff < e.zlen || crc32c(data + zoff, e.zlen) != e.crc) {
+      return false;
+    }
+    zoff += e.zlen;
+  }
+  return zoff == n;
+}
+
+// whether the record with header h and data checks out, and in crc
+// the CRC32C its pieces keep: of the bytes of the extent in the data,
+// or of the table of a bput or bwrite
+static bool
+rec_ok(rec_hdr h, const char *data, uint32_t *crc)
+{
+  uint64_t at;
+  write_off(h, data, &at);
+  size_t skip = is_write(h.type) ? sizeof(at) : 0;
+  skip = std::min(skip, (size_t) h.len);
+  uint32_t sum = h.sum;
+  h.sum = 0;
+  if (h.magic == old_rec_magic) {
+    *crc = crc32c(data + skip, h.len - skip);
+    return log_sum(data, h.len, log_sum((const char *) &h, sizeof(h))) == sum;
+  }
+  if (is_blocked(h.type)) {
+    size_t tlen;
+    if (!blocks_ok(data + skip, h.len - skip, &tlen)) {
+      return false;
+    }
+    *crc = crc32c(data + skip, tlen);
+  } else {
+    *crc = crc32c(data + skip, h.len - skip);
+  }
+  return crc32c(data, skip, crc32c(&h, sizeof(h), *crc)) == sum;
+}
+
+static bool
+pread_all(int fd, char *buf, size_t n, unsigned long long off)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = pread(fd, buf + done, n - done, off + done);
+    if (r <= 0) {
+      return false;
+    }
+    done += r;
+  }
+  return true;
+}
+
+// reads an bytes into a, then bn into b
+static bool
+pread2_all(int fd, char *a, size_t an, char *b, size_t bn,
+           unsigned long long off)
+{
+  struct iovec iov[2];
+  iov[0].iov_base = a;
+  iov[0].iov_len = an;
+  iov[1].iov_base = b;
+  iov[1].iov_len = bn;
+  ssize_t r = preadv(fd, iov, 2, off);
+  if (r < 0) {
+    return false;
+  }
+  size_t got = r;
+  if (got < an) {
+    return pread_all(fd, a + got, an - got, off + got) &&
+      pread_all(fd, b, bn, off + an);
+  }
+  return pread_all(fd, b + (got - an), bn - (got - an), off + got);
+}
+
+static bool
+read_all(int fd, std::string &s)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return false;
+  }
+  s.resize(st.st_size);
+  return pread_all(fd, &s[0], s.size(), 0);
+}
+
+extent_log_store::extent_log_store(const std::string &dir, size_t scrub_rate,
+                                   bool pack)
+  : dir_(dir), head_(1), since_ckpt_(0), pack_(pack), put_bytes_(0),
+    packed_bytes_(0), packed_into_(0), scrub_rate_(scrub_rate),
+    stopping_(false), scrubbed_(0), scrub_passes_(0), bad_reads_(0),
+    bad_records_(0)
+{
+  VERIFY(pthread_rwlock_init(&_m, 0) == 0);
+  VERIFY(pthread_mutex_init(&ckpt_m_, 0) == 0);
+  VERIFY(pthread_mutex_init(&scrub_m_, 0) == 0);
+  VERIFY(pthread_cond_init(&scrub_c_, 0) == 0);
+  if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+    perror(dir_.c_str());
+    VERIFY(0);
+  }
+  recover();
+  VERIFY(pthread_create(&cleaner_, NULL, &extent_log_store::cleaner_thread,
+                        (void *) this) == 0);
+  // old segments may already be worth cleaning
+  clean_q_.enq(1);
+  if (scrub_rate_ > 0) {
+    VERIFY(pthread_create(&scrubber_, NULL,
+                          &extent_log_store::scrubber_thread,
+                          (void *) this) == 0);
+  }
+}
+
+extent_log_store::~extent_log_store()
+{
+  if (scrub_rate_ > 0) {
+    {
+      ScopedLock l(&scrub_m_);
+      stopping_ = true;
+      VERIFY(pthread_cond_signal(&scrub_c_) == 0);
+    }
+    VERIFY(pthread_join(scrubber_, NULL) == 0);
+  }
+  clean_q_.enq(0);
+  VERIFY(pthread_join(cleaner_, NULL) == 0);
+  checkpoint();
+  for (auto it = segs_.begin(); it != segs_.end(); it++) {
+    close(it->second.fd);
+  }
+  VERIFY(pthread_rwlock_destroy(&_m) == 0);
+  VERIFY(pthread_mutex_destroy(&ckpt_m_) == 0);
+  VERIFY(pthread_mutex_destroy(&scrub_m_) == 0);
+  VERIFY(pthread_cond_destroy(&scrub_c_) == 0);
+}
+
+std::string extent_log_store::seg_name(unsigned int seg)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "/seg.%08u", seg);
+  return dir_ + buf;
+}
+
+bool extent_log_store::open_seg(unsigned int seg, bool create)
+{
+  int fd = ::open(seg_name(seg).c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  VERIFY(fstat(fd, &st) == 0);
+  segment &s = segs_[seg];
+  s.fd = fd;
+  s.size = st.st_size;
+  s.live = 0;
+  return true;
+}
+
+bool extent_log_store::load_checkpoint(unsigned int *seg,
+                                       unsigned long long *off)
+{
+  int fd = ::open((dir_ + "/index").c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  std::string buf;
+  bool ok = read_all(fd, buf);
+  close(fd);
+
+  ckpt_hdr h;
+  if (!ok || buf.size() < sizeof(h)) {
+    return false;
+  }
+  memcpy(&h, buf.data(), sizeof(h));
+  const char *ents = buf.data() + sizeof(h);
+  // the pieces of an old checkpoint are summed once the segments are
+  // open
+  bool old = h.magic == old_ckpt_magic;
+  size_t esize = old ? sizeof(old_ckpt_ent) : sizeof(ckpt_ent);
+  if ((h.magic != ckpt_magic && !old) ||
+      buf.size() != sizeof(h) + h.count * esize ||
+      (old ? log_sum(ents, h.count * esize) :
+       crc32c(ents, h.count * esize)) != h.sum) {
+    printf("extent_log_store: ignoring bad checkpoint in %s\n", dir_.c_str());
+    return false;
+  }
+
+  index_.reserve(h.count);
+  for (uint64_t i = 0; i < h.count; i++) {
+    ckpt_ent e;
+    memset(&e, 0, sizeof(e));
+    memcpy(&e, ents + i * esize, esize);
+    piece p;
+    p.seg = e.seg;
+    p.at = e.at;
+    p.len = e.len;
+    p.rlen = e.rlen;
+    p.off = e.off;
+    p.clen = e.clen & 0x3fffffff;
+    p.blocked = (e.clen >> 30) & 1;
+    p.packed = e.clen >> 31;
+    p.crc = e.crc;
+    auto it = index_.find(e.id);
+    if (it != index_.end()) {
+      it->second.writes.push_back(p);
+      continue;
+    }
+    loc &l = index_[e.id];
+    l.attr.atime = e.atime;
+    l.attr.mtime = e.mtime;
+    l.attr.ctime = e.ctime;
+    l.attr.size = e.size;
+    l.base = p;
+  }
+  *seg = h.head;
+  *off = h.head_off;
+  return true;
+}
+
+// applies the records of seg from off on.  a torn record can only be
+// at the very end of the log, and is cut off.
+void extent_log_store::replay(unsigned int seg, unsigned long long off,
+                              bool last)
+{
+  segment &s = segs_[seg];
+  std::string buf;
+  VERIFY(read_all(s.fd, buf));
+
+  while (off < buf.size()) {
+    rec_hdr h;
+    if (buf.size() - off < sizeof(h)) {
+      break;
+    }
+    memcpy(&h, buf.data() + off, sizeof(h));
+    uint32_t crc;
+    if ((h.magic != rec_magic && h.magic != old_rec_magic) ||
+        buf.size() - off - sizeof(h) < h.len ||
+        !rec_ok(h, buf.data() + off + sizeof(h), &crc)) {
+      break;
+    }
+    if (h.type == REC_PUT || h.type == REC_PACKED || is_write(h.type) ||
+        is_blocked(h.type)) {
+      const char *data = buf.data() + off + sizeof(h);
+      uint64_t at;
+      write_off(h, data, &at);
+      size_t skip = is_write(h.type) ? sizeof(at) : 0;
+      piece p;
+      p.seg = seg;
+      p.at = at;
+      p.len = h.len - skip;
+      p.rlen = h.len;
+      p.off = off + sizeof(h) + skip;
+      p.clen = p.len;
+      p.blocked = is_blocked(h.type);
+      p.packed = h.type == REC_PACKED;
+      p.crc = crc;
+      size_t len;
+      if (p.packed && lz_size(data, h.len, &len)) {
+        p.len = len;
+      }
+      if (p.blocked) {
+        uint32_t n;
+        memcpy(&n, data + skip, sizeof(n));
+        p.len = n;
+        p.clen = n;
+        p.packed = h.len - skip - table_size(n) < n;
+      }
+      loc &l = index_[h.id];
+      l.attr.atime = h.atime;
+      l.attr.mtime = h.mtime;
+      l.attr.ctime = h.ctime;
+      l.attr.size = h.size;
+      if (is_write(h.type)) {
+        apply_write_wo(l, p);
+      } else {
+        apply_put_wo(l, p);
+      }
+    } else if (h.type == REC_REMOVE) {
+      index_.erase(h.id);
+    } else if (h.type == REC_CLONE && h.len == sizeof(uint64_t)) {
+      uint64_t from;
+      memcpy(&from, buf.data() + off + sizeof(h), sizeof(from));
+      auto it = index_.find(from);
+      if (it == index_.end()) {
+        index_.erase(h.id);
+      } else {
+        loc l = it->second;
+        l.attr.atime = h.atime;
+        l.attr.mtime = h.mtime;
+        l.attr.ctime = h.ctime;
+        l.attr.size = h.size;
+        index_[h.id] = l;
+      }
+    }
+    off += sizeof(h) + h.len;
+  }
+
+  if (off < buf.size()) {
+    printf("extent_log_store: %s: %s record at %llu\n", seg_name(seg).c_str(),
+           last ? "dropping torn" : "skipping the rest from bad", off);
+    if (last) {
+      VERIFY(ftruncate(s.fd, off) == 0);
+      s.size = off;
+    }
+  }
+}
+
+void extent_log_store::recover()
+{
+  std::vector<unsigned int> found;
+  DIR *d = opendir(dir_.c_str());
+  VERIFY(d != NULL);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    unsigned int seg;
+    if (sscanf(e->d_name, "seg.%u", &seg) == 1) {
+      found.push_back(seg);
+    }
+  }
+  closedir(d);
+  std::sort(found.begin(), found.end());
+
+  unsigned int from = 1;
+  unsigned long long from_off = 0;
+  if (!load_checkpoint(&from, &from_off)) {
+    index_.clear();
+    from = found.empty() ? 1 : found.front();
+    from_off = 0;
+  }
+
+  for (size_t i = 0; i < found.size(); i++) {
+    VERIFY(open_seg(found[i], false));
+  }
+  for (size_t i = 0; i < found.size(); i++) {
+    if (found[i] >= from) {
+      replay(found[i], found[i] == from ? from_off : 0, i == found.size() - 1);
+    }
+  }
+
+  head_ = found.empty() ? from : std::max(from, found.back());
+  if (segs_.count(head_) == 0) {
+    VERIFY(open_seg(head_, true));
+  }
+
+  // replay kept no proper count of the live bytes.  the pieces from
+  // an old checkpoint are read once to sum them.
+  for (auto it = segs_.begin(); it != segs_.end(); it++) {
+    it->second.live = 0;
+  }
+  size_t unsummed = 0;
+  for (auto it = index_.begin(); it != index_.end(); it++) {
+    loc &l = it->second;
+    for (size_t i = 0; i <= l.writes.size(); i++) {
+      piece &p = i == 0 ? l.base : l.writes[i - 1];
+      ref_wo(p);
+      if (p.clen == 0 && p.len > 0) {
+        VERIFY(sum_piece_wo(p));
+        unsummed++;
+      }
+    }
+  }
+  if (unsummed > 0) {
+    printf("extent_log_store: %s: summed %lu pieces of an old checkpoint\n",
+           dir_.c_str(), (unsigned long) unsummed);
+  }
+
+  // segments that were cleaned, but not yet deleted.  what was
+  // replayed from them must be in a checkpoint first.
+  bool orphans = false;
+  for (auto it = segs_.begin(); it != segs_.end(); it++) {
+    orphans = orphans || (it->first != head_ && it->second.live == 0);
+  }
+  if (orphans || unsummed > 0) {
+    checkpoint();
+  }
+  for (auto it = segs_.begin(); it != segs_.end(); ) {
+    if (it->first != head_ && it->second.live == 0) {
+      close(it->second.fd);
+      unlink(seg_name(it->first).c_str());
+      segs_.erase(it++);
+    } else {
+      it++;
+    }
+  }
+
+  printf("extent_log_store: %s: %lu extents in %lu segments\n",
+         dir_.c_str(), (unsigned long) index_.size(),
+         (unsigned long) segs_.size());
+}
+
+// assumes the write lock.  a write record gets at in front of its
+// data, and a bput or bwrite the table of the blocks of its data.  on
+// success, p is the piece for the data.
+int extent_log_store::append_wo(int type, extent_protocol::extentid_t id,
+                                const extent_protocol::attr &a,
+                                unsigned long long at,
+                                const std::string &table, const char *data,
+                                unsigned int len, piece *p, bool *rolled)
+{
+  uint64_t at64 = at;
+  size_t skip = is_write(type) ? sizeof(at64) : 0;
+
+  rec_hdr h;
+  h.magic = rec_magic;
+  h.type = type;
+  h.id = id;
+  h.atime = a.atime;
+  h.mtime = a.mtime;
+  h.ctime = a.ctime;
+  h.size = a.size;
+  h.len = skip + table.size() + len;
+  h.sum = 0;
+  // the blocks were summed into the table
+  uint32_t crc = is_blocked(type) ? crc32c(table.data(), table.size()) :
+    crc32c(data, len);
+  h.sum = crc32c(&at64, skip, crc32c(&h, sizeof(h), crc));
+
+  segment *s = &segs_[head_];
+  if (s->size > 0 && s->size + sizeof(h) + h.len > seg_max) {
+    fdatasync(s->fd);
+    if (!open_seg(head_ + 1, true)) {
+      return extent_protocol::IOERR;
+    }
+    head_++;
+    s = &segs_[head_];
+    *rolled = true;
+  }
+
+  struct iovec iov[4];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = &at64;
+  iov[1].iov_len = skip;
+  iov[2].iov_base = (void *) table.data();
+  iov[2].iov_len = table.size();
+  iov[3].iov_base = (void *) data;
+  iov[3].iov_len = len;
+  ssize_t n = pwritev(s->fd, iov, 4, s->size);
+  if (n != (ssize_t) (sizeof(h) + h.len)) {
+    // don't leave half a record in front of the next one
+    VERIFY(ftruncate(s->fd, s->size) == 0);
+    return extent_protocol::IOERR;
+  }
+
+  p->seg = head_;
+  p->at = at;
+  p->len = len;
+  p->rlen = h.len;
+  p->off = s->size + sizeof(h) + skip;
+  p->clen = len;
+  p->blocked = is_blocked(type);
+  p->packed = 0;
+  p->crc = crc;
+  s->size += n;
+  since_ckpt_ += n;
+  return extent_protocol::OK;
+}
+
+// sets table to the table of the blocks of the n bytes of a put at
+// data.  if packing is on, each block is packed if it shrinks enough,
+// and z gets the blocks as stored, packed or not; z is left empty if
+// none shrank.
+void extent_log_store::pack(const char *data, size_t n, std::string &table,
+                            std::string &z)
+{
+  if (!pack_) {
+    block_table(data, n, table);
+    return;
+  }
+  __atomic_fetch_add(&put_bytes_, n, __ATOMIC_RELAXED);
+  table.resize(table_size(n));
+  uint32_t len = n;
+  memcpy(&table[0], &len, sizeof(len));
+  std::string zb;
+  unsigned long long packed = 0, into = 0;
+  for (size_t i = 0; i < nblocks(n); i++) {
+    size_t at = i * block_size;
+    size_t bn = std::min(n - at, (size_t) block_size);
+    const char *b = data + at;
+    if (lz_pack(b, bn, zb)) {
+      if (packed == 0) {
+        z.assign(data, at);
+      }
+      packed += bn;
+      into += zb.size();
+      b = zb.data();
+      bn = zb.size();
+    }
+    if (packed > 0) {
+      z.append(b, bn);
+    }
+    blk_ent e;
+    e.crc = crc32c(b, bn);
+    e.zlen = bn;
+    memcpy(&table[sizeof(len) + i * sizeof(e)], &e, sizeof(e));
+  }
+  if (packed > 0) {
+    __atomic_fetch_add(&packed_bytes_, packed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&packed_into_, into, __ATOMIC_RELAXED);
+  }
+}
+
+// assumes the write lock.  appends a put of the n bytes at data in
+// the blocks of table, or of z if pack packed some of them.
+int extent_log_store::append_put_wo(extent_protocol::extentid_t id,
+                                    const extent_protocol::attr &a,
+                                    const char *data, size_t n,
+                                    const std::string &table,
+                                    const std::string &z, piece *p,
+                                    bool *rolled)
+{
+  if (z.empty()) {
+    return append_wo(REC_BPUT, id, a, 0, table, data, n, p, rolled);
+  }
+  int ret = append_wo(REC_BPUT, id, a, 0, table, z.data(), z.size(), p,
+                      rolled);
+  if (ret == extent_protocol::OK) {
+    p->len = n;
+    p->clen = n;
+    p->packed = 1;
+  }
+  return ret;
+}
+
+// assumes the write lock.  a record counts as live once for every
+// piece of it in the index.
+void extent_log_store::ref_wo(const piece &p)
+{
+  if (p.seg != 0) {
+    VERIFY(segs_.count(p.seg));
+    segs_[p.seg].live += sizeof(rec_hdr) + p.rlen;
+  }
+}
+
+// assumes the write lock
+void extent_log_store::unref_wo(const piece &p)
+{
+  auto it = segs_.find(p.seg);
+  if (it != segs_.end()) {
+    it->second.live -= sizeof(rec_hdr) + p.rlen;
+  }
+}
+
+// assumes the write lock
+void extent_log_store::apply_put_wo(loc &l, const piece &p)
+{
+  unref_wo(l.base);
+  for (size_t i = 0; i < l.writes.size(); i++) {
+    unref_wo(l.writes[i]);
+  }
+  l.writes.clear();
+  l.base = p;
+  ref_wo(l.base);
+}
+
+// assumes the write lock and l.attr.size already set.  cuts the pieces
+// that reach past the end, then puts p on top.
+void extent_log_store::apply_write_wo(loc &l, const piece &p)
+{
+  unsigned int size = l.attr.size;
+  l.base.len = std::min(l.base.len, size);
+  size_t j = 0;
+  for (size_t i = 0; i < l.writes.size(); i++) {
+    piece &w = l.writes[i];
+    if (w.at >= size) {
+      unref_wo(w);
+      continue;
+    }
+    w.len = std::min(w.len, size - w.at);
+    l.writes[j++] = w;
+  }
+  l.writes.resize(j);
+  if (p.len > 0 && p.at < size) {
+    l.writes.push_back(p);
+    l.writes.back().len = std::min(p.len, size - p.at);
+    ref_wo(l.writes.back());
+  }
+}
+
+// assumes a read or write lock.  len bytes from off on of the extent
+// at l, cut short at its end.
+int extent_log_store::read_wo(const loc &l, size_t off, size_t len,
+                              std::string &buf)
+{
+  if (off > l.attr.size) {
+    off = l.attr.size;
+  }
+  if (len > l.attr.size - off) {
+    len = l.attr.size - off;
+  }
+  buf.assign(len, '\0');
+  for (size_t i = 0; i <= l.writes.size(); i++) {
+    const piece &p = i == 0 ? l.base : l.writes[i - 1];
+    size_t from = std::max(off, (size_t) p.at);
+    size_t to = std::min(off + len, (size_t) p.at + p.len);
+    if (from < to &&
+        !read_piece_wo(p, from - p.at, to - p.at, &buf[from - off])) {
+      return extent_protocol::IOERR;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+// assumes a read or write lock.  reads the bytes of p from from to to
+// into dst, once the bytes the sum of p is of check out.  reads them
+// straight into dst when they are all wanted, and unpacks packed bytes
+// straight into dst when the read starts where the piece does.
+bool extent_log_store::read_piece_wo(const piece &p, size_t from, size_t to,
+                                     char *dst)
+{
+  if (p.blocked) {
+    return read_blocks_wo(p, from, to, dst);
+  }
+  int fd = segs_[p.seg].fd;
+  if (p.clen == 0) {
+    return pread_all(fd, dst, to - from, p.off + from);
+  }
+  std::string tmp;
+  char *buf = dst;
+  if (p.packed || from != 0 || to != p.clen) {
+    tmp.resize(p.clen);
+    buf = &tmp[0];
+  }
+  if (!pread_all(fd, buf, p.clen, p.off)) {
+    return false;
+  }
+  if (crc32c(buf, p.clen) != p.crc) {
+    bad_read(p, p.off, p.clen);
+    return false;
+  }
+  if (p.packed && from == 0) {
+    return lz_unpack(buf, p.clen, dst, to);
+  }
+  std::string raw;
+  if (p.packed) {
+    raw.resize(to);
+    if (!lz_unpack(buf, p.clen, &raw[0], to)) {
+      return false;
+    }
+    buf = &raw[0];
+  }
+  if (buf != dst) {
+    memcpy(dst, buf + from, to - from);
+  }
+  return true;
+}
+
+// assumes a read or write lock.  reads the bytes of the blocked piece
+// p from from to to into dst, once the table of its blocks and the
+// blocks they are in check out, and unpacks only those blocks.  where
+// no block is packed, they are where their place in the extent puts
+// them, so the table and the blocks from the first on are read at
+// once, and the blocks straight into dst when all their bytes are
+// wanted.
+bool extent_log_store::read_blocks_wo(const piece &p, size_t from,
+                                      size_t to, char *dst)
+{
+  int fd = segs_[p.seg].fd;
+  size_t tlen = table_size(p.clen);
+  size_t first = from / block_size, last = (to - 1) / block_size;
+  size_t start = first * block_size;
+  size_t end = std::min((size_t) p.clen, (last + 1) * block_size);
+  std::string table(tlen, '\0'), tmp;
+  char *buf = dst;
+  bool ok;
+  if (p.packed) {
+    ok = pread_all(fd, &table[0], tlen, p.off);
+  } else {
+    if (from != start || to != end) {
+      tmp.resize(end - start);
+      buf = &tmp[0];
+    }
+    ok = first == 0 ?
+      pread2_all(fd, &table[0], tlen, buf, end, p.off) :
+      pread_all(fd, &table[0], tlen, p.off) &&
+      pread_all(fd, buf, end - start, p.off + tlen + start);
+  }
+  if (!ok) {
+    return false;
+  }
+  if (crc32c(table.data(), tlen) != p.crc) {
+    bad_read(p, p.off, tlen);
+    return false;
+  }
+  // where the blocks from first on are stored after the table
+  size_t zstart = start;
+  if (p.packed) {
+    zstart = 0;
+    for (size_t i = 0; i < first; i++) {
+      zstart += table_ent(table.data(), i).zlen;
+    }
+    size_t zend = zstart;
+    for (size_t i = first; i <= last; i++) {
+      zend += table_ent(table.data(), i).zlen;
+    }
+    tmp.resize(zend - zstart);
+    buf = &tmp[0];
+    if (!pread_all(fd, buf, zend - zstart, p.off + tlen + zstart)) {
+      return false;
+    }
+  }
+  size_t zat = 0;
+  for (size_t i = first; i <= last; i++) {
+    blk_ent e = table_ent(table.data(), i);
+    size_t at = i * block_size;
+    size_t n = std::min((size_t) p.clen - at, (size_t) block_size);
+    if (e.zlen > n || (!p.packed && e.zlen != n) ||
+        crc32c(buf + zat, e.zlen) != e.crc) {
+      bad_read(p, p.off + tlen + zstart + zat, e.zlen);
+      return false;
+    }
+    if (p.packed) {
+      // the bytes of the block that are wanted
+      size_t bfrom = std::max(from, at) - at;
+      size_t bto = std::min(to, at + n) - at;
+      char *out = dst + (at + bfrom - from);
+      if (e.zlen == n) {
+        memcpy(out, buf + zat + bfrom, bto - bfrom);
+      } else if (bfrom == 0) {
+        if (!lz_unpack(buf + zat, e.zlen, out, bto)) {
+          return false;
+        }
+      } else {
+        std::string raw(bto, '\0');
+        if (!lz_unpack(buf + zat, e.zlen, &raw[0], bto)) {
+          return false;
+        }
+        memcpy(out, raw.data() + bfrom, bto - bfrom);
+      }
+    }
+    zat += e.zlen;
+  }
+  if (buf != dst && !p.packed) {
+    memcpy(dst, buf + (from - start), to - from);
+  }
+  return true;
+}
+
+void extent_log_store::bad_read(const piece &p, unsigned long long off,
+                                size_t n)
+{
+  printf("extent_log_store: %s: bad checksum of %lu bytes at %llu\n",
+         seg_name(p.seg).c_str(), (unsigned long) n, off);
+  ScopedLock l(&scrub_m_);
+  bad_reads_++;
+}
+
+// assumes the write lock.  sums the bytes of p as they are now.
+bool extent_log_store::sum_piece_wo(piece &p)
+{
+  std::string buf(p.len, '\0');
+  if (!pread_all(segs_[p.seg].fd, &buf[0], p.len, p.off)) {
+    return false;
+  }
+  p.clen = p.len;
+  p.crc = crc32c(buf.data(), buf.size());
+  return true;
+}
+
+// assumes the write lock.  replaces the pieces of the extent with one
+// put of its contents.
+int extent_log_store::compact_wo(extent_protocol::extentid_t id, loc &l,
+                                 bool *rolled)
+{
+  std::string buf;
+  int ret = read_wo(l, 0, l.attr.size, buf);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  std::string table, z;
+  pack(buf.data(), buf.size(), table, z);
+  piece p;
+  ret = append_put_wo(id, l.attr, buf.data(), buf.size(), table, z, &p,
+                      rolled);
+  if (ret == extent_protocol::OK) {
+    apply_put_wo(l, p);
+  }
+  return ret;
+}
+
+void extent_log_store::after_append(bool rolled)
+{
+  if (!rolled) {
+    return;
+  }
+  bool due;
+  {
+    ScopedRead r(&_m);
+    due = since_ckpt_ >= std::max(seg_max,
+        (unsigned long long) (index_.size() * sizeof(ckpt_ent)));
+  }
+  if (due) {
+    checkpoint();
+  }
+  clean_q_.enq(1);
+}
+
+void extent_log_store::checkpoint()
+{
+  ScopedLock c(&ckpt_m_);
+
+  std::string buf;
+  ckpt_hdr h;
+  int head_fd;
+  {
+    ScopedRead r(&_m);
+    h.magic = ckpt_magic;
+    h.head = head_;
+    h.head_off = segs_[head_].size;
+    h.count = 0;
+    h.pad = 0;
+    head_fd = segs_[head_].fd;
+
+    for (auto it = index_.begin(); it != index_.end(); it++) {
+      h.count += 1 + it->second.writes.size();
+    }
+    buf.resize(sizeof(h) + h.count * sizeof(ckpt_ent));
+    char *p = &buf[sizeof(h)];
+    for (auto it = index_.begin(); it != index_.end(); it++) {
+      const loc &l = it->second;
+      for (size_t i = 0; i <= l.writes.size(); i++) {
+        const piece &pc = i == 0 ? l.base : l.writes[i - 1];
+        extent_protocol::attr a;
+        get_attr(l.attr, a);
+        ckpt_ent e;
+        e.id = it->first;
+        e.atime = a.atime;
+        e.mtime = a.mtime;
+        e.ctime = a.ctime;
+        e.size = a.size;
+        e.seg = pc.seg;
+        e.at = pc.at;
+        e.len = pc.len;
+        e.rlen = pc.rlen;
+        e.off = pc.off;
+        e.clen = pc.clen | ((uint32_t) pc.blocked << 30) |
+          ((uint32_t) pc.packed << 31);
+        e.crc = pc.crc;
+        memcpy(p, &e, sizeof(e));
+        p += sizeof(e);
+      }
+    }
+    since_ckpt_ = 0;
+  }
+  h.sum = crc32c(buf.data() + sizeof(h), buf.size() - sizeof(h));
+  memcpy(&buf[0], &h, sizeof(h));
+
+  // the log the checkpoint covers has to be on disk first; the
+  // segments before the head were synced when they filled up
+  fdatasync(head_fd);
+
+  std::string tmp = dir_ + "/index.tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  VERIFY(fd >= 0);
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+    VERIFY(n > 0);
+    done += n;
+  }
+  VERIFY(fsync(fd) == 0);
+  close(fd);
+  VERIFY(rename(tmp.c_str(), (dir_ + "/index").c_str()) == 0);
+  int dfd = ::open(dir_.c_str(), O_RDONLY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+}
+
+int extent_log_store::getattr(extent_protocol::extentid_t id,
+                              extent_protocol::attr &a)
+{
+  ScopedRead r(&_m);
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return extent_protocol::NOENT;
+  }
+  get_attr(it->second.attr, a);
+  return extent_protocol::OK;
+}
+
+int extent_log_store::read(extent_protocol::extentid_t id, size_t off,
+                           size_t len, rpc_slice &data)
+{
+  ScopedRead r(&_m);
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return extent_protocol::NOENT;
+  }
+  std::string buf;
+  int ret = read_wo(it->second, off, len, buf);
+  if (ret == extent_protocol::OK) {
+    data = rpc_slice(std::move(buf));
+  }
+  return ret;
+}
+
+int extent_log_store::put(extent_protocol::extentid_t id,
+                          const extent_protocol::attr &a,
+                          const rpc_slice &data)
+{
+  // packed and summed before the lock is taken
+  std::string table, z;
+  pack(data.data(), data.size(), table, z);
+  bool rolled = false;
+  int ret;
+  {
+    ScopedWrite w(&_m);
+    piece p;
+    ret = append_put_wo(id, a, data.data(), data.size(), table, z, &p,
+                        &rolled);
+    if (ret == extent_protocol::OK) {
+      loc &l = index_[id];
+      l.attr = a;
+      apply_put_wo(l, p);
+    }
+  }
+  after_append(rolled);
+  return ret;
+}
+
+// appends the whole batch under one hold of the lock
+void extent_log_store::puts(const std::vector<extent_protocol::extentid_t> &ids,
+                            const std::vector<extent_protocol::attr> &as,
+                            const std::vector<rpc_slice> &data,
+                            std::vector<int> &rets)
+{
+  std::vector<std::string> tables(ids.size()), z(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    pack(data[i].data(), data[i].size(), tables[i], z[i]);
+  }
+  bool rolled = false;
+  rets.resize(ids.size());
+  {
+    ScopedWrite w(&_m);
+    for (size_t i = 0; i < ids.size(); i++) {
+      piece p;
+      rets[i] = append_put_wo(ids[i], as[i], data[i].data(), data[i].size(),
+                              tables[i], z[i], &p, &rolled);
+      if (rets[i] == extent_protocol::OK) {
+        loc &l = index_[ids[i]];
+        l.attr = as[i];
+        apply_put_wo(l, p);
+      }
+    }
+  }
+  after_append(rolled);
+}
+
+int extent_log_store::write(extent_protocol::extentid_t id,
+                            const extent_protocol::attr &a, size_t off,
+                            const rpc_slice &data)
+{
+  std::string table;
+  block_table(data.data(), data.size(), table);
+  bool rolled = false;
+  int ret;
+  {
+    ScopedWrite w(&_m);
+    piece p;
+    ret = append_wo(REC_BWRITE, id, a, off, table, data.data(), data.size(),
+                    &p, &rolled);
+    if (ret == extent_protocol::OK) {
+      loc &l = index_[id]; // with no base if new
+      l.attr = a;
+      apply_write_wo(l, p);
+      // the writes cost reads, memory, and dead bytes in the log; once
+      // they hold as much as the put below them, fold them into it
+      unsigned long long written = 0;
+      for (size_t i = 0; i < l.writes.size(); i++) {
+        written += l.writes[i].len;
+      }
+      if (l.writes.size() >= max_writes ||
+          written >= std::max(l.base.len, 64u << 10)) {
+        ret = compact_wo(id, l, &rolled);
+      }
+    }
+  }
+  after_append(rolled);
+  return ret;
+}
+
+int extent_log_store::touch(extent_protocol::extentid_t id, unsigned int t)
+{
+  ScopedRead r(&_m);
+  auto it = index_.find(id);
+  if (it == index_.end()) {
+    return extent_protocol::NOENT;
+  }
+  touch_attr(it->second.attr, t);
+  return extent_protocol::OK;
+}
+
+int extent_log_store::remove(extent_protocol::extentid_t id)
+{
+  bool rolled = false;
+  int ret;
+  {
+    ScopedWrite w(&_m);
+    auto it = index_.find(id);
+    if (it == index_.end()) {
+      return extent_protocol::NOENT;
+    }
+    piece p;
+    ret = append_wo(REC_REMOVE, id, it->second.attr, 0, std::string(), NULL,
+                    0, &p, &rolled);
+    if (ret == extent_protocol::OK) {
+      loc &l = it->second;
+      unref_wo(l.base);
+      for (size_t i = 0; i < l.writes.size(); i++) {
+        unref_wo(l.writes[i]);
+      }
+      index_.erase(it);
+    }
+  }
+  after_append(rolled);
+  return ret;
+}
+
+// the clone shares the records of src, and counts as another use of
+// them
+int extent_log_store::clone(extent_protocol::extentid_t src,
+                            extent_protocol::extentid_t dst,
+                            const extent_protocol::attr &a)
+{
+  bool rolled = false;
+  int ret;
+  {
+    ScopedWrite w(&_m);
+    auto it = index_.find(src);
+    if (it == index_.end()) {
+      return extent_protocol::NOENT;
+    }
+    loc l = it->second;
+    unsigned int size = l.attr.size;
+    l.attr = a;
+    l.attr.size = size;
+    uint64_t from = src;
+    piece p;
+    ret = append_wo(REC_CLONE, dst, l.attr, 0, std::string(),
+                    (const char *) &from, sizeof(from), &p, &rolled);
+    if (ret == extent_protocol::OK) {
+      loc &d = index_[dst];
+      unref_wo(d.base);
+      for (size_t i = 0; i < d.writes.size(); i++) {
+        unref_wo(d.writes[i]);
+      }
+      d = l;
+      ref_wo(d.base);
+      for (size_t i = 0; i < d.writes.size(); i++) {
+        ref_wo(d.writes[i]);
+      }
+    }
+  }
+  after_append(rolled);
+  return ret;
+}
+
+void extent_log_store::ids(std::vector<extent_protocol::extentid_t> &v)
+{
+  ScopedRead r(&_m);
+  v.reserve(v.size() + index_.size());
+  for (auto it = index_.begin(); it != index_.end(); it++) {
+    v.push_back(it->first);
+  }
+}
+
+// the segments before the head were synced when they filled up.  the
+// head is synced through a copy of its descriptor, so that appends go
+// on meanwhile, and the head can fill up and be cleaned.
+int extent_log_store::sync()
+{
+  int fd;
+  {
+    ScopedRead r(&_m);
+    fd = dup(segs_[head_].fd);
+  }
+  if (fd < 0) {
+    return extent_protocol::IOERR;
+  }
+  int ret = fdatasync(fd) == 0 ? extent_protocol::OK : extent_protocol::IOERR;
+  close(fd);
+  return ret;
+}
+
+void extent_log_store::stats(std::string &s)
+{
+  size_t n, nsegs;
+  {
+    ScopedRead r(&_m);
+    n = index_.size();
+    nsegs = segs_.size();
+  }
+  char buf[384];
+  ScopedLock l(&scrub_m_);
+  snprintf(buf, sizeof(buf),
+           "log %lu extents in %lu segments, %.1f of %.1f MB put packed "
+           "into %.1f MB, %.1f MB scrubbed in %llu passes, %llu bad reads, "
+           "%llu bad records",
+           (unsigned long) n, (unsigned long) nsegs,
+           __atomic_load_n(&packed_bytes_, __ATOMIC_RELAXED) / 1048576.0,
+           __atomic_load_n(&put_bytes_, __ATOMIC_RELAXED) / 1048576.0,
+           __atomic_load_n(&packed_into_, __ATOMIC_RELAXED) / 1048576.0,
+           scrubbed_ / 1048576.0, scrub_passes_, bad_reads_, bad_records_);
+  s += buf;
+}
+
+void *extent_log_store::cleaner_thread(void *x)
+{
+  ((extent_log_store *) x)->cleaner();
+  return 0;
+}
+
+// cleans segments less than half live, oldest first
+void extent_log_store::cleaner()
+{
+  while (1) {
+    int what;
+    clean_q_.deq(&what);
+    if (what == 0) {
+      return;
+    }
+    std::vector<unsigned int> victims;
+    {
+      ScopedRead r(&_m);
+      for (auto it = segs_.begin(); it != segs_.end(); it++) {
+        if (it->first != head_ && it->second.live * 2 < it->second.size) {
+          victims.push_back(it->first);
+        }
+      }
+    }
+    for (size_t i = 0; i < victims.size(); i++) {
+      clean(victims[i]);
+    }
+  }
+}
+
+bool extent_log_store::in_seg(const loc &l, unsigned int seg)
+{
+  bool here = l.base.seg == seg;
+  for (size_t i = 0; !here && i < l.writes.size(); i++) {
+    here = l.writes[i].seg == seg;
+  }
+  return here;
+}
+
+// rewrites the extents with pieces in seg at the head of the log, then
+// deletes seg once a checkpoint no longer needs it.  the extents are
+// found in the index rather than by the records in seg, as a clone
+// has pieces of records with the id of another extent.
+void extent_log_store::clean(unsigned int seg)
+{
+  int fd;
+  std::vector<extent_protocol::extentid_t> ids;
+  {
+    ScopedRead r(&_m);
+    fd = segs_[seg].fd;
+    for (auto it = index_.begin(); it != index_.end(); it++) {
+      if (in_seg(it->second, seg)) {
+        ids.push_back(it->first);
+      }
+    }
+  }
+
+  bool rolled = false;
+  for (size_t i = 0; i < ids.size(); i++) {
+    ScopedWrite w(&_m);
+    auto it = index_.find(ids[i]);
+    if (it != index_.end() && in_seg(it->second, seg) &&
+        compact_wo(ids[i], it->second, &rolled) != extent_protocol::OK) {
+      return;
+    }
+  }
+
+  checkpoint();
+  {
+    ScopedWrite w(&_m);
+    if (segs_[seg].live != 0) {
+      // moved back in by a clone of an extent not yet moved
+      return;
+    }
+    segs_.erase(seg);
+  }
+  close(fd);
+  unlink(seg_name(seg).c_str());
+}
+
+void *extent_log_store::scrubber_thread(void *x)
+{
+  ((extent_log_store *) x)->scrubber();
+  return 0;
+}
+
+// reads the segments through again and again, oldest first, at the
+// lowest priority and no faster than the scrub rate, so that it only
+// takes disk and CPU that the requests leave over
+void extent_log_store::scrubber()
+{
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  while (1) {
+    std::vector<unsigned int> segs;
+    {
+      ScopedRead r(&_m);
+      for (auto it = segs_.begin(); it != segs_.end(); it++) {
+        segs.push_back(it->first);
+      }
+    }
+    for (size_t i = 0; i < segs.size(); i++) {
+      if (!scrub(segs[i])) {
+        return;
+      }
+    }
+    {
+      ScopedLock l(&scrub_m_);
+      scrub_passes_++;
+    }
+    // at least a second between passes, if the log is small
+    if (!pace(scrub_rate_)) {
+      return;
+    }
+  }
+}
+
+// checks the sums of the records of seg, as far as it was written when
+// the scrub started.  the segment is read through a file descriptor of
+// its own, so the cleaner may delete it meanwhile.  false once the
+// store is closing.
+bool extent_log_store::scrub(unsigned int seg)
+{
+  int fd;
+  unsigned long long size;
+  {
+    ScopedRead r(&_m);
+    auto it = segs_.find(seg);
+    if (it == segs_.end()) {
+      return true;
+    }
+    fd = dup(it->second.fd);
+    size = it->second.size;
+  }
+  if (fd < 0) {
+    return true;
+  }
+
+  unsigned long long off = 0;
+  size_t owed = 0;
+  std::string data;
+  bool open = true;
+  while (off < size && open) {
+    rec_hdr h;
+    uint32_t crc;
+    bool ok = size - off >= sizeof(h) &&
+      pread_all(fd, (char *) &h, sizeof(h), off) &&
+      (h.magic == rec_magic || h.magic == old_rec_magic) &&
+      size - off - sizeof(h) >= h.len;
+    if (ok) {
+      data.resize(h.len);
+      ok = pread_all(fd, &data[0], h.len, off + sizeof(h)) &&
+        rec_ok(h, data.data(), &crc);
+    }
+    if (!ok) {
+      // the lengths of the records after it can't be trusted
+      ScopedLock l(&scrub_m_);
+      if (bad_.insert(std::make_pair(seg, off)).second) {
+        printf("extent_log_store: %s: scrub found a bad record at %llu\n",
+               seg_name(seg).c_str(), off);
+        bad_records_++;
+      }
+      break;
+    }
+    off += sizeof(h) + h.len;
+    owed += sizeof(h) + h.len;
+    if (owed >= scrub_step) {
+      open = paid(owed);
+      owed = 0;
+    }
+  }
+  close(fd);
+  return open && paid(owed);
+}
+
+// counts bytes as scrubbed, then paces them
+bool extent_log_store::paid(size_t bytes)
+{
+  {
+    ScopedLock l(&scrub_m_);
+    scrubbed_ += bytes;
+  }
+  return pace(bytes);
+}
+
+// sleeps as long as reading bytes takes at the scrub rate.  false
+// once the store is closing.
+bool extent_log_store::pace(size_t bytes)
+{
+  unsigned long long ns = bytes * 1000000000ULL / scrub_rate_;
+  struct timespec due;
+  clock_gettime(CLOCK_REALTIME, &due);
+  due.tv_sec += ns / 1000000000ULL;
+  due.tv_nsec += ns % 1000000000ULL;
+  if (due.tv_nsec >= 1000000000L) {
+    due.tv_sec++;
+    due.tv_nsec -= 1000000000L;
+  }
+  ScopedLock l(&scrub_m_);
+  while (!stopping_ &&
+         pthread_cond_timedwait(&scrub_c_, &scrub_m_, &due) != ETIMEDOUT) {
+  }
+  return !stopping_;
+}
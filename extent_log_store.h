@@ -0,0 +1,168 @@
+// a log-structured extent store
+
+#ifndef extent_log_store_h
+#define extent_log_store_h
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include "extent_store.h"
+#include "rpc/fifo.h"
+
+// every put, write, remove and clone is appended to the head of a log
+// of segment files, dir/seg.00000001 and on, and an in-memory index
+// maps each extent to the records holding its bytes; a clone points
+// at the records of the extent it was cloned from.  the index is
+// checkpointed to dir/index once about as much log has been written as
+// the checkpoint takes, and when the store is closed; opening the store
+// loads the checkpoint and replays the log written after it.  a cleaner
+// thread rewrites the extents still in mostly dead segments and deletes
+// the segments.
+//
+// segment writes are not synced one by one; a segment is synced when
+// it fills up, before a checkpoint that covers it, and by sync.
+//
+// the bytes of a put or write are kept in blocks of block_size, behind
+// a table of the CRC32C of each.  the index keeps the CRC32C of the
+// table, and a read checks the table and the blocks it reads from,
+// failing with IOERR if they have gone bad; the pieces of logs written
+// before are summed whole, and read whole.
+//
+// with pack, each block of a put is packed with lz_pack on its own if
+// it shrinks enough, and a read unpacks only the blocks it reads from.  with a scrub rate, a
+// thread of low priority also reads the log through at that many bytes
+// a second, checking the records, so that bad bytes are found before
+// they are read.
+class extent_log_store : public extent_store {
+ private:
+  // bytes of an extent that are in a record in the log
+  struct piece {
+    unsigned int seg;        // 0 if none
+    unsigned int at;         // where they go in the extent
+    unsigned int len;        // how many are still in the extent
+    unsigned int rlen;       // of the data of the record
+    unsigned long long off;  // of the bytes in the segment
+    // bytes from off on that crc is of, or with blocked, bytes of the
+    // extent in the blocks behind the table at off that crc is of
+    unsigned int clen : 30;
+    unsigned int blocked : 1;
+    unsigned int packed : 1; // and they hold the len bytes packed
+    unsigned int crc;
+  };
+
+  // where the latest version of an extent is: the last put, and the
+  // writes since, oldest first.  a later piece wins where pieces
+  // overlap, and gaps read as zeros.
+  struct loc {
+    extent_protocol::attr attr;
+    piece base;
+    std::vector<piece> writes;
+  };
+
+  struct segment {
+    int fd;
+    unsigned long long size;
+    unsigned long long live; // bytes of records the index points to
+  };
+
+  std::string dir_;
+  std::unordered_map<extent_protocol::extentid_t, loc> index_;
+  std::map<unsigned int, segment> segs_;
+  unsigned int head_;             // the segment appended to
+  unsigned long long since_ckpt_; // bytes appended since the checkpoint
+  pthread_rwlock_t _m;            // index_ and segs_; appends write-lock
+  pthread_mutex_t ckpt_m_;        // one checkpoint at a time
+
+  fifo<int> clean_q_; // work for the cleaner: scan or stop
+  pthread_t cleaner_;
+
+  bool pack_;
+  // bytes of puts, those of them packed, and what they were packed into
+  unsigned long long put_bytes_, packed_bytes_, packed_into_;
+
+  size_t scrub_rate_; // bytes a second, or 0 for no scrubber
+  pthread_t scrubber_;
+  pthread_mutex_t scrub_m_;
+  pthread_cond_t scrub_c_;
+  bool stopping_;
+  // figures for stats, under scrub_m_
+  unsigned long long scrubbed_, scrub_passes_, bad_reads_, bad_records_;
+  // where the scrubber found bad records, so each is reported once
+  std::set<std::pair<unsigned int, unsigned long long> > bad_;
+
+  std::string seg_name(unsigned int seg);
+  bool open_seg(unsigned int seg, bool create);
+  void recover();
+  bool load_checkpoint(unsigned int *seg, unsigned long long *off);
+  void replay(unsigned int seg, unsigned long long off, bool last);
+  int append_wo(int type, extent_protocol::extentid_t id,
+                const extent_protocol::attr &a, unsigned long long at,
+                const std::string &table, const char *data,
+                unsigned int len, piece *p, bool *rolled);
+  void pack(const char *data, size_t n, std::string &table,
+            std::string &z);
+  int append_put_wo(extent_protocol::extentid_t id,
+                    const extent_protocol::attr &a, const char *data,
+                    size_t n, const std::string &table,
+                    const std::string &z, piece *p, bool *rolled);
+  void ref_wo(const piece &p);
+  void unref_wo(const piece &p);
+  void apply_put_wo(loc &l, const piece &p);
+  void apply_write_wo(loc &l, const piece &p);
+  int read_wo(const loc &l, size_t off, size_t len, std::string &buf);
+  bool read_piece_wo(const piece &p, size_t from, size_t to, char *dst);
+  bool read_blocks_wo(const piece &p, size_t from, size_t to, char *dst);
+  void bad_read(const piece &p, unsigned long long off, size_t n);
+  bool sum_piece_wo(piece &p);
+  int compact_wo(extent_protocol::extentid_t id, loc &l, bool *rolled);
+  static bool in_seg(const loc &l, unsigned int seg);
+  void checkpoint();
+  void after_append(bool rolled);
+
+  static void *cleaner_thread(void *);
+  void cleaner();
+  void clean(unsigned int seg);
+
+  static void *scrubber_thread(void *);
+  void scrubber();
+  bool scrub(unsigned int seg);
+  bool paid(size_t bytes);
+  bool pace(size_t bytes);
+
+ public:
+  extent_log_store(const std::string &dir, size_t scrub_rate = 0,
+                   bool pack = false);
+  ~extent_log_store();
+
+  // segments are closed once they reach this size
+  static const unsigned long long seg_max = 64 << 20;
+  // an extent is rewritten whole once it has this many writes on top
+  // of its last put
+  static const unsigned int max_writes = 1024;
+  // puts and writes are checked in blocks of this many bytes
+  static const unsigned int block_size = 32 << 10;
+
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int read(extent_protocol::extentid_t id, size_t off, size_t len,
+           rpc_slice &data);
+  int put(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+          const rpc_slice &data);
+  int write(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+            size_t off, const rpc_slice &data);
+  int touch(extent_protocol::extentid_t id, unsigned int t);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &v);
+  void puts(const std::vector<extent_protocol::extentid_t> &ids,
+            const std::vector<extent_protocol::attr> &as,
+            const std::vector<rpc_slice> &data, std::vector<int> &rets);
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            const extent_protocol::attr &a);
+  bool needs_sync() { return true; }
+  int sync();
+  void stats(std::string &s);
+};
+
+#endif
@@ -0,0 +1,274 @@
+// the LZ77 codec
+
+#include "extent_lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static const size_t min_match = 4;
+static const size_t max_offset = 65535;
+// the last bytes are always literals, so a match never reads past
+// the end
+static const size_t tail = 8;
+static const int hash_bits = 12;
+
+// an extent of more than four times the samples is judged by packing
+// sample_count samples of sample_size bytes spread over it; a smaller
+// one by packing it whole
+static const size_t sample_size = 1024;
+static const int sample_count = 4;
+
+static inline uint32_t
+read32(const unsigned char *p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint32_t
+hash4(uint32_t x)
+{
+  return (x * 2654435761u) >> (32 - hash_bits);
+}
+
+// appends a length of extra above what a nibble holds
+static inline bool
+put_len(unsigned char *&op, unsigned char *oend, size_t extra)
+{
+  while (extra >= 255) {
+    if (op == oend) {
+      return false;
+    }
+    *op++ = 255;
+    extra -= 255;
+  }
+  if (op == oend) {
+    return false;
+  }
+  *op++ = (unsigned char) extra;
+  return true;
+}
+
+// a run of literals, then a match of mlen bytes off back, or none if
+// mlen is 0
+static bool
+put_seq(unsigned char *&op, unsigned char *oend, const unsigned char *lit,
+        size_t nlit, size_t off, size_t mlen)
+{
+  if (op == oend) {
+    return false;
+  }
+  unsigned char *token = op++;
+  size_t ml = mlen ? mlen - min_match : 0;
+  *token = (unsigned char) (((nlit < 15 ? nlit : 15) << 4) |
+                            (ml < 15 ? ml : 15));
+  if (nlit >= 15 && !put_len(op, oend, nlit - 15)) {
+    return false;
+  }
+  if ((size_t) (oend - op) < nlit) {
+    return false;
+  }
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0) {
+    return true;
+  }
+  if (oend - op < 2) {
+    return false;
+  }
+  *op++ = (unsigned char) (off & 0xff);
+  *op++ = (unsigned char) (off >> 8);
+  return ml < 15 || put_len(op, oend, ml - 15);
+}
+
+// packs n bytes at src into at most cap bytes at dst; 0 if they
+// don't fit
+static size_t
+pack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+  unsigned char *op = dst, *oend = dst + cap;
+  size_t v = n;
+  do {
+    if (op == oend) {
+      return 0;
+    }
+    *op++ = (unsigned char) ((v & 0x7f) | (v > 0x7f ? 0x80 : 0));
+    v >>= 7;
+  } while (v > 0);
+
+  uint32_t table[1 << hash_bits];
+  memset(table, 0, sizeof(table));
+  size_t anchor = 0, i = 0;
+  while (n >= tail + min_match && i < n - tail - min_match) {
+    uint32_t x = read32(src + i);
+    uint32_t h = hash4(x);
+    size_t cand = table[h];
+    table[h] = i;
+    if (cand >= i || i - cand > max_offset || read32(src + cand) != x) {
+      // skips faster through bytes that don't match
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+    size_t len = min_match;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // eight bytes at a time; the lowest byte that differs ends it
+    while (i + len + 8 <= n - tail) {
+      uint64_t a, b;
+      memcpy(&a, src + cand + len, 8);
+      memcpy(&b, src + i + len, 8);
+      if (a != b) {
+        len += __builtin_ctzll(a ^ b) >> 3;
+        break;
+      }
+      len += 8;
+    }
+#endif
+    while (i + len < n - tail && src[cand + len] == src[i + len]) {
+      len++;
+    }
+    while (i > anchor && cand > 0 && src[i - 1] == src[cand - 1]) {
+      i--;
+      cand--;
+      len++;
+    }
+    if (!put_seq(op, oend, src + anchor, i - anchor, i - cand, len)) {
+      return 0;
+    }
+    i += len;
+    anchor = i;
+    if (i >= 2 && i < n - tail - min_match) {
+      table[hash4(read32(src + i - 2))] = i - 2;
+    }
+  }
+  if (!put_seq(op, oend, src + anchor, n - anchor, 0, 0)) {
+    return 0;
+  }
+  return op - dst;
+}
+
+bool
+lz_pack(const char *src, size_t n, std::string &out)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  if (n < 32) {
+    return false;
+  }
+  if (n > sample_size * sample_count * 4) {
+    unsigned char buf[sample_size];
+    size_t packed = 0;
+    for (int k = 0; k < sample_count; k++) {
+      size_t at = (n - sample_size) / (sample_count - 1) * k;
+      size_t m = pack(s + at, sample_size, buf, sizeof(buf));
+      packed += m ? m : sample_size;
+    }
+    if (packed > sample_size * sample_count / 8 * 7) {
+      return false;
+    }
+  }
+  std::string z(n - n / 8, '\0');
+  size_t m = pack(s, n, (unsigned char *) &z[0], z.size());
+  if (m == 0) {
+    return false;
+  }
+  // copied out, as z keeps the room it had, and the cache counts
+  // packed extents by their size
+  out.assign(z.data(), m);
+  return true;
+}
+
+static bool
+get_size(const unsigned char *&ip, const unsigned char *iend, size_t *len)
+{
+  size_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (ip == iend) {
+      return false;
+    }
+    unsigned char b = *ip++;
+    v |= (size_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *len = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool
+get_len(const unsigned char *&ip, const unsigned char *iend, size_t *len)
+{
+  unsigned char b;
+  do {
+    if (ip == iend) {
+      return false;
+    }
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+bool
+lz_size(const char *src, size_t n, size_t *len)
+{
+  const unsigned char *ip = (const unsigned char *) src;
+  return get_size(ip, ip + n, len);
+}
+
+bool
+lz_unpack(const char *src, size_t n, char *dst, size_t want)
+{
+  const unsigned char *ip = (const unsigned char *) src, *iend = ip + n;
+  size_t len;
+  if (!get_size(ip, iend, &len) || want > len) {
+    return false;
+  }
+  char *op = dst, *oend = dst + want;
+  while (op < oend) {
+    if (ip == iend) {
+      return false;
+    }
+    unsigned char token = *ip++;
+    size_t nlit = token >> 4;
+    if (nlit == 15 && !get_len(ip, iend, &nlit)) {
+      return false;
+    }
+    if ((size_t) (iend - ip) < nlit) {
+      return false;
+    }
+    size_t c = nlit < (size_t) (oend - op) ? nlit : oend - op;
+    memcpy(op, ip, c);
+    op += c;
+    ip += nlit;
+    if (op == oend) {
+      break;
+    }
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t mlen = token & 15;
+    if (mlen == 15 && !get_len(ip, iend, &mlen)) {
+      return false;
+    }
+    mlen += min_match;
+    if (off == 0 || off > (size_t) (op - dst)) {
+      return false;
+    }
+    if (mlen > (size_t) (oend - op)) {
+      mlen = oend - op;
+    }
+    // a match closer than its length repeats its first off bytes, so
+    // it is copied in pieces that double as the copy goes on
+    const char *from = op - off;
+    while (mlen > 0) {
+      size_t c = mlen < (size_t) (op - from) ? mlen : op - from;
+      memcpy(op, from, c);
+      op += c;
+      mlen -= c;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,25 @@
+// a fast LZ77 codec for extents at rest
+
+#ifndef extent_lz_h
+#define extent_lz_h
+
+#include <stddef.h>
+#include <string>
+
+// packed bytes are the length of the bytes they unpack to, as a
+// varint, then runs of literal bytes each followed by a match of at
+// least four bytes up to 64K back, as in LZ4.  packing is greedy over
+// a small hash table of the last place each four bytes were seen, so
+// it runs at hundreds of megabytes a second, and unpacking at more.
+
+// packs the n bytes at src into out if that saves at least an eighth
+// of them.  a sample of a big extent is packed first, and the rest
+// only if the sample shrinks that much.
+bool lz_pack(const char *src, size_t n, std::string &out);
+// the length of the bytes the n packed bytes at src unpack to
+bool lz_size(const char *src, size_t n, size_t *len);
+// unpacks the first want bytes of what the n packed bytes at src hold
+// into dst.  false if they are corrupt, or hold fewer than want.
+bool lz_unpack(const char *src, size_t n, char *dst, size_t want);
+
+#endif
@@ -9,19 +9,54 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  // MOVED: the ring puts the extent on another server; the caller
+  // reads the ring again and goes there
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, MOVED };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    put_stream,   // streaming put/get, for extents bigger than a PDU
+    get_stream,
+    read,         // a byte range of an extent
+    write,
+    truncate,
+    list_stream,  // the ids of the extents a server has
+    have,         // which of some chunk hashes a server has
+    put_chunks,   // a put that leaves out the chunks the server has
+    multi_get,    // many extents in one call
+    multi_getattr,
+    multi_put,
+    multi_remove,
+    clone,        // copies an extent on the servers, sharing its bytes
+    append,       // bytes at the end of an extent
+    get_if_changed, // an extent, unless the caller has its version
+    ring_get,     // the ring a server has
+    ring_set,     // gives a server a new ring
+    move_out,     // has a server hand an extent over to its new server
+    move_in,      // an extent handed over
+    features      // what a server can do, as feature_ bits
   };
+  // the server deduplicates chunks, so have and put_chunks save bytes
+  static const int feature_dedup = 1;
 
   struct attr {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    // changes with every update of the extent, and is never the same
+    // for two contents of it, even across restarts of the server
+    unsigned long long version;
+  };
+
+  // an extent in a batch call
+  struct batch_ent {
+    extentid_t id;
+    status ret;
+    attr a;
+    std::string data;
   };
 };
 
@@ -32,6 +67,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -42,6 +78,27 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::batch_ent &e)
+{
+  u >> e.id;
+  u >> e.ret;
+  u >> e.a;
+  u >> e.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::batch_ent &e)
+{
+  m << e.id;
+  m << e.ret;
+  m << e.a;
+  m << e.data;
   return m;
 }
 
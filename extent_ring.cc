@@ -0,0 +1,91 @@
+// the consistent hash ring
+
+#include "extent_ring.h"
+#include "utils/utils.h"
+
+// the 64-bit finalizer of MurmurHash3; spreads sequential ids and
+// similar server names evenly around the ring
+static unsigned int
+ring_hash(unsigned long long x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (unsigned int) x;
+}
+
+static unsigned int
+ring_hash(const std::string &s)
+{
+  unsigned long long h = 14695981039346656037ULL; // FNV-1a
+  for (size_t i = 0; i < s.size(); i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  return ring_hash(h);
+}
+
+extent_ring::extent_ring(unsigned int epoch, const std::string &servers)
+  : epoch_(epoch)
+{
+  std::vector<std::string> v;
+  split(servers, v, ',');
+  for (size_t i = 0; i < v.size(); i++) {
+    if (v[i].empty()) {
+      continue;
+    }
+    int s = servers_.size();
+    servers_.push_back(v[i]);
+    for (int k = 0; k < vnodes; k++) {
+      points_[ring_hash(v[i] + "#" + std::to_string(k))] = s;
+    }
+  }
+}
+
+std::string
+extent_ring::str() const
+{
+  return join(servers_, ',');
+}
+
+int
+extent_ring::find(const std::string &name) const
+{
+  for (size_t i = 0; i < servers_.size(); i++) {
+    if (servers_[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int
+extent_ring::owner(extent_protocol::extentid_t id) const
+{
+  auto it = points_.lower_bound(ring_hash(id));
+  if (it == points_.end()) {
+    it = points_.begin();
+  }
+  return it->second;
+}
+
+marshall &
+operator<<(marshall &m, const extent_ring &r)
+{
+  m << r.epoch();
+  m << r.str();
+  return m;
+}
+
+unmarshall &
+operator>>(unmarshall &u, extent_ring &r)
+{
+  unsigned int epoch;
+  std::string servers;
+  u >> epoch;
+  u >> servers;
+  r = extent_ring(epoch, servers);
+  return u;
+}
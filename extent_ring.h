@@ -0,0 +1,44 @@
+// the consistent hash ring that places extents on extent servers,
+// shared by extent_client and extent_server
+
+#ifndef extent_ring_h
+#define extent_ring_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include "extent_protocol.h"
+
+// every server has vnodes points on the ring, and an extent lives on
+// the server of the first point at or after its hash.  the servers keep
+// the ring, and each change of its servers has the next epoch; epoch 0
+// is the list every client was started with, which the servers don't
+// know and don't enforce.
+class extent_ring {
+ private:
+  static const int vnodes = 100;
+
+  unsigned int epoch_;
+  std::vector<std::string> servers_;
+  std::map<unsigned int, int> points_; // point -> index in servers_
+
+ public:
+  extent_ring() : epoch_(0) {}
+  // servers is a comma separated list
+  extent_ring(unsigned int epoch, const std::string &servers);
+
+  unsigned int epoch() const { return epoch_; }
+  bool empty() const { return servers_.empty(); }
+  const std::vector<std::string> &servers() const { return servers_; }
+  // the servers, comma separated
+  std::string str() const;
+  // the index of name in servers(), or -1
+  int find(const std::string &name) const;
+  // the index in servers() of the server of id
+  int owner(extent_protocol::extentid_t id) const;
+};
+
+marshall &operator<<(marshall &m, const extent_ring &r);
+unmarshall &operator>>(unmarshall &u, extent_ring &r);
+
+#endif
@@ -2,86 +2,1235 @@
 
 #include "extent_server.h"
 #include <sstream>
+#include <utility>
+#include <algorithm>
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
 
+#include "handle.h"
 #include "rpc/slock.h"
 #include "lang/verify.h"
 
-extent_server::extent_server() : ext_map_(), nacquire(0)
+extent_server::extent_server(extent_store *store)
+  : store_(store ? store : new extent_mem_store()), nacquire(0),
+    base_version_(0), last_version_(0), rebalancing_(false), commit_us_(0),
+    commit_batch_(1024), stopping_(false), syncs_(0), synced_(0),
+    max_batch_(0), stats_secs_(0)
 {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  base_version_ = (tv.tv_sec * 1000000ULL + tv.tv_usec) << 12;
+  last_version_ = base_version_;
+  for (int i = 0; i < nstripes; i++) {
+    VERIFY(pthread_mutex_init(&stripes_[i], 0) == 0);
+  }
+  extent_protocol::attr a;
+  if (store_->getattr(1, a) == extent_protocol::NOENT) {
+    unsigned int now = time(NULL);
+    a = {now, now, now, 0};
+    store_->put(1, a, rpc_slice());
+  }
+  VERIFY(pthread_mutex_init(&ring_m_, 0) == 0);
+  rpc_slice rs;
+  if (store_->read(ring_id, 0, (size_t) -1, rs) == extent_protocol::OK) {
+    unmarshall u(std::string(rs.data(), rs.size()));
+    u >> ring_;
+    u >> old_ring_;
+    u >> self_;
+    VERIFY(u.okdone());
+    printf("[EXT SERVER] ring %u: %s\n", ring_.epoch(), ring_.str().c_str());
+  }
+  VERIFY(pthread_mutex_init(&commit_m_, 0) == 0);
+  VERIFY(pthread_cond_init(&commit_c_, 0) == 0);
+  VERIFY(pthread_cond_init(&waiters_c_, 0) == 0);
+  VERIFY(pthread_cond_init(&stats_c_, 0) == 0);
+  if (store_->needs_sync()) {
+    VERIFY(pthread_create(&committer_, NULL, &committer_thread, this) == 0);
+  }
+  if (!old_ring_.empty()) {
+    // a join cut short by a restart
+    rebalancing_ = true;
+    VERIFY(pthread_create(&rebalancer_, NULL, &rebalance_thread, this) == 0);
+  }
+}
+
+extent_server::~extent_server()
+{
+  {
+    ScopedLock l(&commit_m_);
+    stopping_ = true;
+    VERIFY(pthread_cond_broadcast(&commit_c_) == 0);
+    VERIFY(pthread_cond_broadcast(&stats_c_) == 0);
+  }
+  if (store_->needs_sync()) {
+    VERIFY(pthread_join(committer_, NULL) == 0);
+  }
+  if (stats_secs_ > 0) {
+    VERIFY(pthread_join(stats_thread_, NULL) == 0);
+  }
+  bool join;
+  {
+    ScopedLock rl(&ring_m_);
+    join = rebalancing_;
+  }
+  if (join) {
+    VERIFY(pthread_join(rebalancer_, NULL) == 0);
+  }
+  VERIFY(pthread_mutex_destroy(&ring_m_) == 0);
+  VERIFY(pthread_cond_destroy(&commit_c_) == 0);
+  VERIFY(pthread_cond_destroy(&waiters_c_) == 0);
+  VERIFY(pthread_cond_destroy(&stats_c_) == 0);
+  VERIFY(pthread_mutex_destroy(&commit_m_) == 0);
+  delete store_;
+  for (int i = 0; i < nstripes; i++) {
+    VERIFY(pthread_mutex_destroy(&stripes_[i]) == 0);
+  }
+}
+
+
+void extent_server::set_commit(unsigned int interval_us, size_t batch)
+{
+  ScopedLock l(&commit_m_);
+  commit_us_ = interval_us;
+  commit_batch_ = std::max(batch, (size_t) 1);
+}
+
+void extent_server::print_stats_every(int secs)
+{
+  VERIFY(stats_secs_ == 0 && secs > 0);
+  stats_secs_ = secs;
+  VERIFY(pthread_create(&stats_thread_, NULL, &stats_thread, this) == 0);
+}
+
+int extent_server::sync()
+{
+  if (!store_->needs_sync()) {
+    return extent_protocol::OK;
+  }
+  commit_waiter w = { false, extent_protocol::OK };
+  commit_ent e = { NULL, extent_protocol::OK, "", &w };
+  ScopedLock l(&commit_m_);
+  queue_wo(e);
+  while (!w.done) {
+    VERIFY(pthread_cond_wait(&waiters_c_, &commit_m_) == 0);
+  }
+  return w.ret;
+}
+
+// a reply value marshalled already, sent as it is
+struct marshalled {
+  const std::string &s;
+};
+
+static marshall &
+operator<<(marshall &m, const marshalled &x)
+{
+  m.rawbytes(x.s.data(), x.s.size());
+  return m;
+}
+
+// queues the reply to an update for the next sync, or sends it now if
+// the store has nothing to sync
+void extent_server::commit_raw(reply_token *t, int ret, const std::string &rep)
+{
+  if (!store_->needs_sync()) {
+    t->reply(ret, marshalled{rep});
+    return;
+  }
+  commit_ent e = { t, ret, rep, NULL };
+  ScopedLock l(&commit_m_);
+  queue_wo(e);
+}
+
+// assumes commit_m_
+void extent_server::queue_wo(const commit_ent &e)
+{
+  if (pending_.empty()) {
+    clock_gettime(CLOCK_REALTIME, &pending_since_);
+  }
+  pending_.push_back(e);
+  if (pending_.size() == 1 || pending_.size() == commit_batch_) {
+    VERIFY(pthread_cond_signal(&commit_c_) == 0);
+  }
+}
+
+void *extent_server::committer_thread(void *x)
+{
+  ((extent_server *) x)->committer();
+  return 0;
+}
+
+// the updates queued while a sync runs wait for the next one, so the
+// batches grow with the load even without an interval
+void extent_server::committer()
+{
+  VERIFY(pthread_mutex_lock(&commit_m_) == 0);
+  while (1) {
+    while (pending_.empty() && !stopping_) {
+      VERIFY(pthread_cond_wait(&commit_c_, &commit_m_) == 0);
+    }
+    if (pending_.empty()) {
+      break;
+    }
+    struct timespec due = pending_since_;
+    due.tv_nsec += (long) (commit_us_ % 1000000) * 1000;
+    due.tv_sec += commit_us_ / 1000000 + due.tv_nsec / 1000000000;
+    due.tv_nsec %= 1000000000;
+    while (!stopping_ && pending_.size() < commit_batch_ &&
+           pthread_cond_timedwait(&commit_c_, &commit_m_, &due) !=
+           ETIMEDOUT) {
+    }
+    std::vector<commit_ent> batch;
+    batch.swap(pending_);
+    VERIFY(pthread_mutex_unlock(&commit_m_) == 0);
+
+    int ret = store_->sync();
+    bool waiters = false;
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (batch[i].t != NULL) {
+        batch[i].t->reply(ret == extent_protocol::OK ? batch[i].ret : ret,
+                          marshalled{batch[i].rep});
+      } else {
+        waiters = true;
+      }
+    }
+
+    VERIFY(pthread_mutex_lock(&commit_m_) == 0);
+    for (size_t i = 0; waiters && i < batch.size(); i++) {
+      if (batch[i].w != NULL) {
+        batch[i].w->ret = ret;
+        batch[i].w->done = true;
+      }
+    }
+    if (waiters) {
+      VERIFY(pthread_cond_broadcast(&waiters_c_) == 0);
+    }
+    syncs_++;
+    synced_ += batch.size();
+    max_batch_ = std::max(max_batch_, batch.size());
+  }
+  VERIFY(pthread_mutex_unlock(&commit_m_) == 0);
+}
+
+void *extent_server::stats_thread(void *x)
+{
+  ((extent_server *) x)->print_stats();
+  return 0;
+}
+
+void extent_server::print_stats()
+{
+  unsigned long long syncs = 0, synced = 0;
+  VERIFY(pthread_mutex_lock(&commit_m_) == 0);
+  while (!stopping_) {
+    struct timespec due;
+    clock_gettime(CLOCK_REALTIME, &due);
+    due.tv_sec += stats_secs_;
+    while (!stopping_ &&
+           pthread_cond_timedwait(&stats_c_, &commit_m_, &due) !=
+           ETIMEDOUT) {
+    }
+    unsigned long long n = syncs_ - syncs, m = synced_ - synced;
+    size_t most = max_batch_;
+    syncs = syncs_;
+    synced = synced_;
+    max_batch_ = 0;
+    VERIFY(pthread_mutex_unlock(&commit_m_) == 0);
+    printf("[EXT SERVER] %.1f fsyncs/s, %.1f updates per fsync, "
+           "at most %lu\n", (double) n / stats_secs_,
+           n ? (double) m / n : 0.0, (unsigned long) most);
+    std::string ss;
+    store_->stats(ss);
+    if (!ss.empty()) {
+      printf("[EXT SERVER] %s\n", ss.c_str());
+    }
+    VERIFY(pthread_mutex_lock(&commit_m_) == 0);
+  }
+  VERIFY(pthread_mutex_unlock(&commit_m_) == 0);
+}
+
+// updates of one extent read its attributes first, so they are
+// serialized by a lock picked by the extent's id.  reads go straight to
+// the store.
+pthread_mutex_t *extent_server::stripe(extent_protocol::extentid_t id)
+{
+  return &stripes_[id % nstripes];
+}
+
+unsigned long long extent_server::next_version()
+{
+  return __atomic_add_fetch(&last_version_, 1, __ATOMIC_RELAXED);
+}
+
+// the version a client is given
+void extent_server::show_version(extent_protocol::attr &a)
+{
+  if (a.version == 0) {
+    a.version = base_version_;
+  }
+}
+
+// a batch takes its stripes once each, in order, so that batches
+// can't deadlock
+void extent_server::lock_stripes(
+  const std::vector<extent_protocol::extentid_t> &ids, std::vector<int> &held)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    held.push_back(ids[i] % nstripes);
+  }
+  std::sort(held.begin(), held.end());
+  held.erase(std::unique(held.begin(), held.end()), held.end());
+  for (size_t i = 0; i < held.size(); i++) {
+    VERIFY(pthread_mutex_lock(&stripes_[held[i]]) == 0);
+  }
+}
+
+void extent_server::unlock_stripes(const std::vector<int> &held)
+{
+  for (size_t i = 0; i < held.size(); i++) {
+    VERIFY(pthread_mutex_unlock(&stripes_[held[i]]) == 0);
+  }
+}
+
+// collects the ids a server lists
+class id_sink : public rpc_sink {
+ public:
+  id_sink(std::vector<extent_protocol::extentid_t> &v) : v_(v) {}
+  int write(const std::string &chunk) {
+    size_t n = chunk.size() / sizeof(v_[0]);
+    size_t at = v_.size();
+    v_.resize(at + n);
+    memcpy(&v_[at], chunk.data(), n * sizeof(v_[0]));
+    return 0;
+  }
+ private:
+  std::vector<extent_protocol::extentid_t> &v_;
+};
+
+// whether the ring puts id on this server.  a server without a ring
+// has every extent it is asked for.
+bool extent_server::owns(extent_protocol::extentid_t id)
+{
+  ScopedLock rl(&ring_m_);
+  return ring_.empty() || ring_.servers()[ring_.owner(id)] == self_;
+}
+
+// OK if this server has id, and first pulls it from its old server
+// if it joined the ring and still rebalances.  an update checks owns()
+// again once it holds the stripe, in case the ring moved it meanwhile.
+int extent_server::admit(extent_protocol::extentid_t id)
+{
+  extent_ring ring;
+  std::string from;
+  {
+    ScopedLock rl(&ring_m_);
+    if (ring_.empty()) {
+      return extent_protocol::OK;
+    }
+    if (ring_.servers()[ring_.owner(id)] != self_) {
+      return extent_protocol::MOVED;
+    }
+    if (old_ring_.empty() || settled_.count(id)) {
+      return extent_protocol::OK;
+    }
+    from = old_ring_.servers()[old_ring_.owner(id)];
+    ring = ring_;
+  }
+  if (from != self_) {
+    // the old server hands id over under its stripe lock and then
+    // answers MOVED for it, so a second pull finds nothing to move
+    handle h(from);
+    rpcc *cl = h.safebind();
+    int r;
+    if (cl == NULL ||
+        cl->call(extent_protocol::move_out, id, ring, from, r) !=
+        extent_protocol::OK) {
+      printf("[EXT SERVER] pulling %016llx from %s failed\n", id,
+             from.c_str());
+      return extent_protocol::RPCERR;
+    }
+  }
+  ScopedLock rl(&ring_m_);
+  if (!old_ring_.empty()) {
+    settled_.insert(id);
+  }
+  return extent_protocol::OK;
+}
+
+bool extent_server::owns(const std::vector<extent_protocol::extentid_t> &ids)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (!owns(ids[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int extent_server::admit(const std::vector<extent_protocol::extentid_t> &ids)
+{
+  for (size_t i = 0; i < ids.size(); i++) {
+    int ret = admit(ids[i]);
+    if (ret != extent_protocol::OK) {
+      return ret;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+// assumes ring_m_.  the store is synced after, so that a ring this
+// server acted on is never lost
+void extent_server::save_ring_wo()
+{
+  marshall m;
+  m << ring_;
+  m << old_ring_;
+  m << self_;
+  std::string buf = m.str();
   unsigned int now = time(NULL);
-  ext_map_[1] = {
-    {0, now, now, now},
-    ""
-  };
-  VERIFY(pthread_mutex_init(&_m, 0) == 0);
+  extent_protocol::attr a = {now, now, now, (unsigned int) buf.size()};
+  a.version = next_version();
+  VERIFY(store_->put(ring_id, a, rpc_slice(std::move(buf))) ==
+         extent_protocol::OK);
+}
+
+// takes ring, on which this server is self, if it is newer than the
+// one it has; true if it is this server's ring then
+bool extent_server::install_ring(const extent_ring &ring,
+                                 const std::string &self)
+{
+  {
+    ScopedLock rl(&ring_m_);
+    if (ring.epoch() < ring_.epoch() || ring.find(self) < 0) {
+      return false;
+    }
+    if (ring.epoch() == ring_.epoch()) {
+      return true;
+    }
+    printf("[EXT SERVER] ring %u as %s: %s\n", ring.epoch(), self.c_str(),
+           ring.str().c_str());
+    ring_ = ring;
+    self_ = self;
+    save_ring_wo();
+  }
+  VERIFY(store_->sync() == extent_protocol::OK);
+  return true;
+}
+
+int extent_server::ring_get(int, extent_ring &ring)
+{
+  ScopedLock rl(&ring_m_);
+  ring = ring_;
+  return extent_protocol::OK;
+}
+
+int extent_server::ring_set(extent_ring ring, std::string self, int &r)
+{
+  r = 0;
+  return install_ring(ring, self) ? extent_protocol::OK :
+    extent_protocol::IOERR;
+}
+
+int extent_server::move_out(extent_protocol::extentid_t id, extent_ring ring,
+                            std::string self, int &r)
+{
+  r = 0;
+  if (!install_ring(ring, self)) {
+    return extent_protocol::IOERR;
+  }
+  std::string to = ring.servers()[ring.owner(id)];
+  if (to == self) {
+    return extent_protocol::OK;
+  }
+  ScopedLock m(stripe(id));
+  extent_protocol::attr a;
+  rpc_slice buf;
+  if (store_->getattr(id, a) != extent_protocol::OK ||
+      store_->read(id, 0, (size_t) -1, buf) != extent_protocol::OK) {
+    return extent_protocol::OK;
+  }
+  show_version(a);
+  a.size = buf.size();
+  handle h(to);
+  rpcc *cl = h.safebind();
+  if (cl == NULL) {
+    return extent_protocol::RPCERR;
+  }
+  size_t off = 0;
+  do {
+    int mr;
+    rpc_slice piece = buf.sub(off, batch_max);
+    if (cl->call(extent_protocol::move_in, id, (unsigned int) off, a, piece,
+                 mr) != extent_protocol::OK) {
+      return extent_protocol::RPCERR;
+    }
+    off += piece.size();
+  } while (off < buf.size());
+  printf("[EXT SERVER] moved %016llx to %s\n", id, to.c_str());
+  r = 1;
+  return store_->remove(id);
 }
 
+// the old server holds id's stripe until the last piece is durable
+// here, so nothing else of id reaches this server in between
+int extent_server::move_in(extent_protocol::extentid_t id, unsigned int off,
+                           extent_protocol::attr a, rpc_slice data, int &r)
+{
+  r = 0;
+  std::string all;
+  {
+    ScopedLock rl(&ring_m_);
+    std::string &got = arriving_[id];
+    if (off != got.size()) {
+      arriving_.erase(id);
+      return extent_protocol::IOERR;
+    }
+    got.append(data.data(), data.size());
+    if (got.size() < a.size) {
+      return extent_protocol::OK;
+    }
+    all.swap(got);
+    arriving_.erase(id);
+  }
+  ScopedLock m(stripe(id));
+  return store_->put(id, a, rpc_slice(std::move(all)));
+}
+
+void extent_server::join(const std::string &servers, const std::string &self)
+{
+  extent_ring old(0, servers);
+  if (old.empty()) {
+    return;
+  }
+  {
+    ScopedLock rl(&ring_m_);
+    if (ring_.find(self) >= 0) {
+      return; // joined already
+    }
+  }
+  // the servers' ring, if they have one, is the one the clients use
+  handle h(old.servers()[0]);
+  rpcc *cl = h.safebind();
+  extent_ring cur;
+  if (cl == NULL ||
+      cl->call(extent_protocol::ring_get, 0, cur) != extent_protocol::OK) {
+    printf("[EXT SERVER] can't get the ring of %s\n",
+           old.servers()[0].c_str());
+    return;
+  }
+  if (!cur.empty()) {
+    old = cur;
+  }
+  VERIFY(old.find(self) < 0);
+  ScopedLock rl(&ring_m_);
+  old_ring_ = old;
+  ring_ = extent_ring(old.epoch() + 1, old.str() + "," + self);
+  self_ = self;
+  save_ring_wo();
+  VERIFY(store_->sync() == extent_protocol::OK);
+  printf("[EXT SERVER] joining as %s: ring %u: %s\n", self.c_str(),
+         ring_.epoch(), ring_.str().c_str());
+  rebalancing_ = true;
+  VERIFY(pthread_create(&rebalancer_, NULL, &rebalance_thread, this) == 0);
+}
+
+void *extent_server::rebalance_thread(void *x)
+{
+  ((extent_server *) x)->rebalance();
+  return 0;
+}
+
+// gives the old servers the new ring, so that they stop taking the
+// extents that are now here, then pulls those that are still there
+void extent_server::rebalance()
+{
+  extent_ring ring, old;
+  std::string self;
+  {
+    ScopedLock rl(&ring_m_);
+    ring = ring_;
+    old = old_ring_;
+    self = self_;
+  }
+  for (size_t s = 0; s < old.servers().size(); s++) {
+    while (1) {
+      {
+        ScopedLock l(&commit_m_);
+        if (stopping_) {
+          return;
+        }
+      }
+      handle h(old.servers()[s]);
+      rpcc *cl = h.safebind();
+      int r;
+      if (cl != NULL &&
+          cl->call(extent_protocol::ring_set, ring, old.servers()[s], r) ==
+          extent_protocol::OK) {
+        break;
+      }
+      printf("[EXT SERVER] giving %s the ring failed, will retry\n",
+             old.servers()[s].c_str());
+      sleep(1);
+    }
+  }
+
+  // until every old server listed its extents and each of those here
+  // now was pulled
+  size_t moved = 0;
+  bool done = false;
+  while (!done) {
+    {
+      ScopedLock l(&commit_m_);
+      if (stopping_) {
+        return;
+      }
+    }
+    done = true;
+    for (size_t s = 0; s < old.servers().size(); s++) {
+      handle h(old.servers()[s]);
+      rpcc *cl = h.safebind();
+      std::vector<extent_protocol::extentid_t> ids;
+      id_sink dst(ids);
+      if (cl == NULL ||
+          cl->call_download(extent_protocol::list_stream,
+                            (extent_protocol::extentid_t) 0, &dst) !=
+          extent_protocol::OK) {
+        printf("[EXT SERVER] listing %s failed, will retry\n",
+               old.servers()[s].c_str());
+        done = false;
+        continue;
+      }
+      for (size_t i = 0; i < ids.size(); i++) {
+        if ((size_t) old.owner(ids[i]) != s ||
+            ring.servers()[ring.owner(ids[i])] != self) {
+          continue;
+        }
+        if (admit(ids[i]) == extent_protocol::OK) {
+          moved++;
+        } else {
+          done = false;
+        }
+      }
+    }
+    if (!done) {
+      sleep(1);
+    }
+  }
+
+  {
+    ScopedLock rl(&ring_m_);
+    old_ring_ = extent_ring();
+    settled_.clear();
+    save_ring_wo();
+  }
+  VERIFY(store_->sync() == extent_protocol::OK);
+  printf("[EXT SERVER] rebalanced %lu extents onto %s\n",
+         (unsigned long) moved, self.c_str());
+}
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int & r)
+int extent_server::put(extent_protocol::extentid_t id, rpc_slice buf,
+                       unsigned long long &version)
 {
-  ScopedLock m(&_m);
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock m(stripe(id));
+  if (!owns(id)) {
+    return extent_protocol::MOVED;
+  }
   unsigned int now = time(NULL);
-  auto it = ext_map_.find(id);
-  r = nacquire;
-  printf("[EXT SERVER] put id %016llx\n", id);
+  extent_protocol::attr a;
   // If there is no such node
-  if (it == ext_map_.end()) {
-    node & n = ext_map_[id];
-    n.attr = {now, now, now, static_cast<unsigned int>(buf.size())};
-    n.buf = buf;
-    return extent_protocol::OK;
+  if (store_->getattr(id, a) != extent_protocol::OK) {
+    a = {now, now, now, static_cast<unsigned int>(buf.size())};
+    version = a.version = next_version();
+    return store_->put(id, a, buf);
   }
 
   // if this node exist
-  printf("[EXT SERVER] replace: %s\n", buf.c_str());
-  node & n = (*it).second;
-  n.attr.ctime = now;
-  n.attr.mtime = now;
-  n.buf = buf;
-  n.attr.size = static_cast<unsigned int>(buf.size());
-  return extent_protocol::OK;
+  a.ctime = now;
+  a.mtime = now;
+  a.size = static_cast<unsigned int>(buf.size());
+  version = a.version = next_version();
+  return store_->put(id, a, buf);
 }
 
-int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
+int extent_server::get(extent_protocol::extentid_t id, rpc_slice &buf)
 {
-  ScopedLock m(&_m);
-  auto it = ext_map_.find(id);
-  printf("[EXT SERVER] get id %016llx\n", id);
-  node & n = (*it).second;
-  n.attr.atime = time(NULL);
-  buf = n.buf;
-  printf("[EXT SERVER] contains: %s\n", buf.c_str());
+  int ret = admit(id);
+  if (ret == extent_protocol::OK) {
+    ret = store_->read(id, 0, (size_t) -1, buf);
+  }
+  if (ret != extent_protocol::OK) {
+    return ret == extent_protocol::NOENT && !owns(id) ?
+      extent_protocol::MOVED : ret;
+  }
+  store_->touch(id, time(NULL));
   return extent_protocol::OK;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  // You replace this with a real implementation. We send a phony response
-  // for now because it's difficult to get FUSE to do anything (including
-  // unmount) if getattr fails.
-
-  ScopedLock m(&_m);
-  auto it = ext_map_.find(id);
+  int ret = admit(id);
+  if (ret == extent_protocol::OK) {
+    ret = store_->getattr(id, a);
+  }
+  if (ret == extent_protocol::NOENT && !owns(id)) {
+    return extent_protocol::MOVED;
+  }
+  show_version(a);
+  return ret;
+}
 
-  a = it->second.attr;
-  return extent_protocol::OK;
+// the attributes are read before the bytes, so that an update in
+// between makes the version older than the bytes, never newer
+int extent_server::get_if_changed(extent_protocol::extentid_t id,
+                                  unsigned long long version,
+                                  extent_protocol::batch_ent &e)
+{
+  e.id = id;
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  e.ret = store_->getattr(id, e.a);
+  if (e.ret != extent_protocol::OK) {
+    return e.ret == extent_protocol::NOENT && !owns(id) ?
+      extent_protocol::MOVED : e.ret;
+  }
+  show_version(e.a);
+  if (e.a.version == version) {
+    return extent_protocol::OK;
+  }
+  if (e.a.size > batch_max) {
+    e.ret = extent_protocol::RPCERR;
+    return extent_protocol::OK;
+  }
+  rpc_slice s;
+  e.ret = store_->read(id, 0, (size_t) -1, s);
+  e.data.assign(s.data(), s.size());
+  e.a.size = s.size();
+  store_->touch(id, time(NULL));
+  return e.ret;
 }
 
 int extent_server::remove(extent_protocol::extentid_t id, int & r)
 {
-  ScopedLock m(&_m);
-  auto it = ext_map_.find(id);
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock m(stripe(id));
+  if (!owns(id)) {
+    return extent_protocol::MOVED;
+  }
   r = nacquire;
-  if (it == ext_map_.end()) {
+  if (store_->remove(id) == extent_protocol::NOENT) {
     r = extent_protocol::NOENT;
   }
-  ext_map_.erase(it);
   return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off,
+                        unsigned int len, rpc_slice &buf)
+{
+  int ret = admit(id);
+  if (ret == extent_protocol::OK) {
+    ret = store_->read(id, off, len, buf);
+  }
+  if (ret != extent_protocol::OK) {
+    return ret == extent_protocol::NOENT && !owns(id) ?
+      extent_protocol::MOVED : ret;
+  }
+  store_->touch(id, time(NULL));
+  return extent_protocol::OK;
+}
+
+// writes past the end pad the extent with zeros, and a write to a
+// missing extent creates it
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off,
+                         rpc_slice buf, int &r)
+{
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock m(stripe(id));
+  if (!owns(id)) {
+    return extent_protocol::MOVED;
+  }
+  unsigned int now = time(NULL);
+  extent_protocol::attr a;
+  if (store_->getattr(id, a) != extent_protocol::OK) {
+    a = {now, now, now, 0};
+  }
+  a.mtime = now;
+  a.ctime = now;
+  a.size = std::max(a.size, off + static_cast<unsigned int>(buf.size()));
+  a.version = next_version();
+  r = a.size;
+  return store_->write(id, a, off, buf);
+}
+
+// a write at the end, so the client need not know where that is
+int extent_server::append(extent_protocol::extentid_t id, rpc_slice buf,
+                          int &r)
+{
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock m(stripe(id));
+  if (!owns(id)) {
+    return extent_protocol::MOVED;
+  }
+  unsigned int now = time(NULL);
+  extent_protocol::attr a;
+  if (store_->getattr(id, a) != extent_protocol::OK) {
+    a = {now, now, now, 0};
+  }
+  unsigned int off = a.size;
+  a.mtime = now;
+  a.ctime = now;
+  a.size = off + static_cast<unsigned int>(buf.size());
+  a.version = next_version();
+  r = a.size;
+  return store_->write(id, a, off, buf);
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned int size,
+                            int &r)
+{
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  ScopedLock m(stripe(id));
+  if (!owns(id)) {
+    return extent_protocol::MOVED;
+  }
+  extent_protocol::attr a;
+  if (store_->getattr(id, a) != extent_protocol::OK) {
+    return extent_protocol::NOENT;
+  }
+  unsigned int now = time(NULL);
+  a.mtime = now;
+  a.ctime = now;
+  a.size = size;
+  a.version = next_version();
+  r = a.size;
+  return store_->write(id, a, size, rpc_slice());
+}
+
+int extent_server::multi_get(std::vector<extent_protocol::extentid_t> ids,
+                             std::vector<extent_protocol::batch_ent> &ents)
+{
+  int ret = admit(ids);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  std::vector<extent_protocol::attr> as;
+  std::vector<int> rets;
+  store_->getattrs(ids, as, rets);
+  ents.resize(ids.size());
+  size_t total = 0;
+  unsigned int now = time(NULL);
+  for (size_t i = 0; i < ids.size(); i++) {
+    ents[i].id = ids[i];
+    ents[i].ret = rets[i];
+    ents[i].a = as[i];
+    if (rets[i] != extent_protocol::OK) {
+      continue;
+    }
+    show_version(ents[i].a);
+    if (total + as[i].size > batch_max) {
+      ents[i].ret = extent_protocol::RPCERR;
+      continue;
+    }
+    rpc_slice s;
+    ents[i].ret = store_->read(ids[i], 0, (size_t) -1, s);
+    ents[i].data.assign(s.data(), s.size());
+    ents[i].a.size = s.size();
+    total += s.size();
+    store_->touch(ids[i], now);
+  }
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (ents[i].ret == extent_protocol::NOENT && !owns(ids[i])) {
+      return extent_protocol::MOVED;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+int extent_server::multi_getattr(std::vector<extent_protocol::extentid_t> ids,
+                                 std::vector<extent_protocol::batch_ent> &ents)
+{
+  int ret = admit(ids);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  std::vector<extent_protocol::attr> as;
+  std::vector<int> rets;
+  store_->getattrs(ids, as, rets);
+  ents.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    ents[i].id = ids[i];
+    ents[i].ret = rets[i];
+    ents[i].a = as[i];
+    show_version(ents[i].a);
+    if (rets[i] == extent_protocol::NOENT && !owns(ids[i])) {
+      return extent_protocol::MOVED;
+    }
+  }
+  return extent_protocol::OK;
+}
+
+// like put, for every extent of the batch
+int extent_server::multi_put(std::vector<extent_protocol::batch_ent> ents,
+                             std::vector<unsigned long long> &versions)
+{
+  std::vector<extent_protocol::extentid_t> ids(ents.size());
+  std::vector<rpc_slice> data(ents.size());
+  for (size_t i = 0; i < ents.size(); i++) {
+    ids[i] = ents[i].id;
+    data[i] = rpc_slice(std::move(ents[i].data));
+  }
+  versions.assign(ids.size(), 0);
+  int ret = admit(ids);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  std::vector<int> held;
+  lock_stripes(ids, held);
+  if (!owns(ids)) {
+    unlock_stripes(held);
+    return extent_protocol::MOVED;
+  }
+  std::vector<extent_protocol::attr> as;
+  std::vector<int> rets;
+  store_->getattrs(ids, as, rets);
+  unsigned int now = time(NULL);
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (rets[i] != extent_protocol::OK) {
+      as[i].atime = now;
+    }
+    as[i].mtime = now;
+    as[i].ctime = now;
+    as[i].size = data[i].size();
+    as[i].version = next_version();
+  }
+  store_->puts(ids, as, data, rets);
+  unlock_stripes(held);
+
+  for (size_t i = 0; i < rets.size(); i++) {
+    if (rets[i] == extent_protocol::OK) {
+      versions[i] = as[i].version;
+    } else {
+      ret = rets[i];
+    }
+  }
+  return ret;
+}
+
+int extent_server::multi_remove(std::vector<extent_protocol::extentid_t> ids,
+                                int &r)
+{
+  r = 0;
+  int ret = admit(ids);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  std::vector<int> held;
+  lock_stripes(ids, held);
+  if (!owns(ids)) {
+    unlock_stripes(held);
+    return extent_protocol::MOVED;
+  }
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (store_->remove(ids[i]) == extent_protocol::OK) {
+      r++;
+    }
+  }
+  unlock_stripes(held);
+  return extent_protocol::OK;
+}
+
+static void
+parse_hashes(const std::string &s, std::vector<chunk_hash> &v)
+{
+  v.resize(s.size() / sizeof(chunk_hash));
+  if (!v.empty()) {
+    memcpy(&v[0], s.data(), v.size() * sizeof(chunk_hash));
+  }
+}
+
+int extent_server::features(int, int &r)
+{
+  r = store_->dedups() ? extent_protocol::feature_dedup : 0;
+  return extent_protocol::OK;
+}
+
+int extent_server::have(std::string hashes, std::string &flags)
+{
+  std::vector<chunk_hash> v;
+  parse_hashes(hashes, v);
+  store_->have(v, flags);
+  return extent_protocol::OK;
+}
+
+// the chunks sent are hashed again, so that a client can't store bytes
+// under another chunk's hash
+int extent_server::put_chunks(extent_protocol::extentid_t id,
+                              std::string hashes,
+                              std::vector<unsigned int> lens,
+                              std::string sent, rpc_slice data,
+                              unsigned long long &version)
+{
+  std::vector<chunk_hash> v;
+  parse_hashes(hashes, v);
+  if (hashes.size() % sizeof(chunk_hash) != 0 || lens.size() != v.size() ||
+      sent.size() != v.size()) {
+    return extent_protocol::IOERR;
+  }
+  std::vector<extent_chunk> chunks(v.size());
+  size_t off = 0, size = 0;
+  for (size_t i = 0; i < v.size(); i++) {
+    chunks[i].hash = v[i];
+    chunks[i].len = lens[i];
+    size += lens[i];
+    if (sent[i]) {
+      if (off + lens[i] > data.size()) {
+        return extent_protocol::IOERR;
+      }
+      chunks[i].data = data.sub(off, lens[i]);
+      off += lens[i];
+      if (!(chunk_hash_of(chunks[i].data.data(), lens[i]) == v[i])) {
+        return extent_protocol::IOERR;
+      }
+    }
+  }
+  if (off != data.size() || size > 0xffffffffU) {
+    return extent_protocol::IOERR;
+  }
+
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  {
+    ScopedLock m(stripe(id));
+    if (!owns(id)) {
+      return extent_protocol::MOVED;
+    }
+    unsigned int now = time(NULL);
+    extent_protocol::attr a;
+    if (store_->getattr(id, a) != extent_protocol::OK) {
+      a.atime = now;
+    }
+    a.mtime = now;
+    a.ctime = now;
+    a.size = size;
+    version = a.version = next_version();
+    ret = store_->put_chunks(id, a, chunks);
+  }
+  return ret;
+}
+
+// streams a snapshot of an extent
+class slice_source : public rpc_source {
+ public:
+  slice_source(const rpc_slice &s) : s_(s), off_(0) {}
+  int read(std::string &chunk, int max) {
+    rpc_slice c = s_.sub(off_, max);
+    chunk.assign(c.data(), c.size());
+    off_ += c.size();
+    return extent_protocol::OK;
+  }
+ private:
+  rpc_slice s_;
+  size_t off_;
+};
+
+int extent_server::clone(extent_protocol::extentid_t src,
+                         extent_protocol::extentid_t dst, std::string to,
+                         int &r)
+{
+  r = nacquire;
+  std::vector<extent_protocol::extentid_t> ids;
+  ids.push_back(src);
+  if (to.empty()) {
+    ids.push_back(dst);
+  }
+  int ret = admit(ids);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  if (to.empty()) {
+    std::vector<int> held;
+    lock_stripes(ids, held);
+    if (!owns(ids)) {
+      unlock_stripes(held);
+      return extent_protocol::MOVED;
+    }
+    unsigned int now = time(NULL);
+    extent_protocol::attr a = {now, now, now, 0};
+    a.version = next_version();
+    ret = store_->clone(src, dst, a);
+    unlock_stripes(held);
+    return ret;
+  }
+
+  // a read is a snapshot, so no lock is held while the bytes move
+  rpc_slice buf;
+  ret = store_->read(src, 0, (size_t) -1, buf);
+  if (ret != extent_protocol::OK) {
+    return ret == extent_protocol::NOENT && !owns(src) ?
+      extent_protocol::MOVED : ret;
+  }
+  handle h(to);
+  rpcc *cl = h.safebind();
+  if (cl == NULL) {
+    return extent_protocol::RPCERR;
+  }
+  unsigned long long pr;
+  if (buf.size() > batch_max) {
+    slice_source s(buf);
+    ret = cl->call_upload(extent_protocol::put_stream, dst, &s, pr);
+  } else {
+    ret = cl->call(extent_protocol::put, dst, buf, pr);
+  }
+  // MOVED if the ring of the server to has dst elsewhere
+  return ret == extent_protocol::OK || ret == extent_protocol::MOVED ? ret :
+    extent_protocol::RPCERR;
+}
+
+// stores a streamed put a chunk at a time as it arrives: the first
+// chunk replaces the extent, and the others are written after it.  the
+// client holds the extent's lock, so no one sees it half written, but
+// a put cut short leaves the chunks stored so far.  the reply is the
+// version the extent ends up with, once a group commit covers it.
+class extent_put_sink : public rpc_sink {
+ public:
+  extent_put_sink(extent_server *es, extent_protocol::extentid_t id)
+    : es_(es), id_(id), off_(0), started_(false) {}
+  int write(const std::string &chunk) {
+    rpc_slice s = rpc_slice(std::string(chunk));
+    int ret;
+    if (!started_) {
+      unsigned long long version;
+      ret = es_->put(id_, s, version);
+      started_ = true;
+    } else {
+      int size;
+      ret = es_->write(id_, off_, s, size);
+    }
+    off_ += chunk.size();
+    return ret;
+  }
+  int finish(marshall &rep) {
+    int ret = extent_protocol::OK;
+    extent_protocol::attr a;
+    a.version = 0;
+    if (!started_) {
+      ret = es_->put(id_, rpc_slice(), a.version);
+    } else {
+      ret = es_->getattr(id_, a);
+    }
+    if (ret == extent_protocol::OK) {
+      ret = es_->sync();
+    }
+    rep << a.version;
+    return ret;
+  }
+ private:
+  extent_server *es_;
+  extent_protocol::extentid_t id_;
+  unsigned int off_;
+  bool started_;
+};
+
+// serves a streamed get a chunk at a time
+class extent_get_source : public rpc_source {
+ public:
+  extent_get_source(extent_server *es, extent_protocol::extentid_t id)
+    : es_(es), id_(id), off_(0) {}
+  int read(std::string &chunk, int max) {
+    int ret = es_->read_chunk(id_, off_, max, chunk);
+    off_ += chunk.size();
+    return ret;
+  }
+ private:
+  extent_server *es_;
+  extent_protocol::extentid_t id_;
+  size_t off_;
+};
+
+// serves a snapshot of the ids, as many whole ids per chunk as fit
+class extent_list_source : public rpc_source {
+ public:
+  extent_list_source(std::vector<extent_protocol::extentid_t> &ids)
+    : off_(0) { ids_.swap(ids); }
+  int read(std::string &chunk, int max) {
+    size_t n = std::min(ids_.size() - off_, max / sizeof(ids_[0]));
+    chunk.assign((const char *) &ids_[off_], n * sizeof(ids_[0]));
+    off_ += n;
+    return extent_protocol::OK;
+  }
+ private:
+  std::vector<extent_protocol::extentid_t> ids_;
+  size_t off_;
+};
+
+int extent_server::open_put(extent_protocol::extentid_t id, rpc_sink **s)
+{
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  *s = new extent_put_sink(this, id);
+  return extent_protocol::OK;
+}
+
+int extent_server::open_get(extent_protocol::extentid_t id, rpc_source **s)
+{
+  int ret = admit(id);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  if (store_->touch(id, time(NULL)) != extent_protocol::OK) {
+    return owns(id) ? extent_protocol::NOENT : extent_protocol::MOVED;
+  }
+  *s = new extent_get_source(this, id);
+  return extent_protocol::OK;
+}
+
+int extent_server::read_chunk(extent_protocol::extentid_t id, size_t off,
+                              int max, std::string &chunk)
+{
+  rpc_slice s;
+  int ret = store_->read(id, off, max, s);
+  chunk.assign(s.data(), s.size());
+  return ret;
+}
+
+int extent_server::open_list(extent_protocol::extentid_t from,
+                             rpc_source **s)
+{
+  std::vector<extent_protocol::extentid_t> ids, v;
+  store_->ids(v);
+  for (size_t i = 0; i < v.size(); i++) {
+    if (v[i] >= from && v[i] != ring_id) {
+      ids.push_back(v[i]);
+    }
+  }
+  *s = new extent_list_source(ids);
+  return extent_protocol::OK;
+}
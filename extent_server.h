@@ -5,27 +5,237 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <vector>
+#include <utility>
 #include <pthread.h>
 #include "extent_protocol.h"
+#include "extent_store.h"
+#include "extent_ring.h"
 
 class extent_server {
  private:
-  struct node {
-    extent_protocol::attr attr;
-    std::string buf;
+  extent_store *store_;
+  static const int nstripes = 64;
+  pthread_mutex_t stripes_[nstripes];
+  int nacquire;
+  // the version of every extent not updated since the server started,
+  // which the store keeps as 0.  it is the microsecond of the start
+  // times 4096, above any version an earlier run can have reached, and
+  // every update takes the next version after the last.
+  unsigned long long base_version_;
+  unsigned long long last_version_;
+
+  unsigned long long next_version();
+  void show_version(extent_protocol::attr &a);
+
+  pthread_mutex_t *stripe(extent_protocol::extentid_t id);
+  void lock_stripes(const std::vector<extent_protocol::extentid_t> &ids,
+                    std::vector<int> &held);
+  void unlock_stripes(const std::vector<int> &held);
+
+  // the ring, once the server has one.  it then serves only the
+  // extents the ring puts on it, and answers MOVED for the others.  a
+  // server that joined keeps the ring from before in old_ring_ while
+  // it rebalances, and pulls each extent it now has from its old
+  // server before its first use, or in the background.  an extent is
+  // handed over under the stripe lock of its old server, which then
+  // no longer has it, so no update can land there after.  the rings
+  // are kept in the store, as the extent ring_id.
+  static const extent_protocol::extentid_t ring_id = 0;
+  extent_ring ring_;
+  extent_ring old_ring_;
+  std::string self_; // this server's name on the rings
+  std::set<extent_protocol::extentid_t> settled_; // pulled already
+  // the first bytes of extents handed over in several calls
+  std::map<extent_protocol::extentid_t, std::string> arriving_;
+  bool rebalancing_;
+  pthread_t rebalancer_;
+  pthread_mutex_t ring_m_; // protects the above
+
+  bool owns(extent_protocol::extentid_t id);
+  bool owns(const std::vector<extent_protocol::extentid_t> &ids);
+  int admit(extent_protocol::extentid_t id);
+  int admit(const std::vector<extent_protocol::extentid_t> &ids);
+  void save_ring_wo();
+  bool install_ring(const extent_ring &ring, const std::string &self);
+  static void *rebalance_thread(void *);
+  void rebalance();
+
+  // group commit.  with a store that needs syncs, an update is only
+  // replied to once a sync of the store covers it.  a single thread
+  // syncs for all the updates that came in since its last sync, or
+  // during it, after waiting up to commit_us_ for more to come unless
+  // commit_batch_ are waiting already.  a thread that waits in sync()
+  // is in the batch too, with w set instead of t.
+  struct commit_waiter {
+    bool done;
+    int ret;
   };
+  struct commit_ent {
+    reply_token *t;
+    int ret;
+    std::string rep; // the reply's value, marshalled
+    commit_waiter *w;
+  };
+  pthread_mutex_t commit_m_; // protects the commit state and stats
+  pthread_cond_t commit_c_;
+  pthread_cond_t waiters_c_; // a batch with waiters was synced
+  pthread_cond_t stats_c_;
+  std::vector<commit_ent> pending_;
+  struct timespec pending_since_;
+  unsigned int commit_us_;
+  size_t commit_batch_;
+  bool stopping_;
+  pthread_t committer_;
+  unsigned long long syncs_;  // since the start
+  unsigned long long synced_; // updates the syncs covered
+  size_t max_batch_;          // since the stats were last printed
+  int stats_secs_;
+  pthread_t stats_thread_;
 
-  std::map<extent_protocol::extentid_t, node> ext_map_;
-  pthread_mutex_t _m;
-  int nacquire;
+  template<class R> void commit(reply_token *t, int ret, const R &r) {
+    marshall m;
+    m << r;
+    commit_raw(t, ret, m.str());
+  }
+  void commit_raw(reply_token *t, int ret, const std::string &rep);
+  void queue_wo(const commit_ent &e);
+  int sync_one();
+  static void *committer_thread(void *);
+  void committer();
+  static void *stats_thread(void *);
+  void print_stats();
 
  public:
-  extent_server();
+  // keeps the extents in store, or in memory if store is NULL
+  extent_server(extent_store *store = NULL);
+  ~extent_server();
 
-  int put(extent_protocol::extentid_t id, std::string, int &);
-  int get(extent_protocol::extentid_t id, std::string &);
+  // a batch of updates is synced once its first has waited interval_us
+  // microseconds, or once batch of them wait.  0 and 1024 by default.
+  void set_commit(unsigned int interval_us, size_t batch);
+  // prints the syncs per second, their batch sizes and the figures of
+  // the store every secs
+  void print_stats_every(int secs);
+  // waits until the updates so far are durable, for those that are
+  // not replied to through a group commit; shares its sync with them
+  int sync();
+
+  // joins the servers of a ring, a comma separated list, as self.
+  // they must be those the clients were given, or those of the
+  // servers' ring if they have one.  the extents the new ring puts on
+  // this server move to it in the background.  one join at a time.
+  void join(const std::string &servers, const std::string &self);
+
+  // the handlers of the updates, which reply through t once the update
+  // is durable
+  template<class A1, class R, int (extent_server::*m)(A1, R &)>
+  void durable(A1 a1, reply_token *t) {
+    R r = R();
+    int ret = (this->*m)(std::move(a1), r);
+    commit(t, ret, r);
+  }
+  template<class A1, class A2, class R, int (extent_server::*m)(A1, A2, R &)>
+  void durable(A1 a1, A2 a2, reply_token *t) {
+    R r = R();
+    int ret = (this->*m)(std::move(a1), std::move(a2), r);
+    commit(t, ret, r);
+  }
+  template<class A1, class A2, class A3, class R,
+           int (extent_server::*m)(A1, A2, A3, R &)>
+  void durable(A1 a1, A2 a2, A3 a3, reply_token *t) {
+    R r = R();
+    int ret = (this->*m)(std::move(a1), std::move(a2), std::move(a3), r);
+    commit(t, ret, r);
+  }
+  template<class A1, class A2, class A3, class A4, class R,
+           int (extent_server::*m)(A1, A2, A3, A4, R &)>
+  void durable(A1 a1, A2 a2, A3 a3, A4 a4, reply_token *t) {
+    R r = R();
+    int ret = (this->*m)(std::move(a1), std::move(a2), std::move(a3),
+                         std::move(a4), r);
+    commit(t, ret, r);
+  }
+  template<class A1, class A2, class A3, class A4, class A5, class R,
+           int (extent_server::*m)(A1, A2, A3, A4, A5, R &)>
+  void durable(A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, reply_token *t) {
+    R r = R();
+    int ret = (this->*m)(std::move(a1), std::move(a2), std::move(a3),
+                         std::move(a4), std::move(a5), r);
+    commit(t, ret, r);
+  }
+
+  // put, multi_put and put_chunks return the new versions
+  int put(extent_protocol::extentid_t id, rpc_slice,
+          unsigned long long &version);
+  int get(extent_protocol::extentid_t id, rpc_slice &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  // byte ranges; write and truncate return the new size in r
+  int read(extent_protocol::extentid_t id, unsigned int off,
+           unsigned int len, rpc_slice &);
+  int write(extent_protocol::extentid_t id, unsigned int off, rpc_slice,
+            int &r);
+  int truncate(extent_protocol::extentid_t id, unsigned int size, int &r);
+  int append(extent_protocol::extentid_t id, rpc_slice, int &r);
+  // the extent, with its attributes, if its version is not version.
+  // if it is, e holds only the attributes.  the data of an extent of
+  // more than batch_max bytes is left out, with e.ret RPCERR.
+  int get_if_changed(extent_protocol::extentid_t id,
+                     unsigned long long version,
+                     extent_protocol::batch_ent &e);
+  // the feature_ bits of extent_protocol this server has
+  int features(int, int &r);
+  // hashes holds 32-byte chunk hashes; flags gets a byte for each, 1 if
+  // the store has the chunk
+  int have(std::string hashes, std::string &flags);
+  // replaces the extent with the chunks of the hashes, lens long.  data
+  // holds the chunks whose byte in sent is 1, in order.  NOENT if
+  // another chunk is not in the store.
+  int put_chunks(extent_protocol::extentid_t id, std::string hashes,
+                 std::vector<unsigned int> lens, std::string sent,
+                 rpc_slice data, unsigned long long &version);
+
+  // batches.  multi_get leaves out the data, with ret RPCERR, of the
+  // extents past the first batch_max bytes.  multi_put returns the
+  // version of each extent, 0 for those it failed to store, and
+  // multi_remove how many it removed.
+  static const size_t batch_max = 1024 * 1024;
+  int multi_get(std::vector<extent_protocol::extentid_t> ids,
+                std::vector<extent_protocol::batch_ent> &ents);
+  int multi_getattr(std::vector<extent_protocol::extentid_t> ids,
+                    std::vector<extent_protocol::batch_ent> &ents);
+  int multi_put(std::vector<extent_protocol::batch_ent> ents,
+                std::vector<unsigned long long> &versions);
+  int multi_remove(std::vector<extent_protocol::extentid_t> ids, int &r);
+
+  // replaces dst with the contents of src, or creates it.  with to
+  // empty, dst is on this server too, and the store shares the bytes
+  // of the two where it can; otherwise this server puts them on the
+  // extent server to.
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            std::string to, int &r);
+
+  int open_put(extent_protocol::extentid_t id, rpc_sink **);
+  int open_get(extent_protocol::extentid_t id, rpc_source **);
+  int read_chunk(extent_protocol::extentid_t id, size_t off, int max,
+                 std::string &chunk);
+  // streams the ids from "from" on as 8-byte words, for rebalancing
+  int open_list(extent_protocol::extentid_t from, rpc_source **);
+
+  // the ring; epoch 0 and no servers if the server has none
+  int ring_get(int, extent_ring &ring);
+  // takes ring, on which this server is self, if it is newer
+  int ring_set(extent_ring ring, std::string self, int &r);
+  // installs ring as ring_set does, then hands the extent over to its
+  // server on ring, and removes it here.  r is 1 if it was here.
+  int move_out(extent_protocol::extentid_t id, extent_ring ring,
+               std::string self, int &r);
+  // data holds the bytes of the extent from off on, and a its final
+  // attributes.  it is stored once all its bytes are in.
+  int move_in(extent_protocol::extentid_t id, unsigned int off,
+              extent_protocol::attr a, rpc_slice data, int &r);
 };
 
 #endif
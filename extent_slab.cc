@@ -0,0 +1,116 @@
+// the slab allocator
+
+#include "extent_slab.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+// about 1.5 apart, so that at most a third of a slot is wasted
+const size_t extent_slab::sizes[nclasses] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+// an arena on huge pages if some are set aside, or else on ordinary
+// pages aligned so that transparent huge pages can back them
+static char *
+map_arena(size_t size)
+{
+  void *p;
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    return (char *) p;
+  }
+#endif
+  p = mmap(NULL, 2 * size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  uintptr_t start = (uintptr_t) p;
+  uintptr_t a = (start + size - 1) & ~(uintptr_t) (size - 1);
+  if (a > start) {
+    munmap(p, a - start);
+  }
+  if (start + 2 * size > a + size) {
+    munmap((void *) (a + size), start + 2 * size - (a + size));
+  }
+#ifdef MADV_HUGEPAGE
+  madvise((void *) a, size, MADV_HUGEPAGE);
+#endif
+  return (char *) a;
+}
+
+extent_slab::extent_slab() : next_page_(NULL)
+{
+  VERIFY(pthread_mutex_init(&m_, 0) == 0);
+  for (int c = 0; c < nclasses; c++) {
+    free_[c] = NULL;
+  }
+}
+
+extent_slab::~extent_slab()
+{
+  for (size_t i = 0; i < arenas_.size(); i++) {
+    munmap(arenas_[i], arena_size);
+  }
+  VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+int extent_slab::class_of(size_t n)
+{
+  int c = 0;
+  while (sizes[c] < n) {
+    c++;
+  }
+  return c;
+}
+
+// assumes m_.  cuts the next free page into slots of class c.
+bool extent_slab::new_page(int c)
+{
+  if (next_page_ == NULL || next_page_ == arenas_.back() + arena_size) {
+    char *a = map_arena(arena_size);
+    if (a == NULL) {
+      return false;
+    }
+    arenas_.push_back(a);
+    next_page_ = a;
+  }
+  char *page = next_page_;
+  next_page_ += page_size;
+  // pushed from the end, so that slots are handed out in address order
+  size_t n = page_size / sizes[c];
+  for (size_t i = n; i > 0; i--) {
+    free_slot *s = (free_slot *) (page + (i - 1) * sizes[c]);
+    s->next = free_[c];
+    free_[c] = s;
+  }
+  return true;
+}
+
+char *extent_slab::alloc(size_t n)
+{
+  VERIFY(n > 0 && n <= max);
+  int c = class_of(n);
+  ScopedLock l(&m_);
+  if (free_[c] == NULL && !new_page(c)) {
+    return NULL;
+  }
+  free_slot *s = free_[c];
+  free_[c] = s->next;
+  return (char *) s;
+}
+
+void extent_slab::free(char *p, size_t n)
+{
+  int c = class_of(n);
+  ScopedLock l(&m_);
+  free_slot *s = (free_slot *) p;
+  s->next = free_[c];
+  free_[c] = s;
+}
@@ -0,0 +1,46 @@
+// a slab allocator for the bytes of small extents
+
+#ifndef extent_slab_h
+#define extent_slab_h
+
+#include <stddef.h>
+#include <vector>
+#include <pthread.h>
+
+// hands out slots of a few size classes, up to max bytes, carved from
+// pages of arenas that are mapped 2M at a time, on huge pages where
+// the system has them.  a freed slot goes on a free list of its class
+// and is handed out again; arenas are only unmapped when the slab is
+// destroyed.  slots carry no header, so free is given the size that
+// alloc was.  thread-safe.
+class extent_slab {
+ private:
+  static const int nclasses = 14;
+  static const size_t sizes[nclasses];
+  static const size_t arena_size = 2 << 20;
+  static const size_t page_size = 64 << 10;  // of one class
+
+  struct free_slot {
+    free_slot *next;
+  };
+
+  pthread_mutex_t m_;
+  std::vector<char *> arenas_;
+  char *next_page_;         // in the last arena
+  free_slot *free_[nclasses];
+
+  static int class_of(size_t n);
+  bool new_page(int c);
+
+ public:
+  static const size_t max = 2048;
+
+  extent_slab();
+  ~extent_slab();
+
+  // a slot of at least n bytes, 0 < n <= max; NULL if out of memory
+  char *alloc(size_t n);
+  void free(char *p, size_t n);
+};
+
+#endif
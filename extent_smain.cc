@@ -11,8 +11,8 @@ main(int argc, char *argv[])
 {
   int count = 0;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s port [dir]\n", argv[0]);
     exit(1);
   }
 
@@ -23,13 +23,117 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  extent_store::options o;
+  // with EXTENT_DEDUP set, extents with the same chunks of bytes share
+  // them
+  char *dedup_env = getenv("EXTENT_DEDUP");
+  o.dedup = dedup_env != NULL && atoi(dedup_env) != 0;
+
+  // with a directory, hot extents are kept in EXTENT_CACHE_MB megabytes
+  // of memory in front of the disk
+  char *cache_env = getenv("EXTENT_CACHE_MB");
+  o.cache = (size_t) (cache_env != NULL ? atoi(cache_env) : 64) << 20;
+  // and the log is read through to check it at EXTENT_SCRUB_KBPS
+  // kilobytes a second, 0 for never
+  char *scrub_env = getenv("EXTENT_SCRUB_KBPS");
+  o.scrub = (size_t) (scrub_env != NULL ? atoi(scrub_env) : 1024) << 10;
+  // extents that shrink are packed in the cache and the log, unless
+  // EXTENT_PACK is 0
+  char *pack_env = getenv("EXTENT_PACK");
+  o.pack = pack_env == NULL || atoi(pack_env) != 0;
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  // with a directory, extents are kept in a log there and survive
+  // restarts
+  extent_server ls(extent_store::open(argc == 3 ? argv[2] : "", o));
+
+  // updates to a log are replied to once synced, in batches that wait
+  // up to EXTENT_COMMIT_US microseconds for EXTENT_COMMIT_BATCH updates
+  char *commit_us_env = getenv("EXTENT_COMMIT_US");
+  char *commit_batch_env = getenv("EXTENT_COMMIT_BATCH");
+  ls.set_commit(commit_us_env ? atoi(commit_us_env) : 0,
+                commit_batch_env ? atoi(commit_batch_env) : 1024);
+  char *stats_env = getenv("EXTENT_STATS");
+  if (stats_env != NULL && atoi(stats_env) > 0) {
+    ls.print_stats_every(atoi(stats_env));
+  }
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
-  server.reg(extent_protocol::put, &ls, &extent_server::put);
-  server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg_deferred(extent_protocol::put, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      rpc_slice, unsigned long long, &extent_server::put>);
+  server.reg_deferred(extent_protocol::remove, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      int, &extent_server::remove>);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg_deferred(extent_protocol::write, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      unsigned int, rpc_slice, int, &extent_server::write>);
+  server.reg_deferred(extent_protocol::truncate, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      unsigned int, int, &extent_server::truncate>);
+  server.reg_deferred(extent_protocol::append, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      rpc_slice, int, &extent_server::append>);
+  server.reg(extent_protocol::features, &ls, &extent_server::features);
+  server.reg(extent_protocol::have, &ls, &extent_server::have);
+  server.reg_deferred(extent_protocol::put_chunks, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      std::string, std::vector<unsigned int>, std::string,
+                      rpc_slice, unsigned long long,
+                      &extent_server::put_chunks>);
+  server.reg(extent_protocol::multi_get, &ls, &extent_server::multi_get);
+  server.reg(extent_protocol::multi_getattr, &ls,
+             &extent_server::multi_getattr);
+  server.reg_deferred(extent_protocol::multi_put, &ls,
+                      &extent_server::durable<
+                      std::vector<extent_protocol::batch_ent>,
+                      std::vector<unsigned long long>,
+                      &extent_server::multi_put>);
+  server.reg_deferred(extent_protocol::multi_remove, &ls,
+                      &extent_server::durable<
+                      std::vector<extent_protocol::extentid_t>, int,
+                      &extent_server::multi_remove>);
+  server.reg_deferred(extent_protocol::clone, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      extent_protocol::extentid_t, std::string, int,
+                      &extent_server::clone>);
+  server.reg(extent_protocol::get_if_changed, &ls,
+             &extent_server::get_if_changed);
+  server.set_idempotent(extent_protocol::get);
+  server.set_idempotent(extent_protocol::getattr);
+  server.set_idempotent(extent_protocol::read);
+  server.set_idempotent(extent_protocol::features);
+  server.set_idempotent(extent_protocol::have);
+  server.set_idempotent(extent_protocol::multi_get);
+  server.set_idempotent(extent_protocol::multi_getattr);
+  server.set_idempotent(extent_protocol::get_if_changed);
+  server.reg_upload(extent_protocol::put_stream, &ls, &extent_server::open_put);
+  server.reg_download(extent_protocol::get_stream, &ls, &extent_server::open_get);
+  server.reg_download(extent_protocol::list_stream, &ls, &extent_server::open_list);
+  server.reg(extent_protocol::ring_get, &ls, &extent_server::ring_get);
+  server.set_idempotent(extent_protocol::ring_get);
+  server.reg_deferred(extent_protocol::ring_set, &ls,
+                      &extent_server::durable<extent_ring, std::string, int,
+                      &extent_server::ring_set>);
+  server.reg_deferred(extent_protocol::move_out, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      extent_ring, std::string, int, &extent_server::move_out>);
+  server.reg_deferred(extent_protocol::move_in, &ls,
+                      &extent_server::durable<extent_protocol::extentid_t,
+                      unsigned int, extent_protocol::attr, rpc_slice, int,
+                      &extent_server::move_in>);
+
+  // with EXTENT_JOIN set to the extent servers the clients use, comma
+  // separated, this server joins them as EXTENT_NAME, by default its
+  // port.  the clients learn the new ring from the servers, and the
+  // extents it now has move to it in the background.
+  char *join_env = getenv("EXTENT_JOIN");
+  if (join_env != NULL) {
+    char *name_env = getenv("EXTENT_NAME");
+    ls.join(join_env, name_env != NULL ? name_env : argv[1]);
+  }
 
   while(1)
     sleep(1000);
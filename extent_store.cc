@@ -0,0 +1,464 @@
+// the in-memory extent store
+
+#include "extent_store.h"
+#include "extent_log_store.h"
+#include "extent_dedup_store.h"
+#include "extent_cache_store.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+extent_store *extent_store::open(const std::string &dir, const options &o)
+{
+  if (o.cache > 0 && !dir.empty()) {
+    // caches whole extents, so those of a dedup store are put together
+    // from their chunks once per miss
+    options below = o;
+    below.cache = 0;
+    return new extent_cache_store(open(dir, below), o.cache, o.pack);
+  }
+  if (o.dedup) {
+    // the chunks go in a store of their own, in a directory inside
+    // that of the recipes
+    options below = o;
+    below.dedup = false;
+    extent_store *recipes = open(dir, below);
+    return new extent_dedup_store(recipes,
+                                  open(dir.empty() ? dir : dir + "/chunks",
+                                       below));
+  }
+  if (dir.empty()) {
+    return new extent_mem_store();
+  }
+  return new extent_log_store(dir, o.scrub, o.pack);
+}
+
+void extent_store::getattrs(const std::vector<extent_protocol::extentid_t> &ids,
+                            std::vector<extent_protocol::attr> &as,
+                            std::vector<int> &rets)
+{
+  as.resize(ids.size());
+  rets.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    rets[i] = getattr(ids[i], as[i]);
+  }
+}
+
+void extent_store::puts(const std::vector<extent_protocol::extentid_t> &ids,
+                        const std::vector<extent_protocol::attr> &as,
+                        const std::vector<rpc_slice> &data,
+                        std::vector<int> &rets)
+{
+  rets.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    rets[i] = put(ids[i], as[i], data[i]);
+  }
+}
+
+void extent_store::have(const std::vector<chunk_hash> &hashes,
+                        std::string &flags)
+{
+  flags.assign(hashes.size(), 0);
+}
+
+int extent_store::put_chunks(extent_protocol::extentid_t id,
+                             const extent_protocol::attr &a,
+                             const std::vector<extent_chunk> &chunks)
+{
+  if (chunks.size() == 1) {
+    return chunks[0].data.size() == chunks[0].len ?
+      put(id, a, chunks[0].data) : extent_protocol::NOENT;
+  }
+  std::string buf;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (chunks[i].data.size() != chunks[i].len) {
+      return extent_protocol::NOENT;
+    }
+    buf.append(chunks[i].data.data(), chunks[i].data.size());
+  }
+  return put(id, a, rpc_slice(std::move(buf)));
+}
+
+int extent_store::clone(extent_protocol::extentid_t src,
+                        extent_protocol::extentid_t dst,
+                        const extent_protocol::attr &a)
+{
+  rpc_slice data;
+  int ret = read(src, 0, (size_t) -1, data);
+  if (ret != extent_protocol::OK) {
+    return ret;
+  }
+  extent_protocol::attr da = a;
+  da.size = data.size();
+  return put(dst, da, data);
+}
+
+extent_mem_store::extent_mem_store()
+{
+  for (int i = 0; i < nshards; i++) {
+    VERIFY(pthread_rwlock_init(&shards_[i].m, 0) == 0);
+    shards_[i].count = 0;
+    shards_[i].slab = &slabs_[i % nslabs];
+  }
+}
+
+extent_mem_store::~extent_mem_store()
+{
+  for (int i = 0; i < nshards; i++) {
+    std::vector<node> &slots = shards_[i].slots;
+    for (size_t j = 0; j < slots.size(); j++) {
+      if (slots[j].used && !is_small(slots[j])) {
+        delete slots[j].b;
+      }
+    }
+    VERIFY(pthread_rwlock_destroy(&shards_[i].m) == 0);
+  }
+}
+
+// the shard is picked by the top bits, so the slot is by the others
+static size_t
+slot_hash(extent_protocol::extentid_t id)
+{
+  unsigned long long h = id * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 32);
+}
+
+extent_mem_store::node *
+extent_mem_store::shard::find(extent_protocol::extentid_t id)
+{
+  if (slots.empty()) {
+    return NULL;
+  }
+  size_t mask = slots.size() - 1;
+  for (size_t i = slot_hash(id) & mask; slots[i].used; i = (i + 1) & mask) {
+    if (slots[i].id == id) {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+// the first free slot for id
+extent_mem_store::node &
+extent_mem_store::shard::probe(extent_protocol::extentid_t id)
+{
+  size_t mask = slots.size() - 1;
+  size_t i = slot_hash(id) & mask;
+  while (slots[i].used) {
+    i = (i + 1) & mask;
+  }
+  return slots[i];
+}
+
+extent_mem_store::node &
+extent_mem_store::shard::get(extent_protocol::extentid_t id)
+{
+  node *n = find(id);
+  if (n != NULL) {
+    return *n;
+  }
+  if ((count + 1) * 4 > slots.size() * 3) {
+    std::vector<node> old(std::max((size_t) 16, slots.size() * 2));
+    old.swap(slots);
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i].used) {
+        probe(old[i].id) = old[i];
+      }
+    }
+  }
+  node &e = probe(id);
+  e = node();
+  e.id = id;
+  e.used = true;
+  count++;
+  return e;
+}
+
+// moves back the nodes after n that probed past it, so that no search
+// stops short at the hole
+void extent_mem_store::shard::erase(node *n)
+{
+  size_t mask = slots.size() - 1;
+  size_t i = n - &slots[0];
+  for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+    size_t k = slot_hash(slots[j].id) & mask;
+    // whether k, where the node of j starts probing, is not in (i, j]
+    if (i < j ? (k <= i || k > j) : (k <= i && k > j)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i] = node();
+  count--;
+}
+
+const char *extent_mem_store::bytes(const node &n)
+{
+  if (is_small(n)) {
+    return n.small;
+  }
+  return n.b->own ? n.b->own->data() : n.b->buf.data();
+}
+
+void extent_mem_store::clear(shard &sh, node &n)
+{
+  if (!is_small(n)) {
+    delete n.b;
+  } else if (n.len > 0) {
+    sh.slab->free(n.small, n.len);
+  }
+  n.len = 0;
+  n.small = NULL;
+}
+
+void extent_mem_store::set(shard &sh, node &n, const rpc_slice &data)
+{
+  clear(sh, n);
+  if (data.size() > extent_slab::max) {
+    n.b = new big();
+    n.b->buf = data;
+  } else if (data.size() > 0) {
+    n.small = sh.slab->alloc(data.size());
+    VERIFY(n.small != NULL);
+    memcpy(n.small, data.data(), data.size());
+  }
+  n.len = data.size();
+}
+
+int extent_mem_store::getattr(extent_protocol::extentid_t id,
+                              extent_protocol::attr &a)
+{
+  shard &sh = shard_of(id);
+  ScopedRead r(&sh.m);
+  node *n = sh.find(id);
+  if (n == NULL) {
+    return extent_protocol::NOENT;
+  }
+  get_attr(n->attr, a);
+  return extent_protocol::OK;
+}
+
+int extent_mem_store::read(extent_protocol::extentid_t id, size_t off,
+                           size_t len, rpc_slice &data)
+{
+  shard &sh = shard_of(id);
+  ScopedRead r(&sh.m);
+  const node *np = sh.find(id);
+  if (np == NULL) {
+    return extent_protocol::NOENT;
+  }
+  const node &n = *np;
+  if (is_small(n)) {
+    // the slot may be reused once the lock is let go
+    off = std::min(off, (size_t) n.len);
+    len = std::min(len, n.len - off);
+    data = rpc_slice(std::string(n.small + off, len));
+  } else if (n.b->own) {
+    std::shared_ptr<char> ref(n.b->own, &(*n.b->own)[0]);
+    data = rpc_slice(ref, ref.get(), n.b->own->size()).sub(off, len);
+  } else {
+    data = n.b->buf.sub(off, len);
+  }
+  return extent_protocol::OK;
+}
+
+int extent_mem_store::put(extent_protocol::extentid_t id,
+                          const extent_protocol::attr &a,
+                          const rpc_slice &data)
+{
+  shard &sh = shard_of(id);
+  ScopedWrite w(&sh.m);
+  node &n = sh.get(id);
+  n.attr = a;
+  set(sh, n, data);
+  return extent_protocol::OK;
+}
+
+int extent_mem_store::write(extent_protocol::extentid_t id,
+                            const extent_protocol::attr &a, size_t off,
+                            const rpc_slice &data)
+{
+  shard &sh = shard_of(id);
+  ScopedWrite w(&sh.m);
+  node &n = sh.get(id);
+  n.attr = a;
+  if (a.size <= extent_slab::max) {
+    // into a slot of the new size, unless it is the old one's
+    char *p = n.small;
+    if (!is_small(n) || n.len != a.size) {
+      p = a.size > 0 ? sh.slab->alloc(a.size) : NULL;
+      VERIFY(a.size == 0 || p != NULL);
+      if (p != NULL) {
+        size_t keep = std::min((size_t) n.len, (size_t) a.size);
+        memcpy(p, bytes(n), keep);
+        memset(p + keep, 0, a.size - keep);
+      }
+      clear(sh, n);
+    }
+    if (off < a.size) {
+      memcpy(p + off, data.data(), std::min(data.size(), a.size - off));
+    }
+    n.small = p;
+    n.len = a.size;
+    return extent_protocol::OK;
+  }
+  if (is_small(n)) {
+    big *b = new big();
+    b->own = std::make_shared<std::string>(n.small, n.len);
+    clear(sh, n);
+    n.b = b;
+  } else if (!n.b->own || n.b->own.use_count() > 1) {
+    n.b->own = n.b->own ? std::make_shared<std::string>(*n.b->own)
+                        : std::make_shared<std::string>(n.b->buf.str());
+    n.b->buf = rpc_slice();
+  }
+  std::string &s = *n.b->own;
+  if (!data.empty()) {
+    if (s.size() < off + data.size()) {
+      s.resize(off + data.size());
+    }
+    s.replace(off, data.size(), data.data(), data.size());
+  }
+  s.resize(a.size);
+  n.len = a.size;
+  return extent_protocol::OK;
+}
+
+int extent_mem_store::touch(extent_protocol::extentid_t id, unsigned int t)
+{
+  shard &sh = shard_of(id);
+  ScopedRead r(&sh.m);
+  node *n = sh.find(id);
+  if (n == NULL) {
+    return extent_protocol::NOENT;
+  }
+  touch_attr(n->attr, t);
+  return extent_protocol::OK;
+}
+
+int extent_mem_store::remove(extent_protocol::extentid_t id)
+{
+  shard &sh = shard_of(id);
+  ScopedWrite w(&sh.m);
+  node *n = sh.find(id);
+  if (n == NULL) {
+    return extent_protocol::NOENT;
+  }
+  clear(sh, *n);
+  sh.erase(n);
+  return extent_protocol::OK;
+}
+
+void extent_mem_store::ids(std::vector<extent_protocol::extentid_t> &v)
+{
+  for (int i = 0; i < nshards; i++) {
+    ScopedRead r(&shards_[i].m);
+    const std::vector<node> &slots = shards_[i].slots;
+    for (size_t j = 0; j < slots.size(); j++) {
+      if (slots[j].used) {
+        v.push_back(slots[j].id);
+      }
+    }
+  }
+}
+
+void extent_mem_store::by_shard(
+  const std::vector<extent_protocol::extentid_t> &ids,
+  std::vector<size_t> &order)
+{
+  order.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&ids](size_t x, size_t y) {
+    return shard_index(ids[x]) < shard_index(ids[y]);
+  });
+}
+
+void extent_mem_store::getattrs(
+  const std::vector<extent_protocol::extentid_t> &ids,
+  std::vector<extent_protocol::attr> &as, std::vector<int> &rets)
+{
+  std::vector<size_t> order;
+  by_shard(ids, order);
+  as.resize(ids.size());
+  rets.resize(ids.size());
+  for (size_t i = 0; i < order.size(); ) {
+    shard &sh = shard_of(ids[order[i]]);
+    ScopedRead r(&sh.m);
+    for (; i < order.size() && &shard_of(ids[order[i]]) == &sh; i++) {
+      node *n = sh.find(ids[order[i]]);
+      if (n == NULL) {
+        rets[order[i]] = extent_protocol::NOENT;
+      } else {
+        get_attr(n->attr, as[order[i]]);
+        rets[order[i]] = extent_protocol::OK;
+      }
+    }
+  }
+}
+
+void extent_mem_store::puts(const std::vector<extent_protocol::extentid_t> &ids,
+                            const std::vector<extent_protocol::attr> &as,
+                            const std::vector<rpc_slice> &data,
+                            std::vector<int> &rets)
+{
+  std::vector<size_t> order;
+  by_shard(ids, order);
+  rets.assign(ids.size(), extent_protocol::OK);
+  for (size_t i = 0; i < order.size(); ) {
+    shard &sh = shard_of(ids[order[i]]);
+    ScopedWrite w(&sh.m);
+    for (; i < order.size() && &shard_of(ids[order[i]]) == &sh; i++) {
+      node &n = sh.get(ids[order[i]]);
+      n.attr = as[order[i]];
+      set(sh, n, data[order[i]]);
+    }
+  }
+}
+
+// a big extent shares its buffer with the clone.  a write to either
+// copies the buffer first, as it does while a read holds it.
+int extent_mem_store::clone(extent_protocol::extentid_t src,
+                            extent_protocol::extentid_t dst,
+                            const extent_protocol::attr &a)
+{
+  int si = shard_index(src), di = shard_index(dst);
+  shard &ss = shards_[si], &ds = shards_[di];
+  // both shards, in order
+  VERIFY(pthread_rwlock_wrlock(&shards_[std::min(si, di)].m) == 0);
+  if (si != di) {
+    VERIFY(pthread_rwlock_wrlock(&shards_[std::max(si, di)].m) == 0);
+  }
+  int ret = extent_protocol::NOENT;
+  node *s = ss.find(src);
+  if (s != NULL) {
+    extent_protocol::attr da = a;
+    da.size = s->attr.size;
+    if (src == dst) {
+      s->attr = da;
+    } else {
+      node from = *s; // get may move s
+      node &n = ds.get(dst);
+      clear(ds, n);
+      n.attr = da;
+      if (!is_small(from)) {
+        n.b = new big(*from.b);
+      } else if (from.len > 0) {
+        n.small = ds.slab->alloc(from.len);
+        VERIFY(n.small != NULL);
+        memcpy(n.small, from.small, from.len);
+      }
+      n.len = from.len;
+    }
+    ret = extent_protocol::OK;
+  }
+  if (si != di) {
+    VERIFY(pthread_rwlock_unlock(&shards_[std::max(si, di)].m) == 0);
+  }
+  VERIFY(pthread_rwlock_unlock(&shards_[std::min(si, di)].m) == 0);
+  return ret;
+}
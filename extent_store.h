@@ -0,0 +1,208 @@
+// storage engines behind the extent server
+
+#ifndef extent_store_h
+#define extent_store_h
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <pthread.h>
+#include "extent_protocol.h"
+#include "extent_chunk.h"
+#include "extent_slab.h"
+
+// where extent_server keeps its extents.  stores are thread-safe, and
+// their methods return extent_protocol::OK, NOENT or IOERR.
+class extent_store {
+ public:
+  virtual ~extent_store() {}
+
+  virtual int getattr(extent_protocol::extentid_t id,
+                      extent_protocol::attr &a) = 0;
+  // len bytes of the extent from off on, cut short at its end
+  virtual int read(extent_protocol::extentid_t id, size_t off, size_t len,
+                   rpc_slice &data) = 0;
+  // replaces the extent, or creates it
+  virtual int put(extent_protocol::extentid_t id,
+                  const extent_protocol::attr &a, const rpc_slice &data) = 0;
+  // overwrites the bytes from off on with data, then cuts the extent
+  // or pads it with zeros to a.size; creates it if need be.  costs in
+  // proportion to data, not to the extent.
+  virtual int write(extent_protocol::extentid_t id,
+                    const extent_protocol::attr &a, size_t off,
+                    const rpc_slice &data) = 0;
+  // moves atime forward to t, and need not survive a crash.  takes
+  // only shared access, so reads of an extent don't queue behind it.
+  virtual int touch(extent_protocol::extentid_t id, unsigned int t) = 0;
+  virtual int remove(extent_protocol::extentid_t id) = 0;
+  // the ids of all extents, in no order
+  virtual void ids(std::vector<extent_protocol::extentid_t> &v) = 0;
+
+  // batches of getattr and put; rets[i] is the result for ids[i].  a
+  // store may take each of its locks once for the whole batch.
+  virtual void getattrs(const std::vector<extent_protocol::extentid_t> &ids,
+                        std::vector<extent_protocol::attr> &as,
+                        std::vector<int> &rets);
+  virtual void puts(const std::vector<extent_protocol::extentid_t> &ids,
+                    const std::vector<extent_protocol::attr> &as,
+                    const std::vector<rpc_slice> &data,
+                    std::vector<int> &rets);
+
+  // whether extents with the same chunks share them
+  virtual bool dedups() { return false; }
+  // a byte per hash, 1 if the store has a chunk with that hash.  a
+  // store that doesn't deduplicate has none.
+  virtual void have(const std::vector<chunk_hash> &hashes,
+                    std::string &flags);
+  // replaces the extent with the chunks, or creates it.  NOENT if a
+  // chunk without data is not in the store.
+  virtual int put_chunks(extent_protocol::extentid_t id,
+                         const extent_protocol::attr &a,
+                         const std::vector<extent_chunk> &chunks);
+
+  // replaces dst with the contents of src, or creates it, with the
+  // attributes a but the size of src.  a store may share the bytes of
+  // the two until one of them changes; by default they are copied.
+  virtual int clone(extent_protocol::extentid_t src,
+                    extent_protocol::extentid_t dst,
+                    const extent_protocol::attr &a);
+
+  // whether updates only survive a crash once sync returns.  sync
+  // makes every update that has returned so far durable.
+  virtual bool needs_sync() { return false; }
+  virtual int sync() { return extent_protocol::OK; }
+
+  // appends a line of figures about the store to s, if it keeps any
+  virtual void stats(std::string &s) {}
+
+  struct options {
+    // extents are kept as chunks shared by all extents with the same
+    // bytes
+    bool dedup;
+    // and, for a store on disk, read through a cache of up to cache
+    // bytes of hot extents,
+    size_t cache;
+    // checked by a scrubber at scrub bytes a second, if not 0,
+    size_t scrub;
+    // and packed in the cache and on disk, where they shrink
+    bool pack;
+
+    options() : dedup(false), cache(0), scrub(0), pack(false) {}
+  };
+
+  // a store in memory if dir is empty, or else a log-structured one
+  // in the directory dir
+  static extent_store *open(const std::string &dir,
+                            const options &o = options());
+
+ protected:
+  // touch changes atime while others read the attributes, so atime is
+  // loaded and stored atomically, and the other fields copied apart
+  // from it
+  static void get_attr(const extent_protocol::attr &from,
+                       extent_protocol::attr &to) {
+    to.atime = __atomic_load_n(&from.atime, __ATOMIC_RELAXED);
+    to.mtime = from.mtime;
+    to.ctime = from.ctime;
+    to.size = from.size;
+    to.version = from.version;
+  }
+  static void touch_attr(extent_protocol::attr &a, unsigned int t) {
+    if (__atomic_load_n(&a.atime, __ATOMIC_RELAXED) < t) {
+      __atomic_store_n(&a.atime, t, __ATOMIC_RELAXED);
+    }
+  }
+};
+
+// everything in memory, lost on exit.  the extents are spread over
+// shards, each a hash table with its own reader/writer lock, so
+// reads only share locks and writes only contend within a shard.
+// most extents are directories and empty files of a few dozen bytes,
+// so those up to extent_slab::max bytes are copied into slots of a
+// slab shared by a few shards, and the table of a shard holds the
+// nodes themselves, each no more than the id, the attributes, the
+// length and the slot.
+class extent_mem_store : public extent_store {
+ private:
+  // the contents of an extent of more than extent_slab::max bytes
+  struct big {
+    rpc_slice buf; // shares the buffer of the put that stored it
+    // the contents once written in place; buf is unused then.  it is
+    // copied before a write if a read still holds a slice of it.
+    std::shared_ptr<std::string> own;
+  };
+
+  struct node {
+    extent_protocol::extentid_t id;
+    extent_protocol::attr attr;
+    unsigned int len;
+    bool used; // the table slot holds an extent
+    union {
+      char *small; // if len <= extent_slab::max; NULL if len is 0
+      big *b;
+    };
+    node() : id(0), len(0), used(false), small(NULL) {}
+  };
+
+  // the table is open-addressed with linear probing, a power of two
+  // slots at most three quarters full, so a scan reads one array
+  struct shard {
+    pthread_rwlock_t m;
+    std::vector<node> slots;
+    size_t count;
+    extent_slab *slab;
+
+    node *find(extent_protocol::extentid_t id);
+    // the node of id, added if need be.  moves the other nodes.
+    node &get(extent_protocol::extentid_t id);
+    void erase(node *n);
+    node &probe(extent_protocol::extentid_t id);
+  };
+
+  static const int nshards = 64;
+  shard shards_[nshards];
+  static const int nslabs = 8;
+  extent_slab slabs_[nslabs];
+
+  // by the top bits of a multiplicative hash, since ids are often
+  // sequential
+  static int shard_index(extent_protocol::extentid_t id) {
+    return (id * 0x9e3779b97f4a7c15ULL) >> 58;
+  }
+  shard &shard_of(extent_protocol::extentid_t id) {
+    return shards_[shard_index(id)];
+  }
+  // the indexes of ids, ordered by shard
+  static void by_shard(const std::vector<extent_protocol::extentid_t> &ids,
+                       std::vector<size_t> &order);
+  static bool is_small(const node &n) { return n.len <= extent_slab::max; }
+  static const char *bytes(const node &n);
+  // these assume the shard is held for writing
+  void clear(shard &sh, node &n);
+  void set(shard &sh, node &n, const rpc_slice &data);
+
+ public:
+  extent_mem_store();
+  ~extent_mem_store();
+
+  int getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
+  int read(extent_protocol::extentid_t id, size_t off, size_t len,
+           rpc_slice &data);
+  int put(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+          const rpc_slice &data);
+  int write(extent_protocol::extentid_t id, const extent_protocol::attr &a,
+            size_t off, const rpc_slice &data);
+  int touch(extent_protocol::extentid_t id, unsigned int t);
+  int remove(extent_protocol::extentid_t id);
+  void ids(std::vector<extent_protocol::extentid_t> &v);
+  void getattrs(const std::vector<extent_protocol::extentid_t> &ids,
+                std::vector<extent_protocol::attr> &as,
+                std::vector<int> &rets);
+  void puts(const std::vector<extent_protocol::extentid_t> &ids,
+            const std::vector<extent_protocol::attr> &as,
+            const std::vector<rpc_slice> &data, std::vector<int> &rets);
+  int clone(extent_protocol::extentid_t src, extent_protocol::extentid_t dst,
+            const extent_protocol::attr &a);
+};
+
+#endif
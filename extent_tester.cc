@@ -0,0 +1,1087 @@
+//
+// extent store tester
+//
+
+#include "extent_store.h"
+#include "extent_log_store.h"
+#include "extent_chunk.h"
+#include "extent_slab.h"
+#include "extent_crc.h"
+#include "extent_lz.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "rpc/slock.h"
+#include "lang/verify.h"
+
+typedef extent_protocol::extentid_t extentid_t;
+
+// where the stores on disk are made
+std::string base;
+
+void
+fail(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stdout, "error: ");
+  vfprintf(stdout, fmt, ap);
+  fprintf(stdout, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+void
+rm_tree(const std::string &path)
+{
+  DIR *d = opendir(path.c_str());
+  if (d == NULL) {
+    unlink(path.c_str());
+    return;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+      rm_tree(path + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+  rmdir(path.c_str());
+}
+
+// the segments of the log in dir, oldest first
+std::vector<std::string>
+segments(const std::string &dir)
+{
+  std::vector<std::string> v;
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) {
+    return v;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strncmp(e->d_name, "seg.", 4) == 0) {
+      v.push_back(dir + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(v.begin(), v.end());
+  return v;
+}
+
+off_t
+file_size(const std::string &path)
+{
+  struct stat st;
+  VERIFY(stat(path.c_str(), &st) == 0);
+  return st.st_size;
+}
+
+unsigned long long
+log_bytes(const std::string &dir)
+{
+  std::vector<std::string> v = segments(dir);
+  unsigned long long n = 0;
+  for (size_t i = 0; i < v.size(); i++) {
+    n += file_size(v[i]);
+  }
+  return n;
+}
+
+std::string
+hex(const unsigned char *p, size_t n)
+{
+  std::string s;
+  char buf[3];
+  for (size_t i = 0; i < n; i++) {
+    snprintf(buf, sizeof(buf), "%02x", p[i]);
+    s += buf;
+  }
+  return s;
+}
+
+// what the stores should hold
+struct model {
+  struct ext {
+    extent_protocol::attr a;
+    std::string data;
+  };
+  std::map<extentid_t, ext> exts;
+  unsigned long long seed; // of the random steps
+  unsigned int t;          // the time of the last update
+
+  model(unsigned long long s = 1) : seed(s), t(0) {}
+
+  unsigned long long next() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ULL;
+  }
+  size_t below(size_t n) { return n == 0 ? 0 : next() % n; }
+};
+
+static const char *words[] = {
+  "extent ", "server ", "block ", "chunk ", "recipe ", "segment ", "log ",
+  "clone ", "\n"
+};
+
+std::string
+random_bytes(model &m, size_t n)
+{
+  std::string s(n, '\0');
+  for (size_t i = 0; i < n; i++) {
+    s[i] = m.next() >> 24;
+  }
+  return s;
+}
+
+// n bytes that are random, text, zeros, or a run repeated, so that some
+// pack and some share chunks
+std::string
+some_bytes(model &m, size_t n)
+{
+  std::string s;
+  switch (m.below(4)) {
+  case 0:
+    s = random_bytes(m, n);
+    break;
+  case 1:
+    while (s.size() < n) {
+      s += words[m.below(sizeof(words) / sizeof(words[0]))];
+    }
+    break;
+  case 2:
+    s.assign(n, '\0');
+    break;
+  default:
+    std::string run = some_bytes(m, 5000);
+    while (s.size() < n) {
+      s += run;
+    }
+  }
+  s.resize(n);
+  return s;
+}
+
+// across the sizes where the stores change how they keep an extent:
+// slab classes, chunk_min and chunk_max, the blocks of the log
+size_t
+some_size(model &m)
+{
+  switch (m.below(8)) {
+  case 0:
+    return m.below(64);
+  case 1:
+  case 2:
+    return m.below(extent_slab::max + 100);
+  case 3:
+    return 0;
+  case 4:
+  case 5:
+    return m.below(40 * 1024);
+  case 6:
+    return m.below(150 * 1024);
+  default:
+    return m.below(400 * 1024);
+  }
+}
+
+extentid_t
+some_id(model &m)
+{
+  // some ids as yfs names the blocks of files
+  if (m.below(4) == 0) {
+    return ((extentid_t) (m.below(8) + 1) << 32) | (m.below(4) + 2);
+  }
+  return m.below(64) + 1;
+}
+
+void
+check_read(extent_store *s, extentid_t id, const std::string &want,
+           size_t off, size_t len)
+{
+  rpc_slice d;
+  int ret = s->read(id, off, len, d);
+  if (ret != extent_protocol::OK) {
+    fail("read of %llu from %lu returned %d", id, (unsigned long) off, ret);
+  }
+  size_t from = std::min(off, want.size());
+  if (d.str() != want.substr(from, len)) {
+    fail("read of %llu from %lu for %lu: wrong bytes", id,
+         (unsigned long) off, (unsigned long) len);
+  }
+}
+
+void
+check_attr(extent_store *s, extentid_t id, const extent_protocol::attr &want)
+{
+  extent_protocol::attr a;
+  if (s->getattr(id, a) != extent_protocol::OK) {
+    fail("getattr of %llu failed", id);
+  }
+  if (a.size != want.size || a.mtime != want.mtime ||
+      a.ctime != want.ctime) {
+    fail("attributes of %llu: size %u mtime %u, not %u and %u", id, a.size,
+         a.mtime, want.size, want.mtime);
+  }
+}
+
+// every extent of the model whole, and no others
+void
+check(extent_store *s, const model &m)
+{
+  for (auto it = m.exts.begin(); it != m.exts.end(); it++) {
+    check_attr(s, it->first, it->second.a);
+    check_read(s, it->first, it->second.data, 0, it->second.data.size() + 1);
+  }
+  std::vector<extentid_t> ids;
+  s->ids(ids);
+  std::sort(ids.begin(), ids.end());
+  if (ids.size() != m.exts.size()) {
+    fail("the store has %lu extents, not %lu", (unsigned long) ids.size(),
+         (unsigned long) m.exts.size());
+  }
+  size_t i = 0;
+  for (auto it = m.exts.begin(); it != m.exts.end(); it++, i++) {
+    if (ids[i] != it->first) {
+      fail("the store has %llu, not %llu", ids[i], it->first);
+    }
+  }
+}
+
+void
+expect(int ret, const char *what, extentid_t id)
+{
+  if (ret != extent_protocol::OK) {
+    fail("%s of %llu returned %d", what, id, ret);
+  }
+}
+
+// one random update or read, on s and on the model.  with s NULL, only
+// the model takes it, as a store that did before a crash.
+void
+step(extent_store *s, model &m)
+{
+  extentid_t id = some_id(m);
+  auto it = m.exts.find(id);
+  bool here = it != m.exts.end();
+  size_t op = m.below(100);
+  unsigned int t = ++m.t;
+  extent_protocol::attr a = extent_protocol::attr();
+  a.atime = a.mtime = a.ctime = t;
+
+  if (op < 20) {
+    std::string d = some_bytes(m, some_size(m));
+    a.size = d.size();
+    if (s) {
+      expect(s->put(id, a, rpc_slice(d)), "put", id);
+    }
+    m.exts[id].a = a;
+    m.exts[id].data = d;
+  } else if (op < 25) {
+    // a batch of distinct ids
+    std::vector<extentid_t> ids;
+    std::vector<extent_protocol::attr> as;
+    std::vector<rpc_slice> data;
+    for (size_t n = m.below(4) + 1; n > 0; n--) {
+      extentid_t b = some_id(m);
+      std::string d = some_bytes(m, some_size(m) / 4);
+      if (std::find(ids.begin(), ids.end(), b) != ids.end()) {
+        continue;
+      }
+      a.size = d.size();
+      ids.push_back(b);
+      as.push_back(a);
+      data.push_back(rpc_slice(d));
+      m.exts[b].a = a;
+      m.exts[b].data = d;
+    }
+    if (s) {
+      std::vector<int> rets;
+      s->puts(ids, as, data, rets);
+      for (size_t i = 0; i < ids.size(); i++) {
+        expect(rets[i], "puts", ids[i]);
+      }
+    }
+  } else if (op < 30) {
+    // with the chunks the store has left out, as extent_client sends
+    // them
+    std::string d = some_bytes(m, some_size(m));
+    a.size = d.size();
+    if (s) {
+      std::vector<extent_chunk> chunks;
+      chunk_extent(rpc_slice(d), chunks);
+      std::vector<chunk_hash> hashes;
+      for (size_t i = 0; i < chunks.size(); i++) {
+        hashes.push_back(chunks[i].hash);
+      }
+      std::string flags;
+      s->have(hashes, flags);
+      for (size_t i = 0; i < chunks.size(); i++) {
+        if (flags[i]) {
+          chunks[i].data = rpc_slice();
+        }
+      }
+      expect(s->put_chunks(id, a, chunks), "put_chunks", id);
+    }
+    m.exts[id].a = a;
+    m.exts[id].data = d;
+  } else if (op < 50) {
+    // a write, which may cut or pad the extent, or only cut it as
+    // truncate does
+    std::string cur = here ? it->second.data : "";
+    size_t off = m.below(cur.size() + 100);
+    std::string d = some_bytes(m, m.below(4) ? m.below(300) :
+                               m.below(70 * 1024));
+    if (m.below(5) == 0) {
+      off = m.below(cur.size() + 1);
+      d.clear();
+    }
+    cur.resize(std::max(cur.size(), off + d.size()), '\0');
+    cur.replace(off, d.size(), d);
+    size_t size = cur.size();
+    switch (m.below(4)) {
+    case 0:
+      size = m.below(size + 1);
+      break;
+    case 1:
+      size += m.below(5000);
+    }
+    if (d.empty()) {
+      size = off;
+    }
+    cur.resize(size, '\0');
+    a.size = size;
+    if (s) {
+      expect(s->write(id, a, off, rpc_slice(d)), "write", id);
+    }
+    m.exts[id].a = a;
+    m.exts[id].data = cur;
+  } else if (op < 55) {
+    extentid_t dst = some_id(m);
+    if (!here) {
+      if (s && s->clone(id, dst, a) != extent_protocol::NOENT) {
+        fail("clone of %llu, which is not there, did not fail", id);
+      }
+      return;
+    }
+    if (s) {
+      expect(s->clone(id, dst, a), "clone", id);
+    }
+    model::ext e = it->second;
+    e.a = a;
+    e.a.size = e.data.size();
+    m.exts[dst] = e;
+  } else if (op < 60) {
+    int ret = s ? s->remove(id) : 0;
+    if (s && ret != (here ? extent_protocol::OK : extent_protocol::NOENT)) {
+      fail("remove of %llu returned %d", id, ret);
+    }
+    m.exts.erase(id);
+  } else if (op < 63) {
+    if (s && here) {
+      expect(s->touch(id, t + 1000), "touch", id);
+      extent_protocol::attr ta;
+      expect(s->getattr(id, ta), "getattr", id);
+      if (ta.atime < t + 1000) {
+        fail("touch of %llu did not move atime", id);
+      }
+    }
+  } else {
+    size_t off = here ? m.below(it->second.data.size() + 10) : 0;
+    size_t len = m.below(3) == 0 ? m.below(100) : m.below(200 * 1024);
+    if (!s) {
+      return;
+    }
+    if (!here) {
+      rpc_slice d;
+      if (s->read(id, 0, 10, d) != extent_protocol::NOENT) {
+        fail("read of %llu, which is not there, did not fail", id);
+      }
+      return;
+    }
+    check_attr(s, id, it->second.a);
+    check_read(s, id, it->second.data, off, len);
+  }
+}
+
+void
+steps(extent_store *s, model &m, int n)
+{
+  for (int i = 0; i < n; i++) {
+    step(s, m);
+  }
+}
+
+// runs f in a child, which ends with _exit as in a crash
+void
+in_child(std::function<void()> f)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  VERIFY(pid >= 0);
+  if (pid == 0) {
+    f();
+    _exit(0);
+  }
+  int status;
+  VERIFY(waitpid(pid, &status, 0) == pid);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fail("child failed");
+  }
+}
+
+// takes n random steps on the store in dir, then syncs and crashes;
+// the model takes the same steps
+void
+crash_after(const std::string &dir, const extent_store::options &o,
+            model &m, int n)
+{
+  in_child([&]() {
+    extent_store *s = extent_store::open(dir, o);
+    steps(s, m, n);
+    expect(s->sync(), "sync", 0);
+  });
+  steps(NULL, m, n);
+}
+
+void
+flip(const std::string &path, off_t at)
+{
+  int fd = open(path.c_str(), O_RDWR);
+  VERIFY(fd >= 0);
+  char c;
+  VERIFY(pread(fd, &c, 1, at) == 1);
+  c ^= 0x10;
+  VERIFY(pwrite(fd, &c, 1, at) == 1);
+  close(fd);
+}
+
+void
+test_slab()
+{
+  printf("slab classes\n");
+  extent_slab slab;
+  std::vector<char *> p(extent_slab::max + 1);
+  for (size_t n = 1; n <= extent_slab::max; n++) {
+    p[n] = slab.alloc(n);
+    if (p[n] == NULL) {
+      fail("slab alloc of %lu", (unsigned long) n);
+    }
+    memset(p[n], n & 0xff, n);
+  }
+  // no two slots overlap
+  for (size_t n = 1; n <= extent_slab::max; n++) {
+    for (size_t i = 0; i < n; i++) {
+      if ((unsigned char) p[n][i] != (n & 0xff)) {
+        fail("slab slot of %lu bytes overlaps another", (unsigned long) n);
+      }
+    }
+  }
+  // the freed slots are handed out again to allocs of the same sizes
+  std::set<char *> freed(p.begin() + 1, p.end());
+  for (size_t n = 1; n <= extent_slab::max; n++) {
+    slab.free(p[n], n);
+  }
+  for (size_t n = extent_slab::max; n >= 1; n--) {
+    char *q = slab.alloc(n);
+    if (freed.erase(q) != 1) {
+      fail("slab alloc of %lu after free took a new slot",
+           (unsigned long) n);
+    }
+  }
+}
+
+// random steps against the model, reopening a store on disk every
+// 1000
+void
+test_random(const char *name, bool disk, const extent_store::options &o)
+{
+  printf("random operations on the %s store\n", name);
+  std::string dir = disk ? base + "/" + name : "";
+  model m(0x9e3779b97f4a7c15ULL + strlen(name));
+  extent_store *s = extent_store::open(dir, o);
+  for (int i = 0; i < 4; i++) {
+    steps(s, m, 1000);
+    check(s, m);
+    if (disk) {
+      delete s;
+      s = extent_store::open(dir, o);
+      check(s, m);
+    }
+  }
+  if (o.scrub > 0) {
+    std::string st;
+    s->stats(st);
+    if (st.find(" 0 bad reads, 0 bad records") == std::string::npos) {
+      fail("the scrubber found bad bytes: %s", st.c_str());
+    }
+  }
+  delete s;
+}
+
+extent_store::options
+opts(bool dedup, size_t cache, bool pack, size_t scrub = 0)
+{
+  extent_store::options o;
+  o.dedup = dedup;
+  o.cache = cache;
+  o.pack = pack;
+  o.scrub = scrub;
+  return o;
+}
+
+// replay of the log after a crash, a torn record at its end, a bad
+// checkpoint, and the cleaner
+void
+test_log()
+{
+  printf("log replay after a crash\n");
+  std::string dir = base + "/crash";
+  extent_store::options o;
+  model m(11);
+  crash_after(dir, o, m, 1500);
+  extent_store *s = extent_store::open(dir, o);
+  check(s, m);
+  steps(s, m, 500);
+  delete s;
+
+  printf("torn record at the end of the log\n");
+  std::string seg = segments(dir).back();
+  off_t size = file_size(seg);
+  in_child([&]() {
+    extent_store *c = extent_store::open(dir, o);
+    std::string d(100000, 'x');
+    extent_protocol::attr a = { 1, 1, 1, (unsigned int) d.size(), 0 };
+    expect(c->put(1000, a, rpc_slice(d)), "put", 1000);
+    expect(c->sync(), "sync", 0);
+  });
+  VERIFY(truncate(seg.c_str(), file_size(seg) - 1) == 0);
+  s = extent_store::open(dir, o);
+  check(s, m);
+  if (file_size(seg) != size) {
+    fail("the torn record was not cut off");
+  }
+  steps(s, m, 200);
+  delete s;
+  // junk after the last record
+  int fd = open(seg.c_str(), O_WRONLY | O_APPEND);
+  VERIFY(fd >= 0 && write(fd, "junk", 4) == 4);
+  close(fd);
+  s = extent_store::open(dir, o);
+  check(s, m);
+  steps(s, m, 200);
+  delete s;
+  s = extent_store::open(dir, o);
+  check(s, m);
+  delete s;
+
+  printf("bad checkpoint\n");
+  flip(dir + "/index", file_size(dir + "/index") / 2);
+  s = extent_store::open(dir, o);
+  check(s, m);
+  delete s;
+
+  printf("the cleaner\n");
+  dir = base + "/clean";
+  s = extent_store::open(dir, o);
+  // overwrites, until more than a segment is dead
+  std::vector<std::string> data(16);
+  extent_protocol::attr a = { 1, 1, 1, 256 << 10, 0 };
+  for (unsigned long long n = 0;
+       n < extent_log_store::seg_max + (8 << 20); n += a.size) {
+    extentid_t id = m.below(data.size());
+    data[id] = random_bytes(m, a.size);
+    expect(s->put(id + 1, a, rpc_slice(data[id])), "put", id + 1);
+  }
+  for (int i = 0; segments(dir).size() > 1; i++) {
+    if (i == 200) {
+      fail("the cleaner left %lu segments",
+           (unsigned long) segments(dir).size());
+    }
+    usleep(100000);
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    if (!data[i].empty()) {
+      check_read(s, i + 1, data[i], 0, a.size);
+    }
+  }
+  delete s;
+  s = extent_store::open(dir, o);
+  for (size_t i = 0; i < data.size(); i++) {
+    if (!data[i].empty()) {
+      check_read(s, i + 1, data[i], 0, a.size);
+    }
+  }
+  delete s;
+}
+
+void
+test_crc()
+{
+  printf("CRC32C\n");
+  struct {
+    std::string in;
+    uint32_t crc;
+  } crcs[] = {
+    { "", 0 },
+    { "123456789", 0xe3069283 },
+    { std::string(32, '\0'), 0x8a9136aa },
+    { std::string(32, '\xff'), 0x62a8ab43 },
+  };
+  for (size_t i = 0; i < sizeof(crcs) / sizeof(crcs[0]); i++) {
+    if (crc32c(crcs[i].in.data(), crcs[i].in.size()) != crcs[i].crc) {
+      fail("CRC32C of vector %lu", (unsigned long) i);
+    }
+  }
+  unsigned char up[32], down[32];
+  for (int i = 0; i < 32; i++) {
+    up[i] = i;
+    down[i] = 31 - i;
+  }
+  if (crc32c(up, 32) != 0x46dd794e || crc32c(down, 32) != 0x113fdb5c) {
+    fail("CRC32C of the ascending or descending bytes");
+  }
+  // continued from any split, at any alignment
+  model m(7);
+  std::string b = random_bytes(m, 1100);
+  for (size_t at = 0; at < 8; at++) {
+    uint32_t whole = crc32c(b.data() + at, 1000);
+    for (size_t cut = 0; cut <= 1000; cut += (cut < 80 ? 1 : 61)) {
+      uint32_t c = crc32c(b.data() + at, cut);
+      if (crc32c(b.data() + at + cut, 1000 - cut, c) != whole) {
+        fail("CRC32C continued at %lu, from %lu", (unsigned long) cut,
+             (unsigned long) at);
+      }
+    }
+  }
+}
+
+void
+test_lz()
+{
+  model m(7);
+  printf("LZ round trips\n");
+  size_t sizes[] = { 31, 32, 33, 100, 1000, 4096, 16384, 16385, 65535,
+                     65536, 65537, 200000, 1 << 20 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (int kind = 0; kind < 8; kind++) {
+      std::string in = some_bytes(m, sizes[i]);
+      if (kind == 0) {
+        // matches farther back than a match can reach
+        std::string run = some_bytes(m, 70000);
+        in = run + in + run;
+      }
+      std::string z;
+      if (!lz_pack(in.data(), in.size(), z)) {
+        if (in.size() >= 32 && in == std::string(in.size(), '\0')) {
+          fail("zeros of %lu bytes did not pack", (unsigned long) in.size());
+        }
+        continue;
+      }
+      if (in.size() < 32 || z.size() > in.size() - in.size() / 8) {
+        fail("packed %lu bytes into %lu", (unsigned long) in.size(),
+             (unsigned long) z.size());
+      }
+      size_t len = 0;
+      std::string out(in.size(), '\0');
+      if (!lz_size(z.data(), z.size(), &len) || len != in.size() ||
+          !lz_unpack(z.data(), z.size(), &out[0], in.size()) || out != in) {
+        fail("round trip of %lu bytes", (unsigned long) in.size());
+      }
+      size_t half = in.size() / 2;
+      std::string part(half, '\0');
+      if (!lz_unpack(z.data(), z.size(), &part[0], half) ||
+          part != in.substr(0, half)) {
+        fail("the first %lu of %lu bytes", (unsigned long) half,
+             (unsigned long) in.size());
+      }
+      if (lz_unpack(z.data(), z.size() - 1, &out[0], in.size()) ||
+          lz_unpack(z.data(), z.size(), &out[0], in.size() + 1)) {
+        fail("unpacked %lu bytes cut short", (unsigned long) in.size());
+      }
+    }
+  }
+}
+
+void
+test_chunks()
+{
+  printf("SHA-256\n");
+  struct {
+    std::string in;
+    const char *hash;
+  } shas[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc",
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    // the lengths where the padding spills into another block
+    { std::string(55, 'a'),
+      "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318" },
+    { std::string(56, 'a'),
+      "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a" },
+    { std::string(64, 'a'),
+      "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb" },
+    { std::string(1000000, 'a'),
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+  };
+  for (size_t i = 0; i < sizeof(shas) / sizeof(shas[0]); i++) {
+    chunk_hash h = chunk_hash_of(shas[i].in.data(), shas[i].in.size());
+    if (hex(h.h, sizeof(h.h)) != shas[i].hash) {
+      fail("SHA-256 of vector %lu", (unsigned long) i);
+    }
+  }
+
+  printf("chunks\n");
+  model m(7);
+  std::string d = random_bytes(m, 1 << 20);
+  std::vector<size_t> lens;
+  chunk_split(d.data(), d.size(), lens);
+  size_t total = 0;
+  for (size_t i = 0; i < lens.size(); i++) {
+    if (lens[i] > chunk_max || (lens[i] < chunk_min && i + 1 < lens.size())) {
+      fail("a chunk of %lu bytes", (unsigned long) lens[i]);
+    }
+    total += lens[i];
+  }
+  if (total != d.size()) {
+    fail("the chunks add up to %lu bytes", (unsigned long) total);
+  }
+  // an insert only changes the chunks around it
+  std::string d2 = d;
+  d2.insert(d.size() / 2, "inserted");
+  std::vector<extent_chunk> c1, c2;
+  chunk_extent(rpc_slice(d), c1);
+  chunk_extent(rpc_slice(d2), c2);
+  size_t same = 0;
+  for (size_t i = 0; i < c2.size(); i++) {
+    for (size_t j = 0; j < c1.size(); j++) {
+      same += c1[j].hash == c2[i].hash;
+    }
+  }
+  if (same + 3 < c1.size()) {
+    fail("an insert changed %lu of %lu chunks",
+         (unsigned long) (c1.size() - same), (unsigned long) c1.size());
+  }
+}
+
+// whether the store has all the chunks of d, or none
+int
+has_chunks(extent_store *s, const std::string &d)
+{
+  std::vector<extent_chunk> chunks;
+  chunk_extent(rpc_slice(d), chunks);
+  std::vector<chunk_hash> hashes;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    hashes.push_back(chunks[i].hash);
+  }
+  std::string flags;
+  s->have(hashes, flags);
+  size_t n = std::count(flags.begin(), flags.end(), 1);
+  return n == hashes.size() ? 1 : n == 0 ? 0 : -1;
+}
+
+void
+test_clone(const char *name, const extent_store::options &o)
+{
+  printf("clones share bytes in the %s store\n", name);
+  std::string dir = base + "/clone-" + name;
+  extent_store *s = extent_store::open(dir, o);
+  model m(13);
+  std::string d = random_bytes(m, 1 << 20);
+  extent_protocol::attr a = { 1, 1, 1, (unsigned int) d.size(), 0 };
+  expect(s->put(1, a, rpc_slice(d)), "put", 1);
+  expect(s->sync(), "sync", 0);
+  unsigned long long before = log_bytes(dir) + log_bytes(dir + "/chunks");
+  extent_protocol::attr b = { 2, 2, 2, 0, 0 };
+  expect(s->clone(1, 2, b), "clone", 1);
+  expect(s->clone(1, 3, b), "clone", 1);
+  expect(s->sync(), "sync", 0);
+  unsigned long long grew =
+    log_bytes(dir) + log_bytes(dir + "/chunks") - before;
+  if (grew > 16384) {
+    fail("two clones of %lu bytes took %llu", (unsigned long) d.size(),
+         grew);
+  }
+  std::string d2 = d;
+  d2.replace(500000, 5, "clone");
+  b.size = d.size();
+  expect(s->write(2, b, 500000, rpc_slice(std::string("clone"))), "write",
+         2);
+  check_read(s, 1, d, 0, d.size());
+  check_read(s, 2, d2, 0, d.size());
+  check_read(s, 3, d, 0, d.size());
+  expect(s->remove(1), "remove", 1);
+  delete s;
+  s = extent_store::open(dir, o);
+  check_read(s, 2, d2, 0, d.size());
+  check_read(s, 3, d, 0, d.size());
+  delete s;
+}
+
+void
+test_dedup()
+{
+  printf("dedup refcounts\n");
+  std::string dir = base + "/dedup";
+  extent_store::options o = opts(true, 0, false);
+  extent_store *s = extent_store::open(dir, o);
+  model m(17);
+  std::string d = random_bytes(m, 300000);
+  extent_protocol::attr a = { 1, 1, 1, (unsigned int) d.size(), 0 };
+  for (extentid_t id = 1; id <= 10; id++) {
+    expect(s->put(id, a, rpc_slice(d)), "put", id);
+  }
+  if (log_bytes(dir + "/chunks") > 2 * d.size()) {
+    fail("ten puts of the same bytes took %llu bytes of chunks",
+         log_bytes(dir + "/chunks"));
+  }
+  for (extentid_t id = 1; id <= 9; id++) {
+    expect(s->remove(id), "remove", id);
+  }
+  if (has_chunks(s, d) != 1) {
+    fail("the chunks of the last extent that has them are gone");
+  }
+  check_read(s, 10, d, 0, d.size());
+  delete s;
+  // the counts are rebuilt from the recipes
+  s = extent_store::open(dir, o);
+  if (has_chunks(s, d) != 1) {
+    fail("the chunks are gone after a reopen");
+  }
+  expect(s->remove(10), "remove", 10);
+  if (has_chunks(s, d) != 0) {
+    fail("the chunks outlived the extents that had them");
+  }
+  delete s;
+
+  printf("dedup recovery\n");
+  m.exts.clear();
+  crash_after(dir, o, m, 800);
+  std::string lost = random_bytes(m, 200000);
+  for (int lose_chunks = 1; lose_chunks >= 0; lose_chunks--) {
+    std::string seg = segments(lose_chunks ? dir + "/chunks" : dir).back();
+    off_t size = file_size(seg);
+    in_child([&]() {
+      extent_store *c = extent_store::open(dir, o);
+      extent_protocol::attr la = { 1, 1, 1, (unsigned int) lost.size(), 0 };
+      expect(c->put(1000, la, rpc_slice(lost)), "put", 1000);
+      expect(c->sync(), "sync", 0);
+    });
+    // one of the stores lost the put, and the other kept it
+    VERIFY(truncate(seg.c_str(), size) == 0);
+    s = extent_store::open(dir, o);
+    check(s, m);
+    if (has_chunks(s, lost) != 0) {
+      fail("chunks of a lost recipe are still there");
+    }
+    steps(s, m, 200);
+    delete s;
+  }
+}
+
+struct shared {
+  extent_store *s;
+  pthread_mutex_t m[32];
+  unsigned int version[32];
+  bool stop;
+};
+
+std::string
+contents(extentid_t id, unsigned int v)
+{
+  char head[32];
+  snprintf(head, sizeof(head), "%llu:%u:", id, v);
+  std::string d = head;
+  d.resize((id * 7919 + v * 104729) % 150000 + 16, (char) ('a' + v % 26));
+  return d;
+}
+
+void *
+updater(void *x)
+{
+  shared *sh = (shared *) x;
+  model m((unsigned long long) pthread_self());
+  for (int i = 0; i < 3000; i++) {
+    extentid_t id = m.below(32);
+    ScopedLock l(&sh->m[id]);
+    std::string d = contents(id, ++sh->version[id]);
+    extent_protocol::attr a = { 1, 1, 1, (unsigned int) d.size(), 0 };
+    if (m.below(2)) {
+      expect(sh->s->put(id, a, rpc_slice(d)), "put", id);
+    } else {
+      expect(sh->s->write(id, a, 0, rpc_slice(d)), "write", id);
+    }
+  }
+  return 0;
+}
+
+void *
+reader(void *x)
+{
+  shared *sh = (shared *) x;
+  model m((unsigned long long) pthread_self() + 1);
+  unsigned int seen[32];
+  memset(seen, 0, sizeof(seen));
+  while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+    extentid_t id = m.below(32);
+    rpc_slice d;
+    if (sh->s->read(id, 0, 1 << 20, d) != extent_protocol::OK) {
+      continue;
+    }
+    unsigned long long rid;
+    unsigned int v;
+    if (sscanf(d.str().c_str(), "%llu:%u:", &rid, &v) != 2 || rid != id ||
+        d.str() != contents(id, v)) {
+      fail("read of %llu returned torn bytes", id);
+    }
+    if (v < seen[id]) {
+      fail("read of %llu went back from version %u to %u", id, seen[id], v);
+    }
+    seen[id] = v;
+  }
+  return 0;
+}
+
+// the cache never hands out bytes an update replaced, from reads that
+// race with updates or from reading ahead
+void
+test_cache(const char *name, const extent_store::options &o)
+{
+  printf("cache coherence of the %s store\n", name);
+  std::string dir = base + "/cache-" + name;
+  shared sh;
+  sh.s = extent_store::open(dir, o);
+  for (int i = 0; i < 32; i++) {
+    VERIFY(pthread_mutex_init(&sh.m[i], NULL) == 0);
+    sh.version[i] = 0;
+  }
+  sh.stop = false;
+  pthread_t up[4], rd[4];
+  for (int i = 0; i < 4; i++) {
+    VERIFY(pthread_create(&up[i], NULL, updater, &sh) == 0);
+    VERIFY(pthread_create(&rd[i], NULL, reader, &sh) == 0);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(up[i], NULL);
+  }
+  __atomic_store_n(&sh.stop, true, __ATOMIC_RELAXED);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(rd[i], NULL);
+  }
+  for (extentid_t id = 0; id < 32; id++) {
+    if (sh.version[id] > 0) {
+      std::string d = contents(id, sh.version[id]);
+      check_read(sh.s, id, d, 0, d.size());
+    }
+  }
+
+  // the blocks of a file, read in order so the cache reads ahead,
+  // while some ahead of the reads change
+  model m(19);
+  std::vector<std::string> blocks(64);
+  for (size_t k = 0; k < blocks.size(); k++) {
+    blocks[k] = some_bytes(m, 8192);
+    extent_protocol::attr a = { 1, 1, 1, 8192, 0 };
+    extentid_t id = ((extentid_t) (k + 1) << 32) | 77;
+    expect(sh.s->put(id, a, rpc_slice(blocks[k])), "put", id);
+  }
+  delete sh.s;
+  sh.s = extent_store::open(dir, o);
+  for (size_t k = 0; k < blocks.size(); k++) {
+    extentid_t id = ((extentid_t) (k + 1) << 32) | 77;
+    check_read(sh.s, id, blocks[k], 0, 8192);
+    if (k + 2 < blocks.size()) {
+      extentid_t next = ((extentid_t) (k + 3) << 32) | 77;
+      blocks[k + 2] = some_bytes(m, 8192);
+      extent_protocol::attr a = { 2, 2, 2, 8192, 0 };
+      if (m.below(2)) {
+        expect(sh.s->put(next, a, rpc_slice(blocks[k + 2])), "put", next);
+      } else {
+        expect(sh.s->write(next, a, 0, rpc_slice(blocks[k + 2])), "write",
+               next);
+      }
+    }
+  }
+  delete sh.s;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int test = 0;
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 1) {
+    // the tests of the stores on disk are made in a directory argv[2],
+    // or in one of their own
+    test = atoi(argv[1]);
+    if (test < 1 || test > 8) {
+      printf("Test number must be between 1 and 8\n");
+      exit(1);
+    }
+  }
+  char tmp[] = "/tmp/extent_tester.XXXXXX";
+  if (argc > 2) {
+    base = argv[2];
+    rm_tree(base);
+    VERIFY(mkdir(base.c_str(), 0755) == 0);
+  } else {
+    VERIFY(mkdtemp(tmp) != NULL);
+    base = tmp;
+  }
+
+  if (!test || test == 1) {
+    test_random("mem", false, opts(false, 0, false));
+    test_random("mem-dedup", false, opts(true, 0, false));
+    test_random("log", true, opts(false, 0, false));
+    test_random("log-pack-scrub", true, opts(false, 0, true, 64 << 20));
+    test_random("log-dedup", true, opts(true, 0, false));
+    test_random("log-cache", true, opts(false, 1 << 20, false));
+    test_random("log-cache-pack-dedup", true, opts(true, 1 << 20, true));
+  }
+  if (!test || test == 2) {
+    test_log();
+  }
+  if (!test || test == 3) {
+    test_chunks();
+    test_dedup();
+  }
+  if (!test || test == 4) {
+    test_slab();
+  }
+  if (!test || test == 5) {
+    test_clone("log", opts(false, 0, false));
+    test_clone("dedup", opts(true, 0, false));
+  }
+  if (!test || test == 6) {
+    test_cache("log", opts(false, 1 << 20, false));
+    test_cache("pack-dedup", opts(true, 1 << 20, true));
+  }
+  if (!test || test == 7) {
+    test_crc();
+  }
+  if (!test || test == 8) {
+    test_lz();
+  }
+
+  rm_tree(base);
+  printf("%s: passed all tests successfully\n", argv[0]);
+}
@@ -15,8 +15,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <set>
 #include "lang/verify.h"
 #include "yfs_client.h"
+#include "utils/utils.h"
 
 int myid;
 yfs_client *yfs;
@@ -520,6 +522,103 @@ fuseserver_statfs(fuse_req_t req)
   fuse_reply_statfs(req, &buf);
 }
 
+// the inum of path, taken from the root of the file system
+yfs_client::status
+resolve(const char *path, size_t len, yfs_client::inum *inum)
+{
+  std::vector<std::string> names;
+  split(std::string(path, len), names, '/');
+  *inum = 1;
+  for (size_t i = 0; i < names.size(); i++) {
+    if (names[i].empty()) {
+      continue;
+    }
+    if (!yfs->isdir(*inum)) {
+      return yfs_client::NOENT;
+    }
+    yfs_client::status ret = yfs->lookup(*inum, names[i], inum);
+    if (ret != yfs_client::OK) {
+      return ret;
+    }
+  }
+  return yfs_client::OK;
+}
+
+// fills directory dst with clones of the files in src, and with new
+// directories filled the same way for those in src.  made holds the
+// directories made so far, so that a snapshot into src itself stops.
+yfs_client::status
+snapshot(yfs_client::inum src, yfs_client::inum dst,
+         std::set<yfs_client::inum> &made)
+{
+  std::vector<yfs_client::dirent> ents;
+  yfs_client::status ret = yfs->readdir(src, ents);
+  if (ret != yfs_client::OK) {
+    return ret;
+  }
+  made.insert(dst);
+  for (size_t i = 0; i < ents.size(); i++) {
+    if (made.count(ents[i].inum)) {
+      continue;
+    }
+    bool file = yfs->isfile(ents[i].inum);
+    yfs_client::inum inum = file ? pick_new_file_inum() : pick_new_dir_inum();
+    if ((ret = yfs->create(inum, ents[i].name, dst)) != yfs_client::OK) {
+      return ret;
+    }
+    ret = file ? yfs->clone(ents[i].inum, inum)
+               : snapshot(ents[i].inum, inum, made);
+    if (ret != yfs_client::OK) {
+      return ret;
+    }
+  }
+  return yfs_client::OK;
+}
+
+//
+// Setting the attribute user.yfs.clone of a file to the path of
+// another file, from the root of the file system, makes the file a
+// copy of the other one; the extent servers copy the bytes, and they
+// don't go through this client.  On a directory, the attribute is
+// the path of another directory, and the files and directories in it
+// are copied into this one.
+//
+//   setfattr -n user.yfs.clone -v /a/src dst
+//
+#ifdef __APPLE__
+void
+fuseserver_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                    const char *value, size_t size, int flags,
+                    uint32_t position)
+#else
+void
+fuseserver_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                    const char *value, size_t size, int flags)
+#endif
+{
+  if (strcmp(name, "user.yfs.clone") != 0) {
+    fuse_reply_err(req, ENOTSUP);
+    return;
+  }
+  yfs_client::inum dst = ino, src;
+  yfs_client::status ret = resolve(value, size, &src);
+  if (ret == yfs_client::OK && yfs->isfile(src) != yfs->isfile(dst)) {
+    fuse_reply_err(req, yfs->isfile(dst) ? EISDIR : ENOTDIR);
+    return;
+  }
+  if (ret == yfs_client::OK) {
+    std::set<yfs_client::inum> made;
+    ret = yfs->isfile(dst) ? yfs->clone(src, dst) : snapshot(src, dst, made);
+  }
+  if (ret == yfs_client::NOENT) {
+    fuse_reply_err(req, ENOENT);
+  } else if (ret == yfs_client::EXIST) {
+    fuse_reply_err(req, EEXIST);
+  } else {
+    fuse_reply_err(req, ret == yfs_client::OK ? 0 : EIO);
+  }
+}
+
 struct fuse_lowlevel_ops fuseserver_oper;
 
 int
@@ -532,7 +631,7 @@ main(int argc, char *argv[])
   setvbuf(stdout, NULL, _IONBF, 0);
 
   if(argc != 4){
-    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
+    fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server[,port-extent-server...]> <port-lock-server>\n");
     exit(1);
   }
   mountpoint = argv[1];
@@ -555,6 +654,7 @@ main(int argc, char *argv[])
   fuseserver_oper.setattr    = fuseserver_setattr;
   fuseserver_oper.unlink     = fuseserver_unlink;
   fuseserver_oper.mkdir      = fuseserver_mkdir;
+  fuseserver_oper.setxattr   = fuseserver_setxattr;
 
   const char *fuse_argv[20];
   int fuse_argc = 0;
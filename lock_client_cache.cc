@@ -15,14 +15,15 @@ lock_client_cache::lock_client_cache(std::string xdst,
   : lock_client(xdst), lu(_lu), _lock_map(), _cond(), _acq_cond(),
     _emp_cond(), _wait_set()
 {
-  rpcs *rlsrpc = new rpcs(0);
+  // the server calls revoke and retry back over cl's own connection,
+  // and knows this client by cl's nonce.
+  rpcs *rlsrpc = new rpcs(0, 0, false);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
+  cl->set_callbacks(rlsrpc);
 
-  const char *hname;
-  hname = "127.0.0.1";
   std::ostringstream host;
-  host << hname << ":" << rlsrpc->port();
+  host << cl->id();
   id = host.str();
   VERIFY(pthread_mutex_init(&_m, NULL) == 0);
 }
@@ -18,23 +18,22 @@ releasethread(void *x)
   return 0;
 }
 
-int lock_client_cache_rsm::last_port = 0;
-
 lock_client_cache_rsm::lock_client_cache_rsm(std::string xdst,
 				     class lock_release_user *_lu)
   : lock_client(xdst), lu(_lu),
     _stat(), _lc(), _ac(), _ec(), _ws()
 {
-  srand(time(NULL)^last_port);
-  rlock_port = ((rand()%32000) | (0x1 << 10));
+  // the replicated lock server can't call back over our connection:
+  // a new primary after a fail-over has never seen it.  let the OS
+  // pick a free port for our callback server instead of guessing one.
+  rpcs *rlsrpc = new rpcs(0);
+  rlock_port = rlsrpc->port();
   const char *hname;
   // VERIFY(gethostname(hname, 100) == 0);
   hname = "127.0.0.1";
   std::ostringstream host;
   host << hname << ":" << rlock_port;
   id = host.str();
-  last_port = rlock_port;
-  rpcs *rlsrpc = new rpcs(rlock_port);
   rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache_rsm::revoke_handler);
   rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache_rsm::retry_handler);
   xid = 0;
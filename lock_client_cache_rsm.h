@@ -58,7 +58,6 @@ class lock_client_cache_rsm : public lock_client {
   void _wait(lock_protocol::lockid_t, pthread_t);
 
  public:
-  static int last_port;
   lock_client_cache_rsm(std::string xdst, class lock_release_user *l = 0);
   virtual ~lock_client_cache_rsm() {};
   lock_protocol::status acquire(lock_protocol::lockid_t);
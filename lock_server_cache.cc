@@ -3,127 +3,218 @@
 #include "lock_server_cache.h"
 #include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "lang/verify.h"
-#include "handle.h"
 #include "tprintf.h"
 #include "rpc/slock.h"
 
-lock_server_cache::lock_server_cache()
-  : nacquire(0), _owners(), _wait_queue(), _wait_set(), _rev_cond()
+static void *
+revokethread(void *x)
 {
-  VERIFY(pthread_mutex_init(&_m, NULL) == 0);
+  lock_server_cache *sc = (lock_server_cache *) x;
+  sc->revoker();
+  return 0;
 }
 
-
-int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id,
-                               int & r)
+static void *
+retrythread(void *x)
 {
-  lock_protocol::status ret = lock_protocol::OK;
-  std::string holder;
-  {
-    ScopedLock l(&_m);
-    if (_rev_cond.count(lid) == 0) {
-      _rev_cond[lid] = PTHREAD_COND_INITIALIZER;
-    }
-    // if the lock is free, grant the lock immediately.
-    if (_owners.count(lid) == 0 && _wait_queue[lid].empty()) {
-      _owners[lid] = id;
-      // initialize condition var
-      r = lock_protocol::OK;
-      tprintf("[LOCK SRV] %s acquired lock %llu granted.\n", id.c_str(), lid);
-      return ret;
-    }
+  lock_server_cache *sc = (lock_server_cache *) x;
+  sc->retryer();
+  return 0;
+}
 
-    // if the client is not in the waiting list
-    if (_wait_set[lid].count(id) == 0) {
-      _wait_set[lid].insert(id);
-      _wait_queue[lid].push(id);
-    }
+lock_server_cache::lock_server_cache(rpcs *_srv)
+  : nacquire(0), srv(_srv), _owners(), _wait_queue(), _wait_set(), _pending(),
+    revoke_queue(), retry_queue()
+{
+  VERIFY(pthread_mutex_init(&_m, NULL) == 0);
+  pthread_t th;
+  int r = pthread_create(&th, NULL, &revokethread, (void *) this);
+  VERIFY (r == 0);
+  r = pthread_create(&th, NULL, &retrythread, (void *) this);
+  VERIFY (r == 0);
+}
 
-    // if this client is not the next to hold the lock
-    if (_wait_queue[lid].front() != id) {
-      r = lock_protocol::RETRY;
-      tprintf("[LOCK SRV] %s acquired lock %llu retry queue front: %s, sz: %lu.\n",
-          id.c_str(), lid, _wait_queue[lid].front().c_str(), _wait_queue[lid].size());
-      return ret;
-    }
+// hand the free lock to the client at the front of the wait queue and
+// tell the next waiter to retry. called with _m held; the grant goes
+// in out.
+void
+lock_server_cache::grant_front(lock_protocol::lockid_t lid, reply_token *t,
+                               std::vector<answer> &out)
+{
+  std::string id = _wait_queue[lid].front();
+  _wait_queue[lid].pop();
+  _wait_set[lid].erase(id);
+  _owners[lid] = id;
+  tprintf("[LOCK SRV] %s got lock %llu, wait queue size: %lu.\n",
+      id.c_str(), lid, _wait_queue[lid].size());
+  out.push_back({ t, lock_protocol::OK });
 
-    holder = _owners[lid];
+  if (!_wait_queue[lid].empty()) {
+    qitem it;
+    it.receiver = _wait_queue[lid].front();
+    it.lid = lid;
+    retry_queue.enq(it);
   }
+}
 
-  // otherwise revoke the holder
-  handle h(holder);
-  int rr;
-  rlock_protocol::status rret;
-  if (h.safebind()) {
-    tprintf("[LOCK SRV] %s send revoke to client %s for lock %llu.\n", id.c_str(), holder.c_str(), lid);
-    rret = h.safebind()->call(rlock_protocol::revoke, lid, rr);
-  }
-  if (!h.safebind() || rret != rlock_protocol::OK) {
-    tprintf("[LOCK SRV] bind error cli:%s lock:%llu holder:%s\n", id.c_str(), lid, holder.c_str());
-    r = lock_protocol::IOERR;
-    return ret;
+// sends the replies gathered under _m
+void
+lock_server_cache::send(const std::vector<answer> &out)
+{
+  for (size_t i = 0; i < out.size(); i++) {
+    out[i].t->reply(lock_protocol::OK, out[i].r);
   }
+}
 
-  // successfully revoked the lock from previous holder.
-  std::string to_retry;
+void
+lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id,
+                           reply_token *t)
+{
+  std::vector<answer> out;
   {
     ScopedLock l(&_m);
-    // ensure the holder is given up
-    tprintf("[LOCK SRV] %s waiting for revoke from %s on lock %llu\n", id.c_str(), holder.c_str(), lid);
-    while (_owners.count(lid) != 0) {
-      pthread_cond_wait(&_rev_cond[lid], &_m);
-    }
-    tprintf("[LOCK SRV] %s got lock %llu (revoke returned from %s).\n", id.c_str(), lid, holder.c_str());
-    // remove this client from waiting queue/set.
-    _wait_set[lid].erase(id);
-    _wait_queue[lid].pop();
-    // set owner
+    acquire_wo(lid, id, t, out);
+  }
+  send(out);
+}
+
+// called with _m held; the replies to send go in out
+void
+lock_server_cache::acquire_wo(lock_protocol::lockid_t lid, std::string id,
+                              reply_token *t, std::vector<answer> &out)
+{
+  // if the lock is free, grant the lock immediately.
+  if (_owners.count(lid) == 0 && _wait_queue[lid].empty()) {
     _owners[lid] = id;
-    tprintf("[LOCK SRV] new wait queue on lock %llu size: %lu.\n", lid, _wait_queue[lid].size());
-    // send retry to next waiting client;
-    if (!_wait_queue[lid].empty()) {
-      to_retry = _wait_queue[lid].front();
-    }
-    else {
-      tprintf("[LOCK SRV] no cli is waiting for lock %llu.\n", lid);
-      r = lock_protocol::OK;
-      return ret;
-    }
-    tprintf("[LOCK SRV] %s ready to send retry to %s on lock %llu.\n", id.c_str(), to_retry.c_str(), lid);
+    tprintf("[LOCK SRV] %s acquired lock %llu granted.\n", id.c_str(), lid);
+    out.push_back({ t, lock_protocol::OK });
+    return;
   }
 
-  // send retry
-  handle rh(to_retry);
-  if (rh.safebind()) {
-    rret = rh.safebind()->call(rlock_protocol::retry, lid, rr);
+  // if the client is not in the waiting list
+  if (_wait_set[lid].count(id) == 0) {
+    _wait_set[lid].insert(id);
+    _wait_queue[lid].push(id);
   }
-  if (!rh.safebind() || rret != rlock_protocol::OK) {
-    tprintf("[LOCK SRV] bind err when sending retry cli:%s lock %llu retriee:%s\n",
-        id.c_str(), lid, to_retry.c_str());
-    r = lock_protocol::IOERR;
-    return ret;
+
+  // if this client is not the next to hold the lock
+  if (_wait_queue[lid].front() != id) {
+    tprintf("[LOCK SRV] %s acquired lock %llu retry queue front: %s, sz: %lu.\n",
+        id.c_str(), lid, _wait_queue[lid].front().c_str(), _wait_queue[lid].size());
+    out.push_back({ t, lock_protocol::RETRY });
+    return;
   }
-  tprintf("[LOCK SRV] cli:%s acquire for %llu returned successfuly\n", id.c_str(), lid);
-  r = lock_protocol::OK;
-  return ret;
+
+  // the holder released before this client came back for the lock
+  if (_owners.count(lid) == 0) {
+    grant_front(lid, t, out);
+    return;
+  }
+
+  // otherwise park the request and revoke the holder
+  if (_pending.count(lid) != 0) {
+    out.push_back({ _pending[lid], lock_protocol::RETRY });
+  }
+  _pending[lid] = t;
+  qitem it;
+  it.receiver = _owners[lid];
+  it.lid = lid;
+  revoke_queue.enq(it);
+  tprintf("[LOCK SRV] %s waiting for revoke from %s on lock %llu\n",
+      id.c_str(), it.receiver.c_str(), lid);
 }
 
 int
 lock_server_cache::release(lock_protocol::lockid_t lid, std::string id,
          int &r)
 {
-  ScopedLock l(&_m);
   lock_protocol::status ret = lock_protocol::OK;
-  _owners.erase(lid);
-  r = lock_protocol::OK;
-  pthread_cond_signal(&_rev_cond[lid]);
-  tprintf("[LOCK SRV] %s released lock %llu.\n", id.c_str(), lid);
+  std::vector<answer> out;
+  {
+    ScopedLock l(&_m);
+    _owners.erase(lid);
+    r = lock_protocol::OK;
+    tprintf("[LOCK SRV] %s released lock %llu.\n", id.c_str(), lid);
+    if (_pending.count(lid) != 0) {
+      reply_token *t = _pending[lid];
+      _pending.erase(lid);
+      grant_front(lid, t, out);
+    }
+  }
+  send(out);
   return ret;
 }
 
+void
+lock_server_cache::revoker()
+{
+  while (true) {
+    qitem it;
+    revoke_queue.deq(&it);
+
+    rpcc *cl = srv->reverse(strtoul(it.receiver.c_str(), NULL, 10));
+    int rr;
+    rlock_protocol::status rret;
+    if (cl) {
+      tprintf("[LOCK SRV] send revoke to client %s for lock %llu.\n",
+          it.receiver.c_str(), it.lid);
+      // the holder answers once it has let go of the lock, however long
+      // that takes, so there is no timeout short of to_max.  a call on
+      // a client whose connection dies fails within rpcc::to_min.
+      rret = cl->call(rlock_protocol::revoke, it.lid, rr);
+      srv->reverse_done(cl);
+    }
+    if (!cl || rret != rlock_protocol::OK) {
+      tprintf("[LOCK SRV] bind error lock:%llu holder:%s\n",
+          it.lid, it.receiver.c_str());
+      // fail the parked acquire; its client has to start over.
+      std::vector<answer> out;
+      {
+        ScopedLock l(&_m);
+        if (_pending.count(it.lid) != 0) {
+          out.push_back({ _pending[it.lid], lock_protocol::IOERR });
+          _pending.erase(it.lid);
+          _wait_set[it.lid].erase(_wait_queue[it.lid].front());
+          _wait_queue[it.lid].pop();
+          if (!_wait_queue[it.lid].empty()) {
+            qitem next;
+            next.receiver = _wait_queue[it.lid].front();
+            next.lid = it.lid;
+            retry_queue.enq(next);
+          }
+        }
+      }
+      send(out);
+    }
+  }
+}
+
+void
+lock_server_cache::retryer()
+{
+  while (true) {
+    qitem it;
+    retry_queue.deq(&it);
+
+    rpcc *cl = srv->reverse(strtoul(it.receiver.c_str(), NULL, 10));
+    int rr;
+    rlock_protocol::status rret;
+    if (cl) {
+      // a retry is answered at once
+      rret = cl->call(rlock_protocol::retry, it.lid, rr, rpcc::to(1000));
+      srv->reverse_done(cl);
+    }
+    if (!cl || rret != rlock_protocol::OK) {
+      tprintf("[LOCK SRV] bind err when sending retry lock %llu retriee:%s\n",
+          it.lid, it.receiver.c_str());
+    }
+  }
+}
+
 lock_protocol::status
 lock_server_cache::stat(lock_protocol::lockid_t lid, int &r)
 {
@@ -131,4 +222,3 @@ lock_server_cache::stat(lock_protocol::lockid_t lid, int &r)
   r = nacquire;
   return lock_protocol::OK;
 }
-
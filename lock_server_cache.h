@@ -4,30 +4,62 @@
 #include <string>
 #include <map>
 #include <queue>
+#include <vector>
 #include <unordered_set>
 
 #include <pthread.h>
 
 #include "lock_protocol.h"
 #include "rpc/rpc.h"
+#include "rpc/fifo.h"
 #include "lock_server.h"
 
 
+// acquire is a deferred handler; register it with
+//   lock_server_cache ls(&server);
+//   server.reg_deferred(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+// an acquire that has to wait for a revoke parks its reply_token in
+// _pending instead of holding a dispatch thread.  clients are known by
+// their rpcc nonce, and revoke and retry go back to them over the
+// connection they call from (rpcs::reverse).  replies are gathered
+// under _m and sent once it is dropped.
 class lock_server_cache {
  private:
+  struct qitem {
+    std::string receiver;
+    lock_protocol::lockid_t lid;
+  };
+  // a reply owed to an acquire
+  struct answer {
+    reply_token *t;
+    int r;
+  };
+
   int nacquire;
+  rpcs *srv;
   std::map<lock_protocol::lockid_t, std::string> _owners;
   std::map<lock_protocol::lockid_t, std::queue<std::string>> _wait_queue;
   std::map<lock_protocol::lockid_t, std::unordered_set<std::string>> _wait_set;
 
-  std::map<lock_protocol::lockid_t, pthread_cond_t> _rev_cond;
+  // the parked acquire of the client at the front of the wait queue
+  std::map<lock_protocol::lockid_t, reply_token *> _pending;
+
+  fifo<qitem> revoke_queue, retry_queue;
 
   pthread_mutex_t _m;
+
+  void grant_front(lock_protocol::lockid_t lid, reply_token *t,
+                   std::vector<answer> &out);
+  void acquire_wo(lock_protocol::lockid_t lid, std::string id,
+                  reply_token *t, std::vector<answer> &out);
+  static void send(const std::vector<answer> &out);
  public:
-  lock_server_cache();
+  lock_server_cache(rpcs *srv);
   lock_protocol::status stat(lock_protocol::lockid_t, int &);
-  int acquire(lock_protocol::lockid_t, std::string id, int &);
+  void acquire(lock_protocol::lockid_t, std::string id, reply_token *);
   int release(lock_protocol::lockid_t, std::string id, int &);
+  void revoker();
+  void retryer();
 };
 
 #endif
@@ -17,8 +17,9 @@
 #define MAX_PDU (10<<20) //maximum PDF is 10M
 
 
-connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+connection::connection(chanmgr *m1, int f1, int l1, shaper *s1) 
+: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1),
+	shaper_(s1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -46,6 +47,7 @@ connection::~connection()
 	if (rpdu_.buf)
 		free(rpdu_.buf);
 	VERIFY(!wpdu_.buf);
+	delete shaper_;
 	close(fd_);
 }
 
@@ -211,7 +213,11 @@ connection::read_cb(int s)
 	}
 
 	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
+		if (shaper_) {
+			shaper_->delay(this, rpdu_.buf, rpdu_.sz);
+			rpdu_.buf = NULL;
+			rpdu_.sz = rpdu_.solong = 0;
+		} else if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
 			//chanmgr has successfully consumed the pdu
 			rpdu_.buf = NULL;
 			rpdu_.sz = rpdu_.solong = 0;
@@ -219,6 +225,16 @@ connection::read_cb(int s)
 	}
 }
 
+void
+connection::deliver(char *b, int sz)
+{
+	ScopedLock ml(&m_);
+	if (dead_ || !mgr_->got_pdu(this, b, sz)) {
+		// lost in transit, as far as the chanmgr can tell
+		free(b);
+	}
+}
+
 bool
 connection::writepdu()
 {
@@ -255,8 +271,8 @@ connection::readpdu()
 		}
 
 		if (n < 0) {
-			VERIFY(errno!=EAGAIN);
-			return false;
+			// readiness reports may be stale (see IOUringAIO)
+			return (errno == EAGAIN);
 		}
 
 		if (n >0 && n!= sizeof(sz)) {
@@ -371,7 +387,8 @@ tcpsconn::process_accept()
 
 	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
 			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
+	connection *ch = new connection(mgr_, s1, lossy_,
+	    shaper::make(shaper::REQUEST));
 
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
@@ -442,7 +459,7 @@ connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
 	}
 	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
 			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
-	return new connection(mgr, s, lossy);
+	return new connection(mgr, s, lossy, shaper::make(shaper::REPLY));
 }
 
 
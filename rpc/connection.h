@@ -10,6 +10,7 @@
 #include <map>
 
 #include "pollmgr.h"
+#include "shaper.h"
 
 class connection;
 
@@ -29,7 +30,9 @@ class connection : public aio_callback {
 			int solong; //amount of bytes written or read so far
 		};
 
-		connection(chanmgr *m1, int f1, int lossytest=0);
+		// a shaper, if any, delays what arrives and is owned by the
+		// connection
+		connection(chanmgr *m1, int f1, int lossytest=0, shaper *s=NULL);
 		~connection();
 
 		int channo() { return fd_; }
@@ -39,6 +42,8 @@ class connection : public aio_callback {
 		bool send(char *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
+		// hand a PDU the shaper held back to the chanmgr
+		void deliver(char *b, int sz);
 
 		void incref();
 		void decref();
@@ -62,6 +67,7 @@ class connection : public aio_callback {
 		int waiters_;
 		int refno_;
 		const int lossy_;
+		shaper *shaper_;
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
@@ -7,6 +7,7 @@
 #include <vector>
 #include <deque>
 #include <map>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
 #include <cstddef>
@@ -44,6 +45,44 @@ enum {
 #endif
 };
 
+// a refcounted slice of bytes, usually inside a received PDU.
+// it goes on the wire like a std::string, but unmarshalling one
+// shares the PDU buffer instead of copying the bytes out of it.
+// the whole PDU stays allocated while any slice of it is alive.
+class rpc_slice {
+	private:
+		std::shared_ptr<char> _ref; // keeps _data alive
+		const char *_data;
+		size_t _sz;
+
+	public:
+		rpc_slice() : _ref(), _data(NULL), _sz(0) {}
+		rpc_slice(const std::shared_ptr<char> &ref, const char *d, size_t sz)
+			: _ref(ref), _data(d), _sz(sz) {}
+		// takes over the contents of s without copying them
+		explicit rpc_slice(std::string s) {
+			std::shared_ptr<std::string> h = std::make_shared<std::string>();
+			h->swap(s);
+			_ref = std::shared_ptr<char>(h, &(*h)[0]);
+			_data = _ref.get();
+			_sz = h->size();
+		}
+
+		const char *data() const { return _data; }
+		size_t size() const { return _sz; }
+		bool empty() const { return _sz == 0; }
+		std::string str() const { return std::string(_data, _sz); }
+
+		// a slice of this slice, sharing its buffer
+		rpc_slice sub(size_t off, size_t n) const {
+			if (off > _sz)
+				off = _sz;
+			if (n > _sz - off)
+				n = _sz - off;
+			return rpc_slice(_ref, _data + off, n);
+		}
+};
+
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
@@ -132,6 +171,8 @@ class unmarshall {
 		int _sz;
 		int _ind;
 		bool _ok;
+		// set once a slice shares _buf; owns _buf from then on
+		std::shared_ptr<char> _ref;
 	public:
 		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false) {}
 		unmarshall(char *b, int sz): _buf(b),_sz(sz),_ind(),_ok(true) {}
@@ -141,7 +182,7 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			if (_buf && !_ref) free(_buf);
 		}
 
 		//take contents from another unmarshall object
@@ -149,6 +190,10 @@ class unmarshall {
 
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
+			if (_ref) {
+				_ref.reset();
+				_buf = NULL;
+			}
 			_sz = s.size()+RPC_HEADER_SZ;
 			_buf = (char *)realloc(_buf,_sz);
 			VERIFY(_buf);
@@ -162,12 +207,21 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		rpc_slice slice(unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
 		void unpack(int *); //non-const ref
 		void take_buf(char **b, int *sz) {
-			*b = _buf;
+			if (_ref) {
+				// slices still point into _buf; give away a copy
+				*b = (char *) malloc(_sz);
+				VERIFY(*b);
+				memcpy(*b, _buf, _sz);
+				_ref.reset();
+			} else {
+				*b = _buf;
+			}
 			*sz = _sz;
 			_sz = _ind = 0;
 			_buf = NULL;
@@ -208,6 +262,8 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, rpc_slice &);
+marshall& operator<<(marshall &, const rpc_slice &);
 
 template <class C> marshall &
 operator<<(marshall &m, std::vector<C> v)
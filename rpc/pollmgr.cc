@@ -2,6 +2,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -9,6 +12,11 @@
 #include "lang/verify.h"
 #include "pollmgr.h"
 
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 PollMgr *PollMgr::instance = NULL;
 static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
 
@@ -28,8 +36,31 @@ PollMgr::Instance()
 PollMgr::PollMgr() : pending_change_(false)
 {
 	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
-	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+
+	// RPC_AIO=select|epoll|io_uring picks a backend; by default use
+	// epoll, else select.  io_uring is no faster than epoll here: a
+	// one-shot poll costs as many system calls per rpc as level-triggered
+	// epoll, which needs no re-arming.
+	aio_ = NULL;
+	char *aio_env = getenv("RPC_AIO");
+	if (aio_env && strcmp(aio_env, "select") == 0) {
+		aio_ = new SelectAIO();
+	}
+#ifdef HAVE_IO_URING
+	if (aio_env && strcmp(aio_env, "io_uring") == 0 &&
+	    IOUringAIO::supported()) {
+		aio_ = new IOUringAIO();
+	}
+#endif
+#ifdef __linux__
+	if (!aio_) {
+		aio_ = new EPollAIO();
+	}
+#endif
+	if (!aio_) {
+		aio_ = new SelectAIO();
+	}
+	jsl_log(JSL_DBG_1, "PollMgr: using %s\n", aio_->name());
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
@@ -164,6 +195,7 @@ SelectAIO::watch_fd(int fd, poll_flag flag)
 
 	char tmp = 1;
 	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+	count_syscall();
 }
 
 bool
@@ -210,6 +242,7 @@ SelectAIO::unwatch_fd(int fd, poll_flag flag)
 	if (flag == CB_RDWR) {
 		char tmp = 1;
 		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+		count_syscall();
 	}
 	return (!FD_ISSET(fd, &rfds_) && !FD_ISSET(fd, &wfds_));
 }
@@ -229,6 +262,7 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 	}
 
 	int ret = select(high+1, &trfds, &twfds, NULL, NULL);
+	count_syscall();
 
 	if (ret < 0) {
 		if (errno == EINTR) {
@@ -245,6 +279,7 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 			char tmp;
 			VERIFY (read(pipefd_[0],&tmp,sizeof(tmp))==1);
 			VERIFY(tmp==1);
+			count_syscall();
 		}else {
 			if (FD_ISSET(fd, &twfds)) {
 				writable->push_back(fd);
@@ -263,25 +298,49 @@ EPollAIO::EPollAIO()
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
 	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	// like SelectAIO, wake wait_ready through a pipe when an fd goes
+	VERIFY(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
+	close(pipefd_[0]);
+	close(pipefd_[1]);
 }
 
-static inline
-int poll_flag_to_event(poll_flag flag)
+// level-triggered, like select: connection::read_cb reads at most one
+// pdu per call and relies on being called again for the rest.
+static void
+epoll_update(int pollfd, int fd, int oldstatus, int newstatus)
 {
-	int f;
-	if (flag == CB_RDONLY) {
-		f = EPOLLIN;
-	}else if (flag == CB_WRONLY) {
-		f = EPOLLOUT;
-	}else { //flag == CB_RDWR
-		f = EPOLLIN | EPOLLOUT;
+	struct epoll_event ev;
+	int op;
+	if (!oldstatus) {
+		op = EPOLL_CTL_ADD;
+	} else if (!newstatus) {
+		op = EPOLL_CTL_DEL;
+	} else {
+		op = EPOLL_CTL_MOD;
 	}
-	return f;
+
+	ev.events = 0;
+	ev.data.fd = fd;
+	if (newstatus & CB_RDONLY) {
+		ev.events |= EPOLLIN;
+	}
+	if (newstatus & CB_WRONLY) {
+		ev.events |= EPOLLOUT;
+	}
+	VERIFY(epoll_ctl(pollfd, op, fd, &ev) == 0);
 }
 
 void
@@ -289,66 +348,54 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
 
-	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	int old = fdstatus_[fd];
 	fdstatus_[fd] |= (int)flag;
-
-	ev.events = EPOLLET;
-	ev.data.fd = fd;
-
-	if (fdstatus_[fd] & CB_RDONLY) {
-		ev.events |= EPOLLIN;
-	}
-	if (fdstatus_[fd] & CB_WRONLY) {
-		ev.events |= EPOLLOUT;
-	}
-
-	if (flag == CB_RDWR) {
-		VERIFY(ev.events == (uint32_t)(EPOLLET | EPOLLIN | EPOLLOUT));
+	if (fdstatus_[fd] != old) {
+		epoll_update(pollfd_, fd, old, fdstatus_[fd]);
+		count_syscall();
 	}
-
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
 }
 
 bool 
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	fdstatus_[fd] &= ~(int)flag;
-
-	struct epoll_event ev;
-	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-	ev.events = EPOLLET;
-	ev.data.fd = fd;
 
-	if (fdstatus_[fd] & CB_RDONLY) {
-		ev.events |= EPOLLIN;
-	}
-	if (fdstatus_[fd] & CB_WRONLY) {
-		ev.events |= EPOLLOUT;
+	int old = fdstatus_[fd];
+	fdstatus_[fd] &= ~(int)flag;
+	if (fdstatus_[fd] != old) {
+		epoll_update(pollfd_, fd, old, fdstatus_[fd]);
+		count_syscall();
 	}
-
 	if (flag == CB_RDWR) {
-		VERIFY(op == EPOLL_CTL_DEL);
+		char tmp = 1;
+		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+		count_syscall();
 	}
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
-	return (op == EPOLL_CTL_DEL);
+	return (fdstatus_[fd] == 0);
 }
 
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	return ((fdstatus_[fd] & flag) == flag);
 }
 
 void
 EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
 	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	count_syscall();
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
+		if (ready_[i].data.fd == pipefd_[0]) {
+			char tmp[16];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			count_syscall();
+			continue;
+		}
+		if (ready_[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
 			readable->push_back(ready_[i].data.fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
@@ -358,3 +405,298 @@ EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 }
 
 #endif
+
+#ifdef HAVE_IO_URING
+
+// there is no liburing here; talk to the kernel directly.
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+// user_data of a poll is (generation << 32) | fd; requests whose
+// completions we don't care about (poll removes, wakeups) set this bit.
+#define URING_INTERNAL 0x80000000ULL
+#define URING_ENTRIES 256
+
+static inline unsigned long long
+uring_ud(int fd, unsigned gen)
+{
+	return ((unsigned long long) gen << 32) | (unsigned) fd;
+}
+
+bool
+IOUringAIO::supported()
+{
+	struct io_uring_params p;
+	bzero(&p, sizeof(p));
+	int fd = sys_io_uring_setup(4, &p);
+	if (fd < 0) {
+		jsl_log(JSL_DBG_1, "IOUringAIO: io_uring_setup failed errno %d\n",
+				errno);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+IOUringAIO::IOUringAIO() : loop_th_(), in_loop_(false)
+{
+	struct io_uring_params p;
+	bzero(&p, sizeof(p));
+	ringfd_ = sys_io_uring_setup(URING_ENTRIES, &p);
+	VERIFY(ringfd_ >= 0);
+	entries_ = p.sq_entries;
+
+	sq_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		sq_sz_ = cq_sz_ = (sq_sz_ > cq_sz_ ? sq_sz_ : cq_sz_);
+	}
+	sq_ptr_ = mmap(0, sq_sz_, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_SQ_RING);
+	VERIFY(sq_ptr_ != MAP_FAILED);
+	if (single) {
+		cq_ptr_ = sq_ptr_;
+	} else {
+		cq_ptr_ = mmap(0, cq_sz_, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringfd_, IORING_OFF_CQ_RING);
+		VERIFY(cq_ptr_ != MAP_FAILED);
+	}
+	sqes_ = (struct io_uring_sqe *) mmap(0,
+			p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ringfd_, IORING_OFF_SQES);
+	VERIFY(sqes_ != MAP_FAILED);
+
+	char *sq = (char *) sq_ptr_, *cq = (char *) cq_ptr_;
+	sq_head_ = (unsigned *) (sq + p.sq_off.head);
+	sq_tail_ = (unsigned *) (sq + p.sq_off.tail);
+	sq_mask_ = (unsigned *) (sq + p.sq_off.ring_mask);
+	sq_array_ = (unsigned *) (sq + p.sq_off.array);
+	cq_head_ = (unsigned *) (cq + p.cq_off.head);
+	cq_tail_ = (unsigned *) (cq + p.cq_off.tail);
+	cq_mask_ = (unsigned *) (cq + p.cq_off.ring_mask);
+	cqes_ = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	bzero(fdstatus_, sizeof(fdstatus_));
+	bzero(gen_, sizeof(gen_));
+	bzero(armed_, sizeof(armed_));
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+}
+
+IOUringAIO::~IOUringAIO()
+{
+	munmap(sqes_, entries_ * sizeof(struct io_uring_sqe));
+	if (cq_ptr_ != sq_ptr_) {
+		munmap(cq_ptr_, cq_sz_);
+	}
+	munmap(sq_ptr_, sq_sz_);
+	close(ringfd_);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+bool
+IOUringAIO::on_loop_thread()
+{
+	return in_loop_ && pthread_equal(loop_th_, pthread_self());
+}
+
+// hand everything queued to the kernel without waiting. m_ held.
+void
+IOUringAIO::flush_sq()
+{
+	unsigned n = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+	if (n == 0) {
+		return;
+	}
+	int ret = sys_io_uring_enter(ringfd_, n, 0, 0);
+	count_syscall();
+	VERIFY(ret >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY);
+}
+
+// the sqe at the tail; it goes to the kernel after push_sqe(). m_ held.
+struct io_uring_sqe *
+IOUringAIO::next_sqe()
+{
+	unsigned tail = *sq_tail_;
+	if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries_) {
+		flush_sq();
+		VERIFY(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < entries_);
+	}
+	struct io_uring_sqe *sqe = &sqes_[tail & *sq_mask_];
+	bzero(sqe, sizeof(*sqe));
+	return sqe;
+}
+
+void
+IOUringAIO::push_sqe()
+{
+	unsigned tail = *sq_tail_;
+	sq_array_[tail & *sq_mask_] = tail & *sq_mask_;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+// arm a one-shot poll for whatever fd is watched for. m_ held.
+void
+IOUringAIO::queue_poll(int fd)
+{
+	struct io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	unsigned events = 0;
+	if (fdstatus_[fd] & CB_RDONLY) {
+		events |= POLLIN;
+	}
+	if (fdstatus_[fd] & CB_WRONLY) {
+		events |= POLLOUT;
+	}
+	sqe->poll32_events = events;
+	sqe->user_data = uring_ud(fd, gen_[fd]);
+	push_sqe();
+	armed_[fd] = true;
+}
+
+// cancel fd's outstanding poll and make any completion of it stale. m_ held.
+void
+IOUringAIO::queue_remove(int fd)
+{
+	if (armed_[fd]) {
+		struct io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = uring_ud(fd, gen_[fd]);
+		sqe->user_data = URING_INTERNAL;
+		push_sqe();
+		armed_[fd] = false;
+	}
+	gen_[fd]++;
+}
+
+void
+IOUringAIO::watch_fd(int fd, poll_flag flag)
+{
+	VERIFY(fd < MAX_POLL_FDS);
+	ScopedLock ml(&m_);
+	int old = fdstatus_[fd];
+	fdstatus_[fd] |= (int)flag;
+	if (fdstatus_[fd] == old) {
+		return;
+	}
+	queue_remove(fd);
+	queue_poll(fd);
+	// changes made by callbacks ride along with the next wait
+	if (!on_loop_thread()) {
+		flush_sq();
+	}
+}
+
+bool
+IOUringAIO::unwatch_fd(int fd, poll_flag flag)
+{
+	VERIFY(fd < MAX_POLL_FDS);
+	ScopedLock ml(&m_);
+	int old = fdstatus_[fd];
+	fdstatus_[fd] &= ~(int)flag;
+	if (fdstatus_[fd] != old) {
+		queue_remove(fd);
+		if (fdstatus_[fd]) {
+			queue_poll(fd);
+		}
+	}
+	if (!on_loop_thread()) {
+		if (flag == CB_RDWR) {
+			// wake wait_ready so PollMgr::block_remove_fd returns
+			struct io_uring_sqe *sqe = next_sqe();
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = URING_INTERNAL;
+			push_sqe();
+		}
+		flush_sq();
+	}
+	return (fdstatus_[fd] == 0);
+}
+
+bool
+IOUringAIO::is_watched(int fd, poll_flag flag)
+{
+	VERIFY(fd < MAX_POLL_FDS);
+	ScopedLock ml(&m_);
+	return ((fdstatus_[fd] & flag) == flag);
+}
+
+void
+IOUringAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+{
+	unsigned n;
+	{
+		ScopedLock ml(&m_);
+		if (!in_loop_) {
+			loop_th_ = pthread_self();
+			in_loop_ = true;
+		}
+		// re-arm the polls that fired last round, now that their
+		// callbacks have run; re-arming earlier would report data the
+		// callbacks have since consumed.
+		for (unsigned i = 0; i < rearm_.size(); i++) {
+			int fd = rearm_[i];
+			if (fdstatus_[fd] && !armed_[fd]) {
+				queue_poll(fd);
+			}
+		}
+		rearm_.clear();
+		n = *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+	}
+
+	int ret = sys_io_uring_enter(ringfd_, n, 1, IORING_ENTER_GETEVENTS);
+	count_syscall();
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+			return;
+		}
+		perror("io_uring_enter:");
+		jsl_log(JSL_DBG_OFF, "IOUringAIO::wait_ready failure errno %d\n", errno);
+		VERIFY(0);
+	}
+
+	ScopedLock ml(&m_);
+	unsigned head = *cq_head_;
+	unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+		unsigned long long ud = cqe->user_data;
+		if (ud & URING_INTERNAL) {
+			continue;
+		}
+		int fd = (int) (ud & 0xffffffffULL);
+		if (fd >= MAX_POLL_FDS || (unsigned) (ud >> 32) != gen_[fd]) {
+			continue; // the poll was removed or replaced since
+		}
+		armed_[fd] = false;
+		int res = cqe->res;
+		if (res < 0) {
+			// let the callbacks find out what is wrong with fd
+			res = POLLERR;
+		}
+		if ((fdstatus_[fd] & CB_RDONLY) && (res & (POLLIN | POLLHUP | POLLERR))) {
+			readable->push_back(fd);
+		}
+		if ((fdstatus_[fd] & CB_WRONLY) && (res & (POLLOUT | POLLHUP | POLLERR))) {
+			writable->push_back(fd);
+		}
+		rearm_.push_back(fd);
+	}
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
@@ -6,6 +6,10 @@
 
 #ifdef __linux__
 #include <sys/epoll.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 #endif
 
 #define MAX_POLL_FDS 128
@@ -24,7 +28,16 @@ class aio_mgr {
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
 		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		virtual const char *name() = 0;
 		virtual ~aio_mgr() {}
+
+		// number of system calls made to watch fds and wait for them
+		unsigned long syscalls() { return __sync_fetch_and_add(&nsyscalls_, 0); }
+	protected:
+		aio_mgr() : nsyscalls_(0) {}
+		void count_syscall() { __sync_fetch_and_add(&nsyscalls_, 1); }
+	private:
+		unsigned long nsyscalls_;
 };
 
 class aio_callback {
@@ -48,6 +61,9 @@ class PollMgr {
 		void block_remove_fd(int fd);
 		void wait_loop();
 
+		const char *aio_name() { return aio_->name(); }
+		unsigned long aio_syscalls() { return aio_->syscalls(); }
+
 
 		static PollMgr *instance;
 		static int useful;
@@ -73,6 +89,7 @@ class SelectAIO : public aio_mgr {
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
 		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		const char *name() { return "select"; }
 
 	private:
 
@@ -94,14 +111,64 @@ class EPollAIO : public aio_mgr {
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
 		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		const char *name() { return "epoll"; }
 
 	private:
 		int pollfd_;
+		int pipefd_[2];
 		struct epoll_event ready_[MAX_POLL_FDS];
 		int fdstatus_[MAX_POLL_FDS];
 
 };
 #endif /* __linux */
 
+#ifdef HAVE_IO_URING
+// readiness through io_uring poll requests.  every watched fd has one
+// one-shot IORING_OP_POLL_ADD outstanding; when it fires, wait_ready
+// queues its re-arm, and the re-arms and any watch changes made by the
+// callbacks go to the kernel in the same io_uring_enter() that waits
+// for the next completions, so a busy loop makes one system call per
+// round instead of epoll_wait plus an epoll_ctl per change.
+class IOUringAIO : public aio_mgr {
+	public:
+		IOUringAIO();
+		~IOUringAIO();
+		// false if the kernel (or a sandbox) doesn't let us set up a ring
+		static bool supported();
+		void watch_fd(int fd, poll_flag flag);
+		bool unwatch_fd(int fd, poll_flag flag);
+		bool is_watched(int fd, poll_flag flag);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		const char *name() { return "io_uring"; }
+
+	private:
+		struct io_uring_sqe *next_sqe();
+		void push_sqe();
+		void queue_poll(int fd);
+		void queue_remove(int fd);
+		void rearm(int fd);
+		void flush_sq();
+		bool on_loop_thread();
+
+		int ringfd_;
+		unsigned entries_;
+		void *sq_ptr_, *cq_ptr_;
+		size_t sq_sz_, cq_sz_;
+		struct io_uring_sqe *sqes_;
+		unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+		unsigned *cq_head_, *cq_tail_, *cq_mask_;
+		struct io_uring_cqe *cqes_;
+		std::vector<int> rearm_; // fired in the last round
+
+		int fdstatus_[MAX_POLL_FDS];
+		unsigned gen_[MAX_POLL_FDS]; // bumped whenever fd's poll changes
+		bool armed_[MAX_POLL_FDS];
+		pthread_t loop_th_; // the thread in wait_ready
+		bool in_loop_;
+
+		pthread_mutex_t m_; // protects everything but the completion queue
+};
+#endif /* HAVE_IO_URING */
+
 #endif /* pollmgr_h */
 
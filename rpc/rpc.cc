@@ -21,7 +21,9 @@
    reply or error. All connections use a single PollMgr object to perform async
    socket IO.  PollMgr creates a single thread to examine the readiness of socket
    file descriptors and informs the corresponding connection whenever a socket is
-   ready to be read or written.  (We use asynchronous socket IO to reduce the
+   ready to be read or written.  The readiness backend (epoll, or select
+   where there is none) is picked at startup; RPC_AIO overrides the choice,
+   and can pick io_uring.  (We use asynchronous socket IO to reduce the
    number of threads needed to manage these connections; without async IO, at
    least one thread is needed per connection to read data without blocking other
    activities.)  Each rpcs object creates one thread for listening on the server
@@ -58,6 +60,31 @@
    a thread pool of x threads. Upon getting a poison pill instead of a normal
    task, a worker thread will exit (and thread pool destructor waits to join all
    x exited worker threads).
+
+   The dispatch pool is shared fairly among clients.  rpcs::got_pdu does not
+   hand a request to the pool directly; it queues it on a per-client (per
+   clt_nonce) queue and adds a token job to the pool.  Whichever worker takes
+   a token picks the next request in deficit round robin order, so a client
+   that floods the server only delays its own requests.  A client that already
+   has max_inflight_ requests queued or executing is answered with
+   rpc_const::busy_failure and a retry-after hint; rpcc backs off and
+   retransmits instead of counting that as a reply.
+
+   A handler registered with rpcs::reg_deferred does not fill in a reply; it
+   gets a reply_token and may return with the RPC still outstanding.  The
+   token holds a reference on the connection and the xid stays INPROGRESS in
+   the at-most-once window until someone calls reply_token::reply(), from any
+   thread.  A request that has to wait for another client (e.g. a lock
+   acquire that needs a revoke) thus costs a token, not a dispatch thread.
+
+   Streaming calls (rpcc::call_upload, rpcc::call_download) carry payloads
+   too big for one PDU.  The client opens a stream with a stream_open RPC,
+   then a few threads keep a window of stream_data (or stream_read) RPCs in
+   flight, one per chunk, each with its own xid so that retransmission and
+   at-most-once work as for any other call.  rpcs puts the chunks back in
+   offset order for the handler's rpc_sink, or reads ahead from its
+   rpc_source, and stream_close returns the handler's reply.  Neither side
+   buffers more than a window of chunks.
    */
 
 #include "rpc.h"
@@ -74,11 +101,14 @@
 #include "gettime.h"
 #include "lang/verify.h"
 
+#include <set>
+#include <vector>
+
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-  : xid(xxid), un(xun), done(false)
+  : xid(xxid), un(xun), done(false), busy_ms(0)
 {
   VERIFY(pthread_mutex_init(&m,0) == 0);
   VERIFY(pthread_cond_init(&c, 0) == 0);
@@ -100,11 +130,16 @@ void set_rand_seed()
 
 rpcc::rpcc(sockaddr_in d, bool retrans) :
   dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-  retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+  retrans_(retrans), reachable_(true), reverse_(false), chan_(NULL),
+  callbacks_(NULL), destroy_wait_ (false), xid_rep_done_(-1),
+  stream_chunk_(256*1024), stream_window_(4), stream_pool_(NULL),
+  ka_idle_(0), ka_timeout_(0), ka_running_(false), ka_stop_(false)
 {
   VERIFY(pthread_mutex_init(&m_, 0) == 0);
   VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
   VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+  VERIFY(pthread_cond_init(&ka_c_, 0) == 0);
+  clock_gettime(CLOCK_REALTIME, &last_rx_);
 
   if(retrans){
     set_rand_seed();
@@ -124,23 +159,73 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
   // xid starts with 1 and latest received reply starts with 0
   xid_rep_window_.push_back(0);
 
+  // stream ids only need to be unique per clt_nonce, but nonce 0
+  // is shared by all clients that don't retransmit
+  next_sid_ = random();
+
+  char *ka_env = getenv("RPC_KEEPALIVE");
+  if(ka_env != NULL){
+    int idle = 0, timeout = 0;
+    if(sscanf(ka_env, "%d:%d", &idle, &timeout) == 1)
+      timeout = idle;
+    if(idle > 0 && timeout > 0)
+      set_keepalive(idle, timeout);
+  }
+
   jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n",
       clt_nonce_, lossytest_);
 }
 
+// a server's rpcc on a connection a client opened.  it needs no bind,
+// uses the reverse half of the xid space so that the client can tell
+// its requests from replies, and dies with the connection.
+rpcc::rpcc(connection *c) :
+  srv_nonce_(0), bind_done_(true), xid_(rpc_const::reverse_xid + 1),
+  lossytest_(0), retrans_(false), reachable_(true), reverse_(true), chan_(c),
+  callbacks_(NULL), destroy_wait_ (false), xid_rep_done_(-1),
+  stream_chunk_(256*1024), stream_window_(4), stream_pool_(NULL),
+  ka_idle_(0), ka_timeout_(0), ka_running_(false), ka_stop_(false)
+{
+  VERIFY(pthread_mutex_init(&m_, 0) == 0);
+  VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
+  VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+  VERIFY(pthread_cond_init(&ka_c_, 0) == 0);
+  clock_gettime(CLOCK_REALTIME, &last_rx_);
+  bzero(&dst_, sizeof(dst_));
+  clt_nonce_ = 0;
+  chan_->incref();
+  xid_rep_window_.push_back((unsigned int) rpc_const::reverse_xid);
+  next_sid_ = random();
+}
+
 // IMPORTANT: destruction should happen only when no external threads
 // are blocked inside rpcc or will use rpcc in the future
 rpcc::~rpcc()
 {
   jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
       clt_nonce_, chan_?chan_->channo():-1);
+  if(ka_running_){
+    {
+      // only a ping can be in flight
+      ScopedLock ml(&m_);
+      ka_stop_ = true;
+      destroy_wait_ = true;
+      fail_calls_wo(rpc_const::cancel_failure);
+      VERIFY(pthread_cond_broadcast(&ka_c_) == 0);
+    }
+    VERIFY(pthread_join(ka_th_, NULL) == 0);
+  }
+  delete stream_pool_;
   if(chan_){
-    chan_->closeconn();
+    // a reverse rpcc borrows the client's connection
+    if(!reverse_)
+      chan_->closeconn();
     chan_->decref();
   }
   VERIFY(calls_.size() == 0);
   VERIFY(pthread_mutex_destroy(&m_) == 0);
   VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+  VERIFY(pthread_cond_destroy(&ka_c_) == 0);
 }
 
   int
@@ -165,24 +250,115 @@ rpcc::cancel(void)
 {
   ScopedLock ml(&m_);
   printf("rpcc::cancel: force callers to fail\n");
+  fail_calls_wo(rpc_const::cancel_failure);
+
+  while (calls_.size () > 0){
+    destroy_wait_ = true;
+    VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
+  }
+  printf("rpcc::cancel: done\n");
+}
+
+// assumes thread holds mutex m
+  void
+rpcc::fail_calls_wo(int ret)
+{
   std::map<int,caller*>::iterator iter;
   for(iter = calls_.begin(); iter != calls_.end(); iter++){
     caller *ca = iter->second;
 
-    jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
+    jsl_log(JSL_DBG_2, "rpcc: force caller xid %u to fail %d\n", ca->xid, ret);
     {
       ScopedLock cl(&ca->m);
-      ca->done = true;
-      ca->intret = rpc_const::cancel_failure;
+      if(!ca->done){
+        ca->done = true;
+        ca->intret = ret;
+      }
       VERIFY(pthread_cond_signal(&ca->c) == 0);
     }
   }
+}
 
-  while (calls_.size () > 0){
-    destroy_wait_ = true;
-    VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
+  void
+rpcc::set_keepalive(int idle_ms, int timeout_ms)
+{
+  VERIFY(idle_ms >= 0 && (idle_ms == 0 || timeout_ms > 0));
+  ScopedLock ml(&m_);
+  VERIFY(!reverse_);
+  ka_idle_ = idle_ms;
+  ka_timeout_ = timeout_ms;
+  if(idle_ms && !ka_running_){
+    VERIFY(pthread_create(&ka_th_, NULL, &rpcc::keepalive_thread,
+          (void *) this) == 0);
+    ka_running_ = true;
   }
-  printf("rpcc::cancel: done\n");
+  VERIFY(pthread_cond_broadcast(&ka_c_) == 0);
+}
+
+  void *
+rpcc::keepalive_thread(void *x)
+{
+  ((rpcc *) x)->keepalive_loop();
+  return 0;
+}
+
+// a dead peer would otherwise only show when a send fails or a call
+// runs out its whole timeout.  any PDU from the server counts as a
+// sign of life, so a busy server that sheds the ping is still alive.
+  void
+rpcc::keepalive_loop()
+{
+  while(1){
+    struct timespec now, due, heard;
+    int timeout;
+    {
+      ScopedLock ml(&m_);
+      if(ka_stop_)
+        return;
+      if(!ka_idle_){
+        VERIFY(pthread_cond_wait(&ka_c_, &m_) == 0);
+        continue;
+      }
+      clock_gettime(CLOCK_REALTIME, &now);
+      add_timespec(last_rx_, ka_idle_, &due);
+      if(!bind_done_ || destroy_wait_ || cmp_timespec(due, now) > 0){
+        if(cmp_timespec(due, now) <= 0)
+          add_timespec(now, ka_idle_, &due);
+        pthread_cond_timedwait(&ka_c_, &m_, &due);
+        continue;
+      }
+      heard = last_rx_;
+      timeout = ka_timeout_;
+    }
+
+    int r;
+    int ret = call(rpc_const::ping, 0, r, to(timeout));
+
+    {
+      ScopedLock ml(&m_);
+      if(ret == 0 || ka_stop_ || destroy_wait_ ||
+          cmp_timespec(last_rx_, heard) != 0)
+        continue;
+      jsl_log(JSL_DBG_1, "rpcc::keepalive: %s:%d silent for %d ms, "
+          "failing %d calls\n", inet_ntoa(dst_.sin_addr),
+          ntohs(dst_.sin_port), timeout, (int)calls_.size());
+      fail_calls_wo(rpc_const::timeout_failure);
+      // give the next connection a full idle period
+      clock_gettime(CLOCK_REALTIME, &last_rx_);
+    }
+    {
+      ScopedLock cl(&chan_m_);
+      if(chan_)
+        chan_->closeconn();
+    }
+  }
+}
+
+  void
+rpcc::set_callbacks(rpcs *s)
+{
+  ScopedLock ml(&m_);
+  callbacks_ = s;
 }
 
   int
@@ -215,10 +391,12 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
   }
 
   TO curr_to;
-  struct timespec now, nextdeadline, finaldeadline;
+  struct timespec now, nextdeadline, finaldeadline, deadline;
+  int busy_to = 0;
 
   clock_gettime(CLOCK_REALTIME, &now);
   add_timespec(now, to.to, &finaldeadline);
+  deadline = finaldeadline;
   curr_to.to = to_min.to;
 
   bool transmit = true;
@@ -245,6 +423,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
         jsl_log(JSL_DBG_2,
             "rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
             clt_nonce_, proc, ca.xid, clt_nonce_);
+      } else if(reverse_){
+        break; // the client's connection is gone
       }
       transmit = false; // only send once on a given channel
     }
@@ -259,9 +439,10 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
       finaldeadline.tv_sec = 0;
     }
 
+    int busy_ms = 0;
     {
       ScopedLock cal(&ca.m);
-      while (!ca.done){
+      while (!ca.done && !ca.busy_ms){
         jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
         if(pthread_cond_timedwait(&ca.c, &ca.m,
               &nextdeadline) == ETIMEDOUT){
@@ -273,6 +454,35 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
         jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
         break;
       }
+      busy_ms = ca.busy_ms;
+      ca.busy_ms = 0;
+    }
+
+    if(busy_ms){
+      // the server shed this request.  wait at least as long as it
+      // asked, doubling on repeated refusals, then send it again.
+      busy_to = busy_to * 2 > busy_ms ? busy_to * 2 : busy_ms;
+      clock_gettime(CLOCK_REALTIME, &now);
+      add_timespec(now, busy_to, &nextdeadline);
+      if(cmp_timespec(nextdeadline, deadline) > 0)
+        nextdeadline = deadline;
+      jsl_log(JSL_DBG_2, "rpcc::call1: xid %u busy, retry in %d ms\n",
+          ca.xid, busy_to);
+      {
+        ScopedLock cal(&ca.m);
+        while (!ca.done){
+          if(pthread_cond_timedwait(&ca.c, &ca.m,
+                &nextdeadline) == ETIMEDOUT)
+            break;
+        }
+        if(ca.done)
+          break;
+      }
+      if(cmp_timespec(nextdeadline, deadline) >= 0)
+        break;
+      finaldeadline = deadline;
+      transmit = true;
+      continue;
     }
 
     if(retrans_ && (!ch || ch->isdead())){
@@ -280,6 +490,13 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
       // on the new connection
       transmit = true;
     }
+    if(reverse_){
+      // nothing comes back once the client's connection is gone, so
+      // look at it every to_min rather than wait out the whole call
+      if(!ch || ch->isdead())
+        break;
+      continue;
+    }
     curr_to.to <<= 1;
   }
 
@@ -326,7 +543,10 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 rpcc::get_refconn(connection **ch)
 {
   ScopedLock ml(&chan_m_);
-  if(!chan_ || chan_->isdead()){
+  if(reverse_){
+    if(chan_->isdead())
+      return;
+  } else if(!chan_ || chan_->isdead()){
     if(chan_)
       chan_->decref();
     chan_ = connect_to_dst(dst_, this, lossytest_);
@@ -357,7 +577,40 @@ rpcc::got_pdu(connection *c, char *b, int sz)
     return true;
   }
 
+  if((h.xid & rpc_const::reverse_xid) && !reverse_){
+    // not a reply but a call from the server
+    rpcs *s;
+    {
+      ScopedLock ml(&m_);
+      clock_gettime(CLOCK_REALTIME, &last_rx_);
+      s = callbacks_;
+    }
+    if(s == NULL){
+      jsl_log(JSL_DBG_1, "rpcc::got_pdu: no callbacks for xid %x\n", h.xid);
+      return true;
+    }
+    rep.take_buf(&b, &sz);
+    return s->got_pdu(c, b, sz);
+  }
+
   ScopedLock ml(&m_);
+  clock_gettime(CLOCK_REALTIME, &last_rx_);
+
+  if(h.ret == rpc_const::busy_failure){
+    // not a reply: the request was refused and will be sent again, so
+    // it must not count towards xid_rep.
+    int wait = 0;
+    rep >> wait;
+    if(calls_.find(h.xid) != calls_.end()){
+      caller *ca = calls_[h.xid];
+      ScopedLock cl(&ca->m);
+      if(!ca->done){
+        ca->busy_ms = wait > 0 ? wait : 1;
+        VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+      }
+    }
+    return true;
+  }
 
   update_xid_rep(h.xid);
 
@@ -407,14 +660,197 @@ compress:
   }
 }
 
+  void
+rpcc::set_stream_window(int chunk, int window)
+{
+  VERIFY(chunk > 0 && window > 0);
+  ScopedLock ml(&m_);
+  stream_chunk_ = chunk;
+  stream_window_ = window;
+}
+
+// state shared by the threads that keep a stream's window full
+struct stream_job {
+  rpcc *cl;
+  unsigned int sid;
+  rpc_source *src;
+  rpc_sink *dst;
+  rpcc::TO to;
+  int chunk;
+  int window;
+
+  pthread_mutex_t m;
+  pthread_cond_t c;
+  unsigned long long next; // next offset to hand out
+  std::set<unsigned long long> outstanding; // upload chunks in flight
+  unsigned long long delivered; // download: next offset dst wants
+  std::map<unsigned long long, std::string> early; // download: out of order
+  bool done;
+  int ret;
+  int helpers; // jobs on the stream pool that have not returned yet
+
+  // lowest offset the receiver has not consumed yet
+  unsigned long long low() {
+    if(dst)
+      return delivered;
+    return outstanding.empty() ? next : *outstanding.begin();
+  }
+};
 
-rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+  static void
+stream_worker(stream_job *j)
+{
+  unsigned int nonce = j->cl->id();
+  while(1){
+    unsigned long long off;
+    std::string chunk;
+    {
+      ScopedLock ml(&j->m);
+      while(!j->done && j->ret == 0 &&
+          j->next >= j->low() + (unsigned long long) j->window * j->chunk)
+        VERIFY(pthread_cond_wait(&j->c, &j->m) == 0);
+      if(j->done || j->ret != 0)
+        break;
+      off = j->next;
+      if(j->src){
+        int r = j->src->read(chunk, j->chunk);
+        if(r != 0 || chunk.empty()){
+          j->ret = r;
+          j->done = true;
+          VERIFY(pthread_cond_broadcast(&j->c) == 0);
+          break;
+        }
+        j->next += chunk.size();
+        j->outstanding.insert(off);
+      } else {
+        j->next += j->chunk;
+      }
+    }
+
+    int ret;
+    if(j->src){
+      int r;
+      ret = j->cl->call(rpc_const::stream_data, nonce, j->sid, off, chunk,
+          r, j->to);
+    } else {
+      ret = j->cl->call(rpc_const::stream_read, nonce, j->sid, off,
+          j->chunk, chunk, j->to);
+    }
+
+    ScopedLock ml(&j->m);
+    VERIFY(pthread_cond_broadcast(&j->c) == 0);
+    if(ret != 0){
+      if(j->ret == 0)
+        j->ret = ret;
+      break;
+    }
+    if(j->src){
+      j->outstanding.erase(off);
+      continue;
+    }
+    // a short chunk marks the end of the download
+    if((int) chunk.size() < j->chunk)
+      j->done = true;
+    j->early[off] = chunk;
+    std::map<unsigned long long, std::string>::iterator it;
+    while(j->ret == 0 &&
+        (it = j->early.find(j->delivered)) != j->early.end()){
+      int len = it->second.size();
+      if(len > 0)
+        j->ret = j->dst->write(it->second);
+      j->early.erase(it);
+      if(len < j->chunk)
+        break;
+      j->delivered += len;
+    }
+  }
+}
+
+// a stream_worker on the stream pool
+  void
+rpcc::stream_helper(stream_job *j)
+{
+  stream_worker(j);
+  ScopedLock ml(&j->m);
+  j->helpers--;
+  VERIFY(pthread_cond_broadcast(&j->c) == 0);
+}
+
+// run a streaming call: open the stream on the server, keep up to
+// stream_window_ chunk RPCs in flight until src runs dry (upload) or
+// the server's source does (download), then close it.  the calling
+// thread is one of the window, so a stream moves on even while the
+// pool is busy with other streams.
+  int
+rpcc::stream_call(unsigned int proc, const std::string &args,
+    rpc_source *src, rpc_sink *dst, std::string &rep, TO to)
+{
+  stream_job j;
+  ThrPool *pool;
+  {
+    ScopedLock ml(&m_);
+    j.sid = next_sid_++;
+    j.chunk = stream_chunk_;
+    j.window = stream_window_;
+    if(!stream_pool_ && j.window > 1)
+      stream_pool_ = new ThrPool(j.window - 1, false);
+    pool = stream_pool_;
+  }
+  j.cl = this;
+  j.src = src;
+  j.dst = dst;
+  j.to = to;
+  j.next = 0;
+  j.delivered = 0;
+  j.done = false;
+  j.ret = 0;
+  j.helpers = 0;
+  VERIFY(pthread_mutex_init(&j.m, 0) == 0);
+  VERIFY(pthread_cond_init(&j.c, 0) == 0);
+
+  int r;
+  int ret = call(rpc_const::stream_open, clt_nonce_, j.sid, proc, args, r, to);
+  jsl_log(JSL_DBG_2, "rpcc::stream_call: open sid %u proc %x ret %d\n",
+      j.sid, proc, ret);
+  if(ret == 0){
+    for(int i = 1; pool && i < j.window; i++){
+      ScopedLock ml(&j.m);
+      if(!pool->addObjJob(this, &rpcc::stream_helper, &j))
+        break; // the pool's queue is full; run with a smaller window
+      j.helpers++;
+    }
+    stream_worker(&j);
+    {
+      // j goes away with this call, so wait for the helpers, even
+      // those that start only once the stream is done
+      ScopedLock ml(&j.m);
+      while(j.helpers > 0)
+        VERIFY(pthread_cond_wait(&j.c, &j.m) == 0);
+    }
+
+    // always close, so the server can drop the stream
+    int cret = call(rpc_const::stream_close, clt_nonce_, j.sid, rep, to);
+    ret = j.ret != 0 ? j.ret : cret;
+  }
+
+  VERIFY(pthread_mutex_destroy(&j.m) == 0);
+  VERIFY(pthread_cond_destroy(&j.c) == 0);
+  return ret;
+}
+
+
+rpcs::rpcs(unsigned int p1, int count, bool listen)
+  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true),
+  quantum_(8192), max_inflight_(64)
 {
   VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
   VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
   VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
   VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
+  VERIFY(pthread_mutex_init(&sched_m_, 0) == 0);
+  VERIFY(pthread_mutex_init(&streams_m_, 0) == 0);
+  VERIFY(pthread_mutex_init(&reverse_m_, 0) == 0);
+  streams_reaped_ = time(NULL);
 
   set_rand_seed();
   nonce_ = random();
@@ -425,10 +861,29 @@ rpcs::rpcs(unsigned int p1, int count)
     lossytest_ = atoi(loss_env);
   }
 
+  char *inflight_env = getenv("RPC_MAX_INFLIGHT");
+  if(inflight_env != NULL){
+    max_inflight_ = atoi(inflight_env);
+  }
+
   reg(rpc_const::bind, this, &rpcs::rpcbind);
-  dispatchpool_ = new ThrPool(6,false);
+  reg(rpc_const::ping, this, &rpcs::rpcping);
+  set_idempotent(rpc_const::ping);
+  reg(rpc_const::stream_open, this, &rpcs::stream_open);
+  reg(rpc_const::stream_data, this, &rpcs::stream_data);
+  reg(rpc_const::stream_read, this, &rpcs::stream_read);
+  reg(rpc_const::stream_close, this, &rpcs::stream_close);
+
+  // handler threads; more let a server whose handlers don't serialize
+  // on one lock use more cores
+  int nthreads = 6;
+  char *threads_env = getenv("RPC_THREADS");
+  if(threads_env != NULL && atoi(threads_env) > 0){
+    nthreads = atoi(threads_env);
+  }
+  dispatchpool_ = new ThrPool(nthreads,false);
 
-  listener_ = new tcpsconn(this, port_, lossytest_);
+  listener_ = listen ? new tcpsconn(this, port_, lossytest_) : NULL;
 }
 
 rpcs::~rpcs()
@@ -437,6 +892,118 @@ rpcs::~rpcs()
   delete listener_;
   delete dispatchpool_;
   free_reply_window();
+
+  std::map<std::pair<unsigned int, unsigned int>, stream_t *>::iterator it;
+  for(it = streams_.begin(); it != streams_.end(); it++)
+    delete it->second;
+  std::map<int, stream_opener *>::iterator oi;
+  for(oi = stream_procs_.begin(); oi != stream_procs_.end(); oi++)
+    delete oi->second;
+
+  std::map<unsigned int, rpcc *>::iterator ri;
+  for(ri = reverse_.begin(); ri != reverse_.end(); ri++)
+    delete ri->second;
+  std::list<rpcc *>::iterator oli;
+  for(oli = reverse_old_.begin(); oli != reverse_old_.end(); oli++)
+    delete *oli;
+}
+
+  rpcc *
+rpcs::reverse(unsigned int clt_nonce)
+{
+  connection *c = NULL;
+  {
+    ScopedLock rwl(&conss_m_);
+    if(conns_.count(clt_nonce) != 0 && !conns_[clt_nonce]->isdead())
+      c = conns_[clt_nonce];
+  }
+
+  rpcc *cl = NULL, *gone = NULL;
+  {
+    ScopedLock rl(&reverse_m_);
+    std::map<unsigned int, rpcc *>::iterator it = reverse_.find(clt_nonce);
+    if(it != reverse_.end()){
+      std::map<connection *, rpcc *>::iterator ci = reverse_conn_.find(c);
+      if(c && ci != reverse_conn_.end() && ci->second == it->second){
+        cl = it->second;
+        reverse_users_[cl]++;
+        return cl;
+      }
+      // the client has reconnected or gone away since
+      gone = retire_reverse_wo(it->second);
+      reverse_.erase(it);
+    }
+    if(c){
+      cl = new rpcc(c);
+      reverse_[clt_nonce] = cl;
+      reverse_conn_[c] = cl;
+      reverse_users_[cl] = 1;
+    }
+  }
+  delete gone;
+  return cl;
+}
+
+  void
+rpcs::reverse_done(rpcc *cl)
+{
+  rpcc *gone;
+  {
+    ScopedLock rl(&reverse_m_);
+    gone = unuse_reverse_wo(cl);
+  }
+  delete gone;
+}
+
+// takes cl out of use for new calls.  returns cl for the caller to
+// free if nothing uses it, else keeps it in reverse_old_ until then.
+  rpcc *
+rpcs::retire_reverse_wo(rpcc *cl)
+{
+  if(reverse_users_[cl] > 0){
+    reverse_old_.push_back(cl);
+    return NULL;
+  }
+  reverse_users_.erase(cl);
+  std::map<connection *, rpcc *>::iterator ci;
+  for(ci = reverse_conn_.begin(); ci != reverse_conn_.end(); ci++){
+    if(ci->second == cl){
+      reverse_conn_.erase(ci);
+      break;
+    }
+  }
+  return cl;
+}
+
+// drops a use of cl; returns cl for the caller to free if that was
+// the last use of a retired rpcc
+  rpcc *
+rpcs::unuse_reverse_wo(rpcc *cl)
+{
+  VERIFY(reverse_users_[cl] > 0);
+  if(--reverse_users_[cl] > 0)
+    return NULL;
+  std::list<rpcc *>::iterator oi;
+  for(oi = reverse_old_.begin(); oi != reverse_old_.end(); oi++){
+    if(*oi == cl){
+      reverse_old_.erase(oi);
+      return retire_reverse_wo(cl);
+    }
+  }
+  return NULL;
+}
+
+// decode the request header of a pdu without taking ownership of it
+  static bool
+peek_req_header(char *b, int sz, req_header *h)
+{
+  unmarshall u(b, sz);
+  u.unpack_req_header(h);
+  bool ok = u.ok();
+  char *ub;
+  int usz;
+  u.take_buf(&ub, &usz);
+  return ok;
 }
 
   bool
@@ -447,16 +1014,160 @@ rpcs::got_pdu(connection *c, char *b, int sz)
     return true;
   }
 
-  djob_t *j = new djob_t(c, b, sz);
+  req_header h;
+  if(!peek_req_header(b, sz, &h))
+    h.clt_nonce = 0; // dispatch will drop it
+
+  if(((unsigned int) h.xid & rpc_const::reverse_xid) && listener_){
+    // a reply to one of our calls back to the client.  (an rpcs
+    // without a listener serves callbacks, and gets the calls.)
+    rpcc *cl = NULL;
+    {
+      ScopedLock rl(&reverse_m_);
+      if(reverse_conn_.count(c)){
+        cl = reverse_conn_[c];
+        reverse_users_[cl]++;
+      }
+    }
+    if(!cl){
+      free(b);
+      return true;
+    }
+    bool ret = cl->got_pdu(c, b, sz);
+    reverse_done(cl);
+    return ret;
+  }
+
+  djob_t *j = new djob_t(c, b, sz, h.clt_nonce);
   c->incref();
-  bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
-  if(!succ || !reachable_){
+  bool succ;
+  {
+    ScopedLock sl(&sched_m_);
+    if(max_inflight_ > 0 && inflight_[j->clt_nonce] >= max_inflight_){
+      succ = dispatchpool_->addObjJob(this, &rpcs::dispatch_busy, j);
+    } else {
+      std::deque<djob_t *> &q = sched_q_[j->clt_nonce];
+      if(q.empty()){
+        active_.push_back(j->clt_nonce);
+        deficit_[j->clt_nonce] = active_.size() == 1 ? quantum_ : 0;
+      }
+      q.push_back(j);
+      succ = dispatchpool_->addObjJob(this, &rpcs::dispatch_next, 0);
+      if(succ){
+        inflight_[j->clt_nonce]++;
+      } else {
+        q.pop_back();
+        if(q.empty()){
+          active_.remove(j->clt_nonce);
+          sched_q_.erase(j->clt_nonce);
+          deficit_.erase(j->clt_nonce);
+        }
+      }
+    }
+  }
+  if(!succ){
     c->decref();
     delete j;
   }
   return succ;
 }
 
+  void
+rpcs::set_max_inflight(int n)
+{
+  ScopedLock sl(&sched_m_);
+  max_inflight_ = n;
+}
+
+// pick the next request to run, in deficit round robin order.
+// there is one queued request per token in the dispatch pool,
+// so active_ cannot be empty.
+// assumes sched_m_ is held.
+  rpcs::djob_t *
+rpcs::next_job_wo()
+{
+  VERIFY(!active_.empty());
+  while (1){
+    unsigned int n = active_.front();
+    std::deque<djob_t *> &q = sched_q_[n];
+    djob_t *j = q.front();
+    if(j->sz <= deficit_[n]){
+      q.pop_front();
+      deficit_[n] -= j->sz;
+      if(q.empty()){
+        // an idle client does not bank credit
+        active_.pop_front();
+        sched_q_.erase(n);
+        deficit_.erase(n);
+        if(!active_.empty())
+          deficit_[active_.front()] += quantum_;
+      }
+      return j;
+    }
+    // n has spent its credit for this round
+    active_.pop_front();
+    active_.push_back(n);
+    deficit_[active_.front()] += quantum_;
+  }
+}
+
+// thread pool job: one per request queued by got_pdu
+  void
+rpcs::dispatch_next(int)
+{
+  djob_t *j;
+  {
+    ScopedLock sl(&sched_m_);
+    j = next_job_wo();
+  }
+  unsigned int n = j->clt_nonce;
+  dispatch(j);
+  {
+    ScopedLock sl(&sched_m_);
+    if(--inflight_[n] <= 0)
+      inflight_.erase(n);
+  }
+}
+
+// refuse a request from a client that is over its max_inflight_.
+// the reply carries how long the client should wait before retrying,
+// scaled by how much of its work is still queued.
+  void
+rpcs::dispatch_busy(djob_t *j)
+{
+  connection *c = j->conn;
+  unmarshall req(j->buf, j->sz);
+  delete j;
+
+  req_header h;
+  req.unpack_req_header(&h);
+  if(!req.ok()){
+    jsl_log(JSL_DBG_1, "rpcs:dispatch_busy unmarshall header failed!!!\n");
+    c->decref();
+    return;
+  }
+
+  int wait;
+  {
+    ScopedLock sl(&sched_m_);
+    wait = 2 * (sched_q_.count(h.clt_nonce) ? sched_q_[h.clt_nonce].size() : 0);
+  }
+  if(wait < 5)
+    wait = 5;
+  if(wait > 1000)
+    wait = 1000;
+
+  jsl_log(JSL_DBG_2, "rpcs::dispatch_busy: xid %u from clt %u, retry after %d ms\n",
+      h.xid, h.clt_nonce, wait);
+
+  marshall rep;
+  rep << wait;
+  reply_header rh(h.xid, rpc_const::busy_failure);
+  rep.pack_reply_header(rh);
+  c->send(rep.cstr(), rep.size());
+  c->decref();
+}
+
   void
 rpcs::reg1(unsigned int proc, handler *h)
 {
@@ -466,6 +1177,14 @@ rpcs::reg1(unsigned int proc, handler *h)
   VERIFY(procs_.count(proc) >= 1);
 }
 
+  void
+rpcs::set_idempotent(unsigned int proc)
+{
+  ScopedLock pl(&procs_m_);
+  VERIFY(procs_.count(proc) == 1);
+  procs_[proc]->idempotent = true;
+}
+
   void
 rpcs::updatestat(unsigned int proc)
 {
@@ -575,8 +1294,13 @@ rpcs::dispatch(djob_t *j)
       }
     }
 
-    stat = checkduplicate_and_update(h.clt_nonce, h.xid,
-        h.xid_rep, &b1, &sz1);
+    if(f->idempotent){
+      // nothing to remember: a duplicate is just executed again
+      stat = NEW;
+    } else {
+      stat = checkduplicate_and_update(h.clt_nonce, h.xid,
+          h.xid_rep, &b1, &sz1);
+    }
   } else {
     // this client does not require at most once logic
     stat = NEW;
@@ -588,7 +1312,13 @@ rpcs::dispatch(djob_t *j)
         updatestat(proc);
       }
 
-      rh.ret = f->fn(req, rep);
+      if(f->deferred()){
+        // the token takes over our reference to c
+        rh.ret = f->dfn(req, new reply_token(this, c, h.clt_nonce, h.xid,
+              !f->idempotent));
+      } else {
+        rh.ret = f->fn(req, rep);
+      }
       if (rh.ret == rpc_const::unmarshal_args_failure) {
         fprintf(stderr, "rpcs::dispatch: failed to"
             " unmarshall the arguments. You are"
@@ -596,41 +1326,21 @@ rpcs::dispatch(djob_t *j)
             " types of arguments.\n", proc);
         VERIFY(0);
       }
-      VERIFY(rh.ret >= 0);
-
-      rep.pack_reply_header(rh);
-      rep.take_buf(&b1,&sz1);
-
-      jsl_log(JSL_DBG_2,
-          "rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-          sz1, h.xid, proc, rh.ret, h.clt_nonce);
+      // the stream handlers may fail a chunk of a lost stream
+      VERIFY(rh.ret >= 0 || rh.ret == rpc_const::stream_failure);
 
       if(h.clt_nonce > 0){
-        // only record replies for clients that require at-most-once logic
-        printf("rpcs::dispatch proc %x\n", proc);
-        add_reply(h.clt_nonce, h.xid, b1, sz1);
+        jsl_log(JSL_DBG_4, "rpcs::dispatch proc %x\n", proc);
       }
-
-      // get the latest connection to the client
-      {
-        ScopedLock rwl(&conss_m_);
-        if(c->isdead() && c != conns_[h.clt_nonce]){
-          c->decref();
-          c = conns_[h.clt_nonce];
-          c->incref();
-        }
+      if(!f->deferred()){
+        send_reply(c, h.clt_nonce, h.xid, rh.ret, rep, !f->idempotent);
       }
-
-      c->send(b1, sz1);
-      if(h.clt_nonce == 0){
-        // reply is not added to at-most-once window, free it
-        free(b1);
-      }
-      break;
+      return;
     case INPROGRESS: // server is working on this request
       break;
     case DONE: // duplicate and we still have the response
       c->send(b1, sz1);
+      free(b1);
       break;
     case FORGOTTEN: // very old request and we don't have the response anymore
       jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
@@ -643,6 +1353,41 @@ rpcs::dispatch(djob_t *j)
   c->decref();
 }
 
+  void
+rpcs::send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+    int ret, marshall &rep, bool save)
+{
+  char *b;
+  int sz;
+  reply_header rh(xid, ret);
+  rep.pack_reply_header(rh);
+  rep.take_buf(&b, &sz);
+
+  jsl_log(JSL_DBG_2,
+      "rpcs::send_reply: sending %sreply of size %d for rpc %u, ret %d, clt %u\n",
+      save ? "and saving " : "", sz, xid, ret, clt_nonce);
+
+  if(clt_nonce > 0 && save){
+    // only record replies for clients that require at-most-once logic
+    add_reply(clt_nonce, xid, b, sz);
+  }
+
+  // get the latest connection to the client
+  {
+    ScopedLock rwl(&conss_m_);
+    if(c->isdead() && conns_.count(clt_nonce) && c != conns_[clt_nonce]){
+      c->decref();
+      c = conns_[clt_nonce];
+      c->incref();
+    }
+  }
+
+  c->send(b, sz);
+  // add_reply kept its own copy
+  free(b);
+  c->decref();
+}
+
 // rpcs::dispatch calls this when an RPC request arrives.
 //
 // checks to see if an RPC with xid from clt_nonce has already been received.
@@ -655,7 +1400,8 @@ rpcs::dispatch(djob_t *j)
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, a copy of the previous reply returned in *b
+//     and *sz; the caller frees *b.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
   rpcs::rpcstate_t
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
@@ -690,9 +1436,12 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
         if ((*it).cb_present) {
           // rpc has already replied
           ret = rpcstate_t::DONE;
-          *b = (*it).buf;
+          // a copy: the entry may be freed as soon as we unlock
           *sz = (*it).sz;
           VERIFY((*sz) > 0);
+          *b = (char *) malloc(*sz);
+          VERIFY(*b);
+          memcpy(*b, (*it).buf, *sz);
         }
         else {
           ret = rpcstate_t::INPROGRESS;
@@ -709,9 +1458,10 @@ rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
   }
 
 
-  // clean
-  it = window.begin();
-  for (it++; window.front().xid <= xid_rep && window.front().xid == (*it).xid - 1; it++) {
+  // forget acknowledged replies, keeping the newest of them at the
+  // front as the FORGOTTEN boundary. xids of idempotent procs never
+  // enter the window, so there may be gaps.
+  while (window.size() > 1 && (*std::next(window.begin())).xid <= xid_rep) {
     free(window.front().buf);
     window.pop_front();
   }
@@ -739,7 +1489,8 @@ rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
   }
 
   // copy buffer
-  char * toBuf = new char[sz];
+  char * toBuf = (char *)malloc(sz);
+  VERIFY(toBuf);
   memcpy(toBuf, b, sz);
 
   if(it != reply_window_[clt_nonce].end()) {
@@ -752,7 +1503,7 @@ rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
     reply_t rt(xid);
     rt.cb_present = true;
     rt.buf = toBuf;
-    rt.sz = 0;
+    rt.sz = sz;
     reply_window_[clt_nonce].push_back(rt);
   }
 
@@ -783,6 +1534,230 @@ rpcs::rpcbind(int a, int &r)
   return 0;
 }
 
+  int
+rpcs::rpcping(int a, int &r)
+{
+  r = a;
+  return 0;
+}
+
+  rpcs::stream_t *
+rpcs::get_stream(unsigned int clt_nonce, unsigned int sid)
+{
+  ScopedLock sl(&streams_m_);
+  std::map<std::pair<unsigned int, unsigned int>, stream_t *>::iterator it;
+  it = streams_.find(std::make_pair(clt_nonce, sid));
+  if(it == streams_.end())
+    return NULL;
+  it->second->refs++;
+  it->second->used = time(NULL);
+  return it->second;
+}
+
+  void
+rpcs::put_stream(stream_t *st)
+{
+  {
+    ScopedLock sl(&streams_m_);
+    if(--st->refs > 0)
+      return;
+  }
+  delete st;
+}
+
+// drops the streams of clients that went away mid-stream: those idle
+// for a minute whose client has no live connection, and any idle for
+// ten.  runs at most every ten seconds, as streams are opened.
+  void
+rpcs::reap_streams()
+{
+  std::vector<stream_t *> dead;
+  {
+    ScopedLock sl(&streams_m_);
+    time_t now = time(NULL);
+    if(now < streams_reaped_ + 10)
+      return;
+    streams_reaped_ = now;
+    std::map<std::pair<unsigned int, unsigned int>, stream_t *>::iterator it;
+    for(it = streams_.begin(); it != streams_.end(); ){
+      stream_t *st = it->second;
+      bool gone = false;
+      if(now > st->used + 600){
+        gone = true;
+      } else if(now > st->used + 60){
+        ScopedLock rwl(&conss_m_);
+        gone = conns_.count(it->first.first) == 0 ||
+          conns_[it->first.first]->isdead();
+      }
+      if(gone){
+        jsl_log(JSL_DBG_1, "rpcs::reap_streams: dropping stream %u of %u\n",
+            it->first.second, it->first.first);
+        dead.push_back(st);
+        streams_.erase(it++);
+      } else {
+        it++;
+      }
+    }
+  }
+  for(size_t i = 0; i < dead.size(); i++)
+    put_stream(dead[i]);
+}
+
+  int
+rpcs::stream_open(unsigned int clt_nonce, unsigned int sid, unsigned int proc,
+    std::string args, int &r)
+{
+  reap_streams();
+
+  stream_opener *o;
+  {
+    ScopedLock sl(&streams_m_);
+    if(stream_procs_.count(proc) == 0){
+      fprintf(stderr, "rpcs::stream_open: unknown stream proc %x.\n", proc);
+      VERIFY(0);
+    }
+    o = stream_procs_[proc];
+  }
+
+  stream_t *st = new stream_t();
+  unmarshall u(args);
+  int ret = o->open(u, &st->sink, &st->src);
+  if(ret == rpc_const::unmarshal_args_failure){
+    fprintf(stderr, "rpcs::stream_open: failed to"
+        " unmarshall the arguments. You are"
+        " probably calling RPC 0x%x with wrong"
+        " types of arguments.\n", proc);
+    VERIFY(0);
+  }
+  if(ret != 0){
+    delete st;
+    return ret;
+  }
+  VERIFY(st->sink || st->src);
+
+  ScopedLock sl(&streams_m_);
+  if(streams_.count(std::make_pair(clt_nonce, sid)) != 0){
+    jsl_log(JSL_DBG_1, "rpcs::stream_open: stream %u of %u is open\n",
+        sid, clt_nonce);
+    delete st;
+    return rpc_const::stream_failure;
+  }
+  st->used = time(NULL);
+  streams_[std::make_pair(clt_nonce, sid)] = st;
+  r = 0;
+  return 0;
+}
+
+// a chunk or a close of a stream the server doesn't have fails, so
+// that the client doesn't take a stream lost in a restart for one
+// that ended
+  int
+rpcs::stream_data(unsigned int clt_nonce, unsigned int sid,
+    unsigned long long off, std::string data, int &r)
+{
+  stream_t *st = get_stream(clt_nonce, sid);
+  r = 0;
+  if(st == NULL)
+    return rpc_const::stream_failure;
+
+  int ret;
+  {
+    ScopedLock ml(&st->m);
+    if(st->sink == NULL)
+      st->err = rpc_const::stream_failure;
+    if(st->err == 0 && off >= st->next)
+      st->early[off].swap(data);
+    std::map<unsigned long long, std::string>::iterator it;
+    while(st->err == 0 &&
+        (it = st->early.find(st->next)) != st->early.end()){
+      st->err = st->sink->write(it->second);
+      st->next += it->second.size();
+      st->early.erase(it);
+    }
+    ret = st->err;
+  }
+  put_stream(st);
+  return ret;
+}
+
+  int
+rpcs::stream_read(unsigned int clt_nonce, unsigned int sid,
+    unsigned long long off, int len, std::string &r)
+{
+  stream_t *st = get_stream(clt_nonce, sid);
+  if(st == NULL)
+    return rpc_const::stream_failure;
+
+  int ret = 0;
+  {
+    ScopedLock ml(&st->m);
+    if(st->src == NULL)
+      st->err = rpc_const::stream_failure;
+    // read ahead until [off, off+len) is buffered or src runs dry
+    while(st->err == 0 && !st->eof &&
+        st->next + st->ahead.size() < off + len){
+      std::string chunk;
+      st->err = st->src->read(chunk, len);
+      if(chunk.empty())
+        st->eof = true;
+      st->ahead += chunk;
+    }
+    if(st->err != 0){
+      ret = st->err;
+    } else if(off < st->next){
+      // every chunk is asked for once; a retransmission is answered
+      // from the reply window.
+      jsl_log(JSL_DBG_1, "rpcs::stream_read: offset %llu already dropped\n",
+          off);
+      ret = rpc_const::stream_failure;
+    } else {
+      if(off - st->next < st->ahead.size())
+        r = st->ahead.substr(off - st->next, len);
+
+      // drop the prefix that has been served completely
+      st->served[off] = r.size();
+      std::map<unsigned long long, unsigned long long>::iterator it;
+      while((it = st->served.find(st->next)) != st->served.end() &&
+          it->second > 0){
+        st->ahead.erase(0, it->second);
+        st->next += it->second;
+        st->served.erase(it);
+      }
+    }
+  }
+  put_stream(st);
+  return ret;
+}
+
+  int
+rpcs::stream_close(unsigned int clt_nonce, unsigned int sid, std::string &r)
+{
+  stream_t *st;
+  {
+    ScopedLock sl(&streams_m_);
+    std::map<std::pair<unsigned int, unsigned int>, stream_t *>::iterator it;
+    it = streams_.find(std::make_pair(clt_nonce, sid));
+    if(it == streams_.end())
+      return rpc_const::stream_failure;
+    st = it->second;
+    streams_.erase(it);
+  }
+
+  int ret;
+  {
+    // waits out a late chunk that still holds the stream
+    ScopedLock ml(&st->m);
+    ret = st->err;
+    if(ret == 0 && st->sink){
+      marshall m;
+      ret = st->sink->finish(m);
+      r = m.str();
+    }
+  }
+  put_stream(st);
+  return ret;
+}
+
   void
 marshall::rawbyte(unsigned char x)
 {
@@ -865,6 +1840,14 @@ operator<<(marshall &m, int x)
 
   marshall &
 operator<<(marshall &m, const std::string &s)
+{
+  m << (unsigned int) s.size();
+  m.rawbytes(s.data(), s.size());
+  return m;
+}
+
+  marshall &
+operator<<(marshall &m, const rpc_slice &s)
 {
   m << (unsigned int) s.size();
   m.rawbytes(s.data(), s.size());
@@ -901,8 +1884,9 @@ unmarshall::unpack(int *x)
   void
 unmarshall::take_in(unmarshall &another)
 {
-  if(_buf)
+  if(_buf && !_ref)
     free(_buf);
+  _ref.reset();
   another.take_buf(&_buf, &_sz);
   _ind = RPC_HEADER_SZ;
   _ok = _sz >= RPC_HEADER_SZ?true:false;
@@ -1007,6 +1991,31 @@ operator>>(unmarshall &u, std::string &s)
   return u;
 }
 
+  unmarshall &
+operator>>(unmarshall &u, rpc_slice &s)
+{
+  unsigned sz;
+  u >> sz;
+  if(u.ok())
+    s = u.slice(sz);
+  return u;
+}
+
+// share the next n bytes of the PDU instead of copying them
+  rpc_slice
+unmarshall::slice(unsigned int n)
+{
+  if((_ind+n) > (unsigned)_sz){
+    _ok = false;
+    return rpc_slice();
+  }
+  if(!_ref)
+    _ref.reset(_buf, free);
+  rpc_slice s(_ref, _buf+_ind, n);
+  _ind += n;
+  return s;
+}
+
   void
 unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
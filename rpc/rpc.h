@@ -7,9 +7,12 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <deque>
 #include <stdio.h>
+#include <time.h>
 
 #include "thr_pool.h"
+#include "slock.h"
 #include "marshall.h"
 #include "connection.h"
 
@@ -20,6 +23,15 @@
 class rpc_const {
   public:
     static const unsigned int bind = 1;   // handler number reserved for bind
+    // handler numbers reserved for streaming calls
+    static const unsigned int stream_open = 2;
+    static const unsigned int stream_data = 3;
+    static const unsigned int stream_read = 4;
+    static const unsigned int stream_close = 5;
+    static const unsigned int ping = 6;  // handler number reserved for keepalive
+    // xids of calls from a server back to a client, over the client's
+    // own connection, have this bit set
+    static const unsigned int reverse_xid = 0x80000000;
     static const int timeout_failure = -1;
     static const int unmarshal_args_failure = -2;
     static const int unmarshal_reply_failure = -3;
@@ -27,6 +39,35 @@ class rpc_const {
     static const int oldsrv_failure = -5;
     static const int bind_failure = -6;
     static const int cancel_failure = -7;
+    static const int busy_failure = -8; // server shed the request; retry later
+    // the server has no such stream, say after a restart
+    static const int stream_failure = -9;
+};
+
+// a streaming call moves a payload of any size as a sequence of
+// bounded chunks, each sent as its own RPC, with at most a window of
+// them outstanding.  the sending side reads the chunks from an
+// rpc_source, the receiving side gets them in offset order through
+// an rpc_sink, so neither end ever holds the whole payload in a PDU.
+// read() and write() return 0 on success; any other value aborts the
+// stream and becomes the result of the call.
+class rpc_source {
+  public:
+    virtual ~rpc_source() {}
+    // set chunk to at most max bytes; an empty chunk ends the stream
+    virtual int read(std::string &chunk, int max) = 0;
+};
+
+class rpcs;
+struct stream_job;
+
+class rpc_sink {
+  public:
+    virtual ~rpc_sink() {}
+    virtual int write(const std::string &chunk) = 0;
+    // on the server, called after the last chunk of an upload to
+    // produce the reply of the call
+    virtual int finish(marshall &rep) { return 0; }
 };
 
 // rpc client endpoint.
@@ -45,6 +86,7 @@ class rpcc : public chanmgr {
       unmarshall *un;
       int intret;
       bool done;
+      int busy_ms; // server asked us to retry after this many ms
       pthread_mutex_t m;
       pthread_cond_t c;
     };
@@ -61,9 +103,12 @@ class rpcc : public chanmgr {
     int lossytest_;
     bool retrans_;
     bool reachable_;
+    bool reverse_; // a server's rpcc back to a client; can't reconnect
 
     connection *chan_;
 
+    rpcs *callbacks_; // serves calls the server makes back to us
+
     pthread_mutex_t m_; // protect insert/delete to calls[]
     pthread_mutex_t chan_m_;
 
@@ -82,9 +127,33 @@ class rpcc : public chanmgr {
     };
     struct request dup_req_;
     int xid_rep_done_;
+
+    // streaming calls.  the caller runs one chunk RPC of a stream's
+    // window at a time, and stream_pool_ the rest; it is made on the
+    // first streaming call.
+    unsigned int next_sid_;
+    int stream_chunk_;
+    int stream_window_;
+    ThrPool *stream_pool_;
+    void stream_helper(stream_job *j);
+
+    // keepalive (set_keepalive)
+    int ka_idle_;
+    int ka_timeout_;
+    bool ka_running_;
+    bool ka_stop_;
+    pthread_t ka_th_;
+    pthread_cond_t ka_c_;
+    struct timespec last_rx_; // when we last heard from the server
+    static void *keepalive_thread(void *);
+    void keepalive_loop();
+    void fail_calls_wo(int ret);
   public:
 
     rpcc(sockaddr_in d, bool retrans=true);
+    // call back a client over the connection it opened to us; see
+    // rpcs::reverse
+    rpcc(connection *c);
     ~rpcc();
 
     struct TO {
@@ -100,8 +169,19 @@ class rpcc : public chanmgr {
 
     void set_reachable(bool r) { reachable_ = r; }
 
+    // the server may call procedures registered on s over the
+    // connection of this rpcc; s needs no port of its own
+    void set_callbacks(rpcs *s);
+
     void cancel();
 
+    // ping the server whenever nothing has been heard from it for
+    // idle_ms.  if the ping goes unanswered for timeout_ms, close the
+    // connection and fail the pending calls with timeout_failure.
+    // idle_ms 0 turns keepalive off.  RPC_KEEPALIVE=idle_ms[:timeout_ms]
+    // turns it on for every rpcc.
+    void set_keepalive(int idle_ms, int timeout_ms);
+
     int islossy() { return lossytest_ > 0; }
 
     int call1(unsigned int proc,
@@ -109,6 +189,20 @@ class rpcc : public chanmgr {
 
     bool got_pdu(connection *c, char *b, int sz);
 
+    // chunk size and number of chunks in flight of streaming calls
+    void set_stream_window(int chunk, int window);
+
+    // upload the payload read from src; the server's rpc_sink
+    // produces r once it has consumed the whole stream
+    template<class R, class A1>
+      int call_upload(unsigned int proc, const A1 & a1, rpc_source *src,
+          R & r, TO to = to_max);
+    // download the payload the server's rpc_source produces into dst
+    template<class A1>
+      int call_download(unsigned int proc, const A1 & a1, rpc_sink *dst,
+          TO to = to_max);
+    int stream_call(unsigned int proc, const std::string &args,
+        rpc_source *src, rpc_sink *dst, std::string &rep, TO to);
 
     template<class R>
       int call_m(unsigned int proc, marshall &req, R & r, TO to);
@@ -142,6 +236,37 @@ class rpcc : public chanmgr {
 
 };
 
+  template<class R, class A1> int
+rpcc::call_upload(unsigned int proc, const A1 & a1, rpc_source *src, R & r,
+    TO to)
+{
+  marshall m;
+  m << a1;
+  std::string rep;
+  int ret = stream_call(proc, m.str(), src, NULL, rep, to);
+  if(ret == 0){
+    unmarshall u(rep);
+    u >> r;
+    if(!u.okdone()){
+      fprintf(stderr, "rpcc::call_upload: failed to unmarshall the reply."
+          "You are probably calling RPC 0x%x with wrong return "
+          "type.\n", proc);
+      VERIFY(0);
+      return rpc_const::unmarshal_reply_failure;
+    }
+  }
+  return ret;
+}
+
+  template<class A1> int
+rpcc::call_download(unsigned int proc, const A1 & a1, rpc_sink *dst, TO to)
+{
+  marshall m;
+  m << a1;
+  std::string rep;
+  return stream_call(proc, m.str(), NULL, dst, rep, to);
+}
+
   template<class R> int
 rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 {
@@ -256,11 +381,51 @@ rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
+class rpcs;
+
+// the pending reply to an RPC whose handler was registered with
+// rpcs::reg_deferred.  the handler keeps the token and returns at
+// once; later, from any thread, someone calls reply() exactly once,
+// which sends the reply and deletes the token.  until then the xid
+// stays INPROGRESS in the at-most-once window, and the only cost of
+// the waiting RPC is this object.  all tokens must be answered before
+// their rpcs is deleted.
+class reply_token {
+  public:
+    template<class R>
+      void reply(int ret, const R &r);
+  private:
+    friend class rpcs;
+    reply_token(rpcs *s, connection *c, unsigned int clt_nonce,
+        unsigned int xid, bool save)
+      : srv_(s), conn_(c), clt_nonce_(clt_nonce), xid_(xid), save_(save) {}
+    ~reply_token() {}
+    rpcs *srv_;
+    connection *conn_; // holds a reference until the reply is sent
+    unsigned int clt_nonce_;
+    unsigned int xid_;
+    bool save_; // remember the reply for at-most-once
+};
+
+// opens the server side of a stream registered with
+// rpcs::reg_upload or rpcs::reg_download
+class stream_opener {
+  public:
+    virtual ~stream_opener() { }
+    virtual int open(unmarshall &args, rpc_sink **sink, rpc_source **src) = 0;
+};
+
 class handler {
   public:
-    handler() { }
+    handler() : idempotent(false) { }
     virtual ~handler() { }
+    // re-executed on a duplicate rather than answered from the
+    // at-most-once reply window (rpcs::set_idempotent)
+    bool idempotent;
     virtual int fn(unmarshall &, marshall &) = 0;
+    // deferred handlers implement dfn instead of fn
+    virtual bool deferred() { return false; }
+    virtual int dfn(unmarshall &, reply_token *) { VERIFY(0); return 0; }
 };
 
 
@@ -309,9 +474,66 @@ class rpcs : public chanmgr {
 
   void updatestat(unsigned int proc);
 
+  // record (for at-most-once, if save) and send a reply; consumes a
+  // reference on c
+  void send_reply(connection *c, unsigned int clt_nonce, unsigned int xid,
+      int ret, marshall &rep, bool save = true);
+  friend class reply_token;
+
   // latest connection to the client
   std::map<unsigned int, connection *> conns_;
 
+  // open streams, indexed by (clt_nonce, stream id).  an upload
+  // buffers chunks that arrive ahead of next and writes the rest to
+  // sink in order; a download reads ahead from src into ahead, which
+  // starts at offset next, and drops what every chunk request has
+  // been served.  refs counts streams_ and the handlers using the
+  // stream, and the last to let go deletes it.
+  struct stream_t {
+    stream_t() : sink(NULL), src(NULL), next(0), eof(false), err(0),
+      refs(1), used(0) {
+      VERIFY(pthread_mutex_init(&m, 0) == 0);
+    }
+    ~stream_t() {
+      delete sink;
+      delete src;
+      VERIFY(pthread_mutex_destroy(&m) == 0);
+    }
+    rpc_sink *sink;
+    rpc_source *src;
+    unsigned long long next;
+    std::map<unsigned long long, std::string> early;
+    std::string ahead;
+    std::map<unsigned long long, unsigned long long> served;
+    bool eof;
+    int err;
+    pthread_mutex_t m;
+    int refs;    // protected by streams_m_
+    time_t used; // of the last chunk; protected by streams_m_
+  };
+  // rpccs calling clients back over their own connections, and how
+  // many callers (reverse() up to reverse_done()) and replies to them
+  // are using each
+  std::map<unsigned int, rpcc *> reverse_;
+  std::map<connection *, rpcc *> reverse_conn_;
+  std::map<rpcc *, int> reverse_users_;
+  // replaced when their client reconnected or went away; each is
+  // freed once it has no users
+  std::list<rpcc *> reverse_old_;
+  pthread_mutex_t reverse_m_; // protect the four above
+  // assume reverse_m_ is held; return an rpcc to free, if any
+  rpcc *retire_reverse_wo(rpcc *cl);
+  rpcc *unuse_reverse_wo(rpcc *cl);
+
+  std::map<std::pair<unsigned int, unsigned int>, stream_t *> streams_;
+  std::map<int, stream_opener *> stream_procs_;
+  pthread_mutex_t streams_m_; // protect streams_
+  time_t streams_reaped_;
+  // a stream with a reference, or NULL; put_stream gives it back
+  stream_t *get_stream(unsigned int clt_nonce, unsigned int sid);
+  void put_stream(stream_t *st);
+  void reap_streams();
+
   // counting
   const int counting_;
   int curr_counts_;
@@ -332,13 +554,31 @@ class rpcs : public chanmgr {
   protected:
 
   struct djob_t {
-    djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+    djob_t (connection *c, char *b, int bsz, unsigned int n)
+      :buf(b),sz(bsz),conn(c),clt_nonce(n) {}
     char *buf;
     int sz;
     connection *conn;
+    unsigned int clt_nonce;
   };
   void dispatch(djob_t *);
 
+  // fair scheduling of the dispatch pool across clients.  requests are
+  // queued per clt_nonce and handed out in deficit round robin order,
+  // each client earning quantum_ bytes of credit per round.  a client
+  // with max_inflight_ requests queued or executing gets a busy reply
+  // instead of another slot.
+  std::map<unsigned int, std::deque<djob_t *> > sched_q_;
+  std::map<unsigned int, int> deficit_;
+  std::map<unsigned int, int> inflight_;
+  std::list<unsigned int> active_; // clients with queued requests
+  int quantum_;
+  int max_inflight_;
+  pthread_mutex_t sched_m_; // protect the scheduling state above
+  djob_t *next_job_wo();
+  void dispatch_next(int);
+  void dispatch_busy(djob_t *);
+
   // internal handler registration
   void reg1(unsigned int proc, handler *);
 
@@ -346,16 +586,44 @@ class rpcs : public chanmgr {
   tcpsconn* listener_;
 
   public:
-  rpcs(unsigned int port, int counts=0);
+  // an rpcs that only serves callbacks of an rpcc (rpcc::set_callbacks)
+  // is made with listen false
+  rpcs(unsigned int port, int counts=0, bool listen=true);
   ~rpcs();
   
-  inline int port() { return listener_->port(); }
+  inline int port() { return listener_ ? listener_->port() : 0; }
+
+  // an rpcc on which to call the client clt_nonce back over its
+  // latest connection, or NULL if that connection is gone. owned by
+  // this rpcs; the caller gives it back with reverse_done once its
+  // calls have returned.
+  rpcc *reverse(unsigned int clt_nonce);
+  void reverse_done(rpcc *cl);
 
   //RPC handler for clients binding
   int rpcbind(int a, int &r);
+  //RPC handler for keepalive pings
+  int rpcping(int a, int &r);
+
+  //RPC handlers for streaming calls
+  int stream_open(unsigned int clt_nonce, unsigned int sid, unsigned int proc,
+      std::string args, int &r);
+  int stream_data(unsigned int clt_nonce, unsigned int sid,
+      unsigned long long off, std::string data, int &r);
+  int stream_read(unsigned int clt_nonce, unsigned int sid,
+      unsigned long long off, int len, std::string &r);
+  int stream_close(unsigned int clt_nonce, unsigned int sid, std::string &r);
 
   void set_reachable(bool r) { reachable_ = r; }
 
+  // limit on requests per client queued or executing; 0 means no limit
+  void set_max_inflight(int n);
+
+  // proc has no side effects, so its replies are not kept for
+  // at-most-once; a duplicate request simply runs it again.
+  // call after registering proc.
+  void set_idempotent(unsigned int proc);
+
   bool got_pdu(connection *c, char *b, int sz);
 
   // register a handler
@@ -385,8 +653,44 @@ class rpcs : public chanmgr {
             const A3, const A4, const A5,
             const A6, const A7,
             R & r));
+
+  // register the server side of a streaming call: meth looks at the
+  // call's argument and hands back the sink that will consume the
+  // upload, or the source that will produce the download
+  template<class S, class A1>
+    void reg_upload(unsigned int proc, S*, int (S::*meth)(const A1,
+          rpc_sink **));
+  template<class S, class A1>
+    void reg_download(unsigned int proc, S*, int (S::*meth)(const A1,
+          rpc_source **));
+
+  // register a handler that replies later through a reply_token
+  template<class S, class A1>
+    void reg_deferred(unsigned int proc, S*, void (S::*meth)(const A1,
+          reply_token *));
+  template<class S, class A1, class A2>
+    void reg_deferred(unsigned int proc, S*, void (S::*meth)(const A1,
+          const A2, reply_token *));
+  template<class S, class A1, class A2, class A3>
+    void reg_deferred(unsigned int proc, S*, void (S::*meth)(const A1,
+          const A2, const A3, reply_token *));
+  template<class S, class A1, class A2, class A3, class A4>
+    void reg_deferred(unsigned int proc, S*, void (S::*meth)(const A1,
+          const A2, const A3, const A4, reply_token *));
+  template<class S, class A1, class A2, class A3, class A4, class A5>
+    void reg_deferred(unsigned int proc, S*, void (S::*meth)(const A1,
+          const A2, const A3, const A4, const A5, reply_token *));
 };
 
+  template<class R> void
+reply_token::reply(int ret, const R &r)
+{
+  marshall m;
+  m << r;
+  srv_->send_reply(conn_, clt_nonce_, xid_, ret, m, save_);
+  delete this;
+}
+
   template<class S, class A1, class R> void
 rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 {
@@ -619,6 +923,204 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 }
 
 
+  template<class S, class A1> void
+rpcs::reg_deferred(unsigned int proc, S*sob, void (S::*meth)(const A1 a1,
+      reply_token *t))
+{
+  class h1 : public handler {
+    private:
+      S * sob;
+      void (S::*meth)(const A1 a1, reply_token *t);
+    public:
+      h1(S *xsob, void (S::*xmeth)(const A1 a1, reply_token *t))
+        : sob(xsob), meth(xmeth) { }
+      int fn(unmarshall &args, marshall &ret) { VERIFY(0); return 0; }
+      bool deferred() { return true; }
+      int dfn(unmarshall &args, reply_token *t) {
+        A1 a1;
+        args >> a1;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        (sob->*meth)(a1, t);
+        return 0;
+      }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+  template<class S, class A1, class A2> void
+rpcs::reg_deferred(unsigned int proc, S*sob, void (S::*meth)(const A1 a1,
+      const A2 a2, reply_token *t))
+{
+  class h1 : public handler {
+    private:
+      S * sob;
+      void (S::*meth)(const A1 a1, const A2 a2, reply_token *t);
+    public:
+      h1(S *xsob, void (S::*xmeth)(const A1 a1, const A2 a2, reply_token *t))
+        : sob(xsob), meth(xmeth) { }
+      int fn(unmarshall &args, marshall &ret) { VERIFY(0); return 0; }
+      bool deferred() { return true; }
+      int dfn(unmarshall &args, reply_token *t) {
+        A1 a1;
+        A2 a2;
+        args >> a1;
+        args >> a2;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        (sob->*meth)(a1, a2, t);
+        return 0;
+      }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+  template<class S, class A1, class A2, class A3> void
+rpcs::reg_deferred(unsigned int proc, S*sob, void (S::*meth)(const A1 a1,
+      const A2 a2, const A3 a3, reply_token *t))
+{
+  class h1 : public handler {
+    private:
+      S * sob;
+      void (S::*meth)(const A1 a1, const A2 a2, const A3 a3, reply_token *t);
+    public:
+      h1(S *xsob, void (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
+            reply_token *t))
+        : sob(xsob), meth(xmeth) { }
+      int fn(unmarshall &args, marshall &ret) { VERIFY(0); return 0; }
+      bool deferred() { return true; }
+      int dfn(unmarshall &args, reply_token *t) {
+        A1 a1;
+        A2 a2;
+        A3 a3;
+        args >> a1;
+        args >> a2;
+        args >> a3;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        (sob->*meth)(a1, a2, a3, t);
+        return 0;
+      }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+  template<class S, class A1, class A2, class A3, class A4> void
+rpcs::reg_deferred(unsigned int proc, S*sob, void (S::*meth)(const A1 a1,
+      const A2 a2, const A3 a3, const A4 a4, reply_token *t))
+{
+  class h1 : public handler {
+    private:
+      S * sob;
+      void (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
+          reply_token *t);
+    public:
+      h1(S *xsob, void (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
+            const A4 a4, reply_token *t))
+        : sob(xsob), meth(xmeth) { }
+      int fn(unmarshall &args, marshall &ret) { VERIFY(0); return 0; }
+      bool deferred() { return true; }
+      int dfn(unmarshall &args, reply_token *t) {
+        A1 a1;
+        A2 a2;
+        A3 a3;
+        A4 a4;
+        args >> a1;
+        args >> a2;
+        args >> a3;
+        args >> a4;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        (sob->*meth)(a1, a2, a3, a4, t);
+        return 0;
+      }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+  template<class S, class A1, class A2, class A3, class A4, class A5> void
+rpcs::reg_deferred(unsigned int proc, S*sob, void (S::*meth)(const A1 a1,
+      const A2 a2, const A3 a3, const A4 a4, const A5 a5, reply_token *t))
+{
+  class h1 : public handler {
+    private:
+      S * sob;
+      void (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
+          const A5 a5, reply_token *t);
+    public:
+      h1(S *xsob, void (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
+            const A4 a4, const A5 a5, reply_token *t))
+        : sob(xsob), meth(xmeth) { }
+      int fn(unmarshall &args, marshall &ret) { VERIFY(0); return 0; }
+      bool deferred() { return true; }
+      int dfn(unmarshall &args, reply_token *t) {
+        A1 a1;
+        A2 a2;
+        A3 a3;
+        A4 a4;
+        A5 a5;
+        args >> a1;
+        args >> a2;
+        args >> a3;
+        args >> a4;
+        args >> a5;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        (sob->*meth)(a1, a2, a3, a4, a5, t);
+        return 0;
+      }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+  template<class S, class A1> void
+rpcs::reg_upload(unsigned int proc, S*sob, int (S::*meth)(const A1 a1,
+      rpc_sink **s))
+{
+  class o1 : public stream_opener {
+    private:
+      S * sob;
+      int (S::*meth)(const A1 a1, rpc_sink **s);
+    public:
+      o1(S *xsob, int (S::*xmeth)(const A1 a1, rpc_sink **s))
+        : sob(xsob), meth(xmeth) { }
+      int open(unmarshall &args, rpc_sink **sink, rpc_source **src) {
+        A1 a1;
+        args >> a1;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        return (sob->*meth)(a1, sink);
+      }
+  };
+  ScopedLock sl(&streams_m_);
+  VERIFY(stream_procs_.count(proc) == 0);
+  stream_procs_[proc] = new o1(sob, meth);
+}
+
+  template<class S, class A1> void
+rpcs::reg_download(unsigned int proc, S*sob, int (S::*meth)(const A1 a1,
+      rpc_source **s))
+{
+  class o1 : public stream_opener {
+    private:
+      S * sob;
+      int (S::*meth)(const A1 a1, rpc_source **s);
+    public:
+      o1(S *xsob, int (S::*xmeth)(const A1 a1, rpc_source **s))
+        : sob(xsob), meth(xmeth) { }
+      int open(unmarshall &args, rpc_sink **sink, rpc_source **src) {
+        A1 a1;
+        args >> a1;
+        if(!args.okdone())
+          return rpc_const::unmarshal_args_failure;
+        return (sob->*meth)(a1, src);
+      }
+  };
+  ScopedLock sl(&streams_m_);
+  VERIFY(stream_procs_.count(proc) == 0);
+  stream_procs_[proc] = new o1(sob, meth);
+}
+
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
 void make_sockaddr(const char *host, const char *port,
     struct sockaddr_in *dst);
@@ -0,0 +1,363 @@
+// RPC throughput and latency benchmark.
+//
+// sweeps payload size, client threads, rpcc instances, and the
+// RPC_LOSSY / RPC_DELAY settings of the client connections, and prints
+// one JSON object per point on stdout:
+//
+//   rpcbench [-s | -c] [-h host] [-p port] [-o put,get] [-m sizes]
+//            [-t threads] [-n rpccs] [-D delays] [-L lossy] [-T secs]
+//
+// -s only serves, -c only drives a separate rpcbench -s; by default
+// both run in this process.  list arguments are comma separated, sizes
+// take a k or m suffix, and delays are one-way milliseconds.  a delay
+// shapes both directions only when the server runs in this process.
+// payloads too large for one PDU go as streaming calls.
+
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "jsl_log.h"
+#include "gettime.h"
+#include "lang/verify.h"
+
+// procedures of the benchmark server
+enum {
+	put_proc = 0x9001,     // a1 is the payload, r its size
+	get_proc,              // a1 is the size, r the payload
+	put_stream_proc,
+	get_stream_proc,
+};
+
+// larger payloads are streamed; a PDU holds at most 10M
+static const int stream_above = 8 << 20;
+static const int stream_chunk = 1 << 20;
+
+class fill_source : public rpc_source {
+	public:
+		fill_source(long long n) : n(n) {}
+		int read(std::string &chunk, int max) {
+			chunk.assign(std::min((long long) max, n), 'x');
+			n -= chunk.size();
+			return 0;
+		}
+	private:
+		long long n;
+};
+
+class count_sink : public rpc_sink {
+	public:
+		count_sink() : n(0) {}
+		int write(const std::string &chunk) {
+			n += chunk.size();
+			return 0;
+		}
+		int finish(marshall &rep) {
+			rep << n;
+			return 0;
+		}
+		unsigned long long n;
+};
+
+class benchsrv {
+	public:
+		int put(const rpc_slice data, int &r) {
+			r = data.size();
+			return 0;
+		}
+		int get(const int n, std::string &r) {
+			r.assign(n, 'x');
+			return 0;
+		}
+		int put_stream(const int n, rpc_sink **s) {
+			*s = new count_sink();
+			return 0;
+		}
+		int get_stream(const int n, rpc_source **s) {
+			*s = new fill_source(n);
+			return 0;
+		}
+};
+
+static benchsrv service;
+
+static rpcs *
+startserver(int port)
+{
+	rpcs *server = new rpcs(port);
+	server->reg(put_proc, &service, &benchsrv::put);
+	server->reg(get_proc, &service, &benchsrv::get);
+	server->set_idempotent(get_proc);
+	server->reg_upload(put_stream_proc, &service, &benchsrv::put_stream);
+	server->reg_download(get_stream_proc, &service, &benchsrv::get_stream);
+	return server;
+}
+
+// one point of the sweep
+struct point {
+	bool put;
+	int size;
+	int threads;
+	int nrpcc;
+	double delay_ms;
+	int lossy;
+};
+
+struct worker {
+	rpcc *cl;
+	const point *p;
+	struct timespec end;
+	std::string payload;
+	std::vector<int> lat_us;
+	int failures;
+};
+
+static long long
+elapsed_us(const struct timespec &a, const struct timespec &b)
+{
+	return (b.tv_sec - a.tv_sec) * 1000000LL + (b.tv_nsec - a.tv_nsec) / 1000;
+}
+
+static int
+one_call(worker *w)
+{
+	const point *p = w->p;
+	if (p->size > stream_above) {
+		if (p->put) {
+			fill_source src(p->size);
+			unsigned long long got;
+			return w->cl->call_upload(put_stream_proc, p->size, &src, got);
+		}
+		count_sink dst;
+		return w->cl->call_download(get_stream_proc, p->size, &dst);
+	}
+	if (p->put) {
+		int got;
+		return w->cl->call(put_proc, w->payload, got);
+	}
+	std::string got;
+	int ret = w->cl->call(get_proc, p->size, got);
+	VERIFY(ret != 0 || (int) got.size() == p->size);
+	return ret;
+}
+
+static void *
+run_worker(void *x)
+{
+	worker *w = (worker *) x;
+	if (w->p->put && w->p->size <= stream_above)
+		w->payload.assign(w->p->size, 'x');
+	while (1) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (elapsed_us(w->end, t0) >= 0)
+			break;
+		int ret = one_call(w);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (ret == 0)
+			w->lat_us.push_back(elapsed_us(t0, t1));
+		else
+			w->failures++;
+	}
+	return 0;
+}
+
+static int
+percentile(const std::vector<int> &v, double q)
+{
+	if (v.empty())
+		return 0;
+	size_t i = (size_t) (q * v.size());
+	return v[std::min(i, v.size() - 1)];
+}
+
+static void
+run_point(const sockaddr_in &dst, const point &p, double secs)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%d", p.lossy);
+	VERIFY(setenv("RPC_LOSSY", buf, 1) == 0);
+	if (p.delay_ms > 0) {
+		snprintf(buf, sizeof(buf), "fixed:%g", p.delay_ms);
+		VERIFY(setenv("RPC_DELAY", buf, 1) == 0);
+	}
+
+	// connections pick up the environment when they are made
+	std::vector<rpcc *> cls;
+	for (int i = 0; i < p.nrpcc; i++) {
+		rpcc *cl = new rpcc(dst);
+		VERIFY(cl->bind() == 0);
+		cl->set_stream_window(stream_chunk, 4);
+		cls.push_back(cl);
+	}
+	VERIFY(unsetenv("RPC_DELAY") == 0);
+	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
+
+	std::vector<worker> ws(p.threads);
+	std::vector<pthread_t> th(p.threads);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	unsigned long sys0 = PollMgr::Instance()->aio_syscalls();
+	for (int i = 0; i < p.threads; i++) {
+		ws[i].cl = cls[i % p.nrpcc];
+		ws[i].p = &p;
+		ws[i].failures = 0;
+		ws[i].end = t0;
+		ws[i].end.tv_sec += (time_t) secs;
+		ws[i].end.tv_nsec += (long) ((secs - (time_t) secs) * 1e9);
+		if (ws[i].end.tv_nsec >= 1000000000) {
+			ws[i].end.tv_sec++;
+			ws[i].end.tv_nsec -= 1000000000;
+		}
+		VERIFY(pthread_create(&th[i], NULL, run_worker, &ws[i]) == 0);
+	}
+	std::vector<int> lat;
+	int failures = 0;
+	for (int i = 0; i < p.threads; i++) {
+		VERIFY(pthread_join(th[i], NULL) == 0);
+		lat.insert(lat.end(), ws[i].lat_us.begin(), ws[i].lat_us.end());
+		failures += ws[i].failures;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	unsigned long sys = PollMgr::Instance()->aio_syscalls() - sys0;
+
+	for (size_t i = 0; i < cls.size(); i++)
+		delete cls[i];
+
+	std::sort(lat.begin(), lat.end());
+	double el = elapsed_us(t0, t1) / 1e6;
+	double ops = lat.size();
+	printf("{\"op\": \"%s\", \"size\": %d, \"threads\": %d, \"rpccs\": %d, "
+	    "\"delay_ms\": %g, \"lossy\": %d, \"aio\": \"%s\", "
+	    "\"secs\": %.3f, \"ops\": %.0f, \"failures\": %d, "
+	    "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+	    "\"p50_us\": %d, \"p99_us\": %d, \"p999_us\": %d, "
+	    "\"poll_syscalls_per_op\": %.3f}\n",
+	    p.put ? "put" : "get", p.size, p.threads, p.nrpcc, p.delay_ms,
+	    p.lossy, PollMgr::Instance()->aio_name(), el, ops, failures,
+	    ops / el, ops * p.size / el / (1 << 20),
+	    percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999),
+	    ops > 0 ? sys / ops : 0.0);
+}
+
+// splits a comma separated list of numbers; k and m multiply by 2^10, 2^20
+static std::vector<double>
+parse_list(const char *s)
+{
+	std::vector<double> v;
+	while (*s) {
+		char *end;
+		double x = strtod(s, &end);
+		if (end == s)
+			break;
+		if (*end == 'k' || *end == 'K') {
+			x *= 1 << 10;
+			end++;
+		} else if (*end == 'm' || *end == 'M') {
+			x *= 1 << 20;
+			end++;
+		}
+		v.push_back(x);
+		s = *end == ',' ? end + 1 : end;
+	}
+	return v;
+}
+
+static void
+usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [-s | -c] [-h host] [-p port] [-o put,get] "
+	    "[-m sizes] [-t threads] [-n rpccs] [-D delays] [-L lossy] "
+	    "[-T secs] [-d debug]\n", me);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	bool isclient = false, isserver = false;
+	const char *host = "127.0.0.1";
+	int port = 20000 + (getpid() % 10000);
+	std::string opss = "put,get";
+	std::vector<double> sizes = parse_list("64,1k,16k,256k,1m,4m,16m");
+	std::vector<double> threads = parse_list("1,4,16");
+	std::vector<double> nrpccs = parse_list("1");
+	std::vector<double> delays = parse_list("0");
+	std::vector<double> lossies = parse_list("0");
+	double secs = 2;
+
+	srandom(getpid());
+
+	int ch;
+	while ((ch = getopt(argc, argv, "sch:p:o:m:t:n:D:L:T:d:")) != -1) {
+		switch (ch) {
+			case 's': isserver = true; break;
+			case 'c': isclient = true; break;
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'o': opss = optarg; break;
+			case 'm': sizes = parse_list(optarg); break;
+			case 't': threads = parse_list(optarg); break;
+			case 'n': nrpccs = parse_list(optarg); break;
+			case 'D': delays = parse_list(optarg); break;
+			case 'L': lossies = parse_list(optarg); break;
+			case 'T': secs = atof(optarg); break;
+			case 'd': jsl_set_debug(atoi(optarg)); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (!isserver && !isclient)
+		isserver = isclient = true;
+
+	if (isserver) {
+		startserver(port);
+		fprintf(stderr, "rpcbench: serving on port %d\n", port);
+		if (!isclient) {
+			while (1)
+				sleep(1000);
+		}
+	}
+
+	struct hostent *hp = gethostbyname(host);
+	if (hp == NULL || hp->h_length != 4) {
+		fprintf(stderr, "rpcbench: unknown host %s\n", host);
+		exit(1);
+	}
+	sockaddr_in dst;
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	memcpy(&dst.sin_addr, hp->h_addr, 4);
+	dst.sin_port = htons(port);
+
+	bool ops[2] = { opss.find("put") != std::string::npos,
+		opss.find("get") != std::string::npos };
+	for (int o = 0; o < 2; o++) {
+		if (!ops[o])
+			continue;
+		for (size_t l = 0; l < lossies.size(); l++)
+		for (size_t d = 0; d < delays.size(); d++)
+		for (size_t n = 0; n < nrpccs.size(); n++)
+		for (size_t t = 0; t < threads.size(); t++)
+		for (size_t m = 0; m < sizes.size(); m++) {
+			point p;
+			p.put = o == 0;
+			p.size = (int) sizes[m];
+			p.threads = (int) threads[t];
+			p.nrpcc = (int) nrpccs[n];
+			p.delay_ms = delays[d];
+			p.lossy = (int) lossies[l];
+			if (p.threads < 1 || p.nrpcc < 1 || p.size < 0)
+				usage(argv[0]);
+			run_point(dst, p, secs);
+		}
+	}
+	exit(0);
+}
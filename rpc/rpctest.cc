@@ -10,6 +10,8 @@
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
+#include "slock.h"
+#include <vector>
 
 #define NUM_CL 2
 
@@ -28,6 +30,12 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		void handle_deferred(const int a, reply_token *t);
+		int handle_upload(const int n, rpc_sink **s);
+		int handle_download(const int n, rpc_source **s);
+		int handle_callback(const unsigned int clt, const int a, int &r);
+		int handle_double(const int a, int &r);
+		int handle_stall(const int a, int &r);
 };
 
 // a handler. a and b are arguments, r is the result.
@@ -66,6 +74,100 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// a deferred handler returns without replying; the reply is sent
+// later, by whoever calls reply() on the token.
+pthread_mutex_t parked_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parked_c = PTHREAD_COND_INITIALIZER;
+std::vector<std::pair<int, reply_token *> > parked;
+
+void
+srv::handle_deferred(const int a, reply_token *t)
+{
+	ScopedLock ml(&parked_m);
+	parked.push_back(std::make_pair(a, t));
+	VERIFY(pthread_cond_signal(&parked_c) == 0);
+}
+
+// streams of n bytes with a known pattern, so that neither end
+// needs to keep the whole payload to check it.
+static char
+pattern(unsigned long long i)
+{
+	return 'a' + i % 23;
+}
+
+class pattern_source : public rpc_source {
+	public:
+		pattern_source(unsigned long long n) : off(0), n(n) {}
+		int read(std::string &chunk, int max) {
+			unsigned long long len = std::min((unsigned long long) max, n - off);
+			chunk.resize(len);
+			for(unsigned long long i = 0; i < len; i++)
+				chunk[i] = pattern(off + i);
+			off += len;
+			return 0;
+		}
+	private:
+		unsigned long long off, n;
+};
+
+class pattern_sink : public rpc_sink {
+	public:
+		pattern_sink() : off(0) {}
+		int write(const std::string &chunk) {
+			for(unsigned long long i = 0; i < chunk.size(); i++)
+				VERIFY(chunk[i] == pattern(off + i));
+			off += chunk.size();
+			return 0;
+		}
+		int finish(marshall &rep) {
+			rep << off;
+			return 0;
+		}
+		unsigned long long off;
+};
+
+int
+srv::handle_upload(const int n, rpc_sink **s)
+{
+	*s = new pattern_sink();
+	return 0;
+}
+
+int
+srv::handle_download(const int n, rpc_source **s)
+{
+	*s = new pattern_source(n);
+	return 0;
+}
+
+// calls the client back over the connection the call came in on
+int
+srv::handle_callback(const unsigned int clt, const int a, int &r)
+{
+	rpcc *cl = server->reverse(clt);
+	VERIFY(cl != NULL);
+	int ret = cl->call(30, a, r);
+	server->reverse_done(cl);
+	r += 1;
+	return ret;
+}
+
+int
+srv::handle_double(const int a, int &r)
+{
+	r = 2 * a;
+	return 0;
+}
+
+int
+srv::handle_stall(const int a, int &r)
+{
+	sleep(5);
+	r = a;
+	return 0;
+}
+
 srv service;
 
 void startserver()
@@ -75,6 +177,13 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg_deferred(26, &service, &srv::handle_deferred);
+	server->reg_upload(27, &service, &srv::handle_upload);
+	server->reg_download(28, &service, &srv::handle_download);
+	server->reg(29, &service, &srv::handle_callback);
+	// same as 25, but re-executed on duplicates instead of cached
+	server->reg(31, &service, &srv::handle_bigrep);
+	server->set_idempotent(31);
 }
 
 void
@@ -108,6 +217,22 @@ testmarshall()
 	un >> s1;
 	VERIFY(un.okdone());
 	VERIFY(i1==i && l1==l && s1==s);
+
+	// a slice goes on the wire like a string, and shares the pdu
+	rpc_slice sl;
+	{
+		marshall m2;
+		m2 << s;
+		char *b2;
+		int sz2;
+		m2.take_buf(&b2,&sz2);
+		unmarshall un2(b2,sz2);
+		un2.unpack_req_header(&rh1);
+		un2 >> sl;
+		VERIFY(un2.okdone());
+		VERIFY(sl.data() == b2 + RPC_HEADER_SZ + sizeof(int));
+	}
+	VERIFY(sl.str() == s && sl.sub(2, 3).str() == "llo");
 }
 
 void *
@@ -161,7 +286,9 @@ client2(void *xx)
 	while(time(0) - t1 < 10){
 		int arg = (random() % 2000);
 		std::string rep;
-		int ret = clients[which_cl]->call(25, arg, rep);
+		// mixing in idempotent calls leaves gaps in the server's
+		// reply window
+		int ret = clients[which_cl]->call((arg % 3) ? 25 : 31, arg, rep);
 		if ((int)rep.size()!=arg) {
 			printf("ask for %d reply got %d ret %d\n",
                                arg, (int)rep.size(), ret);
@@ -281,6 +408,234 @@ concurrent_test(int nt)
 	printf(" OK\n");
 }
 
+void *
+client4(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+
+	for(int i = 0; i < 20; i++){
+		int rep;
+		int ret = c->call(24, i, rep);
+		VERIFY(ret == 0);
+		VERIFY(rep == i+2);
+	}
+	return 0;
+}
+
+void
+busy_test(int nt)
+{
+	// one client keeps more calls outstanding than the server
+	// admits; the refused ones must back off and still succeed.
+	int ret;
+
+	printf("start busy_test (%d threads) ...", nt);
+	server->set_max_inflight(2);
+
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, client4, (void *) clients[0]);
+		VERIFY(ret == 0);
+	}
+
+	// the other client must not be starved meanwhile
+	for(int i = 0; i < 20; i++){
+		int rep;
+		VERIFY(clients[1]->call(23, i, rep) == 0);
+		VERIFY(rep == i+1);
+	}
+
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	server->set_max_inflight(0);
+	printf(" OK\n");
+}
+
+void *
+client5(void *xx)
+{
+	int i = (long) xx;
+	int rep;
+	int ret = clients[i % NUM_CL]->call(26, i, rep);
+	VERIFY(ret == 0);
+	VERIFY(rep == i+3);
+	return 0;
+}
+
+void
+deferred_test(int nt)
+{
+	// park more calls than there are dispatch threads, then
+	// answer them all from this thread.
+	int ret;
+
+	printf("start deferred_test (%d threads) ...", nt);
+
+	pthread_t th[nt];
+	for(int i = 0; i < nt; i++){
+		ret = pthread_create(&th[i], &attr, client5, (void *) (long) i);
+		VERIFY(ret == 0);
+	}
+
+	{
+		ScopedLock ml(&parked_m);
+		while((int) parked.size() < nt)
+			VERIFY(pthread_cond_wait(&parked_c, &parked_m) == 0);
+		for(unsigned i = 0; i < parked.size(); i++)
+			parked[i].second->reply(0, parked[i].first + 3);
+		parked.clear();
+	}
+
+	for(int i = 0; i < nt; i++){
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	}
+	printf(" OK\n");
+}
+
+void
+stream_test(rpcc *c)
+{
+	printf("start stream_test ...");
+	c->set_stream_window(64*1024, 4);
+
+	int sizes[] = { 0, 1, 64*1024, 3*1024*1024 + 17 };
+	for(unsigned i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+		pattern_source src(sizes[i]);
+		unsigned long long got = 0;
+		int ret = c->call_upload(27, sizes[i], &src, got);
+		VERIFY(ret == 0);
+		VERIFY(got == (unsigned long long) sizes[i]);
+
+		pattern_sink dst;
+		ret = c->call_download(28, sizes[i], &dst);
+		VERIFY(ret == 0);
+		VERIFY(dst.off == (unsigned long long) sizes[i]);
+	}
+
+	// chunks of a stream the server doesn't have fail, rather than
+	// read as its end
+	std::string chunk, rep;
+	int r;
+	VERIFY(c->call(rpc_const::stream_read, c->id(), 12345u, 0ULL, 1024,
+	    chunk) == rpc_const::stream_failure);
+	VERIFY(c->call(rpc_const::stream_data, c->id(), 12345u, 0ULL,
+	    std::string("x"), r) == rpc_const::stream_failure);
+	VERIFY(c->call(rpc_const::stream_close, c->id(), 12345u, rep) ==
+	    rpc_const::stream_failure);
+	printf(" OK\n");
+}
+
+void *
+closer(void *x)
+{
+	usleep(200 * 1000);
+	delete (rpcc *) x;
+	return 0;
+}
+
+void
+reverse_test(rpcc *c)
+{
+	printf("start reverse_test ...");
+	rpcs *callbacks = new rpcs(0, 0, false);
+	callbacks->reg(30, &service, &srv::handle_double);
+	c->set_callbacks(callbacks);
+
+	for(int i = 0; i < 10; i++){
+		int rep;
+		VERIFY(c->call(29, c->id(), i, rep) == 0);
+		VERIFY(rep == 2*i + 1);
+	}
+
+	// nothing to call back once the client is gone
+	VERIFY(server->reverse(12345) == NULL);
+
+	// and a call back fails soon after its client goes away under it,
+	// not after the call's two minute timeout
+	rpcc *gone = new rpcc(dst);
+	VERIFY(gone->bind() == 0);
+	callbacks->reg(31, &service, &srv::handle_stall);
+	gone->set_callbacks(callbacks);
+	rpcc *cl = server->reverse(gone->id());
+	VERIFY(cl != NULL);
+	pthread_t th;
+	VERIFY(pthread_create(&th, &attr, closer, (void *) gone) == 0);
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	int rep;
+	VERIFY(cl->call(31, 1, rep) != 0);
+	clock_gettime(CLOCK_REALTIME, &end);
+	server->reverse_done(cl);
+	VERIFY(diff_timespec(end, start) < 3000);
+	pthread_join(th, NULL);
+	printf(" OK\n");
+}
+
+void
+keepalive_test()
+{
+	printf("start keepalive_test ...");
+	rpcc *c = new rpcc(dst);
+	VERIFY(c->bind() == 0);
+	c->set_keepalive(200, 300);
+
+	// the server stops answering but the connection stays up; the
+	// call must fail long before its own two minute timeout
+	server->set_reachable(false);
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	int rep;
+	int ret = c->call(23, 1, rep);
+	clock_gettime(CLOCK_REALTIME, &end);
+	VERIFY(ret == rpc_const::timeout_failure);
+	VERIFY(diff_timespec(end, start) < 5000);
+
+	// and the client gets going again on a new connection
+	server->set_reachable(true);
+	VERIFY(c->call(23, 1, rep) == 0);
+	VERIFY(rep == 2);
+	delete c;
+	printf(" OK\n");
+}
+
+// time ten calls and a large reply over connections made while the
+// environment asks for shaping
+void
+shaper_test()
+{
+	printf("start shaper_test ...");
+	VERIFY(setenv("RPC_DELAY", "fixed:10", 1) == 0);
+	VERIFY(setenv("RPC_BW", "1m", 1) == 0);
+	rpcc *c = new rpcc(dst);
+	VERIFY(c->bind() == 0); // connects
+	VERIFY(unsetenv("RPC_DELAY") == 0);
+	VERIFY(unsetenv("RPC_BW") == 0);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_REALTIME, &start);
+	for(int i = 0; i < 10; i++){
+		int rep;
+		VERIFY(c->call(23, i, rep) == 0);
+		VERIFY(rep == i+1);
+	}
+	clock_gettime(CLOCK_REALTIME, &end);
+	int diff = diff_timespec(end, start);
+	VERIFY(diff >= 10 * 20 && diff < 10 * 20 * 5);
+
+	// 512KB at 1MB/s
+	std::string rep;
+	clock_gettime(CLOCK_REALTIME, &start);
+	VERIFY(c->call(25, 512*1024, rep) == 0);
+	clock_gettime(CLOCK_REALTIME, &end);
+	VERIFY(rep.size() == 512*1024);
+	diff = diff_timespec(end, start);
+	VERIFY(diff >= 500 && diff < 2500);
+
+	delete c;
+	printf(" OK\n");
+}
+
 void
 lossy_test()
 {
@@ -463,6 +818,14 @@ main(int argc, char *argv[])
 
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		stream_test(clients[0]);
+		if (isserver) {
+			busy_test(10);
+			deferred_test(20);
+			reverse_test(clients[1]);
+			keepalive_test();
+			shaper_test();
+		}
 		lossy_test();
 		if (isserver) {
 			failure_test();
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <queue>
+#include <vector>
+
+#include "shaper.h"
+#include "connection.h"
+#include "slock.h"
+#include "jsl_log.h"
+#include "gettime.h"
+#include "lang/verify.h"
+
+static long long
+now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// PDUs held back by all shapers, delivered in time order by one thread
+class delayq {
+	public:
+		static delayq *instance();
+		void add(long long when, connection *c, char *b, int sz);
+
+	private:
+		struct item {
+			long long when;
+			unsigned long long seq; // keeps equal times in arrival order
+			connection *c;
+			char *b;
+			int sz;
+			bool operator<(const item &o) const {
+				return when > o.when || (when == o.when && seq > o.seq);
+			}
+		};
+
+		delayq();
+		static void *loop(void *);
+		void deliver_ready();
+
+		std::priority_queue<item> q_;
+		unsigned long long seq_;
+		pthread_mutex_t m_;
+		pthread_cond_t c_;
+		pthread_t th_;
+};
+
+delayq *
+delayq::instance()
+{
+	static delayq *q = new delayq();
+	return q;
+}
+
+delayq::delayq() : seq_(0)
+{
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+	VERIFY(pthread_cond_init(&c_, NULL) == 0);
+	VERIFY(pthread_create(&th_, NULL, &delayq::loop, (void *)this) == 0);
+}
+
+void
+delayq::add(long long when, connection *c, char *b, int sz)
+{
+	item it;
+	it.when = when;
+	it.c = c;
+	it.b = b;
+	it.sz = sz;
+	c->incref();
+
+	ScopedLock ml(&m_);
+	it.seq = seq_++;
+	q_.push(it);
+	if (q_.top().seq == it.seq)
+		VERIFY(pthread_cond_signal(&c_) == 0);
+}
+
+void *
+delayq::loop(void *x)
+{
+	((delayq *)x)->deliver_ready();
+	return 0;
+}
+
+void
+delayq::deliver_ready()
+{
+	while (1) {
+		item it;
+		{
+			ScopedLock ml(&m_);
+			while (q_.empty() || q_.top().when > now_us()) {
+				if (q_.empty()) {
+					VERIFY(pthread_cond_wait(&c_, &m_) == 0);
+				} else {
+					long long when = q_.top().when;
+					struct timespec ts;
+					ts.tv_sec = when / 1000000;
+					ts.tv_nsec = (when % 1000000) * 1000;
+					pthread_cond_timedwait(&c_, &m_, &ts);
+				}
+			}
+			it = q_.top();
+			q_.pop();
+		}
+		it.c->deliver(it.b, it.sz);
+		it.c->decref();
+	}
+}
+
+// reads a rate like 512k into bytes per second
+static double
+parse_rate(const char *s)
+{
+	char *end;
+	double r = strtod(s, &end);
+	switch (*end) {
+	case 'g': case 'G': r *= 1024; // fall through
+	case 'm': case 'M': r *= 1024; // fall through
+	case 'k': case 'K': r *= 1024;
+	}
+	return r > 0 ? r : 0;
+}
+
+bool
+shaper::parse_delay(const char *spec)
+{
+	if (sscanf(spec, "uniform:%lf:%lf", &a_, &b_) == 2 && a_ <= b_) {
+		dist_ = UNIFORM;
+	} else if (sscanf(spec, "pareto:%lf:%lf", &a_, &b_) == 2 && b_ > 0) {
+		dist_ = PARETO;
+	} else if (sscanf(spec, "fixed:%lf", &a_) == 1 ||
+	    sscanf(spec, "%lf", &a_) == 1) {
+		dist_ = FIXED;
+	} else {
+		jsl_log(JSL_DBG_OFF, "shaper: bad delay spec %s\n", spec);
+		return false;
+	}
+	return a_ >= 0;
+}
+
+shaper *
+shaper::make(dir_t d)
+{
+	const char *delay = getenv(d == REQUEST ? "RPC_DELAY_REQ" : "RPC_DELAY_REP");
+	if (delay == NULL)
+		delay = getenv("RPC_DELAY");
+	const char *bw = getenv("RPC_BW");
+	const char *reorder = getenv("RPC_REORDER");
+
+	shaper *s = new shaper();
+	s->dist_ = FIXED;
+	s->a_ = s->b_ = 0;
+	s->bw_ = bw ? parse_rate(bw) : 0;
+	s->reorder_ = reorder ? atoi(reorder) : 0;
+	s->link_free_us_ = s->last_us_ = 0;
+	if (delay && !s->parse_delay(delay)) {
+		s->dist_ = FIXED;
+		s->a_ = 0;
+	}
+	bool delayed = s->dist_ != FIXED || s->a_ > 0;
+	if (!delayed && s->bw_ == 0 && s->reorder_ <= 0) {
+		delete s;
+		return NULL;
+	}
+	jsl_log(JSL_DBG_2, "shaper::make %s dist %d %f %f bw %f reorder %d\n",
+	    d == REQUEST ? "request" : "reply", s->dist_, s->a_, s->b_,
+	    s->bw_, s->reorder_);
+	return s;
+}
+
+long long
+shaper::sample_us()
+{
+	double ms = a_;
+	double u = (random() + 1.0) / (RAND_MAX + 2.0); // in (0, 1)
+	switch (dist_) {
+	case FIXED:
+		break;
+	case UNIFORM:
+		ms = a_ + (b_ - a_) * u;
+		break;
+	case PARETO:
+		ms = a_ / pow(u, 1.0 / b_);
+		if (ms > 100 * a_)
+			ms = 100 * a_;
+		break;
+	}
+	return (long long)(ms * 1000);
+}
+
+void
+shaper::delay(connection *c, char *b, int sz)
+{
+	long long now = now_us();
+
+	// the PDU is on the wire once the ones before it are, and takes
+	// sz / bw to get there
+	long long when = now;
+	if (bw_ > 0) {
+		if (link_free_us_ > now)
+			when = link_free_us_;
+		when += (long long)(sz / bw_ * 1000000);
+		link_free_us_ = when;
+	}
+
+	// like a real link, delivers in order, except that a PDU picked
+	// for reordering skips the delay and so overtakes those in flight
+	if (reorder_ > 0 && (random() % 100) < reorder_) {
+		jsl_log(JSL_DBG_4, "shaper::delay reorder pdu of size %d\n", sz);
+	} else {
+		when += sample_us();
+		if (when < last_us_)
+			when = last_us_;
+		last_us_ = when;
+	}
+
+	delayq::instance()->add(when, c, b, sz);
+}
@@ -0,0 +1,60 @@
+#ifndef shaper_h
+#define shaper_h
+
+// makes loopback look like a wide-area link by holding each received
+// PDU back until it would have arrived over a slower, more distant
+// network.  set from the environment when a connection is made:
+//
+//   RPC_DELAY=spec      one-way delay in both directions
+//   RPC_DELAY_REQ=spec  one-way delay from client to server
+//   RPC_DELAY_REP=spec  one-way delay from server to client
+//   RPC_BW=rate         per-connection, per-direction bandwidth in
+//                       bytes/s; a k, m or g suffix multiplies by 2^10..
+//   RPC_REORDER=pct     percent of PDUs that skip the delay, overtaking
+//                       the ones in flight
+//
+// where a delay spec, in (fractional) milliseconds, is one of
+//
+//   ms or fixed:ms      always ms
+//   uniform:lo:hi       uniform between lo and hi
+//   pareto:min:alpha    pareto tail with scale min and shape alpha,
+//                       cut off at 100 * min
+//
+// so RPC_DELAY=5 gives a 10 ms round trip.
+
+#include <time.h>
+
+class connection;
+
+class shaper {
+	public:
+		// the direction a connection receives in
+		typedef enum {
+			REQUEST, // client to server, received by the server
+			REPLY,   // server to client, received by the client
+		} dir_t;
+
+		// NULL if the environment asks for no shaping
+		static shaper *make(dir_t d);
+
+		// hold b back on behalf of c, then hand it to c->deliver.
+		// called in arrival order, with c's lock held.
+		void delay(connection *c, char *b, int sz);
+
+	private:
+		typedef enum { FIXED, UNIFORM, PARETO } dist_t;
+
+		shaper() {}
+		bool parse_delay(const char *spec);
+		long long sample_us();
+
+		dist_t dist_;
+		double a_, b_; // parameters of dist_, in ms for the delays
+		double bw_;    // bytes per second, or 0 for no cap
+		int reorder_;  // percent
+
+		long long link_free_us_; // when the link finishes sending
+		long long last_us_;      // delivery time of the latest in-order PDU
+};
+
+#endif
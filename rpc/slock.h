@@ -17,4 +17,28 @@ struct ScopedLock {
 			VERIFY(pthread_mutex_unlock(m_)==0);
 		}
 };
+
+struct ScopedRead {
+	private:
+		pthread_rwlock_t *l_;
+	public:
+		ScopedRead(pthread_rwlock_t *l): l_(l) {
+			VERIFY(pthread_rwlock_rdlock(l_)==0);
+		}
+		~ScopedRead() {
+			VERIFY(pthread_rwlock_unlock(l_)==0);
+		}
+};
+
+struct ScopedWrite {
+	private:
+		pthread_rwlock_t *l_;
+	public:
+		ScopedWrite(pthread_rwlock_t *l): l_(l) {
+			VERIFY(pthread_rwlock_wrlock(l_)==0);
+		}
+		~ScopedWrite() {
+			VERIFY(pthread_rwlock_unlock(l_)==0);
+		}
+};
 #endif  /*__SCOPED_LOCK__*/
@@ -47,9 +47,34 @@ fi
 
 unset RPC_LOSSY
 
-echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
-./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
-sleep 1
+# set EXTENT_DIR to keep the extents on disk across restarts, and
+# EXTENT_SERVERS to spread them over that many extent servers.  to add
+# one later, start it with EXTENT_JOIN set to $EXTENT_DST.
+if [ -z $EXTENT_SERVERS ]; then
+    EXTENT_SERVERS=1
+fi
+
+if [ $EXTENT_SERVERS -gt 1 ]; then
+    x=0
+    EXTENT_DST=""
+    while [ $x -lt $EXTENT_SERVERS ]; do
+      port=$[EXTENT_PORT+100*x]
+      dir=""
+      if [ "$EXTENT_DIR" ]; then
+          dir=$EXTENT_DIR.$x
+      fi
+      x=$[x+1]
+      EXTENT_DST=$EXTENT_DST${EXTENT_DST:+,}$port
+      echo "starting ./extent_server $port $dir > extent_server$x.log 2>&1 &"
+      ./extent_server $port $dir > extent_server$x.log 2>&1 &
+    done
+    sleep 1
+else
+    EXTENT_DST=$EXTENT_PORT
+    echo "starting ./extent_server $EXTENT_PORT $EXTENT_DIR > extent_server.log 2>&1 &"
+    ./extent_server $EXTENT_PORT $EXTENT_DIR > extent_server.log 2>&1 &
+    sleep 1
+fi
 
 fusermount -u $YFSDIR1
 fusermount -u $YFSDIR2
@@ -57,15 +82,15 @@ fusermount -u $YFSDIR2
 rm -rf $YFSDIR1
 mkdir $YFSDIR1 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &"
-./yfs_client $YFSDIR1 $EXTENT_PORT $LOCK_PORT > yfs_client1.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_PORT > yfs_client1.log 2>&1 &"
+./yfs_client $YFSDIR1 $EXTENT_DST $LOCK_PORT > yfs_client1.log 2>&1 &
 sleep 1
 
 rm -rf $YFSDIR2
 mkdir $YFSDIR2 || exit 1
 sleep 1
-echo "starting ./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &"
-./yfs_client $YFSDIR2 $EXTENT_PORT $LOCK_PORT > yfs_client2.log 2>&1 &
+echo "starting ./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_PORT > yfs_client2.log 2>&1 &"
+./yfs_client $YFSDIR2 $EXTENT_DST $LOCK_PORT > yfs_client2.log 2>&1 &
 
 sleep 2
 
@@ -6,12 +6,12 @@
 void split(const std::string & str, std::vector<std::string> & vec, char delimiter) {
   size_t start = 0, pos = 0;
   while ((pos = str.find(delimiter, pos)) != std::string::npos) {
-    if (pos++ - start > 0) {
+    if (pos - start > 0) {
       vec.emplace_back(str, start, pos - start);
     }
-    start = pos;
+    start = ++pos;
   }
-  if (!str.empty() && (start - str.length()) > 0) {
+  if (start < str.length()) {
     vec.emplace_back(str, start);
   }
 }
@@ -8,9 +8,132 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
 
 #include "utils/utils.h"
 
+// a file's inode extent starts with a header.  a file of up to
+// block_size bytes follows it in the same extent; a bigger one is cut
+// into blocks of block_size, each its own extent, and the header is
+// followed by the ids of the first ndirect blocks and of nindirect
+// indirect blocks, each holding the ids of the next per_indirect
+// blocks.  an id of 0 is a hole.
+//
+// block k of file f is extent ((k + 1) << 32) | f, and its indirect
+// block j is ((indirect_base + j) << 32) | f, so the blocks of a file
+// are spread over the extent servers, and are written back along with
+// the file when its lock goes.
+static const uint32_t inode_magic = 0x46534659; // "YFSF"
+static const size_t block_size = 64 * 1024;
+static const int ndirect = 16;
+static const int nindirect = 8;
+static const size_t per_indirect = block_size / sizeof(uint64_t);
+static const unsigned long long indirect_base = 0x80000000ULL;
+
+struct inode_hdr {
+  uint32_t magic;
+  uint32_t inlined;
+  uint64_t size;
+};
+
+struct finode {
+  unsigned long long size;
+  bool inlined;
+  std::string data;                    // while inlined
+  uint64_t direct[ndirect];
+  uint64_t indirect[nindirect];
+  std::string ind[nindirect];          // the indirect blocks read so far
+  bool ind_read[nindirect];
+  bool ind_dirty[nindirect];
+
+  finode() : size(0), inlined(true) {
+    memset(direct, 0, sizeof(direct));
+    memset(indirect, 0, sizeof(indirect));
+    memset(ind_read, 0, sizeof(ind_read));
+    memset(ind_dirty, 0, sizeof(ind_dirty));
+  }
+
+  std::string str() const {
+    inode_hdr h = { inode_magic, inlined, size };
+    std::string s((const char *) &h, sizeof(h));
+    if (inlined) {
+      s.append(data);
+    } else {
+      s.append((const char *) direct, sizeof(direct));
+      s.append((const char *) indirect, sizeof(indirect));
+    }
+    return s;
+  }
+
+  // a file written before files had inodes is just its bytes, with
+  // no header, and reads as an inlined file of them.  it gets a header
+  // when it is next written.
+  void parse(const std::string &s) {
+    if (!parse_inode(s)) {
+      *this = finode();
+      data = s;
+      size = s.size();
+    }
+  }
+
+  bool parse_inode(const std::string &s) {
+    inode_hdr h;
+    if (s.empty()) {
+      *this = finode();
+      return true;
+    }
+    if (s.size() < sizeof(h)) {
+      return false;
+    }
+    memcpy(&h, s.data(), sizeof(h));
+    if (h.magic != inode_magic || h.inlined > 1) {
+      return false;
+    }
+    *this = finode();
+    size = h.size;
+    inlined = h.inlined;
+    if (inlined) {
+      data = s.substr(sizeof(h));
+      return data.size() == size;
+    }
+    if (s.size() != sizeof(h) + sizeof(direct) + sizeof(indirect)) {
+      return false;
+    }
+    memcpy(direct, s.data() + sizeof(h), sizeof(direct));
+    memcpy(indirect, s.data() + sizeof(h) + sizeof(direct), sizeof(indirect));
+    return true;
+  }
+};
+
+static yfs_client::inum
+block_id(yfs_client::inum f, size_t k)
+{
+  return ((unsigned long long) (k + 1) << 32) | f;
+}
+
+static yfs_client::inum
+indirect_id(yfs_client::inum f, size_t j)
+{
+  return ((indirect_base + j) << 32) | f;
+}
+
+void
+yfs_lock_release_user::dorelease(lock_protocol::lockid_t lid)
+{
+  std::vector<extent_protocol::extentid_t> ids, mine;
+  ec->cached(ids);
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (ids[i] != lid && (ids[i] & 0xffffffffULL) == lid) {
+      mine.push_back(ids[i]);
+    }
+  }
+  // the blocks in one batch, before the inode that points at them
+  ec->flush(mine);
+  ec->flush(lid);
+}
+
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
 {
   ec = new extent_client(extent_dst);
@@ -65,7 +188,9 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   ScopedNLock l(lc, inum);
   printf("getfile %016llx\n", inum);
   extent_protocol::attr a;
-  if (ec->getattr(inum, a) != extent_protocol::OK) {
+  finode f;
+  if (ec->getattr(inum, a) != extent_protocol::OK ||
+      _getinode(inum, f) != OK) {
     r = IOERR;
     goto release;
   }
@@ -73,7 +198,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   fin.atime = a.atime;
   fin.mtime = a.mtime;
   fin.ctime = a.ctime;
-  fin.size = a.size;
+  fin.size = f.size;
   printf("getfile %016llx -> sz %llu\n", inum, fin.size);
 
  release:
@@ -173,7 +298,8 @@ yfs_client::create(inum inum, const std::string & name, yfs_client::inum parent)
   }
   ents.emplace_back(name, inum);
 
-  if (ec->put(inum, "") != extent_protocol::OK) {
+  if (ec->put(inum, isfile(inum) ? finode().str() : "") !=
+      extent_protocol::OK) {
     return IOERR;
   }
 
@@ -201,6 +327,15 @@ yfs_client::remove(inum parent, const std::string & name) {
     return NOENT;
   }
 
+  if (isfile(inum)) {
+    ScopedNLock fl(lc, inum);
+    finode f;
+    if ((ret = _getinode(inum, f)) != OK ||
+        (ret = _freeblocks(inum, f, 0)) != OK) {
+      return ret;
+    }
+  }
+
   int ec_ret;
   if ((ec_ret = ec->remove(inum)) != extent_protocol::OK) {
     if (ec_ret == extent_protocol::NOENT) {
@@ -279,65 +414,351 @@ yfs_client::writedir(inum inum, const std::vector<dirent> & vec) {
 }
 
 int
-yfs_client::resize(inum inum, unsigned int size) {
-  ScopedNLock l(lc, inum);
+yfs_client::_getinode(inum inum, finode &f)
+{
   std::string buf;
   int ec_ret;
   if ((ec_ret = ec->get(inum, buf)) != extent_protocol::OK) {
-    if (ec_ret == extent_protocol::NOENT) {
-      return NOENT;
+    return ec_ret == extent_protocol::NOENT ? NOENT : IOERR;
+  }
+  f.parse(buf);
+  return OK;
+}
+
+// writes the inode and the indirect blocks it changed
+int
+yfs_client::_putinode(inum inum, finode &f)
+{
+  for (int j = 0; j < nindirect; j++) {
+    if (f.ind_dirty[j]) {
+      if (ec->put(f.indirect[j], f.ind[j]) != extent_protocol::OK) {
+        return IOERR;
+      }
+      f.ind_dirty[j] = false;
     }
+  }
+  if (ec->put(inum, f.str()) != extent_protocol::OK) {
     return IOERR;
   }
+  return OK;
+}
 
-  buf.resize(size);
-
-  if ((ec_ret = ec->put(inum, buf)) != extent_protocol::OK) {
+// reads indirect block j into f
+int
+yfs_client::_indirect(inum inum, finode &f, size_t j)
+{
+  if (f.ind_read[j]) {
+    return OK;
+  }
+  f.ind[j].clear();
+  if (f.indirect[j] != 0 &&
+      ec->get(f.indirect[j], f.ind[j]) != extent_protocol::OK) {
     return IOERR;
   }
+  f.ind[j].resize(block_size);
+  f.ind_read[j] = true;
+  return OK;
+}
 
+// the id of block k of the file, 0 for a hole.  with alloc, a hole
+// gets an id, and so does an indirect block the id has to go in.
+int
+yfs_client::_block(inum inum, finode &f, size_t k, bool alloc, yfs_client::inum *id)
+{
+  if (k < (size_t) ndirect) {
+    if (f.direct[k] == 0 && alloc) {
+      f.direct[k] = block_id(inum, k);
+    }
+    *id = f.direct[k];
+    return OK;
+  }
+  size_t j = (k - ndirect) / per_indirect, i = (k - ndirect) % per_indirect;
+  if (j >= (size_t) nindirect) {
+    return IOERR; // too big
+  }
+  if (f.indirect[j] == 0 && !alloc) {
+    *id = 0;
+    return OK;
+  }
+  if (f.indirect[j] == 0) {
+    f.indirect[j] = indirect_id(inum, j);
+    f.ind[j].assign(block_size, '\0');
+    f.ind_read[j] = true;
+    f.ind_dirty[j] = true;
+  }
+  int r;
+  if ((r = _indirect(inum, f, j)) != OK) {
+    return r;
+  }
+  uint64_t v;
+  memcpy(&v, &f.ind[j][i * sizeof(v)], sizeof(v));
+  if (v == 0 && alloc) {
+    v = block_id(inum, k);
+    memcpy(&f.ind[j][i * sizeof(v)], &v, sizeof(v));
+    f.ind_dirty[j] = true;
+  }
+  *id = v;
   return OK;
 }
 
+// moves the data of an inlined file to its block 0
+int
+yfs_client::_uninline(inum inum, finode &f)
+{
+  if (!f.inlined) {
+    return OK;
+  }
+  if (!f.data.empty()) {
+    f.direct[0] = block_id(inum, 0);
+    if (ec->put(f.direct[0], f.data) != extent_protocol::OK) {
+      return IOERR;
+    }
+  }
+  f.data.clear();
+  f.inlined = false;
+  return OK;
+}
+
+// removes blocks k0 and on, and the indirect blocks left empty
+int
+yfs_client::_freeblocks(inum inum, finode &f, size_t k0)
+{
+  if (f.inlined) {
+    return OK;
+  }
+  for (size_t k = k0; k < (size_t) ndirect; k++) {
+    if (f.direct[k] != 0) {
+      ec->remove(f.direct[k]);
+      f.direct[k] = 0;
+    }
+  }
+  for (int j = 0; j < nindirect; j++) {
+    size_t first = ndirect + j * per_indirect;
+    if (f.indirect[j] == 0 || first + per_indirect <= k0) {
+      continue;
+    }
+    int r;
+    if ((r = _indirect(inum, f, j)) != OK) {
+      return r;
+    }
+    size_t i0 = k0 > first ? k0 - first : 0;
+    for (size_t i = i0; i < per_indirect; i++) {
+      uint64_t v;
+      memcpy(&v, &f.ind[j][i * sizeof(v)], sizeof(v));
+      if (v != 0) {
+        ec->remove(v);
+        memset(&f.ind[j][i * sizeof(v)], 0, sizeof(v));
+        f.ind_dirty[j] = true;
+      }
+    }
+    if (i0 == 0) {
+      ec->remove(f.indirect[j]);
+      f.indirect[j] = 0;
+      f.ind_read[j] = false;
+      f.ind_dirty[j] = false;
+    }
+  }
+  return OK;
+}
+
+int
+yfs_client::resize(inum inum, unsigned int size) {
+  ScopedNLock l(lc, inum);
+  finode f;
+  int r;
+  if ((r = _getinode(inum, f)) != OK) {
+    return r;
+  }
+
+  if (f.inlined && size <= block_size) {
+    f.data.resize(size);
+  } else {
+    if ((r = _uninline(inum, f)) != OK) {
+      return r;
+    }
+    if (size < f.size) {
+      // the blocks past the end go, and the last one is cut
+      if ((r = _freeblocks(inum, f, (size + block_size - 1) / block_size)) !=
+          OK) {
+        return r;
+      }
+      yfs_client::inum id;
+      if (size % block_size != 0 &&
+          (r = _block(inum, f, size / block_size, false, &id)) == OK &&
+          id != 0 && ec->truncate(id, size % block_size) != extent_protocol::OK) {
+        return IOERR;
+      }
+      if (r != OK) {
+        return r;
+      }
+    }
+  }
+  f.size = size;
+  return _putinode(inum, f);
+}
+
 int
 yfs_client::read(inum inum, size_t size, size_t off, std::string & buf) {
   ScopedNLock l(lc, inum);
-  std::string orig;
-  int ec_ret;
-  if ((ec_ret = ec->get(inum, orig)) != extent_protocol::OK) {
-    if (ec_ret == extent_protocol::NOENT) return NOENT;
-    return IOERR;
+  finode f;
+  int r;
+  if ((r = _getinode(inum, f)) != OK) {
+    return r;
   }
 
-  if (off > orig.length()) {
-    buf = "";
+  buf.clear();
+  if (off >= f.size) {
+    return OK;
   }
-  else {
-    buf = orig.substr(off, size);
+  size = std::min(size, (size_t) (f.size - off));
+  if (f.inlined) {
+    buf = f.data.substr(off, size);
+    return OK;
   }
 
+  // the blocks are fetched in one batch, a call per extent server
+  std::vector<extent_protocol::extentid_t> ids;
+  std::vector<size_t> which;
+  size_t k0 = off / block_size, k1 = (off + size - 1) / block_size;
+  for (size_t k = k0; k <= k1; k++) {
+    yfs_client::inum id;
+    if ((r = _block(inum, f, k, false, &id)) != OK) {
+      return r;
+    }
+    if (id != 0) {
+      which.push_back(k);
+      ids.push_back(id);
+    }
+  }
+  std::vector<std::string> blocks;
+  std::vector<extent_protocol::status> rets;
+  ec->get(ids, blocks, rets);
+
+  buf.assign(size, '\0'); // holes, and past the end of a short block
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (rets[i] != extent_protocol::OK) {
+      return IOERR;
+    }
+    size_t start = which[i] * block_size;
+    size_t from = std::max(off, start);
+    size_t to = std::min(off + size, start + blocks[i].size());
+    if (from < to) {
+      buf.replace(from - off, to - from, blocks[i], from - start, to - from);
+    }
+  }
   return OK;
 }
 
 int
 yfs_client::write(inum inum, const char * buf, size_t size, size_t off, size_t * nsize) {
   ScopedNLock l(lc, inum);
-  std::string orig;
-  int ec_ret;
-  if ((ec_ret = ec->get(inum, orig)) != extent_protocol::OK) {
-    if (ec_ret == extent_protocol::NOENT) return NOENT;
-    return IOERR;
+  finode f;
+  int r;
+  if ((r = _getinode(inum, f)) != OK) {
+    return r;
   }
-  printf("[YFS CLI] write file original size: %lu, write: %lu, offset: " \
-      "%lu\n", orig.length(), size, off);
-  if (off > orig.length()) {
-    orig.resize(off + size);
+  printf("[YFS CLI] write file %016llx write: %lu, offset: %lu\n", inum,
+      size, off);
+
+  if (f.inlined && off + size <= block_size) {
+    if (f.data.size() < off + size) {
+      f.data.resize(off + size);
+    }
+    f.data.replace(off, size, buf, size);
+  } else {
+    if ((r = _uninline(inum, f)) != OK) {
+      return r;
+    }
+    size_t done = 0;
+    while (done < size) {
+      size_t pos = off + done;
+      size_t bo = pos % block_size;
+      size_t n = std::min(block_size - bo, size - done);
+      yfs_client::inum id;
+      if ((r = _block(inum, f, pos / block_size, true, &id)) != OK) {
+        return r;
+      }
+      // at the end of the file, a block whose cached attributes show
+      // it holds just the bytes in front of bo is appended to, and is
+      // not fetched to be written.  no getattr is sent to find out.
+      extent_protocol::attr a;
+      bool append = pos == f.size && bo > 0 && ec->cached_attr(id, a) &&
+        a.size == bo;
+      std::string data(buf + done, n);
+      size_t bsize;
+      if ((append ? ec->append(id, data, bsize) : ec->write(id, bo, data)) !=
+          extent_protocol::OK) {
+        return IOERR;
+      }
+      done += n;
+    }
   }
-  orig.replace(off, size, buf, size);
-  if ((ec_ret = ec->put(inum, orig)) != extent_protocol::OK) {
-    return IOERR;
+  f.size = std::max(f.size, (unsigned long long) (off + size));
+  // also moves the inode's mtime
+  if ((r = _putinode(inum, f)) != OK) {
+    return r;
   }
-  printf("[YFS CLI] write file succeed! size : %lu.\n", orig.length());
   (*nsize) = size;
   return OK;
 }
+
+int
+yfs_client::clone(inum src, inum dst)
+{
+  if (src == dst) {
+    return OK;
+  }
+  ScopedNLock l1(lc, std::min(src, dst));
+  ScopedNLock l2(lc, std::max(src, dst));
+  finode f, g;
+  int r;
+  if ((r = _getinode(src, f)) != OK || (r = _getinode(dst, g)) != OK ||
+      (r = _freeblocks(dst, g, 0)) != OK) {
+    return r;
+  }
+  printf("[YFS CLI] clone %016llx to %016llx\n", src, dst);
+
+  if (f.inlined) {
+    // the bytes are in the inode
+    return ec->clone(src, dst) == extent_protocol::OK ? OK : IOERR;
+  }
+
+  // block k of src becomes block k of dst; the block maps are new, as
+  // they hold the ids of dst's blocks
+  finode c;
+  c.size = f.size;
+  c.inlined = false;
+  for (size_t k = 0; k < (size_t) ndirect; k++) {
+    if (f.direct[k] != 0) {
+      c.direct[k] = block_id(dst, k);
+      if (ec->clone(f.direct[k], c.direct[k]) != extent_protocol::OK) {
+        return IOERR;
+      }
+    }
+  }
+  for (int j = 0; j < nindirect; j++) {
+    if (f.indirect[j] == 0) {
+      continue;
+    }
+    if ((r = _indirect(src, f, j)) != OK) {
+      return r;
+    }
+    c.indirect[j] = indirect_id(dst, j);
+    c.ind[j].assign(block_size, '\0');
+    c.ind_read[j] = true;
+    c.ind_dirty[j] = true;
+    for (size_t i = 0; i < per_indirect; i++) {
+      uint64_t v;
+      memcpy(&v, &f.ind[j][i * sizeof(v)], sizeof(v));
+      if (v == 0) {
+        continue;
+      }
+      uint64_t id = block_id(dst, ndirect + j * per_indirect + i);
+      if (ec->clone(v, id) != extent_protocol::OK) {
+        return IOERR;
+      }
+      memcpy(&c.ind[j][i * sizeof(id)], &id, sizeof(id));
+    }
+  }
+  return _putinode(dst, c);
+}
@@ -15,11 +15,13 @@ class yfs_lock_release_user : public lock_release_user {
  public:
   yfs_lock_release_user(extent_client * _ec) : ec(_ec) {}
 
-  virtual void dorelease(lock_protocol::lockid_t lid) {
-    ec->flush(lid);
-  }
+  // writes back the extent lid and the blocks of the file lid
+  virtual void dorelease(lock_protocol::lockid_t lid);
 };
 
+// a file's inode; see yfs_client.cc
+struct finode;
+
 class yfs_client {
   extent_client *ec;
   lock_client *lc;
@@ -77,6 +79,12 @@ class yfs_client {
   static bool _remove(std::vector<dirent> &, const std::string &, inum *);
   int _readdir(inum, std::vector<dirent> &);
   int _writedir(inum, const std::vector<dirent> &);
+  int _getinode(inum, finode &);
+  int _putinode(inum, finode &);
+  int _indirect(inum, finode &, size_t);
+  int _block(inum, finode &, size_t, bool, inum *);
+  int _uninline(inum, finode &);
+  int _freeblocks(inum, finode &, size_t);
  public:
 
   yfs_client(std::string, std::string);
@@ -95,6 +103,9 @@ class yfs_client {
   int resize(inum, unsigned int);
   int write(inum, const char * buf, size_t, size_t, size_t *);
   int read(inum, size_t, size_t, std::string &);
+  // makes file dst a copy of file src; the extent servers copy the
+  // bytes, and share them where they can
+  int clone(inum src, inum dst);
 };
 
 #endif